@@ -350,7 +350,7 @@ static void bufferStreamClose(fz_context *ctx, void *state)
 	/* Nothing to do */
 }
 
-static void bufferStreamSeek(fz_stream *stream, int offset, int whence)
+static void bufferStreamSeek(fz_stream *stream, fz_off_t offset, int whence)
 {
 	globals    *glo = (globals *)stream->state;
 	JNIEnv     *env = glo->env;
@@ -2303,9 +2303,13 @@ JNI_FN(MuPDFCore_saveInternal)(JNIEnv * env, jobject thiz)
 		char *tmp;
 		fz_write_options opts;
 		opts.do_ascii = 1;
+		opts.do_deflate = 0;
 		opts.do_expand = 0;
 		opts.do_garbage = 1;
 		opts.do_linear = 0;
+		opts.do_incremental = 0;
+		opts.dedup_objects = NULL;
+		opts.dedup_bytes = NULL;
 
 		tmp = tmp_path(glo->current_path);
 		if (tmp)
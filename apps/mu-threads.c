@@ -0,0 +1,160 @@
+#include "mu-threads.h"
+
+#ifdef DISABLE_MUTHREADS
+
+int mu_create_mutex(mu_mutex *mutex) { return 0; }
+void mu_destroy_mutex(mu_mutex *mutex) { }
+void mu_lock_mutex(mu_mutex *mutex) { }
+void mu_unlock_mutex(mu_mutex *mutex) { }
+
+int mu_create_semaphore(mu_semaphore *sem) { sem->count = 0; return 0; }
+void mu_destroy_semaphore(mu_semaphore *sem) { }
+void mu_trigger_semaphore(mu_semaphore *sem) { sem->count++; }
+void mu_wait_semaphore(mu_semaphore *sem) { sem->count--; }
+
+int mu_create_thread(mu_thread *thread, void (*fn)(void *), void *arg) { return 1; }
+void mu_destroy_thread(mu_thread *thread) { }
+
+#elif defined(_WIN32)
+
+int mu_create_mutex(mu_mutex *mutex)
+{
+	InitializeCriticalSection(&mutex->cs);
+	return 0;
+}
+
+void mu_destroy_mutex(mu_mutex *mutex)
+{
+	DeleteCriticalSection(&mutex->cs);
+}
+
+void mu_lock_mutex(mu_mutex *mutex)
+{
+	EnterCriticalSection(&mutex->cs);
+}
+
+void mu_unlock_mutex(mu_mutex *mutex)
+{
+	LeaveCriticalSection(&mutex->cs);
+}
+
+int mu_create_semaphore(mu_semaphore *sem)
+{
+	sem->handle = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+	return sem->handle == NULL;
+}
+
+void mu_destroy_semaphore(mu_semaphore *sem)
+{
+	CloseHandle(sem->handle);
+}
+
+void mu_trigger_semaphore(mu_semaphore *sem)
+{
+	ReleaseSemaphore(sem->handle, 1, NULL);
+}
+
+void mu_wait_semaphore(mu_semaphore *sem)
+{
+	WaitForSingleObject(sem->handle, INFINITE);
+}
+
+static DWORD WINAPI thread_start(LPVOID arg)
+{
+	mu_thread *thread = (mu_thread *)arg;
+	thread->fn(thread->arg);
+	return 0;
+}
+
+int mu_create_thread(mu_thread *thread, void (*fn)(void *), void *arg)
+{
+	thread->fn = fn;
+	thread->arg = arg;
+	thread->handle = CreateThread(NULL, 0, thread_start, thread, 0, NULL);
+	return thread->handle == NULL;
+}
+
+void mu_destroy_thread(mu_thread *thread)
+{
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+}
+
+#else
+
+int mu_create_mutex(mu_mutex *mutex)
+{
+	return pthread_mutex_init(&mutex->mutex, NULL);
+}
+
+void mu_destroy_mutex(mu_mutex *mutex)
+{
+	pthread_mutex_destroy(&mutex->mutex);
+}
+
+void mu_lock_mutex(mu_mutex *mutex)
+{
+	pthread_mutex_lock(&mutex->mutex);
+}
+
+void mu_unlock_mutex(mu_mutex *mutex)
+{
+	pthread_mutex_unlock(&mutex->mutex);
+}
+
+int mu_create_semaphore(mu_semaphore *sem)
+{
+	sem->count = 0;
+	if (pthread_mutex_init(&sem->mutex, NULL))
+		return 1;
+	if (pthread_cond_init(&sem->cond, NULL))
+	{
+		pthread_mutex_destroy(&sem->mutex);
+		return 1;
+	}
+	return 0;
+}
+
+void mu_destroy_semaphore(mu_semaphore *sem)
+{
+	pthread_cond_destroy(&sem->cond);
+	pthread_mutex_destroy(&sem->mutex);
+}
+
+void mu_trigger_semaphore(mu_semaphore *sem)
+{
+	pthread_mutex_lock(&sem->mutex);
+	sem->count++;
+	pthread_cond_signal(&sem->cond);
+	pthread_mutex_unlock(&sem->mutex);
+}
+
+void mu_wait_semaphore(mu_semaphore *sem)
+{
+	pthread_mutex_lock(&sem->mutex);
+	while (sem->count == 0)
+		pthread_cond_wait(&sem->cond, &sem->mutex);
+	sem->count--;
+	pthread_mutex_unlock(&sem->mutex);
+}
+
+static void *thread_start(void *arg)
+{
+	mu_thread *thread = (mu_thread *)arg;
+	thread->fn(thread->arg);
+	return NULL;
+}
+
+int mu_create_thread(mu_thread *thread, void (*fn)(void *), void *arg)
+{
+	thread->fn = fn;
+	thread->arg = arg;
+	return pthread_create(&thread->thread, NULL, thread_start, thread);
+}
+
+void mu_destroy_thread(mu_thread *thread)
+{
+	pthread_join(thread->thread, NULL);
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef MU_THREADS_H
+#define MU_THREADS_H
+
+/*
+ * Minimal portable threading primitives for the command line tools.
+ *
+ * The fitz library itself knows nothing about threads; clients that
+ * want to render on several threads must supply locking functions
+ * (see fz_locks_context). These wrappers give the tools a single set
+ * of mutexes, semaphores and threads over pthreads or win32.
+ *
+ * Define DISABLE_MUTHREADS to build the tools without any thread
+ * support; mu_create_thread will then always fail and callers fall
+ * back to doing the work on the calling thread.
+ */
+
+#ifdef DISABLE_MUTHREADS
+
+typedef struct { int dummy; } mu_mutex;
+typedef struct { int count; } mu_semaphore;
+typedef struct { int dummy; } mu_thread;
+
+#elif defined(_WIN32)
+
+#include <windows.h>
+
+typedef struct { CRITICAL_SECTION cs; } mu_mutex;
+typedef struct { HANDLE handle; } mu_semaphore;
+typedef struct { HANDLE handle; void (*fn)(void *); void *arg; } mu_thread;
+
+#else
+
+#include <pthread.h>
+
+typedef struct { pthread_mutex_t mutex; } mu_mutex;
+typedef struct { int count; pthread_mutex_t mutex; pthread_cond_t cond; } mu_semaphore;
+typedef struct { pthread_t thread; void (*fn)(void *); void *arg; } mu_thread;
+
+#endif
+
+/*
+	All the creation functions return 0 on success and non-zero on
+	failure.
+*/
+
+int mu_create_mutex(mu_mutex *mutex);
+void mu_destroy_mutex(mu_mutex *mutex);
+void mu_lock_mutex(mu_mutex *mutex);
+void mu_unlock_mutex(mu_mutex *mutex);
+
+int mu_create_semaphore(mu_semaphore *sem);
+void mu_destroy_semaphore(mu_semaphore *sem);
+void mu_trigger_semaphore(mu_semaphore *sem);
+void mu_wait_semaphore(mu_semaphore *sem);
+
+/*
+	mu_create_thread: Start a new thread calling fn(arg).
+
+	mu_destroy_thread waits for the thread to finish.
+*/
+int mu_create_thread(mu_thread *thread, void (*fn)(void *), void *arg);
+void mu_destroy_thread(mu_thread *thread);
+
+#endif
@@ -3,6 +3,8 @@
  */
 
 #include "fitz.h"
+#include "fitz-internal.h"
+#include "mu-threads.h"
 
 #ifdef _MSC_VER
 #include <winsock2.h>
@@ -74,6 +76,8 @@ static int showmd5 = 0;
 static int showoutline = 0;
 static int savealpha = 0;
 static int uselist = 1;
+static char *savelist = NULL;
+static char *loadlist = NULL;
 static int alphabits = 8;
 static float gamma_value = 1;
 static int invert = 0;
@@ -82,6 +86,11 @@ static int height = 0;
 static int fit = 0;
 static int errored = 0;
 static int ignore_errors = 0;
+static int band_height = 0;
+static int num_workers = 0;
+static int num_page_workers = 0;
+static int png_level = -1;
+static int png_filter = FZ_PNG_FILTER_SUB;
 
 static fz_text_sheet *sheet = NULL;
 static fz_colorspace *colorspace;
@@ -93,6 +102,77 @@ static char *mujstest_filename = NULL;
 static FILE *mujstest_file = NULL;
 static int mujstest_count = 0;
 
+/*
+	Banded rendering: the page pixmap is split into horizontal bands
+	of at most band_height rows. With -T each band is handed to one
+	of num_workers threads, each of which has its own cloned context
+	(sharing the store and glyph cache with the main one) and replays
+	the page's display list into its band.
+
+	When the output can be streamed (pnm, pam, png or just an md5)
+	and -B is given, the page pixmap is never allocated at all: each
+	band is rendered into a band sized buffer, post processed, written
+	out and summed, and the buffer is reused for a later band. Peak
+	memory is then width * band_height per thread, not width * height.
+
+	The band workers are also lent to the png encoder, which cuts each
+	band (or whole page) into blocks of rows that are filtered and
+	deflated independently, and to the library's own jobs (such as
+	scanning a damaged file for its objects) through the context.
+
+	Page parallel rendering: with -P the main thread still loads and
+	interprets each page into a display list (documents may only be
+	used from one thread), but rasterizing, encoding and writing the
+	page happen on one of num_page_workers threads. Pages are handed
+	out to the workers round robin and collected again in the same
+	order, so at most num_page_workers pages are in flight and the
+	per page reports come out in page order.
+*/
+
+typedef struct worker_s
+{
+	fz_context *ctx;
+	int band; /* -1 tells the worker to exit */
+	int pagenum; /* non-zero for a whole page job */
+	void (*fn)(void *); /* non-NULL for an encoder job */
+	void *job;
+	char *filename;
+	int start;
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_rect tbounds;
+	fz_irect ibounds;
+	fz_pixmap *pix;
+	fz_cookie cookie;
+	unsigned char digest[16];
+	int error;
+	mu_semaphore start_sem;
+	mu_semaphore stop_sem;
+	mu_thread thread;
+} worker_t;
+
+static worker_t *workers = NULL;
+static worker_t *page_workers = NULL;
+static fz_jobs_context jobs_ctx;
+static int next_page_worker = 0;
+
+static mu_mutex mutexes[FZ_LOCK_MAX];
+
+static void mudraw_lock(void *user, int lock)
+{
+	mu_lock_mutex(&mutexes[lock]);
+}
+
+static void mudraw_unlock(void *user, int lock)
+{
+	mu_unlock_mutex(&mutexes[lock]);
+}
+
+static fz_locks_context mudraw_locks =
+{
+	NULL, mudraw_lock, mudraw_unlock
+};
+
 static struct {
 	int count, total;
 	int min, max;
@@ -115,10 +195,12 @@ static void usage(void)
 		"\t-a\tsave alpha channel (only pam and png)\n"
 		"\t-b -\tnumber of bits of antialiasing (0 to 8)\n"
 		"\t-g\trender in grayscale\n"
-		"\t-m\tshow timing information\n"
+		"\t-m\tshow timing information (-mm for glyph cache statistics)\n"
 		"\t-t\tshow text (-tt for xml, -ttt for more verbose xml)\n"
 		"\t-x\tshow display list\n"
 		"\t-d\tdisable use of display list\n"
+		"\t-L -\tsave display lists (%%d for page number)\n"
+		"\t-D -\tdraw from saved display lists (%%d for page number)\n"
 		"\t-5\tshow md5 checksums\n"
 		"\t-R -\trotate clockwise by given number of degrees\n"
 		"\t-G gamma\tgamma correct output\n"
@@ -126,6 +208,12 @@ static void usage(void)
 		"\t-l\tprint outline\n"
 		"\t-j -\tOutput mujstest file\n"
 		"\t-i\tignore errors and continue with the next file\n"
+		"\t-B -\tmaximum band height (render and write the page in bands)\n"
+		"\t-T -\tnumber of threads to render bands on\n"
+		"\t-P -\tnumber of pages to render in parallel\n"
+		"\t-z -\tpng compression level (0 to 9)\n"
+		"\t-F -\tpng row filter: none, sub, up, average, paeth or adaptive\n"
+		"\t-K\tcheck the vector span painters against the C ones and exit\n"
 		"\tpages\tcomma separated list of ranges\n");
 	exit(1);
 }
@@ -180,14 +268,586 @@ static void escape_string(FILE *out, int len, const char *string)
 	}
 }
 
+static void drawband(fz_context *ctx, fz_document *doc, fz_page *page, fz_display_list *list, const fz_matrix *ctm, const fz_rect *tbounds, fz_cookie *cookie, fz_pixmap *pix)
+{
+	fz_device *dev = NULL;
+
+	fz_var(dev);
+
+	if (savealpha)
+		fz_clear_pixmap(ctx, pix);
+	else
+		fz_clear_pixmap_with_value(ctx, pix, 255);
+
+	fz_try(ctx)
+	{
+		dev = fz_new_draw_device(ctx, pix);
+		if (list)
+			fz_run_display_list(list, dev, ctm, tbounds, cookie);
+		else
+			fz_run_page(doc, page, dev, ctm, cookie);
+	}
+	fz_always(ctx)
+	{
+		fz_free_device(dev);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static fz_pixmap *new_band_pixmap(fz_context *ctx, fz_pixmap *pix, int band, int bh, fz_irect *bbox)
+{
+	fz_irect pixbox;
+	int stride = fz_pixmap_width(ctx, pix) * fz_pixmap_components(ctx, pix);
+
+	fz_pixmap_bbox(ctx, pix, &pixbox);
+	*bbox = pixbox;
+	bbox->y0 = pixbox.y0 + band * bh;
+	bbox->y1 = fz_mini(bbox->y0 + bh, pixbox.y1);
+	return fz_new_pixmap_with_bbox_and_data(ctx, fz_pixmap_colorspace(ctx, pix), bbox,
+		fz_pixmap_samples(ctx, pix) + (bbox->y0 - pixbox.y0) * stride);
+}
+
+/*
+	Draw the n band pixmaps in bandpix, on the worker threads if we
+	have any (and then n must not exceed num_workers).
+*/
+static void drawbandgroup(fz_context *ctx, fz_document *doc, fz_page *page, fz_display_list *list, const fz_matrix *ctm, fz_cookie *cookie, fz_pixmap **bandpix, int n)
+{
+	fz_irect bbox;
+	fz_rect tbounds;
+	int i, failed = 0;
+
+	if (!workers || !list)
+	{
+		for (i = 0; i < n; i++)
+		{
+			fz_pixmap_bbox(ctx, bandpix[i], &bbox);
+			drawband(ctx, doc, page, list, ctm, fz_rect_from_irect(&tbounds, &bbox), cookie, bandpix[i]);
+		}
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		worker_t *w = &workers[i];
+		fz_pixmap_bbox(ctx, bandpix[i], &bbox);
+		fz_rect_from_irect(&w->tbounds, &bbox);
+		w->pix = bandpix[i];
+		w->band = i;
+		w->list = list;
+		w->ctm = *ctm;
+		memset(&w->cookie, 0, sizeof(fz_cookie));
+		w->error = 0;
+		mu_trigger_semaphore(&w->start_sem);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		worker_t *w = &workers[i];
+		mu_wait_semaphore(&w->stop_sem);
+		cookie->errors += w->cookie.errors;
+		failed |= w->error;
+		w->pix = NULL;
+		w->list = NULL;
+	}
+
+	if (failed)
+		fz_throw(ctx, "cannot draw page band");
+}
+
+/* Render every band of pix, on the worker threads if we have any. */
+static void drawbands(fz_context *ctx, fz_document *doc, fz_page *page, fz_display_list *list, const fz_matrix *ctm, fz_cookie *cookie, fz_pixmap *pix)
+{
+	int h = fz_pixmap_height(ctx, pix);
+	int slots = (workers && list) ? num_workers : 1;
+	int bh, bands, band, i, n;
+	fz_pixmap **bandpix;
+	fz_irect bbox;
+
+	/* Without an explicit band height, give each worker one band. */
+	bh = band_height;
+	if (bh <= 0)
+		bh = (h + num_workers - 1) / num_workers;
+	if (bh <= 0)
+		bh = 1;
+	bands = (h + bh - 1) / bh;
+
+	bandpix = fz_calloc(ctx, slots, sizeof(fz_pixmap *));
+	fz_try(ctx)
+	{
+		for (band = 0; band < bands; band += slots)
+		{
+			n = fz_mini(slots, bands - band);
+			for (i = 0; i < n; i++)
+				bandpix[i] = new_band_pixmap(ctx, pix, band + i, bh, &bbox);
+			drawbandgroup(ctx, doc, page, list, ctm, cookie, bandpix, n);
+			for (i = 0; i < n; i++)
+			{
+				fz_drop_pixmap(ctx, bandpix[i]);
+				bandpix[i] = NULL;
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		for (i = 0; i < slots; i++)
+			fz_drop_pixmap(ctx, bandpix[i]);
+		fz_free(ctx, bandpix);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/* Run the png encoder's (and the library's) jobs on the band workers. */
+static void runjobs(void *arg, void (*fn)(void *), void **jobs, int n)
+{
+	int i, k, m;
+
+	for (i = 0; i < n; i += num_workers)
+	{
+		m = fz_mini(num_workers, n - i);
+		for (k = 0; k < m; k++)
+		{
+			workers[k].fn = fn;
+			workers[k].job = jobs[i + k];
+			workers[k].band = 0;
+			mu_trigger_semaphore(&workers[k].start_sem);
+		}
+		for (k = 0; k < m; k++)
+		{
+			mu_wait_semaphore(&workers[k].stop_sem);
+			workers[k].fn = NULL;
+			workers[k].job = NULL;
+		}
+	}
+}
+
+static void pngoptions(fz_png_options *opts)
+{
+	opts->level = png_level;
+	opts->filter = png_filter;
+	opts->jobs = workers ? num_workers : 1;
+	opts->run = workers ? runjobs : NULL;
+	opts->arg = NULL;
+}
+
+static int parsefilter(char *s)
+{
+	static const char *names[] = { "none", "sub", "up", "average", "paeth", "adaptive" };
+	int i;
+
+	for (i = 0; i < nelem(names); i++)
+		if (!strcmp(s, names[i]))
+			return FZ_PNG_FILTER_NONE + i;
+	fprintf(stderr, "unknown png filter '%s'\n", s);
+	exit(1);
+	return 0;
+}
+
+static void postprocess(fz_context *ctx, fz_pixmap *pix)
+{
+	if (invert)
+		fz_invert_pixmap(ctx, pix);
+	if (gamma_value != 1)
+		fz_gamma_pixmap(ctx, pix, gamma_value);
+
+	if (savealpha)
+		fz_unmultiply_pixmap(ctx, pix);
+}
+
+/* Which outputs can be written a band at a time. */
+static int streamable(char *output)
+{
+	if (!output)
+		return 1;
+	return strstr(output, ".pgm") || strstr(output, ".ppm") || strstr(output, ".pnm") ||
+		strstr(output, ".pam") || strstr(output, ".png");
+}
+
+/*
+	Render the page band_height rows at a time, writing each band out
+	(and adding it to the md5) before its buffer is reused. Only one
+	band per worker thread (or just one band) is held in memory at a
+	time, however big the page is.
+*/
+static void renderbands(fz_context *ctx, fz_document *doc, fz_page *page, fz_display_list *list, int pagenum, const fz_matrix *ctm, const fz_irect *ibounds, fz_cookie *cookie, unsigned char *digest)
+{
+	int slots = (workers && list) ? num_workers : 1;
+	int w = ibounds->x1 - ibounds->x0;
+	int h = ibounds->y1 - ibounds->y0;
+	int bh = band_height;
+	int bands = (h + bh - 1) / bh;
+	int band, i, n, rows, comps;
+	fz_pixmap **slotpix;
+	fz_pixmap **bandpix;
+	fz_output *out = NULL;
+	fz_png_output_context *poc = NULL;
+	fz_png_options opts;
+	fz_md5 md5;
+	fz_irect bbox;
+
+	fz_var(out);
+	fz_var(poc);
+
+	slotpix = fz_calloc(ctx, 2 * slots, sizeof(fz_pixmap *));
+	bandpix = slotpix + slots;
+
+	fz_md5_init(&md5);
+
+	fz_try(ctx)
+	{
+		bbox = *ibounds;
+		bbox.y1 = fz_mini(bbox.y0 + bh, ibounds->y1);
+		for (i = 0; i < fz_mini(slots, bands); i++)
+			slotpix[i] = fz_new_pixmap_with_bbox(ctx, colorspace, &bbox);
+		comps = fz_pixmap_components(ctx, slotpix[0]);
+
+		if (output)
+		{
+			char buf[512];
+			sprintf(buf, output, pagenum);
+			out = fz_new_output_to_filename(ctx, buf);
+			if (strstr(output, ".pam"))
+				fz_output_pam_header(out, w, h, comps, colorspace, savealpha);
+			else if (strstr(output, ".png"))
+			{
+				pngoptions(&opts);
+				poc = fz_output_png_header_with_options(out, w, h, comps, savealpha, &opts);
+			}
+			else
+				fz_output_pnm_header(out, w, h, comps);
+		}
+
+		for (band = 0; band < bands; band += slots)
+		{
+			n = fz_mini(slots, bands - band);
+			for (i = 0; i < n; i++)
+			{
+				bbox.y0 = ibounds->y0 + (band + i) * bh;
+				bbox.y1 = fz_mini(bbox.y0 + bh, ibounds->y1);
+				bandpix[i] = fz_new_pixmap_with_bbox_and_data(ctx, colorspace, &bbox, fz_pixmap_samples(ctx, slotpix[i]));
+			}
+
+			drawbandgroup(ctx, doc, page, list, ctm, cookie, bandpix, n);
+
+			for (i = 0; i < n; i++)
+			{
+				unsigned char *samples = fz_pixmap_samples(ctx, bandpix[i]);
+
+				postprocess(ctx, bandpix[i]);
+				rows = fz_pixmap_height(ctx, bandpix[i]);
+
+				if (out)
+				{
+					if (strstr(output, ".pam"))
+						fz_output_pam_band(out, w, h, comps, band + i, bh, samples, savealpha);
+					else if (strstr(output, ".png"))
+						fz_output_png_band(out, w, h, comps, band + i, bh, samples, savealpha, poc);
+					else
+						fz_output_pnm_band(out, w, h, comps, band + i, bh, samples);
+				}
+				if (showmd5)
+					fz_md5_update(&md5, samples, w * rows * comps);
+
+				fz_drop_pixmap(ctx, bandpix[i]);
+				bandpix[i] = NULL;
+			}
+		}
+
+		if (poc)
+		{
+			fz_png_output_context *last = poc;
+			poc = NULL;
+			fz_output_png_trailer(out, last);
+		}
+
+		if (showmd5)
+			fz_md5_final(&md5, digest);
+	}
+	fz_always(ctx)
+	{
+		fz_free_png_output_context(ctx, poc);
+		fz_close_output(out);
+		for (i = 0; i < 2 * slots; i++)
+			fz_drop_pixmap(ctx, slotpix[i]);
+		fz_free(ctx, slotpix);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void renderpage(fz_context *ctx, fz_document *doc, fz_page *page, fz_display_list *list, int pagenum, const fz_matrix *ctm, const fz_irect *ibounds, fz_cookie *cookie, unsigned char *digest)
+{
+	fz_pixmap *pix = NULL;
+	fz_rect tbounds;
+
+	fz_var(pix);
+
+	if (band_height && streamable(output))
+	{
+		renderbands(ctx, doc, page, list, pagenum, ctm, ibounds, cookie, digest);
+		return;
+	}
+
+	fz_rect_from_irect(&tbounds, ibounds);
+
+	/* TODO: multi-page ppm */
+
+	fz_try(ctx)
+	{
+		pix = fz_new_pixmap_with_bbox(ctx, colorspace, ibounds);
+
+		if (band_height || workers)
+			drawbands(ctx, doc, page, list, ctm, cookie, pix);
+		else
+			drawband(ctx, doc, page, list, ctm, &tbounds, cookie, pix);
+
+		postprocess(ctx, pix);
+
+		if (output)
+		{
+			char buf[512];
+			sprintf(buf, output, pagenum);
+			if (strstr(output, ".pgm") || strstr(output, ".ppm") || strstr(output, ".pnm"))
+				fz_write_pnm(ctx, pix, buf);
+			else if (strstr(output, ".pam"))
+				fz_write_pam(ctx, pix, buf, savealpha);
+			else if (strstr(output, ".png"))
+			{
+				fz_png_options opts;
+				pngoptions(&opts);
+				fz_write_png_with_options(ctx, pix, buf, savealpha, &opts);
+			}
+			else if (strstr(output, ".pbm")) {
+				fz_bitmap *bit = fz_halftone_pixmap(ctx, pix, NULL);
+				fz_write_pbm(ctx, bit, buf);
+				fz_drop_bitmap(ctx, bit);
+			}
+		}
+
+		if (showmd5)
+			fz_md5_pixmap(pix, digest);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void worker_thread(void *arg)
+{
+	worker_t *me = (worker_t *)arg;
+
+	for (;;)
+	{
+		mu_wait_semaphore(&me->start_sem);
+		if (me->band < 0)
+			break;
+
+		fz_try(me->ctx)
+		{
+			if (me->fn)
+				me->fn(me->job);
+			else if (me->pagenum)
+				renderpage(me->ctx, NULL, NULL, me->list, me->pagenum, &me->ctm, &me->ibounds, &me->cookie, me->digest);
+			else
+				drawband(me->ctx, NULL, NULL, me->list, &me->ctm, &me->tbounds, &me->cookie, me->pix);
+		}
+		fz_catch(me->ctx)
+		{
+			me->error = 1;
+		}
+
+		mu_trigger_semaphore(&me->stop_sem);
+	}
+}
+
+/* Start up to *n workers; *n is set to the number actually started */
+static worker_t *start_workers(fz_context *ctx, int *n)
+{
+	worker_t *w = fz_calloc(ctx, *n, sizeof(worker_t));
+	int i;
+
+	for (i = 0; i < *n; i++)
+	{
+		w[i].ctx = fz_clone_context(ctx);
+		if (!w[i].ctx || mu_create_semaphore(&w[i].start_sem) || mu_create_semaphore(&w[i].stop_sem))
+		{
+			fprintf(stderr, "cannot initialise worker %d\n", i);
+			exit(1);
+		}
+		if (mu_create_thread(&w[i].thread, worker_thread, &w[i]))
+		{
+			/* Carry on with the threads we have */
+			mu_destroy_semaphore(&w[i].start_sem);
+			mu_destroy_semaphore(&w[i].stop_sem);
+			fz_free_context(w[i].ctx);
+			*n = i;
+			break;
+		}
+	}
+
+	if (*n == 0)
+	{
+		fprintf(stderr, "cannot create worker threads; rendering on one thread\n");
+		fz_free(ctx, w);
+		return NULL;
+	}
+
+	return w;
+}
+
+static void stop_workers(fz_context *ctx, worker_t *w, int n)
+{
+	int i;
+
+	if (!w)
+		return;
+
+	for (i = 0; i < n; i++)
+	{
+		w[i].band = -1;
+		mu_trigger_semaphore(&w[i].start_sem);
+		mu_destroy_thread(&w[i].thread);
+		mu_destroy_semaphore(&w[i].start_sem);
+		mu_destroy_semaphore(&w[i].stop_sem);
+		fz_free_context(w[i].ctx);
+	}
+	fz_free(ctx, w);
+}
+
+static void finishpage(char *filename, int pagenum, int start, fz_cookie *cookie, unsigned char *digest)
+{
+	if (showmd5 || showtime)
+		printf("page %s %d", filename, pagenum);
+
+	if (showmd5)
+	{
+		int i;
+
+		printf(" ");
+		for (i = 0; i < 16; i++)
+			printf("%02x", digest[i]);
+	}
+
+	if (showtime)
+	{
+		int end = gettime();
+		int diff = end - start;
+
+		if (diff < timing.min)
+		{
+			timing.min = diff;
+			timing.minpage = pagenum;
+			timing.minfilename = filename;
+		}
+		if (diff > timing.max)
+		{
+			timing.max = diff;
+			timing.maxpage = pagenum;
+			timing.maxfilename = filename;
+		}
+		timing.total += diff;
+		timing.count ++;
+
+		printf(" %dms", diff);
+	}
+
+	if (showmd5 || showtime)
+		printf("\n");
+
+	if (cookie->errors)
+		errored = 1;
+}
+
+/*
+	Wait for the page in flight on w (if any) and report it. If
+	discard is set the result is dropped silently; this is used to
+	drain the pipeline when giving up on a document.
+*/
+static void collectpage(fz_context *ctx, worker_t *w, int discard)
+{
+	int pagenum = w->pagenum;
+
+	if (!pagenum)
+		return;
+
+	mu_wait_semaphore(&w->stop_sem);
+	fz_free_display_list(ctx, w->list);
+	w->list = NULL;
+	w->pagenum = 0;
+	fz_flush_warnings(w->ctx);
+
+	if (discard)
+		return;
+	if (w->error)
+		fz_throw(ctx, "cannot draw page %d in file '%s'", pagenum, w->filename);
+	finishpage(w->filename, pagenum, w->start, &w->cookie, w->digest);
+}
+
+static void collectpages(fz_context *ctx, int discard)
+{
+	int i;
+
+	if (!page_workers)
+		return;
+
+	for (i = 0; i < num_page_workers; i++)
+	{
+		collectpage(ctx, &page_workers[next_page_worker], discard);
+		next_page_worker = (next_page_worker + 1) % num_page_workers;
+	}
+}
+
+/* Hand the page to the next worker in turn; takes ownership of list. */
+static void queuepage(fz_context *ctx, fz_display_list *list, int pagenum, const fz_matrix *ctm, const fz_irect *ibounds, int start)
+{
+	worker_t *w = &page_workers[next_page_worker];
+
+	fz_try(ctx)
+	{
+		collectpage(ctx, w, 0);
+	}
+	fz_catch(ctx)
+	{
+		fz_free_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+
+	w->pagenum = pagenum;
+	w->filename = filename;
+	w->start = start;
+	w->list = list;
+	w->ctm = *ctm;
+	w->ibounds = *ibounds;
+	memset(&w->cookie, 0, sizeof(fz_cookie));
+	w->error = 0;
+	mu_trigger_semaphore(&w->start_sem);
+
+	next_page_worker = (next_page_worker + 1) % num_page_workers;
+}
+
 static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 {
 	fz_page *page;
 	fz_display_list *list = NULL;
 	fz_device *dev = NULL;
-	int start;
+	int start = 0;
 	fz_cookie cookie = { 0 };
+	unsigned char digest[16];
 	int needshot = 0;
+	int queued = 0;
 
 	fz_var(list);
 	fz_var(dev);
@@ -311,9 +971,18 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	{
 		fz_try(ctx)
 		{
-			list = fz_new_display_list(ctx);
-			dev = fz_new_list_device(ctx, list);
-			fz_run_page(doc, page, dev, &fz_identity, &cookie);
+			if (loadlist)
+			{
+				char buf[512];
+				sprintf(buf, loadlist, pagenum);
+				list = fz_open_display_list(ctx, buf);
+			}
+			else
+			{
+				list = fz_new_display_list(ctx);
+				dev = fz_new_list_device(ctx, list);
+				fz_run_page(doc, page, dev, &fz_identity, &cookie);
+			}
 		}
 		fz_always(ctx)
 		{
@@ -328,6 +997,22 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 		}
 	}
 
+	if (savelist && list)
+	{
+		fz_try(ctx)
+		{
+			char buf[512];
+			sprintf(buf, savelist, pagenum);
+			fz_write_display_list(ctx, list, buf);
+		}
+		fz_catch(ctx)
+		{
+			fz_free_display_list(ctx, list);
+			fz_free_page(doc, page);
+			fz_throw(ctx, "cannot save display list for page %d in file '%s'", pagenum, filename);
+		}
+	}
+
 	if (showxml)
 	{
 		fz_try(ctx)
@@ -398,20 +1083,14 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 		}
 	}
 
-	if (showmd5 || showtime)
-		printf("page %s %d", filename, pagenum);
-
 	if (output || showmd5 || showtime)
 	{
 		float zoom;
 		fz_matrix ctm;
 		fz_rect bounds, tbounds;
 		fz_irect ibounds;
-		fz_pixmap *pix = NULL;
 		int w, h;
 
-		fz_var(pix);
-
 		fz_bound_page(doc, page, &bounds);
 		zoom = resolution / 72;
 		fz_pre_scale(fz_rotate(&ctm, rotation), zoom, zoom);
@@ -469,74 +1148,36 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 			fz_transform_rect(&tbounds, &ctm);
 		}
 		fz_round_rect(&ibounds, &tbounds);
-		fz_rect_from_irect(&tbounds, &ibounds);
-
-		/* TODO: banded rendering and multi-page ppm */
 
-		fz_try(ctx)
+		if (page_workers && list)
 		{
-			pix = fz_new_pixmap_with_bbox(ctx, colorspace, &ibounds);
-
-			if (savealpha)
-				fz_clear_pixmap(ctx, pix);
-			else
-				fz_clear_pixmap_with_value(ctx, pix, 255);
-
-			dev = fz_new_draw_device(ctx, pix);
-			if (list)
-				fz_run_display_list(list, dev, &ctm, &tbounds, &cookie);
-			else
-				fz_run_page(doc, page, dev, &ctm, &cookie);
-			fz_free_device(dev);
-			dev = NULL;
-
-			if (invert)
-				fz_invert_pixmap(ctx, pix);
-			if (gamma_value != 1)
-				fz_gamma_pixmap(ctx, pix, gamma_value);
-
-			if (savealpha)
-				fz_unmultiply_pixmap(ctx, pix);
-
-			if (output)
+			fz_try(ctx)
 			{
-				char buf[512];
-				sprintf(buf, output, pagenum);
-				if (strstr(output, ".pgm") || strstr(output, ".ppm") || strstr(output, ".pnm"))
-					fz_write_pnm(ctx, pix, buf);
-				else if (strstr(output, ".pam"))
-					fz_write_pam(ctx, pix, buf, savealpha);
-				else if (strstr(output, ".png"))
-					fz_write_png(ctx, pix, buf, savealpha);
-				else if (strstr(output, ".pbm")) {
-					fz_bitmap *bit = fz_halftone_pixmap(ctx, pix, NULL);
-					fz_write_pbm(ctx, bit, buf);
-					fz_drop_bitmap(ctx, bit);
-				}
+				queuepage(ctx, list, pagenum, &ctm, &ibounds, start);
 			}
-
-			if (showmd5)
+			fz_always(ctx)
 			{
-				unsigned char digest[16];
-				int i;
-
-				fz_md5_pixmap(pix, digest);
-				printf(" ");
-				for (i = 0; i < 16; i++)
-					printf("%02x", digest[i]);
+				list = NULL;
 			}
+			fz_catch(ctx)
+			{
+				fz_free_page(doc, page);
+				fz_rethrow(ctx);
+			}
+			queued = 1;
 		}
-		fz_always(ctx)
-		{
-			fz_free_device(dev);
-			dev = NULL;
-			fz_drop_pixmap(ctx, pix);
-		}
-		fz_catch(ctx)
+		else
 		{
-			fz_free_display_list(ctx, list);
-			fz_free_page(doc, page);
-			fz_rethrow(ctx);
+			fz_try(ctx)
+			{
+				renderpage(ctx, doc, page, list, pagenum, &ctm, &ibounds, &cookie, digest);
+			}
+			fz_catch(ctx)
+			{
+				fz_free_display_list(ctx, list);
+				fz_free_page(doc, page);
+				fz_rethrow(ctx);
+			}
 		}
 	}
 
@@ -545,31 +1186,8 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 
 	fz_free_page(doc, page);
 
-	if (showtime)
-	{
-		int end = gettime();
-		int diff = end - start;
-
-		if (diff < timing.min)
-		{
-			timing.min = diff;
-			timing.minpage = pagenum;
-			timing.minfilename = filename;
-		}
-		if (diff > timing.max)
-		{
-			timing.max = diff;
-			timing.maxpage = pagenum;
-			timing.maxfilename = filename;
-		}
-		timing.total += diff;
-		timing.count ++;
-
-		printf(" %dms", diff);
-	}
-
-	if (showmd5 || showtime)
-		printf("\n");
+	if (!queued)
+		finishpage(filename, pagenum, start, &cookie, digest);
 
 	fz_flush_warnings(ctx);
 
@@ -577,9 +1195,6 @@ static void drawpage(fz_context *ctx, fz_document *doc, int pagenum)
 	{
 		fprintf(mujstest_file, "SCREENSHOT\n");
 	}
-
-	if (cookie.errors)
-		errored = 1;
 }
 
 static void drawrange(fz_context *ctx, fz_document *doc, char *range)
@@ -658,12 +1273,14 @@ int main(int argc, char **argv)
 	char *password = "";
 	int grayscale = 0;
 	fz_document *doc = NULL;
-	int c;
+	int c, i;
 	fz_context *ctx;
+	int locked;
+	int checkpainters = 0;
 
 	fz_var(doc);
 
-	while ((c = fz_getopt(argc, argv, "lo:p:r:R:ab:dgmtx5G:Iw:h:fij:")) != -1)
+	while ((c = fz_getopt(argc, argv, "lo:p:r:R:ab:dgmtx5G:Iw:h:fij:B:T:P:L:D:z:F:K")) != -1)
 	{
 		switch (c)
 		{
@@ -687,14 +1304,38 @@ int main(int argc, char **argv)
 		case 'I': invert++; break;
 		case 'j': mujstest_filename = fz_optarg; break;
 		case 'i': ignore_errors = 1; break;
+		case 'B': band_height = atoi(fz_optarg); break;
+		case 'T': num_workers = atoi(fz_optarg); break;
+		case 'P': num_page_workers = atoi(fz_optarg); break;
+		case 'L': savelist = fz_optarg; break;
+		case 'D': loadlist = fz_optarg; break;
+		case 'z': png_level = atoi(fz_optarg); break;
+		case 'F': png_filter = parsefilter(fz_optarg); break;
+		case 'K': checkpainters = 1; break;
 		default: usage(); break;
 		}
 	}
 
+	if (checkpainters)
+	{
+		int bad;
+		ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+		if (!ctx)
+		{
+			fprintf(stderr, "cannot initialise context\n");
+			exit(1);
+		}
+		bad = fz_check_paint_kernels(ctx);
+		printf("span painters in use: %s\n", fz_paint_kernels_name());
+		printf("vector span painters that differ from C: %d\n", bad);
+		fz_free_context(ctx);
+		exit(bad ? 1 : 0);
+	}
+
 	if (fz_optind == argc)
 		usage();
 
-	if (!showtext && !showxml && !showtime && !showmd5 && !showoutline && !output && !mujstest_filename)
+	if (!showtext && !showxml && !showtime && !showmd5 && !showoutline && !output && !mujstest_filename && !savelist)
 	{
 		printf("nothing to do\n");
 		exit(0);
@@ -708,7 +1349,44 @@ int main(int argc, char **argv)
 			mujstest_file = fopen(mujstest_filename, "wb");
 	}
 
-	ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	if ((savelist || loadlist) && !uselist)
+	{
+		fprintf(stderr, "cannot save or load display lists with -d\n");
+		exit(1);
+	}
+
+	if (band_height < 0)
+		band_height = 0;
+	if (num_workers < 0)
+		num_workers = 0;
+	if (num_page_workers < 0)
+		num_page_workers = 0;
+	if ((num_workers > 0 || num_page_workers > 0) && !uselist)
+	{
+		fprintf(stderr, "threaded rendering requires a display list; ignoring -T and -P\n");
+		num_workers = 0;
+		num_page_workers = 0;
+	}
+	if (num_workers > 0 && num_page_workers > 0)
+	{
+		fprintf(stderr, "cannot combine -T and -P; ignoring -T\n");
+		num_workers = 0;
+	}
+
+	locked = (num_workers > 0 || num_page_workers > 0);
+	if (locked)
+	{
+		for (i = 0; i < FZ_LOCK_MAX; i++)
+		{
+			if (mu_create_mutex(&mutexes[i]))
+			{
+				fprintf(stderr, "cannot create mutex\n");
+				exit(1);
+			}
+		}
+	}
+
+	ctx = fz_new_context(NULL, locked ? &mudraw_locks : NULL, FZ_STORE_DEFAULT);
 	if (!ctx)
 	{
 		fprintf(stderr, "cannot initialise context\n");
@@ -717,6 +1395,18 @@ int main(int argc, char **argv)
 
 	fz_set_aa_level(ctx, alphabits);
 
+	if (num_workers > 0)
+		workers = start_workers(ctx, &num_workers);
+	if (workers)
+	{
+		jobs_ctx.user = NULL;
+		jobs_ctx.run = runjobs;
+		jobs_ctx.count = num_workers;
+		fz_set_jobs_context(ctx, &jobs_ctx);
+	}
+	if (num_page_workers > 0)
+		page_workers = start_workers(ctx, &num_page_workers);
+
 	colorspace = fz_device_rgb;
 	if (output && strstr(output, ".pgm"))
 		colorspace = fz_device_gray;
@@ -793,12 +1483,13 @@ int main(int argc, char **argv)
 				if (showoutline)
 					drawoutline(ctx, doc);
 
-				if (showtext || showxml || showtime || showmd5 || output || mujstest_file)
+				if (showtext || showxml || showtime || showmd5 || output || mujstest_file || savelist)
 				{
 					if (fz_optind == argc || !isrange(argv[fz_optind]))
 						drawrange(ctx, doc, "1-");
 					if (fz_optind < argc && isrange(argv[fz_optind]))
 						drawrange(ctx, doc, argv[fz_optind++]);
+					collectpages(ctx, 0);
 				}
 
 				if (showxml || showtext == TEXT_XML)
@@ -809,6 +1500,8 @@ int main(int argc, char **argv)
 			}
 			fz_catch(ctx)
 			{
+				collectpages(ctx, 1);
+
 				if (!ignore_errors)
 					fz_rethrow(ctx);
 
@@ -860,10 +1553,28 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (showtime > 1)
+	{
+		fz_glyph_cache_stats stats;
+		fz_get_glyph_cache_stats(ctx, &stats);
+		printf("glyph cache: %d hits, %d misses, %d evictions, %u of %u bytes used\n",
+			stats.hits, stats.misses, stats.evictions, stats.size, stats.max);
+	}
+
 	if (mujstest_file && mujstest_file != stdout)
 		fclose(mujstest_file);
 
+	fz_set_jobs_context(ctx, NULL);
+	stop_workers(ctx, workers, num_workers);
+	stop_workers(ctx, page_workers, num_page_workers);
+
 	fz_free_context(ctx);
+
+	if (locked)
+	{
+		for (i = 0; i < FZ_LOCK_MAX; i++)
+			mu_destroy_mutex(&mutexes[i]);
+	}
 	return (errored != 0);
 }
 
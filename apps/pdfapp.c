@@ -327,9 +327,13 @@ static int pdfapp_save(pdfapp_t *app)
 		fz_write_options opts;
 
 		opts.do_ascii = 1;
+		opts.do_deflate = 0;
 		opts.do_expand = 0;
 		opts.do_garbage = 1;
 		opts.do_linear = 0;
+		opts.do_incremental = 0;
+		opts.dedup_objects = NULL;
+		opts.dedup_bytes = NULL;
 
 		if (strcmp(buf, app->docpath) == 0)
 		{
@@ -11,10 +11,30 @@
 
 #include "fitz.h"
 #include "mupdf-internal.h"
+#include "mu-threads.h"
 
 static pdf_document *xref = NULL;
 static fz_context *ctx = NULL;
 
+/*
+	With -z and -T, streams are deflated on num_workers threads. The
+	jobs they run neither touch the context nor allocate, so the
+	context needs no locks.
+*/
+
+typedef struct worker_s
+{
+	void (*fn)(void *); /* NULL tells the worker to exit */
+	void *job;
+	mu_semaphore start_sem;
+	mu_semaphore stop_sem;
+	mu_thread thread;
+} worker_t;
+
+static worker_t *workers = NULL;
+static int num_workers = 0;
+static fz_jobs_context jobs_ctx;
+
 static void usage(void)
 {
 	fprintf(stderr,
@@ -23,11 +43,14 @@ static void usage(void)
 		"\t-g\tgarbage collect unused objects\n"
 		"\t-gg\tin addition to -g compact xref table\n"
 		"\t-ggg\tin addition to -gg merge duplicate objects\n"
+		"\t-gggg\tin addition to -ggg merge duplicate streams\n"
 		"\t-d\tdecompress all streams\n"
 		"\t-l\tlinearize PDF\n"
 		"\t-i\ttoggle decompression of image streams\n"
 		"\t-f\ttoggle decompression of font streams\n"
 		"\t-a\tascii hex encode binary streams\n"
+		"\t-z\tdeflate uncompressed streams\n"
+		"\t-T -\tnumber of threads to deflate streams on\n"
 		"\tpages\tcomma separated list of ranges\n");
 	exit(1);
 }
@@ -92,8 +115,8 @@ static void retainpages(int argc, char **argv)
 
 			for (page = spage; page <= epage; page++)
 			{
-				pdf_obj *pageobj = xref->page_objs[page-1];
-				pdf_obj *pageref = xref->page_refs[page-1];
+				pdf_obj *pageobj = pdf_lookup_page_obj(xref, page-1);
+				pdf_obj *pageref = pdf_lookup_page_ref(xref, page-1);
 
 				pdf_dict_puts(pageobj, "Parent", parent);
 
@@ -153,6 +176,86 @@ static void retainpages(int argc, char **argv)
 	}
 }
 
+static void worker_thread(void *arg)
+{
+	worker_t *me = (worker_t *)arg;
+
+	for (;;)
+	{
+		mu_wait_semaphore(&me->start_sem);
+		if (!me->fn)
+			break;
+		me->fn(me->job);
+		mu_trigger_semaphore(&me->stop_sem);
+	}
+}
+
+static void runjobs(void *arg, void (*fn)(void *), void **jobs, int n)
+{
+	int i, k, m;
+
+	for (i = 0; i < n; i += num_workers)
+	{
+		m = fz_mini(num_workers, n - i);
+		for (k = 0; k < m; k++)
+		{
+			workers[k].fn = fn;
+			workers[k].job = jobs[i + k];
+			mu_trigger_semaphore(&workers[k].start_sem);
+		}
+		for (k = 0; k < m; k++)
+			mu_wait_semaphore(&workers[k].stop_sem);
+	}
+}
+
+static void start_workers(void)
+{
+	int i;
+
+	workers = fz_calloc(ctx, num_workers, sizeof(worker_t));
+	for (i = 0; i < num_workers; i++)
+	{
+		if (mu_create_semaphore(&workers[i].start_sem) || mu_create_semaphore(&workers[i].stop_sem))
+		{
+			fprintf(stderr, "cannot initialise worker %d\n", i);
+			exit(1);
+		}
+		if (mu_create_thread(&workers[i].thread, worker_thread, &workers[i]))
+		{
+			/* Carry on with the threads we have */
+			mu_destroy_semaphore(&workers[i].start_sem);
+			mu_destroy_semaphore(&workers[i].stop_sem);
+			num_workers = i;
+			break;
+		}
+	}
+
+	jobs_ctx.user = NULL;
+	jobs_ctx.run = runjobs;
+	jobs_ctx.count = num_workers;
+	fz_set_jobs_context(ctx, &jobs_ctx);
+}
+
+static void stop_workers(void)
+{
+	int i;
+
+	if (!workers)
+		return;
+
+	fz_set_jobs_context(ctx, NULL);
+	for (i = 0; i < num_workers; i++)
+	{
+		workers[i].fn = NULL;
+		mu_trigger_semaphore(&workers[i].start_sem);
+		mu_destroy_thread(&workers[i].thread);
+		mu_destroy_semaphore(&workers[i].start_sem);
+		mu_destroy_semaphore(&workers[i].stop_sem);
+	}
+	fz_free(ctx, workers);
+	workers = NULL;
+}
+
 int pdfclean_main(int argc, char **argv)
 {
 	char *infile;
@@ -163,15 +266,21 @@ int pdfclean_main(int argc, char **argv)
 	fz_write_options opts;
 	int write_failed = 0;
 	int errors = 0;
+	int dedup_objects = 0;
+	fz_off_t dedup_bytes = 0;
 
 	opts.do_garbage = 0;
 	opts.do_expand = 0;
 	opts.do_ascii = 0;
+	opts.do_deflate = 0;
 	opts.do_linear = 0;
+	opts.do_incremental = 0;
+	opts.dedup_objects = &dedup_objects;
+	opts.dedup_bytes = &dedup_bytes;
 	opts.continue_on_error = 1;
 	opts.errors = &errors;
 
-	while ((c = fz_getopt(argc, argv, "adfgilp:")) != -1)
+	while ((c = fz_getopt(argc, argv, "adfgilp:zT:")) != -1)
 	{
 		switch (c)
 		{
@@ -182,6 +291,8 @@ int pdfclean_main(int argc, char **argv)
 		case 'i': opts.do_expand ^= fz_expand_images; break;
 		case 'l': opts.do_linear ++; break;
 		case 'a': opts.do_ascii ++; break;
+		case 'z': opts.do_deflate ++; break;
+		case 'T': num_workers = atoi(fz_optarg); break;
 		default: usage(); break;
 		}
 	}
@@ -208,6 +319,9 @@ int pdfclean_main(int argc, char **argv)
 		exit(1);
 	}
 
+	if (opts.do_deflate && num_workers > 1)
+		start_workers();
+
 	fz_try(ctx)
 	{
 		xref = pdf_open_document_no_run(ctx, infile);
@@ -220,6 +334,9 @@ int pdfclean_main(int argc, char **argv)
 			retainpages(argc, argv);
 
 		pdf_write_document(xref, outfile, &opts);
+
+		if (opts.do_garbage >= 3)
+			printf("merged %d duplicate objects, saving about %lld bytes\n", dedup_objects, dedup_bytes);
 	}
 	fz_always(ctx)
 	{
@@ -230,6 +347,7 @@ int pdfclean_main(int argc, char **argv)
 		write_failed = 1;
 	}
 
+	stop_workers();
 	fz_free_context(ctx);
 
 	if (errors)
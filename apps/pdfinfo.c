@@ -573,8 +573,8 @@ gatherresourceinfo(int page, pdf_obj *rsrc, int show)
 	pdf_obj *subrsrc;
 	int i;
 
-	pageobj = xref->page_objs[page-1];
-	pageref = xref->page_refs[page-1];
+	pageobj = pdf_lookup_page_obj(xref, page-1);
+	pageref = pdf_lookup_page_ref(xref, page-1);
 
 	if (!pageobj)
 		fz_throw(ctx, "cannot retrieve info from page %d", page);
@@ -641,8 +641,8 @@ gatherpageinfo(int page, int show)
 	pdf_obj *pageref;
 	pdf_obj *rsrc;
 
-	pageobj = xref->page_objs[page-1];
-	pageref = xref->page_refs[page-1];
+	pageobj = pdf_lookup_page_obj(xref, page-1);
+	pageref = pdf_lookup_page_ref(xref, page-1);
 
 	if (!pageobj)
 		fz_throw(ctx, "cannot retrieve info from page %d", page);
@@ -893,6 +893,7 @@ showinfo(char *filename, int show, char *pagelist)
 	char *spec, *dash;
 	int allpages;
 	int pagecount;
+	pdf_obj_stm_stats stats;
 
 	if (!xref)
 		infousage();
@@ -942,6 +943,9 @@ showinfo(char *filename, int show, char *pagelist)
 
 	if (allpages)
 		printinfo(filename, show, -1);
+
+	pdf_get_obj_stm_stats(xref, &stats);
+	printf("Object stream cache: %d hits, %d misses\n\n", stats.hits, stats.misses);
 }
 
 static int arg_is_page_range(const char *arg)
@@ -83,7 +83,7 @@ static void decimatepages(pdf_document *xref)
 				fz_rect mb;
 				int num;
 
-				newpageobj = pdf_copy_dict(ctx, xref->page_objs[page]);
+				newpageobj = pdf_copy_dict(ctx, pdf_lookup_page_obj(xref, page));
 				num = pdf_create_object(xref);
 				pdf_update_object(xref, num, newpageobj);
 				newpageref = pdf_new_indirect(ctx, num, 0, xref);
@@ -138,6 +138,10 @@ int pdfposter_main(int argc, char **argv)
 	opts.do_garbage = 0;
 	opts.do_expand = 0;
 	opts.do_ascii = 0;
+	opts.do_deflate = 0;
+	opts.do_incremental = 0;
+	opts.dedup_objects = NULL;
+	opts.dedup_bytes = NULL;
 
 	while ((c = fz_getopt(argc, argv, "x:y:")) != -1)
 	{
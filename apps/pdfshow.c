@@ -62,7 +62,7 @@ static void showpagetree(void)
 	count = pdf_count_pages(doc);
 	for (i = 0; i < count; i++)
 	{
-		ref = doc->page_refs[i];
+		ref = pdf_lookup_page_ref(doc, i);
 		printf("page %d = %d %d R\n", i + 1, pdf_to_num(ref), pdf_to_gen(ref));
 	}
 	printf("\n");
@@ -161,7 +161,10 @@ static void showgrep(char *filename)
 	len = pdf_count_objects(doc);
 	for (i = 0; i < len; i++)
 	{
-		if (doc->table[i].type == 'n' || doc->table[i].type == 'o')
+		pdf_xref_entry entry;
+
+		pdf_peek_xref_entry(doc, i, &entry);
+		if (entry.type == 'n' || entry.type == 'o')
 		{
 			fz_try(ctx)
 			{
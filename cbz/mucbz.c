@@ -9,6 +9,10 @@
 #define ZIP_CENTRAL_DIRECTORY_SIG 0x02014b50
 #define ZIP_END_OF_CENTRAL_DIRECTORY_SIG 0x06054b50
 
+#define ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIG 0x07064b50
+#define ZIP64_END_OF_CENTRAL_DIRECTORY_SIG 0x06064b50
+#define ZIP64_EXTRA_FIELD_SIG 0x0001
+
 #define DPI 72.0f
 
 static void cbz_init_document(cbz_document *doc);
@@ -38,7 +42,9 @@ typedef struct cbz_entry_s cbz_entry;
 struct cbz_entry_s
 {
 	char *name;
-	int offset;
+	fz_off_t offset;
+	int csize; /* -1 if too large to load */
+	int usize;
 };
 
 struct cbz_document_s
@@ -60,15 +66,22 @@ static inline int getshort(fz_stream *file)
 	return a | b << 8;
 }
 
-static inline int getlong(fz_stream *file)
+static inline unsigned int getlong(fz_stream *file)
 {
-	int a = fz_read_byte(file);
-	int b = fz_read_byte(file);
-	int c = fz_read_byte(file);
-	int d = fz_read_byte(file);
+	unsigned int a = fz_read_byte(file);
+	unsigned int b = fz_read_byte(file);
+	unsigned int c = fz_read_byte(file);
+	unsigned int d = fz_read_byte(file);
 	return a | b << 8 | c << 16 | d << 24;
 }
 
+static inline fz_off_t getlong64(fz_stream *file)
+{
+	fz_off_t a = getlong(file);
+	fz_off_t b = getlong(file);
+	return a | b << 32;
+}
+
 static void *
 cbz_zip_alloc_items(void *ctx, unsigned int items, unsigned int size)
 {
@@ -82,16 +95,20 @@ cbz_zip_free(void *ctx, void *ptr)
 }
 
 static unsigned char *
-cbz_read_zip_entry(cbz_document *doc, int offset, int *sizep)
+cbz_read_zip_entry(cbz_document *doc, cbz_entry *entry, int *sizep)
 {
 	fz_context *ctx = doc->ctx;
 	fz_stream *file = doc->file;
-	int sig, method, namelength, extralength;
+	unsigned int sig;
+	int method, namelength, extralength;
 	unsigned long csize, usize;
 	unsigned char *cdata;
 	int code;
 
-	fz_seek(file, offset, 0);
+	if (entry->usize < 0)
+		fz_throw(ctx, "zip entry too large to load: %s", entry->name);
+
+	fz_seek(file, entry->offset, 0);
 
 	sig = getlong(doc->file);
 	if (sig != ZIP_LOCAL_FILE_SIG)
@@ -103,11 +120,16 @@ cbz_read_zip_entry(cbz_document *doc, int offset, int *sizep)
 	(void) getshort(doc->file); /* file time */
 	(void) getshort(doc->file); /* file date */
 	(void) getlong(doc->file); /* crc-32 */
-	csize = getlong(doc->file); /* csize */
-	usize = getlong(doc->file); /* usize */
+	(void) getlong(doc->file); /* csize */
+	(void) getlong(doc->file); /* usize */
 	namelength = getshort(doc->file);
 	extralength = getshort(doc->file);
 
+	/* The sizes here may be missing (data descriptor) or in a zip64
+	 * extra field; the central directory always has them. */
+	csize = entry->csize;
+	usize = entry->usize;
+
 	fz_seek(file, namelength + extralength, 1);
 
 	cdata = fz_malloc(ctx, csize);
@@ -182,11 +204,13 @@ cbz_compare_entries(const void *a_, const void *b_)
 }
 
 static void
-cbz_read_zip_dir_imp(cbz_document *doc, int startoffset)
+cbz_read_zip_dir_imp(cbz_document *doc, fz_off_t startoffset)
 {
 	fz_context *ctx = doc->ctx;
 	fz_stream *file = doc->file;
-	int sig, offset, count;
+	unsigned int sig;
+	fz_off_t offset, count;
+	fz_off_t csize, usize;
 	int namesize, metasize, commentsize;
 	int i, k;
 
@@ -203,6 +227,40 @@ cbz_read_zip_dir_imp(cbz_document *doc, int startoffset)
 	(void) getlong(file); /* size of central directory */
 	offset = getlong(file); /* offset to central directory */
 
+	/* ZIP64 */
+	if (count == 0xFFFF || offset == 0xFFFFFFFF)
+	{
+		fz_seek(file, startoffset - 20, 0);
+
+		sig = getlong(file);
+		if (sig != ZIP64_END_OF_CENTRAL_DIRECTORY_LOCATOR_SIG)
+			fz_throw(ctx, "wrong zip64 end of central directory locator signature (0x%x)", sig);
+
+		(void) getlong(file); /* start disk */
+		offset = getlong64(file); /* offset to end of central directory record */
+		if (offset < 0)
+			fz_throw(ctx, "zip64 end of central directory offset out of range");
+
+		fz_seek(file, offset, 0);
+
+		sig = getlong(file);
+		if (sig != ZIP64_END_OF_CENTRAL_DIRECTORY_SIG)
+			fz_throw(ctx, "wrong zip64 end of central directory signature (0x%x)", sig);
+
+		(void) getlong64(file); /* size of record */
+		(void) getshort(file); /* version made by */
+		(void) getshort(file); /* version to extract */
+		(void) getlong(file); /* disk number */
+		(void) getlong(file); /* disk number start */
+		count = getlong64(file); /* entries in central directory disk */
+		(void) getlong64(file); /* entries in central directory */
+		(void) getlong64(file); /* size of central directory */
+		offset = getlong64(file); /* offset to central directory */
+	}
+
+	if (count < 0 || count > INT_MAX / (int)sizeof(cbz_entry) || offset < 0)
+		fz_throw(ctx, "zip central directory out of range");
+
 	doc->entry = fz_calloc(ctx, count, sizeof(cbz_entry));
 	doc->entry_count = count;
 
@@ -223,21 +281,57 @@ cbz_read_zip_dir_imp(cbz_document *doc, int startoffset)
 		(void) getshort(file); /* last mod file time */
 		(void) getshort(file); /* last mod file date */
 		(void) getlong(file); /* crc-32 */
-		(void) getlong(file); /* csize */
-		(void) getlong(file); /* usize */
+		csize = getlong(file);
+		usize = getlong(file);
 		namesize = getshort(file);
 		metasize = getshort(file);
 		commentsize = getshort(file);
 		(void) getshort(file); /* disk number start */
 		(void) getshort(file); /* int file atts */
 		(void) getlong(file); /* ext file atts */
-		entry->offset = getlong(file);
+		offset = getlong(file);
 
 		entry->name = fz_malloc(ctx, namesize + 1);
 		fz_read(file, (unsigned char *)entry->name, namesize);
 		entry->name[namesize] = 0;
 
-		fz_seek(file, metasize, 1);
+		while (metasize > 0)
+		{
+			int type = getshort(file);
+			int size = getshort(file);
+			if (type == ZIP64_EXTRA_FIELD_SIG)
+			{
+				/* Only the fields that overflowed are present, in this order */
+				if (usize == 0xFFFFFFFF && size >= 8)
+				{
+					usize = getlong64(file);
+					size -= 8;
+					metasize -= 8;
+				}
+				if (csize == 0xFFFFFFFF && size >= 8)
+				{
+					csize = getlong64(file);
+					size -= 8;
+					metasize -= 8;
+				}
+				if (offset == 0xFFFFFFFF && size >= 8)
+				{
+					offset = getlong64(file);
+					size -= 8;
+					metasize -= 8;
+				}
+			}
+			fz_seek(file, size, 1);
+			metasize -= 4 + size;
+		}
+		if (offset < 0)
+			fz_throw(ctx, "zip entry offset out of range: %s", entry->name);
+		if (usize < 0 || usize >= INT_MAX || csize < 0 || csize >= INT_MAX)
+			usize = csize = -1;
+		entry->csize = csize;
+		entry->usize = usize;
+		entry->offset = offset;
+
 		fz_seek(file, commentsize, 1);
 	}
 
@@ -257,13 +351,14 @@ cbz_read_zip_dir(cbz_document *doc)
 {
 	fz_stream *file = doc->file;
 	unsigned char buf[512];
-	int filesize, back, maxback;
+	fz_off_t filesize;
+	int back, maxback;
 	int i, n;
 
 	fz_seek(file, 0, 2);
 	filesize = fz_tell(file);
 
-	maxback = fz_mini(filesize, 0xFFFF + sizeof buf);
+	maxback = filesize < 0xFFFF + (int)sizeof buf ? (int)filesize : 0xFFFF + (int)sizeof buf;
 	back = fz_mini(maxback, sizeof buf);
 
 	while (back < maxback)
@@ -394,7 +489,7 @@ cbz_load_page(cbz_document *doc, int number)
 		page = fz_malloc_struct(ctx, cbz_page);
 		page->image = NULL;
 
-		data = cbz_read_zip_entry(doc, doc->entry[number].offset, &size);
+		data = cbz_read_zip_entry(doc, &doc->entry[number], &size);
 
 		if (data[0] == 0xff && data[1] == 0xd8)
 			pixmap = fz_load_jpeg(ctx, data, size);
@@ -404,7 +499,7 @@ cbz_load_page(cbz_document *doc, int number)
 			fz_throw(ctx, "unknown image format");
 
 		image = fz_malloc_struct(ctx, cbz_image);
-		FZ_INIT_STORABLE(&image->base, 1, cbz_free_image);
+		FZ_INIT_STORABLE(&image->base, 1, cbz_free_image, FZ_STORE_IMAGE);
 		image->base.w = pixmap->w;
 		image->base.h = pixmap->h;
 		image->base.get_pixmap = cbz_image_to_pixmap;
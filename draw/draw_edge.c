@@ -255,8 +255,6 @@ fz_bound_gel(const fz_gel *gel, fz_irect *bbox)
 
 enum { INSIDE, OUTSIDE, LEAVE, ENTER };
 
-#define clip_lerp_y(v,m,x0,y0,x1,y1,t) clip_lerp_x(v,m,y0,x0,y1,x1,t)
-
 static int
 clip_lerp_x(int val, int m, int x0, int y0, int x1, int y1, int *out)
 {
@@ -282,6 +280,28 @@ clip_lerp_x(int val, int m, int x0, int y0, int x1, int y1, int *out)
 	}
 }
 
+/*
+	Step an edge k rows down from its top. Each row adds adj_up to the
+	error term and moves one further in xdir whenever it goes positive,
+	so after k rows it has done that ceil((e + k * adj_up) / adj_down)
+	times.
+*/
+static int
+fz_step_edge(int x, int *e, int k, int xmove, int xdir, int adj_up, int adj_down)
+{
+	int64_t t = (int64_t)*e + (int64_t)k * adj_up;
+	int64_t c = t > 0 ? (t + adj_down - 1) / adj_down : 0;
+	*e = (int)(t - c * adj_down);
+	return x + k * xmove + (int)c * xdir;
+}
+
+/*
+	Edges are clipped to the rows of the clip rectangle by stepping them
+	down to its first row and cutting their height, rather than moving
+	their end points, which would change the slope. The pixels an edge
+	covers then do not depend on the clip, so rendering a page in bands
+	gives the same result as rendering it whole.
+*/
 static void
 fz_insert_gel_raw(fz_gel *gel, int x0, int y0, int x1, int y1)
 {
@@ -290,6 +310,8 @@ fz_insert_gel_raw(fz_gel *gel, int x0, int y0, int x1, int y1)
 	int winding;
 	int width;
 	int tmp;
+	int top, bot, e, xtop, xbot;
+	int xmove, adj_up;
 
 	if (y0 == y1)
 		return;
@@ -302,50 +324,68 @@ fz_insert_gel_raw(fz_gel *gel, int x0, int y0, int x1, int y1)
 	else
 		winding = 1;
 
-	if (x0 < gel->bbox.x0) gel->bbox.x0 = x0;
-	if (x0 > gel->bbox.x1) gel->bbox.x1 = x0;
-	if (x1 < gel->bbox.x0) gel->bbox.x0 = x1;
-	if (x1 > gel->bbox.x1) gel->bbox.x1 = x1;
-
-	if (y0 < gel->bbox.y0) gel->bbox.y0 = y0;
-	if (y1 > gel->bbox.y1) gel->bbox.y1 = y1;
-
-	if (gel->len + 1 == gel->cap) {
-		int new_cap = gel->cap + 512;
-		gel->edges = fz_resize_array(gel->ctx, gel->edges, new_cap, sizeof(fz_edge));
-		gel->cap = new_cap;
-	}
-
-	edge = &gel->edges[gel->len++];
+	top = fz_maxi(y0, (int)gel->clip.y0);
+	bot = fz_mini(y1, (int)gel->clip.y1);
+	if (top >= bot)
+		return;
 
 	dy = y1 - y0;
 	dx = x1 - x0;
 	width = fz_absi(dx);
 
-	edge->xdir = dx > 0 ? 1 : -1;
-	edge->ydir = winding;
-	edge->x = x0;
-	edge->y = y0;
-	edge->h = dy;
-	edge->adj_down = dy;
-
 	/* initial error term going l->r and r->l */
 	if (dx >= 0)
-		edge->e = 0;
+		e = 0;
 	else
-		edge->e = -dy + 1;
+		e = -dy + 1;
 
 	/* y-major edge */
 	if (dy >= width) {
-		edge->xmove = 0;
-		edge->adj_up = width;
+		xmove = 0;
+		adj_up = width;
 	}
 
 	/* x-major edge */
 	else {
-		edge->xmove = (width / dy) * edge->xdir;
-		edge->adj_up = width % dy;
+		xmove = (width / dy) * (dx > 0 ? 1 : -1);
+		adj_up = width % dy;
+	}
+
+	xtop = x0;
+	if (top > y0)
+		xtop = fz_step_edge(x0, &e, top - y0, xmove, dx > 0 ? 1 : -1, adj_up, dy);
+	xbot = x1;
+	if (bot < y1)
+	{
+		tmp = e;
+		xbot = fz_step_edge(xtop, &tmp, bot - top, xmove, dx > 0 ? 1 : -1, adj_up, dy);
+	}
+
+	if (xtop < gel->bbox.x0) gel->bbox.x0 = xtop;
+	if (xtop > gel->bbox.x1) gel->bbox.x1 = xtop;
+	if (xbot < gel->bbox.x0) gel->bbox.x0 = xbot;
+	if (xbot > gel->bbox.x1) gel->bbox.x1 = xbot;
+
+	if (top < gel->bbox.y0) gel->bbox.y0 = top;
+	if (bot > gel->bbox.y1) gel->bbox.y1 = bot;
+
+	if (gel->len + 1 == gel->cap) {
+		int new_cap = gel->cap + 512;
+		gel->edges = fz_resize_array(gel->ctx, gel->edges, new_cap, sizeof(fz_edge));
+		gel->cap = new_cap;
 	}
+
+	edge = &gel->edges[gel->len++];
+
+	edge->xdir = dx > 0 ? 1 : -1;
+	edge->ydir = winding;
+	edge->x = xtop;
+	edge->y = top;
+	edge->h = bot - top;
+	edge->adj_down = dy;
+	edge->e = e;
+	edge->xmove = xmove;
+	edge->adj_up = adj_up;
 }
 
 void
@@ -369,16 +409,7 @@ fz_insert_gel(fz_gel *gel, float fx0, float fy0, float fx1, float fy1)
 	x1 = (int)fz_clamp(fx1, BBOX_MIN * fz_aa_hscale, BBOX_MAX * fz_aa_hscale);
 	y1 = (int)fz_clamp(fy1, BBOX_MIN * fz_aa_vscale, BBOX_MAX * fz_aa_vscale);
 
-	d = clip_lerp_y(gel->clip.y0, 0, x0, y0, x1, y1, &v);
-	if (d == OUTSIDE) return;
-	if (d == LEAVE) { y1 = gel->clip.y0; x1 = v; }
-	if (d == ENTER) { y0 = gel->clip.y0; x0 = v; }
-
-	d = clip_lerp_y(gel->clip.y1, 1, x0, y0, x1, y1, &v);
-	if (d == OUTSIDE) return;
-	if (d == LEAVE) { y1 = gel->clip.y1; x1 = v; }
-	if (d == ENTER) { y0 = gel->clip.y1; x0 = v; }
-
+	/* Clip in x here; fz_insert_gel_raw clips in y. */
 	d = clip_lerp_x(gel->clip.x0, 0, x0, y0, x1, y1, &v);
 	if (d == OUTSIDE) {
 		x0 = x1 = gel->clip.x0;
@@ -579,7 +610,85 @@ advance_active(fz_gel *gel, int inc)
  * Anti-aliased scan conversion.
  */
 
-static inline void add_span_aa(fz_aa_context *ctxaa, int *list, int x0, int x1, int xofs, int h)
+/*
+ * Each scanline of deltas is only touched within the spans that were added
+ * to it. On wide, sparsely covered scanlines (thin strokes across a large
+ * bbox) most of the line is empty, so we keep a short sorted list of the
+ * index ranges that were written, and only undelta, blit and clear those.
+ * Every span's deltas sum to zero, so outside these runs the coverage is
+ * zero, and painting a zero mask would not have changed the destination.
+ * Runs closer together than AA_RUN_GAP are merged; if we run out of room
+ * everything collapses into one run covering the lot.
+ */
+
+#define AA_MAX_RUNS 32
+#define AA_RUN_GAP 16
+
+typedef struct fz_aa_runs_s fz_aa_runs;
+
+struct fz_aa_runs_s
+{
+	int len;
+	int cursor;
+	int last;
+	int run[AA_MAX_RUNS * 2];
+};
+
+static inline void reset_runs_aa(fz_aa_runs *runs)
+{
+	runs->len = 0;
+	runs->cursor = 0;
+	runs->last = INT_MIN;
+}
+
+static void add_run_aa(fz_aa_runs *runs, int x0, int x1)
+{
+	int *run = runs->run;
+	int c = runs->cursor;
+	int len = runs->len;
+
+	/* Spans arrive in increasing x within each pass over the active
+	 * edges, so we only need to rewind when a new pass starts. */
+	if (x0 < runs->last)
+		c = 0;
+	runs->last = x0;
+
+	while (c < len && run[2*c+1] + AA_RUN_GAP < x0)
+		c++;
+
+	if (c == len || run[2*c] > x1 + AA_RUN_GAP)
+	{
+		if (len < AA_MAX_RUNS)
+		{
+			memmove(&run[2*c+2], &run[2*c], (len - c) * 2 * sizeof(int));
+			run[2*c] = x0;
+			run[2*c+1] = x1;
+			runs->len = len + 1;
+			runs->cursor = c;
+			return;
+		}
+		if (run[1] < run[2*len-1])
+			run[1] = run[2*len-1];
+		runs->len = len = 1;
+		c = 0;
+	}
+
+	if (x0 < run[2*c])
+		run[2*c] = x0;
+	if (x1 > run[2*c+1])
+		run[2*c+1] = x1;
+	while (c + 1 < len && run[2*c+2] <= run[2*c+1] + AA_RUN_GAP)
+	{
+		if (run[2*c+3] > run[2*c+1])
+			run[2*c+1] = run[2*c+3];
+		memmove(&run[2*c+2], &run[2*c+4], (len - c - 2) * 2 * sizeof(int));
+		len--;
+	}
+	runs->len = len;
+	runs->cursor = c;
+}
+
+static inline void add_span_aa(fz_aa_context *ctxaa, int *list, fz_aa_runs *runs, int x0, int x1, int xofs, int h)
 {
 	int x0pix, x0sub;
 	int x1pix, x1sub;
@@ -612,9 +721,14 @@ static inline void add_span_aa(fz_aa_context *ctxaa, int *list, int x0, int x1,
 		list[x1pix] += h*(x1sub - fz_aa_hscale);
 		list[x1pix+1] += h*-x1sub;
 	}
+
+	if (x0pix < x1pix)
+		add_run_aa(runs, x0pix, x1pix + 2);
+	else
+		add_run_aa(runs, x1pix, x0pix + 2);
 }
 
-static inline void non_zero_winding_aa(fz_gel *gel, int *list, int xofs, int h)
+static inline void non_zero_winding_aa(fz_gel *gel, int *list, fz_aa_runs *runs, int xofs, int h)
 {
 	int winding = 0;
 	int x = 0;
@@ -626,12 +740,12 @@ static inline void non_zero_winding_aa(fz_gel *gel, int *list, int xofs, int h)
 		if (!winding && (winding + gel->active[i]->ydir))
 			x = gel->active[i]->x;
 		if (winding && !(winding + gel->active[i]->ydir))
-			add_span_aa(ctxaa, list, x, gel->active[i]->x, xofs, h);
+			add_span_aa(ctxaa, list, runs, x, gel->active[i]->x, xofs, h);
 		winding += gel->active[i]->ydir;
 	}
 }
 
-static inline void even_odd_aa(fz_gel *gel, int *list, int xofs, int h)
+static inline void even_odd_aa(fz_gel *gel, int *list, fz_aa_runs *runs, int xofs, int h)
 {
 	int even = 0;
 	int x = 0;
@@ -643,14 +757,94 @@ static inline void even_odd_aa(fz_gel *gel, int *list, int xofs, int h)
 		if (!even)
 			x = gel->active[i]->x;
 		else
-			add_span_aa(ctxaa, list, x, gel->active[i]->x, xofs, h);
+			add_span_aa(ctxaa, list, runs, x, gel->active[i]->x, xofs, h);
 		even = !even;
 	}
 }
 
+/*
+ * The running coverage never exceeds hscale * vscale <= 255, and scaling
+ * it stays below 0xFF00, so the prefix sum can be narrowed to 16 bits and
+ * scaled there without changing a single value.
+ */
+
+#ifndef FZ_PAINT_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_UNDELTA_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_UNDELTA_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+#ifdef HAVE_UNDELTA_SSE2
+static inline __m128i prefix_sum_aa(__m128i x, __m128i *carry)
+{
+	x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+	x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+	x = _mm_add_epi32(x, *carry);
+	*carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+	return x;
+}
+#endif
+
+#ifdef HAVE_UNDELTA_NEON
+static inline uint32x4_t prefix_sum_aa(uint32x4_t x, uint32x4_t *carry)
+{
+	uint32x4_t zero = vdupq_n_u32(0);
+	x = vaddq_u32(x, vextq_u32(zero, x, 3));
+	x = vaddq_u32(x, vextq_u32(zero, x, 2));
+	x = vaddq_u32(x, *carry);
+	*carry = vdupq_n_u32(vgetq_lane_u32(x, 3));
+	return x;
+}
+#endif
+
 static inline void undelta_aa(fz_aa_context *ctxaa, unsigned char * restrict out, int * restrict in, int n)
 {
 	int d = 0;
+#ifdef HAVE_UNDELTA_SSE2
+	if (n >= 16)
+	{
+		__m128i carry = _mm_setzero_si128();
+		__m128i scale = _mm_set1_epi16(0xFF00 / (fz_aa_hscale * fz_aa_vscale));
+		do
+		{
+			__m128i a = prefix_sum_aa(_mm_loadu_si128((const __m128i *)in), &carry);
+			__m128i b = prefix_sum_aa(_mm_loadu_si128((const __m128i *)(in + 4)), &carry);
+			__m128i c = prefix_sum_aa(_mm_loadu_si128((const __m128i *)(in + 8)), &carry);
+			__m128i e = prefix_sum_aa(_mm_loadu_si128((const __m128i *)(in + 12)), &carry);
+			__m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_packs_epi32(a, b), scale), 8);
+			__m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_packs_epi32(c, e), scale), 8);
+			_mm_storeu_si128((__m128i *)out, _mm_packus_epi16(lo, hi));
+			in += 16;
+			out += 16;
+			n -= 16;
+		}
+		while (n >= 16);
+		d = _mm_cvtsi128_si32(carry);
+	}
+#endif
+#ifdef HAVE_UNDELTA_NEON
+	if (n >= 8)
+	{
+		uint32x4_t carry = vdupq_n_u32(0);
+		uint16x8_t scale = vdupq_n_u16(0xFF00 / (fz_aa_hscale * fz_aa_vscale));
+		do
+		{
+			uint32x4_t a = prefix_sum_aa(vld1q_u32((const uint32_t *)in), &carry);
+			uint32x4_t b = prefix_sum_aa(vld1q_u32((const uint32_t *)(in + 4)), &carry);
+			uint16x8_t ab = vcombine_u16(vmovn_u32(a), vmovn_u32(b));
+			vst1_u8(out, vmovn_u16(vshrq_n_u16(vmulq_u16(ab, scale), 8)));
+			in += 8;
+			out += 8;
+			n -= 8;
+		}
+		while (n >= 8);
+		d = (int)vgetq_lane_u32(carry, 0);
+	}
+#endif
 	while (n--)
 	{
 		d += *in++;
@@ -669,6 +863,41 @@ static inline void blit_aa(fz_pixmap *dst, int x, int y,
 		fz_paint_span(dp, mp, 1, w, 255);
 }
 
+/* Turn the deltas within each run into alphas, stopping at the right
+ * hand edge of the clip. Each run starts from zero coverage. */
+static void undelta_runs_aa(fz_aa_context *ctxaa, unsigned char *alphas, int *deltas, fz_aa_runs *runs, int n)
+{
+	int i, x0, x1;
+	for (i = 0; i < runs->len; i++)
+	{
+		x0 = runs->run[2*i];
+		x1 = fz_mini(runs->run[2*i+1], n);
+		if (x0 < x1)
+			undelta_aa(ctxaa, alphas + x0, deltas + x0, x1 - x0);
+	}
+}
+
+static void blit_runs_aa(fz_pixmap *dst, int xmin, int skipx, int n, int y,
+	unsigned char *alphas, fz_aa_runs *runs, unsigned char *color)
+{
+	int i, x0, x1;
+	for (i = 0; i < runs->len; i++)
+	{
+		x0 = fz_maxi(runs->run[2*i], skipx);
+		x1 = fz_mini(runs->run[2*i+1], n);
+		if (x0 < x1)
+			blit_aa(dst, xmin + x0, y, alphas + x0, x1 - x0, color);
+	}
+}
+
+static void clear_runs_aa(int *deltas, fz_aa_runs *runs)
+{
+	int i;
+	for (i = 0; i < runs->len; i++)
+		memset(deltas + runs->run[2*i], 0, (runs->run[2*i+1] - runs->run[2*i]) * sizeof(int));
+	reset_runs_aa(runs);
+}
+
 static void
 fz_scan_convert_aa(fz_gel *gel, int eofill, const fz_irect *clip,
 	fz_pixmap *dst, unsigned char *color)
@@ -680,6 +909,7 @@ fz_scan_convert_aa(fz_gel *gel, int eofill, const fz_irect *clip,
 	fz_context *ctx = gel->ctx;
 	fz_aa_context *ctxaa = ctx->aa;
 	int height, h0, rh;
+	fz_aa_runs runs;
 
 	int xmin = fz_idiv(gel->bbox.x0, fz_aa_hscale);
 	int xmax = fz_idiv(gel->bbox.x1, fz_aa_hscale) + 1;
@@ -704,6 +934,7 @@ fz_scan_convert_aa(fz_gel *gel, int eofill, const fz_irect *clip,
 		fz_throw(ctx, "scan conversion failed (malloc failure)");
 	}
 	memset(deltas, 0, (xmax - xmin + 1) * sizeof(int));
+	reset_runs_aa(&runs);
 	gel->alen = 0;
 
 	/* The theory here is that we have a list of the edges (gel) of length
@@ -769,9 +1000,9 @@ fz_scan_convert_aa(fz_gel *gel, int eofill, const fz_irect *clip,
 		rh = (yc+1)*fz_aa_vscale - y;
 		if (yc != yd)
 		{
-			undelta_aa(ctxaa, alphas, deltas, skipx + clipn);
-			blit_aa(dst, xmin + skipx, yd, alphas + skipx, clipn, color);
-			memset(deltas, 0, (skipx + clipn) * sizeof(int));
+			undelta_runs_aa(ctxaa, alphas, deltas, &runs, skipx + clipn);
+			blit_runs_aa(dst, xmin, skipx, skipx + clipn, yd, alphas, &runs, color);
+			clear_runs_aa(deltas, &runs);
 		}
 		yd = yc;
 		if (yd >= clip->y1)
@@ -789,12 +1020,12 @@ fz_scan_convert_aa(fz_gel *gel, int eofill, const fz_irect *clip,
 				 * have more sub scanlines than will fit into
 				 * it. */
 				if (eofill)
-					even_odd_aa(gel, deltas, xofs, rh);
+					even_odd_aa(gel, deltas, &runs, xofs, rh);
 				else
-					non_zero_winding_aa(gel, deltas, xofs, rh);
-				undelta_aa(ctxaa, alphas, deltas, skipx + clipn);
-				blit_aa(dst, xmin + skipx, yd, alphas + skipx, clipn, color);
-				memset(deltas, 0, (skipx + clipn) * sizeof(int));
+					non_zero_winding_aa(gel, deltas, &runs, xofs, rh);
+				undelta_runs_aa(ctxaa, alphas, deltas, &runs, skipx + clipn);
+				blit_runs_aa(dst, xmin, skipx, skipx + clipn, yd, alphas, &runs, color);
+				clear_runs_aa(deltas, &runs);
 				yd++;
 				if (yd >= clip->y1)
 					break;
@@ -806,15 +1037,15 @@ fz_scan_convert_aa(fz_gel *gel, int eofill, const fz_irect *clip,
 				 * scanlines. */
 				h0 -= fz_aa_vscale;
 				if (eofill)
-					even_odd_aa(gel, deltas, xofs, fz_aa_vscale);
+					even_odd_aa(gel, deltas, &runs, xofs, fz_aa_vscale);
 				else
-					non_zero_winding_aa(gel, deltas, xofs, fz_aa_vscale);
-				undelta_aa(ctxaa, alphas, deltas, skipx + clipn);
+					non_zero_winding_aa(gel, deltas, &runs, xofs, fz_aa_vscale);
+				undelta_runs_aa(ctxaa, alphas, deltas, &runs, skipx + clipn);
 				do
 				{
 					/* Do any successive whole scanlines - no need
 					 * to recalculate deltas here. */
-					blit_aa(dst, xmin + skipx, yd, alphas + skipx, clipn, color);
+					blit_runs_aa(dst, xmin, skipx, skipx + clipn, yd, alphas, &runs, color);
 					yd++;
 					if (yd >= clip->y1)
 						goto clip_ended;
@@ -826,14 +1057,14 @@ fz_scan_convert_aa(fz_gel *gel, int eofill, const fz_irect *clip,
 				 * already. */
 				if (h0 == 0)
 					goto advance;
-				memset(deltas, 0, (skipx + clipn) * sizeof(int));
+				clear_runs_aa(deltas, &runs);
 				h0 += fz_aa_vscale;
 			}
 		}
 		if (eofill)
-			even_odd_aa(gel, deltas, xofs, h0);
+			even_odd_aa(gel, deltas, &runs, xofs, h0);
 		else
-			non_zero_winding_aa(gel, deltas, xofs, h0);
+			non_zero_winding_aa(gel, deltas, &runs, xofs, h0);
 advance:
 		advance_active(gel, height);
 
@@ -842,8 +1073,8 @@ advance:
 
 	if (yd < clip->y1)
 	{
-		undelta_aa(ctxaa, alphas, deltas, skipx + clipn);
-		blit_aa(dst, xmin + skipx, yd, alphas + skipx, clipn, color);
+		undelta_runs_aa(ctxaa, alphas, deltas, &runs, skipx + clipn);
+		blit_runs_aa(dst, xmin, skipx, skipx + clipn, yd, alphas, &runs, color);
 	}
 clip_ended:
 	fz_free(ctx, deltas);
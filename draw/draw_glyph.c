@@ -3,14 +3,21 @@
 #define MAX_GLYPH_SIZE 256
 #define MAX_CACHE_SIZE (1024*1024)
 
-typedef struct fz_glyph_key_s fz_glyph_key;
+/*
+	The glyph cache is split into FZ_GLYPH_CACHE_STRIPES stripes, each
+	with its own hash table, lock (FZ_LOCK_GLYPHCACHE + stripe index),
+	LRU list and share of the size budget. A glyph always lives in the
+	stripe picked by hashing its font and glyph id, so threads drawing
+	different glyphs rarely contend, and when a stripe fills up only
+	its least recently used glyphs are thrown away.
 
-struct fz_glyph_cache_s
-{
-	int refs;
-	fz_hash_table *hash;
-	int total;
-};
+	The refcount and budget of the cache as a whole are protected by
+	the lock of stripe 0. No code ever holds two stripe locks at once.
+*/
+
+typedef struct fz_glyph_key_s fz_glyph_key;
+typedef struct fz_glyph_cache_entry_s fz_glyph_cache_entry;
+typedef struct fz_glyph_cache_stripe_s fz_glyph_cache_stripe;
 
 struct fz_glyph_key_s
 {
@@ -22,67 +29,168 @@ struct fz_glyph_key_s
 	int aa;
 };
 
+struct fz_glyph_cache_entry_s
+{
+	fz_glyph_key key;
+	fz_pixmap *val;
+	unsigned int size;
+	fz_glyph_cache_entry *lru_prev;
+	fz_glyph_cache_entry *lru_next;
+};
+
+struct fz_glyph_cache_stripe_s
+{
+	fz_hash_table *hash;
+	fz_glyph_cache_entry *lru_head; /* most recently used */
+	fz_glyph_cache_entry *lru_tail; /* least recently used */
+	unsigned int total;
+	unsigned int max;
+	int hits;
+	int misses;
+	int evictions;
+};
+
+struct fz_glyph_cache_s
+{
+	int refs;
+	unsigned int max;
+	fz_glyph_cache_stripe stripe[FZ_GLYPH_CACHE_STRIPES];
+};
+
+static int
+glyph_stripe(fz_glyph_key *key)
+{
+	unsigned int h = (unsigned int)((size_t)key->font >> 4);
+	h = h * 31 + key->gid;
+	h ^= h >> 11;
+	return h % FZ_GLYPH_CACHE_STRIPES;
+}
+
 void
 fz_new_glyph_cache_context(fz_context *ctx)
 {
 	fz_glyph_cache *cache;
+	int i;
 
 	cache = fz_malloc_struct(ctx, fz_glyph_cache);
 	fz_try(ctx)
 	{
-		cache->hash = fz_new_hash_table(ctx, 509, sizeof(fz_glyph_key), FZ_LOCK_GLYPHCACHE);
+		for (i = 0; i < FZ_GLYPH_CACHE_STRIPES; i++)
+		{
+			cache->stripe[i].hash = fz_new_hash_table(ctx, 67, sizeof(fz_glyph_key), FZ_LOCK_GLYPHCACHE + i);
+			cache->stripe[i].max = MAX_CACHE_SIZE / FZ_GLYPH_CACHE_STRIPES;
+		}
 	}
 	fz_catch(ctx)
 	{
+		for (i = 0; i < FZ_GLYPH_CACHE_STRIPES; i++)
+			if (cache->stripe[i].hash)
+				fz_free_hash(ctx, cache->stripe[i].hash);
 		fz_free(ctx, cache);
 		fz_rethrow(ctx);
 	}
-	cache->total = 0;
+	cache->max = MAX_CACHE_SIZE;
 	cache->refs = 1;
 
 	ctx->glyph_cache = cache;
 }
 
-/* The glyph cache lock is always held when this function is called. */
 static void
-fz_evict_glyph_cache(fz_context *ctx)
+lru_unlink(fz_glyph_cache_stripe *stripe, fz_glyph_cache_entry *entry)
 {
-	fz_glyph_cache *cache = ctx->glyph_cache;
-	fz_glyph_key *key;
-	fz_pixmap *pixmap;
-	int i;
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		stripe->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		stripe->lru_tail = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+lru_push_front(fz_glyph_cache_stripe *stripe, fz_glyph_cache_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = stripe->lru_head;
+	if (stripe->lru_head)
+		stripe->lru_head->lru_prev = entry;
+	else
+		stripe->lru_tail = entry;
+	stripe->lru_head = entry;
+}
 
-	for (i = 0; i < fz_hash_len(ctx, cache->hash); i++)
+/* The stripe lock is always held when this function is called. */
+static void
+drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_stripe *stripe, fz_glyph_cache_entry *entry)
+{
+	lru_unlink(stripe, entry);
+	fz_hash_remove(ctx, stripe->hash, &entry->key);
+	stripe->total -= entry->size;
+	fz_drop_pixmap(ctx, entry->val);
+	fz_drop_font(ctx, entry->key.font);
+	fz_free(ctx, entry);
+}
+
+/* The stripe lock is always held when this function is called. */
+static void
+fz_evict_glyph_stripe(fz_context *ctx, fz_glyph_cache_stripe *stripe, unsigned int max)
+{
+	while (stripe->lru_tail && stripe->total > max)
 	{
-		key = fz_hash_get_key(ctx, cache->hash, i);
-		if (key->font)
-			fz_drop_font(ctx, key->font);
-		pixmap = fz_hash_get_val(ctx, cache->hash, i);
-		if (pixmap)
-			fz_drop_pixmap(ctx, pixmap);
+		drop_glyph_cache_entry(ctx, stripe, stripe->lru_tail);
+		stripe->evictions++;
 	}
+}
 
-	cache->total = 0;
+static void
+fz_empty_glyph_stripe(fz_context *ctx, fz_glyph_cache_stripe *stripe)
+{
+	while (stripe->lru_tail)
+		drop_glyph_cache_entry(ctx, stripe, stripe->lru_tail);
+}
+
+void
+fz_purge_glyph_cache(fz_context *ctx)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
 
-	fz_empty_hash(ctx, cache->hash);
+	for (i = 0; i < FZ_GLYPH_CACHE_STRIPES; i++)
+	{
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		fz_empty_glyph_stripe(ctx, &cache->stripe[i]);
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+	}
 }
 
 void
 fz_drop_glyph_cache_context(fz_context *ctx)
 {
-	if (!ctx->glyph_cache)
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i, refs;
+
+	if (!cache)
 		return;
 
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	ctx->glyph_cache->refs--;
-	if (ctx->glyph_cache->refs == 0)
+	refs = --cache->refs;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+
+	/* The last reference is gone, so nobody else can be using it. */
+	if (refs == 0)
 	{
-		fz_evict_glyph_cache(ctx);
-		fz_free_hash(ctx, ctx->glyph_cache->hash);
-		fz_free(ctx, ctx->glyph_cache);
-		ctx->glyph_cache = NULL;
+		for (i = 0; i < FZ_GLYPH_CACHE_STRIPES; i++)
+		{
+			fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+			fz_empty_glyph_stripe(ctx, &cache->stripe[i]);
+			fz_free_hash(ctx, cache->stripe[i].hash);
+			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		}
+		fz_free(ctx, cache);
 	}
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+	ctx->glyph_cache = NULL;
 }
 
 fz_glyph_cache *
@@ -94,6 +202,46 @@ fz_keep_glyph_cache(fz_context *ctx)
 	return ctx->glyph_cache;
 }
 
+void
+fz_set_glyph_cache_size(fz_context *ctx, unsigned int max)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	cache->max = max;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+
+	for (i = 0; i < FZ_GLYPH_CACHE_STRIPES; i++)
+	{
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		cache->stripe[i].max = max / FZ_GLYPH_CACHE_STRIPES;
+		fz_evict_glyph_stripe(ctx, &cache->stripe[i], cache->stripe[i].max);
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+	}
+}
+
+void
+fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < FZ_GLYPH_CACHE_STRIPES; i++)
+	{
+		fz_glyph_cache_stripe *stripe = &cache->stripe[i];
+		fz_lock(ctx, FZ_LOCK_GLYPHCACHE + i);
+		if (i == 0)
+			stats->max = cache->max;
+		stats->size += stripe->total;
+		stats->hits += stripe->hits;
+		stats->misses += stripe->misses;
+		stats->evictions += stripe->evictions;
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE + i);
+	}
+}
+
 fz_pixmap *
 fz_render_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm, const fz_matrix *ctm, fz_stroke_state *stroke, fz_irect scissor)
 {
@@ -106,6 +254,52 @@ fz_render_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix
 	return fz_render_glyph(ctx, font, gid, trm, NULL, scissor);
 }
 
+/*
+	Insert a freshly rendered glyph into its stripe, evicting the least
+	recently used glyphs to make room. If another thread got there
+	first, ours is dropped and theirs returned instead.
+	The stripe lock is always held when this function is called.
+*/
+static fz_pixmap *
+fz_encache_glyph(fz_context *ctx, fz_glyph_cache_stripe *stripe, fz_glyph_key *key, fz_pixmap *val)
+{
+	fz_glyph_cache_entry *entry;
+	unsigned int size = fz_pixmap_size(ctx, val);
+
+	entry = fz_hash_find(ctx, stripe->hash, key);
+	if (entry)
+	{
+		lru_unlink(stripe, entry);
+		lru_push_front(stripe, entry);
+		fz_drop_pixmap(ctx, val);
+		return fz_keep_pixmap(ctx, entry->val);
+	}
+
+	if (size > stripe->max)
+		return val;
+
+	fz_evict_glyph_stripe(ctx, stripe, stripe->max - size);
+
+	entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
+	entry->key = *key;
+	entry->val = val;
+	entry->size = size;
+	fz_try(ctx)
+	{
+		fz_hash_insert(ctx, stripe->hash, &entry->key, entry);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, entry);
+		fz_rethrow(ctx);
+	}
+
+	lru_push_front(stripe, entry);
+	stripe->total += size;
+	fz_keep_font(ctx, key->font);
+	return fz_keep_pixmap(ctx, val);
+}
+
 /*
 	Render a glyph and return a bitmap.
 	If the glyph is too large to fit the cache we have two choices:
@@ -119,10 +313,12 @@ fz_pixmap *
 fz_render_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *ctm, fz_colorspace *model, fz_irect scissor)
 {
 	fz_glyph_cache *cache;
+	fz_glyph_cache_stripe *stripe;
+	fz_glyph_cache_entry *entry;
 	fz_glyph_key key;
 	fz_pixmap *val;
 	float size = fz_matrix_expansion(ctm);
-	int do_cache;
+	int do_cache, lock;
 	fz_matrix local_ctm = *ctm;
 
 	if (size <= MAX_GLYPH_SIZE)
@@ -153,74 +349,59 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *ctm, f
 	local_ctm.e = floorf(local_ctm.e) + key.e / 256.0f;
 	local_ctm.f = floorf(local_ctm.f) + key.f / 256.0f;
 
-	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	val = fz_hash_find(ctx, cache->hash, &key);
-	if (val)
+	lock = glyph_stripe(&key);
+	stripe = &cache->stripe[lock];
+	lock += FZ_LOCK_GLYPHCACHE;
+
+	fz_lock(ctx, lock);
+	entry = fz_hash_find(ctx, stripe->hash, &key);
+	if (entry)
 	{
-		fz_keep_pixmap(ctx, val);
-		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+		lru_unlink(stripe, entry);
+		lru_push_front(stripe, entry);
+		stripe->hits++;
+		val = fz_keep_pixmap(ctx, entry->val);
+		fz_unlock(ctx, lock);
 		return val;
 	}
+	stripe->misses++;
+	fz_unlock(ctx, lock);
 
-	fz_try(ctx)
+	/* We render without holding the stripe lock. The danger here is
+	 * that some other thread will come along, and want the same glyph
+	 * too. If it does, we may both end up rendering pixmaps. We cope
+	 * with this in fz_encache_glyph, by ensuring that only one gets
+	 * inserted into the cache. */
+	if (font->ft_face)
 	{
-		if (font->ft_face)
-		{
-			val = fz_render_ft_glyph(ctx, font, gid, &local_ctm, key.aa);
-		}
-		else if (font->t3procs)
-		{
-			/* We drop the glyphcache here, and execute the t3
-			 * glyph code. The danger here is that some other
-			 * thread will come along, and want the same glyph
-			 * too. If it does, we may both end up rendering
-			 * pixmaps. We cope with this later on, by ensuring
-			 * that only one gets inserted into the cache. If
-			 * we insert ours to find one already there, we
-			 * abandon ours, and use the one there already.
-			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			val = fz_render_t3_glyph(ctx, font, gid, &local_ctm, model, scissor);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-		}
-		else
-		{
-			fz_warn(ctx, "assert: uninitialized font structure");
-			val = NULL;
-		}
+		val = fz_render_ft_glyph(ctx, font, gid, &local_ctm, key.aa);
 	}
-	fz_catch(ctx)
+	else if (font->t3procs)
 	{
-		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-		fz_rethrow(ctx);
+		val = fz_render_t3_glyph(ctx, font, gid, &local_ctm, model, scissor);
+	}
+	else
+	{
+		fz_warn(ctx, "assert: uninitialized font structure");
+		val = NULL;
 	}
 
 	if (val && do_cache)
 	{
 		if (val->w < MAX_GLYPH_SIZE && val->h < MAX_GLYPH_SIZE)
 		{
-			if (cache->total + val->w * val->h > MAX_CACHE_SIZE)
-				fz_evict_glyph_cache(ctx);
+			fz_lock(ctx, lock);
 			fz_try(ctx)
 			{
-				fz_pixmap *pix = fz_hash_insert(ctx, cache->hash, &key, val);
-				if (pix)
-				{
-					fz_drop_pixmap(ctx, val);
-					val = pix;
-				}
-				else
-					fz_keep_font(ctx, key.font);
-				val = fz_keep_pixmap(ctx, val);
+				val = fz_encache_glyph(ctx, stripe, &key, val);
 			}
 			fz_catch(ctx)
 			{
 				fz_warn(ctx, "Failed to encache glyph - continuing");
 			}
-			cache->total += val->w * val->h;
+			fz_unlock(ctx, lock);
 		}
 	}
 
-	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 	return val;
 }
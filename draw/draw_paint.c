@@ -72,10 +72,46 @@ and stick to using the premultiplied form.
 
 typedef unsigned char byte;
 
+/*
+The span painters for the common component counts (1, 2 and 4) are
+called through a table of kernels, so that vector versions can be
+picked at runtime according to what the CPU supports. The C versions
+below are the reference; the vector ones must give identical results.
+*/
+
+typedef struct fz_paint_kernels_s fz_paint_kernels;
+
+struct fz_paint_kernels_s
+{
+	const char *name;
+	void (*solid_alpha)(byte * restrict dp, int w, int alpha);
+	void (*solid_color_2)(byte * restrict dp, int w, byte *color);
+	void (*solid_color_4)(byte * restrict dp, int w, byte *color);
+	void (*with_color_2)(byte * restrict dp, byte * restrict mp, int w, byte *color);
+	void (*with_color_4)(byte * restrict dp, byte * restrict mp, int w, byte *color);
+	void (*with_mask_2)(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w);
+	void (*with_mask_4)(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w);
+	void (*with_alpha_2)(byte * restrict dp, byte * restrict sp, int w, int alpha);
+	void (*with_alpha_4)(byte * restrict dp, byte * restrict sp, int w, int alpha);
+	void (*span_1)(byte * restrict dp, byte * restrict sp, int w);
+	void (*span_2)(byte * restrict dp, byte * restrict sp, int w);
+	void (*span_4)(byte * restrict dp, byte * restrict sp, int w);
+};
+
+/* Set by fz_init_paint_kernels when the first context is made */
+static const fz_paint_kernels fz_paint_kernels_c;
+static const fz_paint_kernels *paint_kernels = &fz_paint_kernels_c;
+
+static inline const fz_paint_kernels *
+fz_get_paint_kernels(void)
+{
+	return paint_kernels;
+}
+
 /* These are used by the non-aa scan converter */
 
-void
-fz_paint_solid_alpha(byte * restrict dp, int w, int alpha)
+static inline void
+fz_paint_solid_alpha_1(byte * restrict dp, int w, int alpha)
 {
 	int t = FZ_EXPAND(255 - alpha);
 	while (w--)
@@ -86,7 +122,13 @@ fz_paint_solid_alpha(byte * restrict dp, int w, int alpha)
 }
 
 void
-fz_paint_solid_color(byte * restrict dp, int n, int w, byte *color)
+fz_paint_solid_alpha(byte * restrict dp, int w, int alpha)
+{
+	fz_get_paint_kernels()->solid_alpha(dp, w, alpha);
+}
+
+static inline void
+fz_paint_solid_color_N(byte * restrict dp, int n, int w, byte *color)
 {
 	int n1 = n - 1;
 	int sa = FZ_EXPAND(color[n1]);
@@ -101,6 +143,29 @@ fz_paint_solid_color(byte * restrict dp, int n, int w, byte *color)
 	}
 }
 
+static inline void
+fz_paint_solid_color_2(byte * restrict dp, int w, byte *color)
+{
+	fz_paint_solid_color_N(dp, 2, w, color);
+}
+
+static inline void
+fz_paint_solid_color_4(byte * restrict dp, int w, byte *color)
+{
+	fz_paint_solid_color_N(dp, 4, w, color);
+}
+
+void
+fz_paint_solid_color(byte * restrict dp, int n, int w, byte *color)
+{
+	switch (n)
+	{
+	case 2: fz_get_paint_kernels()->solid_color_2(dp, w, color); break;
+	case 4: fz_get_paint_kernels()->solid_color_4(dp, w, color); break;
+	default: fz_paint_solid_color_N(dp, n, w, color); break;
+	}
+}
+
 /* Blend a non-premultiplied color in mask over destination */
 
 static inline void
@@ -159,8 +224,8 @@ fz_paint_span_with_color(byte * restrict dp, byte * restrict mp, int n, int w, b
 {
 	switch (n)
 	{
-	case 2: fz_paint_span_with_color_2(dp, mp, w, color); break;
-	case 4: fz_paint_span_with_color_4(dp, mp, w, color); break;
+	case 2: fz_get_paint_kernels()->with_color_2(dp, mp, w, color); break;
+	case 4: fz_get_paint_kernels()->with_color_4(dp, mp, w, color); break;
 	default: fz_paint_span_with_color_N(dp, mp, n, w, color); break;
 	}
 }
@@ -232,8 +297,8 @@ fz_paint_span_with_mask(byte * restrict dp, byte * restrict sp, byte * restrict
 {
 	switch (n)
 	{
-	case 2: fz_paint_span_with_mask_2(dp, sp, mp, w); break;
-	case 4: fz_paint_span_with_mask_4(dp, sp, mp, w); break;
+	case 2: fz_get_paint_kernels()->with_mask_2(dp, sp, mp, w); break;
+	case 4: fz_get_paint_kernels()->with_mask_4(dp, sp, mp, w); break;
 	default: fz_paint_span_with_mask_N(dp, sp, mp, n, w); break;
 	}
 }
@@ -353,9 +418,9 @@ fz_paint_span(byte * restrict dp, byte * restrict sp, int n, int w, int alpha)
 	{
 		switch (n)
 		{
-		case 1: fz_paint_span_1(dp, sp, w); break;
-		case 2: fz_paint_span_2(dp, sp, w); break;
-		case 4: fz_paint_span_4(dp, sp, w); break;
+		case 1: fz_get_paint_kernels()->span_1(dp, sp, w); break;
+		case 2: fz_get_paint_kernels()->span_2(dp, sp, w); break;
+		case 4: fz_get_paint_kernels()->span_4(dp, sp, w); break;
 		default: fz_paint_span_N(dp, sp, n, w); break;
 		}
 	}
@@ -363,13 +428,1288 @@ fz_paint_span(byte * restrict dp, byte * restrict sp, int n, int w, int alpha)
 	{
 		switch (n)
 		{
-		case 2: fz_paint_span_2_with_alpha(dp, sp, w, alpha); break;
-		case 4: fz_paint_span_4_with_alpha(dp, sp, w, alpha); break;
+		case 2: fz_get_paint_kernels()->with_alpha_2(dp, sp, w, alpha); break;
+		case 4: fz_get_paint_kernels()->with_alpha_4(dp, sp, w, alpha); break;
 		default: fz_paint_span_N_with_alpha(dp, sp, n, w, alpha); break;
 		}
 	}
 }
 
+static const fz_paint_kernels fz_paint_kernels_c =
+{
+	"C",
+	fz_paint_solid_alpha_1,
+	fz_paint_solid_color_2,
+	fz_paint_solid_color_4,
+	fz_paint_span_with_color_2,
+	fz_paint_span_with_color_4,
+	fz_paint_span_with_mask_2,
+	fz_paint_span_with_mask_4,
+	fz_paint_span_2_with_alpha,
+	fz_paint_span_4_with_alpha,
+	fz_paint_span_1,
+	fz_paint_span_2,
+	fz_paint_span_4,
+};
+
+/*
+
+Vector span painters.
+
+Each of these performs exactly the integer arithmetic of the C version
+it replaces, on 16 bit lanes, so the results are identical bit for bit;
+the C version then finishes off the tail of the span. All the products
+fit in 16 bits: FZ_BLEND(s, d, a) is s*a + d*(256-a), which is at most
+255*256, and FZ_COMBINE(s, a) with s in 0..255 is at most 255*256 too.
+The one exception is the mask times color alpha in the with_color
+painters, where both are in 0..256; that is done as the high half of
+(a<<7) * (b<<1). Sums that can exceed 255 (as they can for data that is
+not properly premultiplied) are masked rather than saturated, to match
+the truncating byte stores of the C code.
+
+Define FZ_PAINT_NO_SIMD to build with the C painters only.
+
+*/
+
+#ifndef FZ_PAINT_NO_SIMD
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#if defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define HAVE_PAINT_SSE2
+#define HAVE_PAINT_AVX2
+#define FZ_TARGET_SSE2 __attribute__((target("sse2")))
+#define FZ_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#define HAVE_PAINT_SSE2
+#define FZ_TARGET_SSE2
+#if _MSC_VER >= 1700
+#define HAVE_PAINT_AVX2
+#define FZ_TARGET_AVX2
+#endif
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_PAINT_NEON
+#endif
+#endif
+
+#ifdef HAVE_PAINT_SSE2
+
+#ifdef HAVE_PAINT_AVX2
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/* Broadcast the alpha of each 4 (or 2) component pixel to its lanes */
+#define FZ_ALPHA_4 0xff
+#define FZ_ALPHA_2 0xf5
+
+static inline FZ_TARGET_SSE2 __m128i
+fz_expand_sse2(__m128i a)
+{
+	return _mm_add_epi16(a, _mm_srli_epi16(a, 7));
+}
+
+static inline FZ_TARGET_SSE2 __m128i
+fz_combine_sse2(__m128i a, __m128i b)
+{
+	return _mm_srli_epi16(_mm_mullo_epi16(a, b), 8);
+}
+
+/* FZ_COMBINE(a, b) for a and b both in 0..256; b2 is b<<1 */
+static inline FZ_TARGET_SSE2 __m128i
+fz_combine_256_sse2(__m128i a, __m128i b2)
+{
+	return _mm_mulhi_epu16(_mm_slli_epi16(a, 7), b2);
+}
+
+static inline FZ_TARGET_SSE2 __m128i
+fz_blend_sse2(__m128i s, __m128i d, __m128i a)
+{
+	__m128i ia = _mm_sub_epi16(_mm_set1_epi16(256), a);
+	return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia)), 8);
+}
+
+/* FZ_COMBINE2(s, ma, d, FZ_EXPAND(255 - FZ_COMBINE(sa, ma))) */
+static inline FZ_TARGET_SSE2 __m128i
+fz_mask_sse2(__m128i s, __m128i sa, __m128i d, __m128i ma)
+{
+	__m128i masa = fz_expand_sse2(_mm_sub_epi16(_mm_set1_epi16(255), fz_combine_sse2(sa, ma)));
+	__m128i r = _mm_add_epi16(fz_combine_sse2(s, ma), fz_combine_sse2(d, masa));
+	return _mm_and_si128(r, _mm_set1_epi16(255));
+}
+
+/* s + FZ_COMBINE(d, FZ_EXPAND(255 - sa)) */
+static inline FZ_TARGET_SSE2 __m128i
+fz_over_sse2(__m128i s, __m128i sa, __m128i d)
+{
+	__m128i t = fz_expand_sse2(_mm_sub_epi16(_mm_set1_epi16(255), sa));
+	return _mm_and_si128(_mm_add_epi16(s, fz_combine_sse2(d, t)), _mm_set1_epi16(255));
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_solid_alpha_sse2(byte * restrict dp, int w, int alpha)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_set1_epi16(alpha);
+	__m128i t = _mm_set1_epi16(FZ_EXPAND(255 - alpha));
+	while (w >= 16)
+	{
+		__m128i d = _mm_loadu_si128((__m128i *)dp);
+		__m128i lo = _mm_add_epi16(a, fz_combine_sse2(_mm_unpacklo_epi8(d, zero), t));
+		__m128i hi = _mm_add_epi16(a, fz_combine_sse2(_mm_unpackhi_epi8(d, zero), t));
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+		dp += 16;
+		w -= 16;
+	}
+	fz_paint_solid_alpha_1(dp, w, alpha);
+}
+
+static inline FZ_TARGET_SSE2 byte *
+fz_paint_solid_sse2(byte * restrict dp, int len, __m128i c, int ma)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_set1_epi16(ma);
+	while (len >= 16)
+	{
+		__m128i d = _mm_loadu_si128((__m128i *)dp);
+		__m128i lo = fz_blend_sse2(c, _mm_unpacklo_epi8(d, zero), a);
+		__m128i hi = fz_blend_sse2(c, _mm_unpackhi_epi8(d, zero), a);
+		_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+		dp += 16;
+		len -= 16;
+	}
+	return dp;
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_solid_color_2_sse2(byte * restrict dp, int w, byte *color)
+{
+	int ma = FZ_COMBINE(FZ_EXPAND(255), FZ_EXPAND(color[1]));
+	__m128i c = _mm_setr_epi16(color[0], 255, color[0], 255, color[0], 255, color[0], 255);
+	dp = fz_paint_solid_sse2(dp, w * 2, c, ma);
+	fz_paint_solid_color_2(dp, w & 7, color);
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_solid_color_4_sse2(byte * restrict dp, int w, byte *color)
+{
+	int ma = FZ_COMBINE(FZ_EXPAND(255), FZ_EXPAND(color[3]));
+	__m128i c = _mm_setr_epi16(color[0], color[1], color[2], 255, color[0], color[1], color[2], 255);
+	dp = fz_paint_solid_sse2(dp, w * 4, c, ma);
+	fz_paint_solid_color_4(dp, w & 3, color);
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_span_with_color_2_sse2(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i sa = _mm_set1_epi16(FZ_EXPAND(color[1]) << 1);
+	__m128i c = _mm_setr_epi16(color[0], 255, color[0], 255, color[0], 255, color[0], 255);
+	while (w >= 8)
+	{
+		__m128i ma = _mm_loadl_epi64((__m128i *)mp);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(ma, zero)) != 0xffff)
+		{
+			__m128i d = _mm_loadu_si128((__m128i *)dp);
+			__m128i lo, hi;
+			ma = fz_combine_256_sse2(fz_expand_sse2(_mm_unpacklo_epi8(ma, zero)), sa);
+			lo = fz_blend_sse2(c, _mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi16(ma, ma));
+			hi = fz_blend_sse2(c, _mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi16(ma, ma));
+			_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+		}
+		dp += 16;
+		mp += 8;
+		w -= 8;
+	}
+	fz_paint_span_with_color_2(dp, mp, w, color);
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_span_with_color_4_sse2(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i sa = _mm_set1_epi16(FZ_EXPAND(color[3]) << 1);
+	__m128i c = _mm_setr_epi16(color[0], color[1], color[2], 255, color[0], color[1], color[2], 255);
+	while (w >= 4)
+	{
+		int m;
+		memcpy(&m, mp, 4);
+		if (m)
+		{
+			__m128i d = _mm_loadu_si128((__m128i *)dp);
+			__m128i ma, lo, hi;
+			ma = fz_combine_256_sse2(fz_expand_sse2(_mm_unpacklo_epi8(_mm_cvtsi32_si128(m), zero)), sa);
+			ma = _mm_unpacklo_epi16(ma, ma);
+			lo = fz_blend_sse2(c, _mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi32(ma, ma));
+			hi = fz_blend_sse2(c, _mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi32(ma, ma));
+			_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+		}
+		dp += 16;
+		mp += 4;
+		w -= 4;
+	}
+	fz_paint_span_with_color_4(dp, mp, w, color);
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_span_with_mask_2_sse2(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	while (w >= 8)
+	{
+		__m128i ma = _mm_loadl_epi64((__m128i *)mp);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(ma, zero)) != 0xffff)
+		{
+			__m128i s = _mm_loadu_si128((__m128i *)sp);
+			__m128i d = _mm_loadu_si128((__m128i *)dp);
+			__m128i lo = _mm_unpacklo_epi8(s, zero);
+			__m128i hi = _mm_unpackhi_epi8(s, zero);
+			ma = fz_expand_sse2(_mm_unpacklo_epi8(ma, zero));
+			lo = fz_mask_sse2(lo, _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, FZ_ALPHA_2), FZ_ALPHA_2),
+				_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi16(ma, ma));
+			hi = fz_mask_sse2(hi, _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, FZ_ALPHA_2), FZ_ALPHA_2),
+				_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi16(ma, ma));
+			_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+		}
+		dp += 16;
+		sp += 16;
+		mp += 8;
+		w -= 8;
+	}
+	fz_paint_span_with_mask_2(dp, sp, mp, w);
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_span_with_mask_4_sse2(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	while (w >= 4)
+	{
+		int m;
+		memcpy(&m, mp, 4);
+		if (m)
+		{
+			__m128i s = _mm_loadu_si128((__m128i *)sp);
+			__m128i d = _mm_loadu_si128((__m128i *)dp);
+			__m128i lo = _mm_unpacklo_epi8(s, zero);
+			__m128i hi = _mm_unpackhi_epi8(s, zero);
+			__m128i ma = fz_expand_sse2(_mm_unpacklo_epi8(_mm_cvtsi32_si128(m), zero));
+			ma = _mm_unpacklo_epi16(ma, ma);
+			lo = fz_mask_sse2(lo, _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, FZ_ALPHA_4), FZ_ALPHA_4),
+				_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi32(ma, ma));
+			hi = fz_mask_sse2(hi, _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, FZ_ALPHA_4), FZ_ALPHA_4),
+				_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi32(ma, ma));
+			_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+		}
+		dp += 16;
+		sp += 16;
+		mp += 4;
+		w -= 4;
+	}
+	fz_paint_span_with_mask_4(dp, sp, mp, w);
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_span_2_with_alpha_sse2(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_set1_epi16(FZ_EXPAND(alpha));
+	while (w >= 8)
+	{
+		__m128i s = _mm_loadu_si128((__m128i *)sp);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) != 0xffff)
+		{
+			__m128i d = _mm_loadu_si128((__m128i *)dp);
+			__m128i lo = _mm_unpacklo_epi8(s, zero);
+			__m128i hi = _mm_unpackhi_epi8(s, zero);
+			lo = fz_blend_sse2(lo, _mm_unpacklo_epi8(d, zero),
+				fz_combine_sse2(_mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, FZ_ALPHA_2), FZ_ALPHA_2), a));
+			hi = fz_blend_sse2(hi, _mm_unpackhi_epi8(d, zero),
+				fz_combine_sse2(_mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, FZ_ALPHA_2), FZ_ALPHA_2), a));
+			_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+		}
+		dp += 16;
+		sp += 16;
+		w -= 8;
+	}
+	fz_paint_span_2_with_alpha(dp, sp, w, alpha);
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_span_4_with_alpha_sse2(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = _mm_set1_epi16(FZ_EXPAND(alpha));
+	while (w >= 4)
+	{
+		__m128i s = _mm_loadu_si128((__m128i *)sp);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) != 0xffff)
+		{
+			__m128i d = _mm_loadu_si128((__m128i *)dp);
+			__m128i lo = _mm_unpacklo_epi8(s, zero);
+			__m128i hi = _mm_unpackhi_epi8(s, zero);
+			lo = fz_blend_sse2(lo, _mm_unpacklo_epi8(d, zero),
+				fz_combine_sse2(_mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, FZ_ALPHA_4), FZ_ALPHA_4), a));
+			hi = fz_blend_sse2(hi, _mm_unpackhi_epi8(d, zero),
+				fz_combine_sse2(_mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, FZ_ALPHA_4), FZ_ALPHA_4), a));
+			_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi));
+		}
+		dp += 16;
+		sp += 16;
+		w -= 4;
+	}
+	fz_paint_span_4_with_alpha(dp, sp, w, alpha);
+}
+
+/*
+	Source over destination for 16 bytes of each. Fully transparent
+	source leaves the destination alone and fully opaque source
+	replaces it; opaque is the given mask of alpha bytes.
+*/
+#define FZ_OVER_SSE2(OPAQUE, ALPHA_LO, ALPHA_HI) \
+	{ \
+		__m128i s = _mm_loadu_si128((__m128i *)sp); \
+		int opaque = _mm_movemask_epi8(_mm_cmpeq_epi8(s, _mm_set1_epi8(-1))) & OPAQUE; \
+		if (opaque == OPAQUE) \
+			_mm_storeu_si128((__m128i *)dp, s); \
+		else if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, zero)) != 0xffff) \
+		{ \
+			__m128i d = _mm_loadu_si128((__m128i *)dp); \
+			__m128i lo = _mm_unpacklo_epi8(s, zero); \
+			__m128i hi = _mm_unpackhi_epi8(s, zero); \
+			lo = fz_over_sse2(lo, ALPHA_LO, _mm_unpacklo_epi8(d, zero)); \
+			hi = fz_over_sse2(hi, ALPHA_HI, _mm_unpackhi_epi8(d, zero)); \
+			_mm_storeu_si128((__m128i *)dp, _mm_packus_epi16(lo, hi)); \
+		} \
+		dp += 16; \
+		sp += 16; \
+	}
+
+static FZ_TARGET_SSE2 void
+fz_paint_span_1_sse2(byte * restrict dp, byte * restrict sp, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	while (w >= 16)
+	{
+		FZ_OVER_SSE2(0xffff, lo, hi);
+		w -= 16;
+	}
+	fz_paint_span_1(dp, sp, w);
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_span_2_sse2(byte * restrict dp, byte * restrict sp, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	while (w >= 8)
+	{
+		FZ_OVER_SSE2(0xaaaa,
+			_mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, FZ_ALPHA_2), FZ_ALPHA_2),
+			_mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, FZ_ALPHA_2), FZ_ALPHA_2));
+		w -= 8;
+	}
+	fz_paint_span_2(dp, sp, w);
+}
+
+static FZ_TARGET_SSE2 void
+fz_paint_span_4_sse2(byte * restrict dp, byte * restrict sp, int w)
+{
+	__m128i zero = _mm_setzero_si128();
+	while (w >= 4)
+	{
+		FZ_OVER_SSE2(0x8888,
+			_mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, FZ_ALPHA_4), FZ_ALPHA_4),
+			_mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, FZ_ALPHA_4), FZ_ALPHA_4));
+		w -= 4;
+	}
+	fz_paint_span_4(dp, sp, w);
+}
+
+static const fz_paint_kernels fz_paint_kernels_sse2 =
+{
+	"SSE2",
+	fz_paint_solid_alpha_sse2,
+	fz_paint_solid_color_2_sse2,
+	fz_paint_solid_color_4_sse2,
+	fz_paint_span_with_color_2_sse2,
+	fz_paint_span_with_color_4_sse2,
+	fz_paint_span_with_mask_2_sse2,
+	fz_paint_span_with_mask_4_sse2,
+	fz_paint_span_2_with_alpha_sse2,
+	fz_paint_span_4_with_alpha_sse2,
+	fz_paint_span_1_sse2,
+	fz_paint_span_2_sse2,
+	fz_paint_span_4_sse2,
+};
+
+#endif /* HAVE_PAINT_SSE2 */
+
+#ifdef HAVE_PAINT_AVX2
+
+/*
+The AVX2 painters do the same as the SSE2 ones on 32 bytes at a time.
+The byte unpacks and packs work within each 128 bit half, so the
+per-pixel mask values have to be spread the same way: the first half
+of the register holds the mask for the first half of the pixels.
+*/
+
+static inline FZ_TARGET_AVX2 __m256i
+fz_expand_avx2(__m256i a)
+{
+	return _mm256_add_epi16(a, _mm256_srli_epi16(a, 7));
+}
+
+static inline FZ_TARGET_AVX2 __m256i
+fz_combine_avx2(__m256i a, __m256i b)
+{
+	return _mm256_srli_epi16(_mm256_mullo_epi16(a, b), 8);
+}
+
+static inline FZ_TARGET_AVX2 __m256i
+fz_combine_256_avx2(__m256i a, __m256i b2)
+{
+	return _mm256_mulhi_epu16(_mm256_slli_epi16(a, 7), b2);
+}
+
+static inline FZ_TARGET_AVX2 __m256i
+fz_blend_avx2(__m256i s, __m256i d, __m256i a)
+{
+	__m256i ia = _mm256_sub_epi16(_mm256_set1_epi16(256), a);
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, ia)), 8);
+}
+
+static inline FZ_TARGET_AVX2 __m256i
+fz_mask_avx2(__m256i s, __m256i sa, __m256i d, __m256i ma)
+{
+	__m256i masa = fz_expand_avx2(_mm256_sub_epi16(_mm256_set1_epi16(255), fz_combine_avx2(sa, ma)));
+	__m256i r = _mm256_add_epi16(fz_combine_avx2(s, ma), fz_combine_avx2(d, masa));
+	return _mm256_and_si256(r, _mm256_set1_epi16(255));
+}
+
+static inline FZ_TARGET_AVX2 __m256i
+fz_over_avx2(__m256i s, __m256i sa, __m256i d)
+{
+	__m256i t = fz_expand_avx2(_mm256_sub_epi16(_mm256_set1_epi16(255), sa));
+	return _mm256_and_si256(_mm256_add_epi16(s, fz_combine_avx2(d, t)), _mm256_set1_epi16(255));
+}
+
+/* 8 mask bytes as 16 bit lanes, each one doubled */
+static inline FZ_TARGET_AVX2 __m256i
+fz_mask_4_avx2(__m128i m)
+{
+	__m256i ma = _mm256_cvtepu8_epi32(m);
+	return _mm256_or_si256(ma, _mm256_slli_epi32(ma, 16));
+}
+
+static FZ_TARGET_AVX2 void
+fz_paint_solid_alpha_avx2(byte * restrict dp, int w, int alpha)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i a = _mm256_set1_epi16(alpha);
+	__m256i t = _mm256_set1_epi16(FZ_EXPAND(255 - alpha));
+	while (w >= 32)
+	{
+		__m256i d = _mm256_loadu_si256((__m256i *)dp);
+		__m256i lo = _mm256_add_epi16(a, fz_combine_avx2(_mm256_unpacklo_epi8(d, zero), t));
+		__m256i hi = _mm256_add_epi16(a, fz_combine_avx2(_mm256_unpackhi_epi8(d, zero), t));
+		_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+		dp += 32;
+		w -= 32;
+	}
+	fz_paint_solid_alpha_1(dp, w, alpha);
+}
+
+static inline FZ_TARGET_AVX2 byte *
+fz_paint_solid_avx2(byte * restrict dp, int len, __m128i c128, int ma)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i c = _mm256_inserti128_si256(_mm256_castsi128_si256(c128), c128, 1);
+	__m256i a = _mm256_set1_epi16(ma);
+	while (len >= 32)
+	{
+		__m256i d = _mm256_loadu_si256((__m256i *)dp);
+		__m256i lo = fz_blend_avx2(c, _mm256_unpacklo_epi8(d, zero), a);
+		__m256i hi = fz_blend_avx2(c, _mm256_unpackhi_epi8(d, zero), a);
+		_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+		dp += 32;
+		len -= 32;
+	}
+	return dp;
+}
+
+static FZ_TARGET_AVX2 void
+fz_paint_solid_color_2_avx2(byte * restrict dp, int w, byte *color)
+{
+	int ma = FZ_COMBINE(FZ_EXPAND(255), FZ_EXPAND(color[1]));
+	__m128i c = _mm_setr_epi16(color[0], 255, color[0], 255, color[0], 255, color[0], 255);
+	dp = fz_paint_solid_avx2(dp, w * 2, c, ma);
+	fz_paint_solid_color_2(dp, w & 15, color);
+}
+
+static FZ_TARGET_AVX2 void
+fz_paint_solid_color_4_avx2(byte * restrict dp, int w, byte *color)
+{
+	int ma = FZ_COMBINE(FZ_EXPAND(255), FZ_EXPAND(color[3]));
+	__m128i c = _mm_setr_epi16(color[0], color[1], color[2], 255, color[0], color[1], color[2], 255);
+	dp = fz_paint_solid_avx2(dp, w * 4, c, ma);
+	fz_paint_solid_color_4(dp, w & 7, color);
+}
+
+static FZ_TARGET_AVX2 void
+fz_paint_span_with_color_2_avx2(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i sa = _mm256_set1_epi16(FZ_EXPAND(color[1]) << 1);
+	__m128i c128 = _mm_setr_epi16(color[0], 255, color[0], 255, color[0], 255, color[0], 255);
+	__m256i c = _mm256_inserti128_si256(_mm256_castsi128_si256(c128), c128, 1);
+	while (w >= 16)
+	{
+		__m128i m = _mm_loadu_si128((__m128i *)mp);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(m, _mm_setzero_si128())) != 0xffff)
+		{
+			__m256i d = _mm256_loadu_si256((__m256i *)dp);
+			__m256i ma, lo, hi;
+			ma = fz_combine_256_avx2(fz_expand_avx2(_mm256_cvtepu8_epi16(m)), sa);
+			lo = fz_blend_avx2(c, _mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi16(ma, ma));
+			hi = fz_blend_avx2(c, _mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi16(ma, ma));
+			_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+		}
+		dp += 32;
+		mp += 16;
+		w -= 16;
+	}
+	fz_paint_span_with_color_2(dp, mp, w, color);
+}
+
+static FZ_TARGET_AVX2 void
+fz_paint_span_with_color_4_avx2(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i sa = _mm256_set1_epi16(FZ_EXPAND(color[3]) << 1);
+	__m128i c128 = _mm_setr_epi16(color[0], color[1], color[2], 255, color[0], color[1], color[2], 255);
+	__m256i c = _mm256_inserti128_si256(_mm256_castsi128_si256(c128), c128, 1);
+	while (w >= 8)
+	{
+		__m128i m = _mm_loadl_epi64((__m128i *)mp);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(m, _mm_setzero_si128())) != 0xffff)
+		{
+			__m256i d = _mm256_loadu_si256((__m256i *)dp);
+			__m256i ma, lo, hi;
+			ma = fz_combine_256_avx2(fz_expand_avx2(fz_mask_4_avx2(m)), sa);
+			lo = fz_blend_avx2(c, _mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi32(ma, ma));
+			hi = fz_blend_avx2(c, _mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi32(ma, ma));
+			_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+		}
+		dp += 32;
+		mp += 8;
+		w -= 8;
+	}
+	fz_paint_span_with_color_4(dp, mp, w, color);
+}
+
+static FZ_TARGET_AVX2 void
+fz_paint_span_with_mask_2_avx2(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w)
+{
+	__m256i zero = _mm256_setzero_si256();
+	while (w >= 16)
+	{
+		__m128i m = _mm_loadu_si128((__m128i *)mp);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(m, _mm_setzero_si128())) != 0xffff)
+		{
+			__m256i s = _mm256_loadu_si256((__m256i *)sp);
+			__m256i d = _mm256_loadu_si256((__m256i *)dp);
+			__m256i lo = _mm256_unpacklo_epi8(s, zero);
+			__m256i hi = _mm256_unpackhi_epi8(s, zero);
+			__m256i ma = fz_expand_avx2(_mm256_cvtepu8_epi16(m));
+			lo = fz_mask_avx2(lo, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, FZ_ALPHA_2), FZ_ALPHA_2),
+				_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi16(ma, ma));
+			hi = fz_mask_avx2(hi, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, FZ_ALPHA_2), FZ_ALPHA_2),
+				_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi16(ma, ma));
+			_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+		}
+		dp += 32;
+		sp += 32;
+		mp += 16;
+		w -= 16;
+	}
+	fz_paint_span_with_mask_2(dp, sp, mp, w);
+}
+
+static FZ_TARGET_AVX2 void
+fz_paint_span_with_mask_4_avx2(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w)
+{
+	__m256i zero = _mm256_setzero_si256();
+	while (w >= 8)
+	{
+		__m128i m = _mm_loadl_epi64((__m128i *)mp);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(m, _mm_setzero_si128())) != 0xffff)
+		{
+			__m256i s = _mm256_loadu_si256((__m256i *)sp);
+			__m256i d = _mm256_loadu_si256((__m256i *)dp);
+			__m256i lo = _mm256_unpacklo_epi8(s, zero);
+			__m256i hi = _mm256_unpackhi_epi8(s, zero);
+			__m256i ma = fz_expand_avx2(fz_mask_4_avx2(m));
+			lo = fz_mask_avx2(lo, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, FZ_ALPHA_4), FZ_ALPHA_4),
+				_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi32(ma, ma));
+			hi = fz_mask_avx2(hi, _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, FZ_ALPHA_4), FZ_ALPHA_4),
+				_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi32(ma, ma));
+			_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi));
+		}
+		dp += 32;
+		sp += 32;
+		mp += 8;
+		w -= 8;
+	}
+	fz_paint_span_with_mask_4(dp, sp, mp, w);
+}
+
+#define FZ_WITH_ALPHA_AVX2(SHUF) \
+	{ \
+		__m256i s = _mm256_loadu_si256((__m256i *)sp); \
+		if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, zero)) != 0xffffffff) \
+		{ \
+			__m256i d = _mm256_loadu_si256((__m256i *)dp); \
+			__m256i lo = _mm256_unpacklo_epi8(s, zero); \
+			__m256i hi = _mm256_unpackhi_epi8(s, zero); \
+			lo = fz_blend_avx2(lo, _mm256_unpacklo_epi8(d, zero), \
+				fz_combine_avx2(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, SHUF), SHUF), a)); \
+			hi = fz_blend_avx2(hi, _mm256_unpackhi_epi8(d, zero), \
+				fz_combine_avx2(_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, SHUF), SHUF), a)); \
+			_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi)); \
+		} \
+		dp += 32; \
+		sp += 32; \
+	}
+
+static FZ_TARGET_AVX2 void
+fz_paint_span_2_with_alpha_avx2(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i a = _mm256_set1_epi16(FZ_EXPAND(alpha));
+	while (w >= 16)
+	{
+		FZ_WITH_ALPHA_AVX2(FZ_ALPHA_2);
+		w -= 16;
+	}
+	fz_paint_span_2_with_alpha(dp, sp, w, alpha);
+}
+
+static FZ_TARGET_AVX2 void
+fz_paint_span_4_with_alpha_avx2(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i a = _mm256_set1_epi16(FZ_EXPAND(alpha));
+	while (w >= 8)
+	{
+		FZ_WITH_ALPHA_AVX2(FZ_ALPHA_4);
+		w -= 8;
+	}
+	fz_paint_span_4_with_alpha(dp, sp, w, alpha);
+}
+
+#define FZ_OVER_AVX2(OPAQUE, ALPHA_LO, ALPHA_HI) \
+	{ \
+		__m256i s = _mm256_loadu_si256((__m256i *)sp); \
+		unsigned int opaque = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, _mm256_set1_epi8(-1))) & OPAQUE; \
+		if (opaque == OPAQUE) \
+			_mm256_storeu_si256((__m256i *)dp, s); \
+		else if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, zero)) != 0xffffffff) \
+		{ \
+			__m256i d = _mm256_loadu_si256((__m256i *)dp); \
+			__m256i lo = _mm256_unpacklo_epi8(s, zero); \
+			__m256i hi = _mm256_unpackhi_epi8(s, zero); \
+			lo = fz_over_avx2(lo, ALPHA_LO, _mm256_unpacklo_epi8(d, zero)); \
+			hi = fz_over_avx2(hi, ALPHA_HI, _mm256_unpackhi_epi8(d, zero)); \
+			_mm256_storeu_si256((__m256i *)dp, _mm256_packus_epi16(lo, hi)); \
+		} \
+		dp += 32; \
+		sp += 32; \
+	}
+
+static FZ_TARGET_AVX2 void
+fz_paint_span_1_avx2(byte * restrict dp, byte * restrict sp, int w)
+{
+	__m256i zero = _mm256_setzero_si256();
+	while (w >= 32)
+	{
+		FZ_OVER_AVX2(0xffffffff, lo, hi);
+		w -= 32;
+	}
+	fz_paint_span_1(dp, sp, w);
+}
+
+static FZ_TARGET_AVX2 void
+fz_paint_span_2_avx2(byte * restrict dp, byte * restrict sp, int w)
+{
+	__m256i zero = _mm256_setzero_si256();
+	while (w >= 16)
+	{
+		FZ_OVER_AVX2(0xaaaaaaaa,
+			_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, FZ_ALPHA_2), FZ_ALPHA_2),
+			_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, FZ_ALPHA_2), FZ_ALPHA_2));
+		w -= 16;
+	}
+	fz_paint_span_2(dp, sp, w);
+}
+
+static FZ_TARGET_AVX2 void
+fz_paint_span_4_avx2(byte * restrict dp, byte * restrict sp, int w)
+{
+	__m256i zero = _mm256_setzero_si256();
+	while (w >= 8)
+	{
+		FZ_OVER_AVX2(0x88888888,
+			_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, FZ_ALPHA_4), FZ_ALPHA_4),
+			_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, FZ_ALPHA_4), FZ_ALPHA_4));
+		w -= 8;
+	}
+	fz_paint_span_4(dp, sp, w);
+}
+
+static const fz_paint_kernels fz_paint_kernels_avx2 =
+{
+	"AVX2",
+	fz_paint_solid_alpha_avx2,
+	fz_paint_solid_color_2_avx2,
+	fz_paint_solid_color_4_avx2,
+	fz_paint_span_with_color_2_avx2,
+	fz_paint_span_with_color_4_avx2,
+	fz_paint_span_with_mask_2_avx2,
+	fz_paint_span_with_mask_4_avx2,
+	fz_paint_span_2_with_alpha_avx2,
+	fz_paint_span_4_with_alpha_avx2,
+	fz_paint_span_1_avx2,
+	fz_paint_span_2_avx2,
+	fz_paint_span_4_avx2,
+};
+
+#endif /* HAVE_PAINT_AVX2 */
+
+#ifdef HAVE_PAINT_NEON
+
+#include <arm_neon.h>
+
+/*
+The NEON painters use the structure loads to split 8 pixels into one
+register per component, and work on 8 pixels of a component at a time.
+*/
+
+static inline uint8x8_t
+fz_blend_neon(uint16x8_t s, uint8x8_t d, uint16x8_t a, uint16x8_t ia)
+{
+	return vmovn_u16(vshrq_n_u16(vmlaq_u16(vmulq_u16(vmovl_u8(d), ia), s, a), 8));
+}
+
+/* FZ_COMBINE(a, b) with both in 0..256 */
+static inline uint16x8_t
+fz_combine_256_neon(uint16x8_t a, uint16_t b)
+{
+	return vcombine_u16(vshrn_n_u32(vmull_n_u16(vget_low_u16(a), b), 8),
+		vshrn_n_u32(vmull_n_u16(vget_high_u16(a), b), 8));
+}
+
+/* FZ_COMBINE(s, ma) + FZ_COMBINE(d, masa), truncated to a byte */
+static inline uint8x8_t
+fz_mask_neon(uint8x8_t s, uint8x8_t d, uint16x8_t ma, uint16x8_t masa)
+{
+	return vmovn_u16(vaddq_u16(vshrq_n_u16(vmulq_u16(vmovl_u8(s), ma), 8),
+		vshrq_n_u16(vmulq_u16(vmovl_u8(d), masa), 8)));
+}
+
+/* s + FZ_COMBINE(d, t), truncated to a byte */
+static inline uint8x8_t
+fz_over_neon(uint8x8_t s, uint8x8_t d, uint16x8_t t)
+{
+	return vmovn_u16(vaddq_u16(vmovl_u8(s), vshrq_n_u16(vmulq_u16(vmovl_u8(d), t), 8)));
+}
+
+/* FZ_EXPAND(255 - a) */
+static inline uint16x8_t
+fz_inverse_neon(uint8x8_t a)
+{
+	uint16x8_t t = vmovl_u8(vsub_u8(vdup_n_u8(255), a));
+	return vsraq_n_u16(t, t, 7);
+}
+
+/* FZ_EXPAND(255 - FZ_COMBINE(sa, ma)) */
+static inline uint16x8_t
+fz_masa_neon(uint8x8_t sa, uint16x8_t ma)
+{
+	uint16x8_t t = vsubq_u16(vdupq_n_u16(255), vshrq_n_u16(vmulq_u16(vmovl_u8(sa), ma), 8));
+	return vsraq_n_u16(t, t, 7);
+}
+
+static void
+fz_paint_solid_alpha_neon(byte * restrict dp, int w, int alpha)
+{
+	uint16x8_t a = vdupq_n_u16(alpha);
+	uint16x8_t t = vdupq_n_u16(FZ_EXPAND(255 - alpha));
+	while (w >= 8)
+	{
+		uint16x8_t d = vmovl_u8(vld1_u8(dp));
+		vst1_u8(dp, vmovn_u16(vaddq_u16(a, vshrq_n_u16(vmulq_u16(d, t), 8))));
+		dp += 8;
+		w -= 8;
+	}
+	fz_paint_solid_alpha_1(dp, w, alpha);
+}
+
+static void
+fz_paint_solid_color_2_neon(byte * restrict dp, int w, byte *color)
+{
+	int ma = FZ_COMBINE(FZ_EXPAND(255), FZ_EXPAND(color[1]));
+	uint16x8_t a = vdupq_n_u16(ma);
+	uint16x8_t ia = vdupq_n_u16(256 - ma);
+	uint16x8_t g = vdupq_n_u16(color[0]);
+	uint16x8_t k = vdupq_n_u16(255);
+	while (w >= 8)
+	{
+		uint8x8x2_t d = vld2_u8(dp);
+		d.val[0] = fz_blend_neon(g, d.val[0], a, ia);
+		d.val[1] = fz_blend_neon(k, d.val[1], a, ia);
+		vst2_u8(dp, d);
+		dp += 16;
+		w -= 8;
+	}
+	fz_paint_solid_color_2(dp, w, color);
+}
+
+static void
+fz_paint_solid_color_4_neon(byte * restrict dp, int w, byte *color)
+{
+	int ma = FZ_COMBINE(FZ_EXPAND(255), FZ_EXPAND(color[3]));
+	uint16x8_t a = vdupq_n_u16(ma);
+	uint16x8_t ia = vdupq_n_u16(256 - ma);
+	uint16x8_t r = vdupq_n_u16(color[0]);
+	uint16x8_t g = vdupq_n_u16(color[1]);
+	uint16x8_t b = vdupq_n_u16(color[2]);
+	uint16x8_t k = vdupq_n_u16(255);
+	while (w >= 8)
+	{
+		uint8x8x4_t d = vld4_u8(dp);
+		d.val[0] = fz_blend_neon(r, d.val[0], a, ia);
+		d.val[1] = fz_blend_neon(g, d.val[1], a, ia);
+		d.val[2] = fz_blend_neon(b, d.val[2], a, ia);
+		d.val[3] = fz_blend_neon(k, d.val[3], a, ia);
+		vst4_u8(dp, d);
+		dp += 32;
+		w -= 8;
+	}
+	fz_paint_solid_color_4(dp, w, color);
+}
+
+static void
+fz_paint_span_with_color_2_neon(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	int sa = FZ_EXPAND(color[1]);
+	uint16x8_t v256 = vdupq_n_u16(256);
+	uint16x8_t g = vdupq_n_u16(color[0]);
+	uint16x8_t k = vdupq_n_u16(255);
+	while (w >= 8)
+	{
+		uint16x8_t ma = vmovl_u8(vld1_u8(mp));
+		uint16x8_t ia;
+		uint8x8x2_t d = vld2_u8(dp);
+		ma = fz_combine_256_neon(vsraq_n_u16(ma, ma, 7), sa);
+		ia = vsubq_u16(v256, ma);
+		d.val[0] = fz_blend_neon(g, d.val[0], ma, ia);
+		d.val[1] = fz_blend_neon(k, d.val[1], ma, ia);
+		vst2_u8(dp, d);
+		dp += 16;
+		mp += 8;
+		w -= 8;
+	}
+	fz_paint_span_with_color_2(dp, mp, w, color);
+}
+
+static void
+fz_paint_span_with_color_4_neon(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	int sa = FZ_EXPAND(color[3]);
+	uint16x8_t v256 = vdupq_n_u16(256);
+	uint16x8_t r = vdupq_n_u16(color[0]);
+	uint16x8_t g = vdupq_n_u16(color[1]);
+	uint16x8_t b = vdupq_n_u16(color[2]);
+	uint16x8_t k = vdupq_n_u16(255);
+	while (w >= 8)
+	{
+		uint16x8_t ma = vmovl_u8(vld1_u8(mp));
+		uint16x8_t ia;
+		uint8x8x4_t d = vld4_u8(dp);
+		ma = fz_combine_256_neon(vsraq_n_u16(ma, ma, 7), sa);
+		ia = vsubq_u16(v256, ma);
+		d.val[0] = fz_blend_neon(r, d.val[0], ma, ia);
+		d.val[1] = fz_blend_neon(g, d.val[1], ma, ia);
+		d.val[2] = fz_blend_neon(b, d.val[2], ma, ia);
+		d.val[3] = fz_blend_neon(k, d.val[3], ma, ia);
+		vst4_u8(dp, d);
+		dp += 32;
+		mp += 8;
+		w -= 8;
+	}
+	fz_paint_span_with_color_4(dp, mp, w, color);
+}
+
+static void
+fz_paint_span_with_mask_2_neon(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w)
+{
+	while (w >= 8)
+	{
+		uint16x8_t ma = vmovl_u8(vld1_u8(mp));
+		uint16x8_t masa;
+		uint8x8x2_t s = vld2_u8(sp);
+		uint8x8x2_t d = vld2_u8(dp);
+		ma = vsraq_n_u16(ma, ma, 7);
+		masa = fz_masa_neon(s.val[1], ma);
+		d.val[0] = fz_mask_neon(s.val[0], d.val[0], ma, masa);
+		d.val[1] = fz_mask_neon(s.val[1], d.val[1], ma, masa);
+		vst2_u8(dp, d);
+		dp += 16;
+		sp += 16;
+		mp += 8;
+		w -= 8;
+	}
+	fz_paint_span_with_mask_2(dp, sp, mp, w);
+}
+
+static void
+fz_paint_span_with_mask_4_neon(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w)
+{
+	while (w >= 8)
+	{
+		uint16x8_t ma = vmovl_u8(vld1_u8(mp));
+		uint16x8_t masa;
+		uint8x8x4_t s = vld4_u8(sp);
+		uint8x8x4_t d = vld4_u8(dp);
+		ma = vsraq_n_u16(ma, ma, 7);
+		masa = fz_masa_neon(s.val[3], ma);
+		d.val[0] = fz_mask_neon(s.val[0], d.val[0], ma, masa);
+		d.val[1] = fz_mask_neon(s.val[1], d.val[1], ma, masa);
+		d.val[2] = fz_mask_neon(s.val[2], d.val[2], ma, masa);
+		d.val[3] = fz_mask_neon(s.val[3], d.val[3], ma, masa);
+		vst4_u8(dp, d);
+		dp += 32;
+		sp += 32;
+		mp += 8;
+		w -= 8;
+	}
+	fz_paint_span_with_mask_4(dp, sp, mp, w);
+}
+
+static void
+fz_paint_span_2_with_alpha_neon(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+	uint16x8_t v256 = vdupq_n_u16(256);
+	uint16x8_t a = vdupq_n_u16(FZ_EXPAND(alpha));
+	while (w >= 8)
+	{
+		uint8x8x2_t s = vld2_u8(sp);
+		uint8x8x2_t d = vld2_u8(dp);
+		uint16x8_t masa = vshrq_n_u16(vmulq_u16(vmovl_u8(s.val[1]), a), 8);
+		uint16x8_t ia = vsubq_u16(v256, masa);
+		d.val[0] = fz_blend_neon(vmovl_u8(s.val[0]), d.val[0], masa, ia);
+		d.val[1] = fz_blend_neon(vmovl_u8(s.val[1]), d.val[1], masa, ia);
+		vst2_u8(dp, d);
+		dp += 16;
+		sp += 16;
+		w -= 8;
+	}
+	fz_paint_span_2_with_alpha(dp, sp, w, alpha);
+}
+
+static void
+fz_paint_span_4_with_alpha_neon(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+	uint16x8_t v256 = vdupq_n_u16(256);
+	uint16x8_t a = vdupq_n_u16(FZ_EXPAND(alpha));
+	while (w >= 8)
+	{
+		uint8x8x4_t s = vld4_u8(sp);
+		uint8x8x4_t d = vld4_u8(dp);
+		uint16x8_t masa = vshrq_n_u16(vmulq_u16(vmovl_u8(s.val[3]), a), 8);
+		uint16x8_t ia = vsubq_u16(v256, masa);
+		d.val[0] = fz_blend_neon(vmovl_u8(s.val[0]), d.val[0], masa, ia);
+		d.val[1] = fz_blend_neon(vmovl_u8(s.val[1]), d.val[1], masa, ia);
+		d.val[2] = fz_blend_neon(vmovl_u8(s.val[2]), d.val[2], masa, ia);
+		d.val[3] = fz_blend_neon(vmovl_u8(s.val[3]), d.val[3], masa, ia);
+		vst4_u8(dp, d);
+		dp += 32;
+		sp += 32;
+		w -= 8;
+	}
+	fz_paint_span_4_with_alpha(dp, sp, w, alpha);
+}
+
+static void
+fz_paint_span_1_neon(byte * restrict dp, byte * restrict sp, int w)
+{
+	while (w >= 8)
+	{
+		uint8x8_t s = vld1_u8(sp);
+		vst1_u8(dp, fz_over_neon(s, vld1_u8(dp), fz_inverse_neon(s)));
+		dp += 8;
+		sp += 8;
+		w -= 8;
+	}
+	fz_paint_span_1(dp, sp, w);
+}
+
+static void
+fz_paint_span_2_neon(byte * restrict dp, byte * restrict sp, int w)
+{
+	while (w >= 8)
+	{
+		uint8x8x2_t s = vld2_u8(sp);
+		uint8x8x2_t d = vld2_u8(dp);
+		uint16x8_t t = fz_inverse_neon(s.val[1]);
+		d.val[0] = fz_over_neon(s.val[0], d.val[0], t);
+		d.val[1] = fz_over_neon(s.val[1], d.val[1], t);
+		vst2_u8(dp, d);
+		dp += 16;
+		sp += 16;
+		w -= 8;
+	}
+	fz_paint_span_2(dp, sp, w);
+}
+
+static void
+fz_paint_span_4_neon(byte * restrict dp, byte * restrict sp, int w)
+{
+	while (w >= 8)
+	{
+		uint8x8x4_t s = vld4_u8(sp);
+		uint8x8x4_t d = vld4_u8(dp);
+		uint16x8_t t = fz_inverse_neon(s.val[3]);
+		d.val[0] = fz_over_neon(s.val[0], d.val[0], t);
+		d.val[1] = fz_over_neon(s.val[1], d.val[1], t);
+		d.val[2] = fz_over_neon(s.val[2], d.val[2], t);
+		d.val[3] = fz_over_neon(s.val[3], d.val[3], t);
+		vst4_u8(dp, d);
+		dp += 32;
+		sp += 32;
+		w -= 8;
+	}
+	fz_paint_span_4(dp, sp, w);
+}
+
+static const fz_paint_kernels fz_paint_kernels_neon =
+{
+	"NEON",
+	fz_paint_solid_alpha_neon,
+	fz_paint_solid_color_2_neon,
+	fz_paint_solid_color_4_neon,
+	fz_paint_span_with_color_2_neon,
+	fz_paint_span_with_color_4_neon,
+	fz_paint_span_with_mask_2_neon,
+	fz_paint_span_with_mask_4_neon,
+	fz_paint_span_2_with_alpha_neon,
+	fz_paint_span_4_with_alpha_neon,
+	fz_paint_span_1_neon,
+	fz_paint_span_2_neon,
+	fz_paint_span_4_neon,
+};
+
+#endif /* HAVE_PAINT_NEON */
+
+/*
+ * Kernel selection
+ */
+
+#ifdef HAVE_PAINT_SSE2
+static int
+fz_cpu_has_sse2(void)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	return 1;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] >> 26) & 1;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+#endif
+
+#ifdef HAVE_PAINT_AVX2
+static int
+fz_cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+	/* The OS must save the YMM registers too (OSXSAVE, then XCR0) */
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return 0;
+	__cpuid(info, 1);
+	if (((info[2] >> 27) & 3) != 3)
+		return 0;
+	if ((_xgetbv(0) & 6) != 6)
+		return 0;
+	__cpuidex(info, 7, 0);
+	return (info[1] >> 5) & 1;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+static void
+fz_run_paint_kernel(const fz_paint_kernels *k, int op, byte *dp, byte *sp, byte *mp, int w, byte *color, int alpha)
+{
+	switch (op)
+	{
+	case 0: k->solid_alpha(dp, w, alpha); break;
+	case 1: k->solid_color_2(dp, w, color); break;
+	case 2: k->solid_color_4(dp, w, color); break;
+	case 3: k->with_color_2(dp, mp, w, color); break;
+	case 4: k->with_color_4(dp, mp, w, color); break;
+	case 5: k->with_mask_2(dp, sp, mp, w); break;
+	case 6: k->with_mask_4(dp, sp, mp, w); break;
+	case 7: k->with_alpha_2(dp, sp, w, alpha); break;
+	case 8: k->with_alpha_4(dp, sp, w, alpha); break;
+	case 9: k->span_1(dp, sp, w); break;
+	case 10: k->span_2(dp, sp, w); break;
+	case 11: k->span_4(dp, sp, w); break;
+	}
+}
+
+#define CHECK_W 83
+#define CHECK_OPS 12
+
+static int
+fz_check_paint_kernel_set(const fz_paint_kernels *k)
+{
+	byte src[CHECK_W * 4 + 16], msk[CHECK_W + 16], dst[CHECK_W * 4 + 16];
+	byte ref[CHECK_W * 4 + 16], out[CHECK_W * 4 + 16];
+	byte color[4];
+	unsigned int seed = 1;
+	int i, j, op;
+
+	for (i = 0; i < 400; i++)
+	{
+		int off, w, alpha;
+
+		/* Favour 0 and 255, which take the short cuts */
+		for (j = 0; j < (int)sizeof dst; j++)
+		{
+			seed = seed * 1103515245 + 12345;
+			src[j] = (seed >> 8) & 7 ? seed >> 16 : (seed >> 12) & 1 ? 255 : 0;
+			seed = seed * 1103515245 + 12345;
+			dst[j] = seed >> 16;
+		}
+		for (j = 0; j < (int)sizeof msk; j++)
+		{
+			seed = seed * 1103515245 + 12345;
+			msk[j] = (seed >> 8) & 3 ? seed >> 16 : (seed >> 12) & 1 ? 255 : 0;
+		}
+		if (i & 1)
+			memset(src + ((seed >> 4) & 15) * 4, 0, 64);
+		if (i & 2)
+			memset(msk + ((seed >> 8) & 15), 0, 16);
+		if (i & 16)
+			memset(src + ((seed >> 12) & 15) * 4, 255, 64);
+		seed = seed * 1103515245 + 12345;
+		off = (seed >> 16) & 15;
+		w = (seed >> 20) % CHECK_W;
+		alpha = i & 4 ? 255 : (seed >> 24) & 255;
+		for (j = 0; j < 4; j++)
+			color[j] = (i & 8) && j == 3 ? 255 : src[j + 1];
+
+		for (op = 0; op < CHECK_OPS; op++)
+		{
+			memcpy(ref, dst, sizeof dst);
+			memcpy(out, dst, sizeof dst);
+			fz_run_paint_kernel(&fz_paint_kernels_c, op, ref + off, src + off, msk + off, w, color, alpha);
+			fz_run_paint_kernel(k, op, out + off, src + off, msk + off, w, color, alpha);
+			if (memcmp(ref, out, sizeof dst))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+fz_check_paint_kernels_warn(fz_context *ctx, const fz_paint_kernels *k)
+{
+	if (!fz_check_paint_kernel_set(k))
+		return 0;
+	fz_warn(ctx, "%s span painters do not match the C ones", k->name);
+	return 1;
+}
+
+int
+fz_check_paint_kernels(fz_context *ctx)
+{
+	int bad = 0;
+#ifdef HAVE_PAINT_SSE2
+	if (fz_cpu_has_sse2())
+		bad += fz_check_paint_kernels_warn(ctx, &fz_paint_kernels_sse2);
+#endif
+#ifdef HAVE_PAINT_AVX2
+	if (fz_cpu_has_avx2())
+		bad += fz_check_paint_kernels_warn(ctx, &fz_paint_kernels_avx2);
+#endif
+#ifdef HAVE_PAINT_NEON
+	bad += fz_check_paint_kernels_warn(ctx, &fz_paint_kernels_neon);
+#endif
+	return bad;
+}
+
+/*
+	Called by fz_new_context, before any other thread can be painting.
+	The table is only written when it changes, which is only ever on
+	the first call, so later contexts can be made while others paint.
+	Debug builds check the chosen painters against the C ones first,
+	and fall back to the next best set if they disagree.
+*/
+void
+fz_init_paint_kernels(fz_context *ctx)
+{
+	const fz_paint_kernels *list[4];
+	int i, n = 0;
+
+#ifdef HAVE_PAINT_NEON
+	list[n++] = &fz_paint_kernels_neon;
+#endif
+#ifdef HAVE_PAINT_AVX2
+	if (fz_cpu_has_avx2())
+		list[n++] = &fz_paint_kernels_avx2;
+#endif
+#ifdef HAVE_PAINT_SSE2
+	if (fz_cpu_has_sse2())
+		list[n++] = &fz_paint_kernels_sse2;
+#endif
+	list[n++] = &fz_paint_kernels_c;
+
+	for (i = 0; i < n - 1; i++)
+	{
+#ifndef NDEBUG
+		if (fz_check_paint_kernel_set(list[i]))
+		{
+			fz_warn(ctx, "%s span painters do not match the C ones; not using them", list[i]->name);
+			continue;
+		}
+#endif
+		break;
+	}
+
+	if (paint_kernels != list[i])
+		paint_kernels = list[i];
+}
+
+const char *
+fz_paint_kernels_name(void)
+{
+	return fz_get_paint_kernels()->name;
+}
+
 /*
  * Pixmap blending functions
  */
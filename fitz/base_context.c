@@ -96,6 +96,7 @@ fz_new_context(fz_alloc_context *alloc, fz_locks_context *locks, unsigned int ma
 		fz_new_store_context(ctx, max_store);
 		fz_new_glyph_cache_context(ctx);
 		fz_new_font_context(ctx);
+		fz_init_paint_kernels(ctx);
 	}
 	fz_catch(ctx)
 	{
@@ -138,6 +139,33 @@ fz_clone_context_internal(fz_context *ctx)
 	new_ctx->glyph_cache = fz_keep_glyph_cache(new_ctx);
 	new_ctx->font = ctx->font;
 	new_ctx->font = fz_keep_font_context(new_ctx);
+	new_ctx->jobs = ctx->jobs;
 
 	return new_ctx;
 }
+
+void
+fz_set_jobs_context(fz_context *ctx, fz_jobs_context *jobs)
+{
+	ctx->jobs = jobs;
+}
+
+int
+fz_count_jobs(fz_context *ctx)
+{
+	if (ctx->jobs && ctx->jobs->run && ctx->jobs->count > 1)
+		return ctx->jobs->count;
+	return 1;
+}
+
+void
+fz_run_jobs(fz_context *ctx, void (*fn)(void *), void **jobs, int n)
+{
+	int i;
+
+	if (n > 1 && fz_count_jobs(ctx) > 1)
+		ctx->jobs->run(ctx->jobs->user, fn, jobs, n);
+	else
+		for (i = 0; i < n; i++)
+			fn(jobs[i]);
+}
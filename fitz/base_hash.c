@@ -134,6 +134,12 @@ do_hash_insert(fz_context *ctx, fz_hash_table *table, void *key, void *val)
 	}
 }
 
+static int
+drop_lock_to_alloc(int lock)
+{
+	return lock == FZ_LOCK_ALLOC || (lock >= FZ_LOCK_STORE && lock <= FZ_LOCK_STORE_LAST);
+}
+
 static void
 fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 {
@@ -149,20 +155,24 @@ fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 		return;
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-	newents = fz_malloc_array(ctx, newsize, sizeof(fz_hash_entry));
-	if (table->lock == FZ_LOCK_ALLOC)
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (table->lock >= 0)
+	/* The allocator may need to scavenge the store, so we must not
+	 * hold the allocation lock or a store lock while allocating. */
+	if (drop_lock_to_alloc(table->lock))
+		fz_unlock(ctx, table->lock);
+	newents = fz_malloc_array_no_throw(ctx, newsize, sizeof(fz_hash_entry));
+	if (drop_lock_to_alloc(table->lock))
+		fz_lock(ctx, table->lock);
+	if (newents == NULL)
+		fz_throw(ctx, "hash table resize failed; out of memory (%d entries)", newsize);
+	if (table->size >= newsize)
 	{
-		if (table->size >= newsize)
-		{
-			/* Someone else fixed it before we could lock! */
+		/* Someone else fixed it before we could lock! */
+		if (drop_lock_to_alloc(table->lock))
 			fz_unlock(ctx, table->lock);
-			fz_free(ctx, newents);
-			return;
-		}
+		fz_free(ctx, newents);
+		if (drop_lock_to_alloc(table->lock))
+			fz_lock(ctx, table->lock);
+		return;
 	}
 	table->ents = newents;
 	memset(table->ents, 0, sizeof(fz_hash_entry) * newsize);
@@ -177,11 +187,11 @@ fz_resize_hash(fz_context *ctx, fz_hash_table *table, int newsize)
 		}
 	}
 
-	if (table->lock == FZ_LOCK_ALLOC)
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (drop_lock_to_alloc(table->lock))
+		fz_unlock(ctx, table->lock);
 	fz_free(ctx, oldents);
-	if (table->lock == FZ_LOCK_ALLOC)
-		fz_lock(ctx, FZ_LOCK_ALLOC);
+	if (drop_lock_to_alloc(table->lock))
+		fz_lock(ctx, table->lock);
 }
 
 void *
@@ -262,3 +262,23 @@ int fz_atoi(const char *s)
 		return 0;
 	return atoi(s);
 }
+
+fz_off_t fz_atoo(const char *s)
+{
+	fz_off_t i = 0;
+	int neg = 0;
+
+	if (s == NULL)
+		return 0;
+	while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n')
+		s++;
+	if (*s == '-' || *s == '+')
+		neg = (*s++ == '-');
+	while (*s >= '0' && *s <= '9')
+	{
+		if (i > (FZ_OFF_T_MAX - 9) / 10)
+			return neg ? -FZ_OFF_T_MAX : FZ_OFF_T_MAX;
+		i = i * 10 + (*s++ - '0');
+	}
+	return neg ? -i : i;
+}
@@ -1,9 +1,30 @@
 #include "fitz-internal.h"
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 typedef struct fz_display_node_s fz_display_node;
+typedef struct fz_display_chunk_s fz_display_chunk;
+typedef struct fz_display_ref_s fz_display_ref;
 
 #define STACK_SIZE 96
 
+/* Runs of sibling nodes are indexed in blocks of 16, 256, 4096... */
+#define SKIP_BLOCK_BITS 4
+#define SKIP_MIN_NODES 64
+
+/* Chunks start small so that short lists stay small, and double */
+#define CHUNK_MIN 4096
+#define CHUNK_MAX (64 << 10)
+
+/* Inline data larger than this that does not fit in the current chunk
+ * gets a block of its own rather than wasting the end of the chunk */
+#define BLOCK_MIN 1024
+
+#define ALIGN_NODE(x) (((x) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
 typedef enum fz_display_command_e
 {
 	FZ_CMD_FILL_PATH,
@@ -25,27 +46,87 @@ typedef enum fz_display_command_e
 	FZ_CMD_BEGIN_GROUP,
 	FZ_CMD_END_GROUP,
 	FZ_CMD_BEGIN_TILE,
-	FZ_CMD_END_TILE
+	FZ_CMD_END_TILE,
+	FZ_CMD_LINK
 } fz_display_command;
 
+/*
+	Nodes are stored back to back in a chain of chunks. Each node is
+	followed by its color values and then any path, text or tile data
+	it owns, so a node is a single variable length record. The last
+	node in a chunk is followed by an FZ_CMD_LINK node pointing at the
+	first node of the next chunk. Large paths and texts that would not
+	fit at the end of a chunk are put in a block of their own instead.
+	Apart from the links, nothing in a chunk points into a chunk, so
+	the last chunk can be trimmed to size once recording is done.
+
+	Colorspaces, stroke states, shades, images and fonts are not kept
+	by each node; the list keeps one reference to each distinct
+	resource, and the nodes refer to those by index. Freeing a list
+	therefore only has to walk the chunks and the resources, not the
+	nodes, and the nodes can be saved to a file as they are.
+*/
 struct fz_display_node_s
 {
-	fz_display_command cmd;
-	fz_display_node *next;
+	unsigned char cmd;
+	unsigned char flag; /* even_odd, accumulate, isolated/knockout... */
+	unsigned char ncolor; /* number of color values following the node */
+	unsigned char big; /* the data is in a block of its own */
+	int size; /* size of the whole record in bytes */
+	int colorspace; /* resources are indices into the list's table, or -1 */
+	int stroke;
+	int ref; /* the font, shade or image */
+	float alpha;
 	fz_rect rect;
+	fz_matrix ctm;
 	union {
-		fz_path *path;
-		fz_text *text;
-		fz_shade *shade;
-		fz_image *image;
+		fz_display_node *link;
+		void *data; /* path or text data in a block of its own */
 		int blendmode;
 	} item;
-	fz_stroke_state *stroke;
-	int flag; /* even_odd, accumulate, isolated/knockout... */
-	fz_matrix ctm;
-	fz_colorspace *colorspace;
-	float alpha;
-	float color[FZ_MAX_COLORS];
+};
+
+struct fz_display_chunk_s
+{
+	fz_display_chunk *next;
+	unsigned char *data;
+	int len;
+	int cap;
+};
+
+enum
+{
+	FZ_REF_COLORSPACE,
+	FZ_REF_STROKE,
+	FZ_REF_SHADE,
+	FZ_REF_IMAGE,
+	FZ_REF_FONT
+};
+
+struct fz_display_ref_s
+{
+	int kind;
+	void *ptr;
+};
+
+/*
+	To avoid walking every node when only part of a list is visible,
+	the list device indexes the list once recording finishes. Nodes
+	are grouped into subtrees (a clip, mask, group or tile together
+	with everything up to its matching pop) and runs of sibling
+	subtrees are summarised by the union of their bounding boxes at
+	several granularities. Replay can then skip over a whole run that
+	lies outside the scissor, or over anything at all while clipped,
+	without changing the sequence of calls that reaches the device.
+*/
+typedef struct fz_display_skip_s fz_display_skip;
+
+struct fz_display_skip_s
+{
+	int first; /* index of the first node in the run */
+	int last; /* index of the last node in the run */
+	fz_display_node *node; /* the last node in the run */
+	fz_rect rect; /* union of the culling rects in the run */
 };
 
 struct fz_display_list_s
@@ -54,9 +135,27 @@ struct fz_display_list_s
 	fz_display_node *last;
 	int len;
 
+	fz_display_chunk *head;
+	fz_display_chunk *tail;
+	fz_display_chunk *blocks;
+
+	int ref_len, ref_cap;
+	fz_display_ref *refs;
+	fz_hash_table *ref_table;
+	fz_stroke_state *stroke; /* most recently added stroke state */
+	int stroke_ref;
+
+	int skip_len;
+	fz_display_skip *skip;
+
+	/* the file a saved list was loaded from, mapped into memory */
+	unsigned char *map;
+	int map_len;
+	int mapped; /* map is a file mapping rather than a copy */
+
 	int top;
 	struct {
-		fz_rect *update;
+		fz_display_node *update;
 		fz_rect rect;
 	} stack[STACK_SIZE];
 	int tiled;
@@ -64,42 +163,283 @@ struct fz_display_list_s
 
 enum { ISOLATED = 1, KNOCKOUT = 2 };
 
+static inline unsigned char *
+chunk_data(fz_display_chunk *chunk)
+{
+	return chunk->data;
+}
+
+static inline void *
+node_ref(fz_display_list *list, int i)
+{
+	return i < 0 ? NULL : list->refs[i].ptr;
+}
+
+static inline float *
+node_color(fz_display_node *node)
+{
+	return (float *)(node + 1);
+}
+
+static inline void *
+node_data(fz_display_node *node)
+{
+	if (node->big)
+		return node->item.data;
+	return (unsigned char *)(node + 1) + ALIGN_NODE(node->ncolor * sizeof(float));
+}
+
+static void
+fz_free_display_chunks(fz_context *ctx, fz_display_chunk *chunk)
+{
+	while (chunk)
+	{
+		fz_display_chunk *next = chunk->next;
+		fz_free(ctx, chunk);
+		chunk = next;
+	}
+}
+
 static fz_display_node *
-fz_new_display_node(fz_context *ctx, fz_display_command cmd, const fz_matrix *ctm,
-	fz_colorspace *colorspace, float *color, float alpha)
+fz_next_display_node(fz_display_list *list, fz_display_node *node)
+{
+	if (node == list->last)
+		return NULL;
+	node = (fz_display_node *)((unsigned char *)node + node->size);
+	while (node->cmd == FZ_CMD_LINK)
+		node = node->item.link;
+	return node;
+}
+
+static void *
+fz_keep_display_ptr(fz_context *ctx, int kind, void *ptr)
+{
+	switch (kind)
+	{
+	case FZ_REF_COLORSPACE:
+		return fz_keep_colorspace(ctx, ptr);
+	case FZ_REF_STROKE:
+		return fz_keep_stroke_state(ctx, ptr);
+	case FZ_REF_SHADE:
+		return fz_keep_shade(ctx, ptr);
+	case FZ_REF_IMAGE:
+		return fz_keep_image(ctx, ptr);
+	case FZ_REF_FONT:
+		return fz_keep_font(ctx, ptr);
+	}
+	return ptr;
+}
+
+static void
+fz_drop_display_ptr(fz_context *ctx, int kind, void *ptr)
+{
+	switch (kind)
+	{
+	case FZ_REF_COLORSPACE:
+		fz_drop_colorspace(ctx, ptr);
+		break;
+	case FZ_REF_STROKE:
+		fz_drop_stroke_state(ctx, ptr);
+		break;
+	case FZ_REF_SHADE:
+		fz_drop_shade(ctx, ptr);
+		break;
+	case FZ_REF_IMAGE:
+		fz_drop_image(ctx, ptr);
+		break;
+	case FZ_REF_FONT:
+		fz_drop_font(ctx, ptr);
+		break;
+	}
+}
+
+/* Append a resource the caller has already taken a reference to */
+static void
+fz_add_display_ref(fz_context *ctx, fz_display_list *list, int kind, void *ptr)
+{
+	fz_display_ref *ref;
+
+	if (list->ref_len == list->ref_cap)
+	{
+		int newcap = list->ref_cap ? list->ref_cap * 2 : 16;
+		list->refs = fz_resize_array(ctx, list->refs, newcap, sizeof(fz_display_ref));
+		list->ref_cap = newcap;
+	}
+	ref = &list->refs[list->ref_len++];
+	ref->kind = kind;
+	ref->ptr = ptr;
+}
+
+/*
+	Make the list hold a reference to a resource, once, and return its
+	index. The hash maps each resource to its index plus one.
+*/
+static int
+fz_keep_display_ref(fz_context *ctx, fz_display_list *list, int kind, void *ptr)
+{
+	void *found;
+	int i;
+
+	if (ptr == NULL)
+		return -1;
+
+	if (!list->ref_table)
+		list->ref_table = fz_new_hash_table(ctx, 16, sizeof(void *), -1);
+	else if ((found = fz_hash_find(ctx, list->ref_table, &ptr)) != NULL)
+		return (int)(size_t)found - 1;
+
+	i = list->ref_len;
+	fz_add_display_ref(ctx, list, kind, NULL);
+	fz_try(ctx)
+	{
+		fz_hash_insert(ctx, list->ref_table, &ptr, (void *)(size_t)(i + 1));
+	}
+	fz_catch(ctx)
+	{
+		list->ref_len--;
+		fz_rethrow(ctx);
+	}
+
+	list->refs[i].ptr = fz_keep_display_ptr(ctx, kind, ptr);
+	return i;
+}
+
+static int
+fz_same_stroke_state(fz_stroke_state *a, fz_stroke_state *b)
 {
-	fz_display_node *node;
 	int i;
 
-	node = fz_malloc_struct(ctx, fz_display_node);
+	if (a == b)
+		return 1;
+	if (a->start_cap != b->start_cap || a->dash_cap != b->dash_cap ||
+		a->end_cap != b->end_cap || a->linejoin != b->linejoin ||
+		a->linewidth != b->linewidth || a->miterlimit != b->miterlimit ||
+		a->dash_phase != b->dash_phase || a->dash_len != b->dash_len)
+		return 0;
+	for (i = 0; i < a->dash_len; i++)
+		if (a->dash_list[i] != b->dash_list[i])
+			return 0;
+	return 1;
+}
+
+/* Interpreters tend to hand us a fresh but identical stroke state for
+ * every path, so share it with the previous one where we can. */
+static int
+fz_keep_display_stroke(fz_context *ctx, fz_display_list *list, fz_stroke_state *stroke)
+{
+	if (list->stroke && fz_same_stroke_state(list->stroke, stroke))
+		return list->stroke_ref;
+	list->stroke_ref = fz_keep_display_ref(ctx, list, FZ_REF_STROKE, stroke);
+	list->stroke = stroke;
+	return list->stroke_ref;
+}
+
+static void
+fz_new_display_chunk(fz_context *ctx, fz_display_list *list, int size)
+{
+	fz_display_chunk *tail = list->tail;
+	fz_display_chunk *chunk;
+	int cap = tail ? tail->cap * 2 : CHUNK_MIN;
+
+	if (cap > CHUNK_MAX)
+		cap = CHUNK_MAX;
+	/* Always leave room for the link to the next chunk */
+	if (cap < size + (int)sizeof(fz_display_node))
+		cap = size + sizeof(fz_display_node);
+
+	chunk = fz_malloc(ctx, sizeof(fz_display_chunk) + cap);
+	chunk->next = NULL;
+	chunk->data = (unsigned char *)(chunk + 1);
+	chunk->len = 0;
+	chunk->cap = cap;
+
+	if (tail)
+	{
+		fz_display_node *link = (fz_display_node *)(chunk_data(tail) + tail->len);
+		link->cmd = FZ_CMD_LINK;
+		link->size = sizeof(fz_display_node);
+		link->item.link = (fz_display_node *)chunk_data(chunk);
+		tail->next = chunk;
+	}
+	else
+		list->head = chunk;
+	list->tail = chunk;
+}
+
+/*
+	Reserve space for a node with extra bytes of data at the end of
+	the list; node_data() returns where the data should go. Nothing
+	that can throw may happen between this and fz_append_display_node.
+*/
+static fz_display_node *
+fz_new_display_node(fz_context *ctx, fz_display_list *list, fz_display_command cmd, const fz_matrix *ctm,
+	fz_colorspace *colorspace, float *color, float alpha, int extra)
+{
+	fz_display_chunk *chunk;
+	fz_display_chunk *block = NULL;
+	fz_display_node *node;
+	int ncolor = colorspace ? colorspace->n : 0;
+	int size = ALIGN_NODE(sizeof(fz_display_node) + ncolor * sizeof(float)) + ALIGN_NODE(extra);
+	int cs, i;
+
+	cs = fz_keep_display_ref(ctx, list, FZ_REF_COLORSPACE, colorspace);
+
+	chunk = list->tail;
+	if (!chunk || chunk->len + size + (int)sizeof(fz_display_node) > chunk->cap)
+	{
+		if (extra >= BLOCK_MIN)
+		{
+			block = fz_malloc(ctx, sizeof(fz_display_chunk) + extra);
+			block->next = list->blocks;
+			block->data = (unsigned char *)(block + 1);
+			block->len = block->cap = extra;
+			list->blocks = block;
+			size -= ALIGN_NODE(extra);
+		}
+		if (!chunk || chunk->len + size + (int)sizeof(fz_display_node) > chunk->cap)
+		{
+			fz_new_display_chunk(ctx, list, size);
+			chunk = list->tail;
+		}
+	}
+
+	node = (fz_display_node *)(chunk_data(chunk) + chunk->len);
 	node->cmd = cmd;
-	node->next = NULL;
-	node->rect = fz_empty_rect;
-	node->item.path = NULL;
-	node->stroke = NULL;
 	node->flag = 0;
+	node->ncolor = ncolor;
+	node->size = size;
+	node->rect = fz_empty_rect;
 	node->ctm = *ctm;
-	if (colorspace)
+	node->alpha = alpha;
+	node->colorspace = cs;
+	node->stroke = -1;
+	node->ref = -1;
+	node->big = 0;
+	if (block)
 	{
-		node->colorspace = fz_keep_colorspace(ctx, colorspace);
-		if (color)
-		{
-			for (i = 0; i < node->colorspace->n; i++)
-				node->color[i] = color[i];
-		}
+		node->big = 1;
+		node->item.data = chunk_data(block);
 	}
-	else
+	if (color)
 	{
-		node->colorspace = NULL;
+		for (i = 0; i < ncolor; i++)
+			node_color(node)[i] = color[i];
 	}
-	node->alpha = alpha;
 
 	return node;
 }
 
 static void
-fz_append_display_node(fz_display_list *list, fz_display_node *node)
+fz_append_display_node(fz_context *ctx, fz_display_list *list, fz_display_node *node)
 {
+	/* The list is growing again; any index is out of date */
+	if (list->skip)
+	{
+		fz_free(ctx, list->skip);
+		list->skip = NULL;
+		list->skip_len = 0;
+	}
+
 	switch (node->cmd)
 	{
 	case FZ_CMD_CLIP_PATH:
@@ -107,7 +447,7 @@ fz_append_display_node(fz_display_list *list, fz_display_node *node)
 	case FZ_CMD_CLIP_IMAGE_MASK:
 		if (list->top < STACK_SIZE)
 		{
-			list->stack[list->top].update = &node->rect;
+			list->stack[list->top].update = node;
 			list->stack[list->top].rect = fz_empty_rect;
 		}
 		list->top++;
@@ -142,15 +482,15 @@ fz_append_display_node(fz_display_list *list, fz_display_node *node)
 		}
 		else if (list->top > 0)
 		{
-			fz_rect *update;
+			fz_display_node *update;
 			list->top--;
 			update = list->stack[list->top].update;
 			if (list->tiled == 0)
 			{
 				if (update)
 				{
-					fz_intersect_rect(update, &list->stack[list->top].rect);
-					node->rect = *update;
+					fz_intersect_rect(&update->rect, &list->stack[list->top].rect);
+					node->rect = update->rect;
 				}
 				else
 					node->rect = list->stack[list->top].rect;
@@ -165,372 +505,673 @@ fz_append_display_node(fz_display_list *list, fz_display_node *node)
 		break;
 	}
 	if (!list->first)
-	{
 		list->first = node;
-		list->last = node;
-	}
-	else
-	{
-		list->last->next = node;
-		list->last = node;
-	}
+	list->last = node;
+	list->tail->len += node->size;
 	list->len++;
 }
 
+static int
+fz_display_path_size(fz_path *path)
+{
+	return sizeof(fz_path) + path->len * sizeof(fz_path_item);
+}
+
+/* The items follow the path; items itself is only filled in on replay */
 static void
-fz_free_display_node(fz_context *ctx, fz_display_node *node)
+fz_copy_display_path(fz_display_node *node, fz_path *old)
 {
-	switch (node->cmd)
-	{
-	case FZ_CMD_FILL_PATH:
-	case FZ_CMD_STROKE_PATH:
-	case FZ_CMD_CLIP_PATH:
-	case FZ_CMD_CLIP_STROKE_PATH:
-		fz_free_path(ctx, node->item.path);
-		break;
-	case FZ_CMD_FILL_TEXT:
-	case FZ_CMD_STROKE_TEXT:
-	case FZ_CMD_CLIP_TEXT:
-	case FZ_CMD_CLIP_STROKE_TEXT:
-	case FZ_CMD_IGNORE_TEXT:
-		fz_free_text(ctx, node->item.text);
-		break;
-	case FZ_CMD_FILL_SHADE:
-		fz_drop_shade(ctx, node->item.shade);
-		break;
-	case FZ_CMD_FILL_IMAGE:
-	case FZ_CMD_FILL_IMAGE_MASK:
-	case FZ_CMD_CLIP_IMAGE_MASK:
-		fz_drop_image(ctx, node->item.image);
-		break;
-	case FZ_CMD_POP_CLIP:
-	case FZ_CMD_BEGIN_MASK:
-	case FZ_CMD_END_MASK:
-	case FZ_CMD_BEGIN_GROUP:
-	case FZ_CMD_END_GROUP:
-	case FZ_CMD_BEGIN_TILE:
-	case FZ_CMD_END_TILE:
-		break;
-	}
-	if (node->stroke)
-		fz_drop_stroke_state(ctx, node->stroke);
-	if (node->colorspace)
-		fz_drop_colorspace(ctx, node->colorspace);
-	fz_free(ctx, node);
+	fz_path *path = node_data(node);
+
+	path->len = old->len;
+	path->cap = old->len;
+	path->last = old->last;
+	path->items = NULL;
+	memcpy(path + 1, old->items, old->len * sizeof(fz_path_item));
+}
+
+static fz_path *
+fz_display_path(fz_display_node *node, fz_path *path)
+{
+	fz_path *data = node_data(node);
+	*path = *data;
+	path->items = (fz_path_item *)(data + 1);
+	return path;
+}
+
+static int
+fz_display_text_size(fz_text *text)
+{
+	return sizeof(fz_text) + text->len * sizeof(fz_text_item);
+}
+
+/* The font must already be held by the list */
+static void
+fz_copy_display_text(fz_display_node *node, fz_text *old)
+{
+	fz_text *text = node_data(node);
+
+	text->font = old->font;
+	text->trm = old->trm;
+	text->wmode = old->wmode;
+	text->len = old->len;
+	text->cap = old->len;
+	text->items = NULL;
+	memcpy(text + 1, old->items, old->len * sizeof(fz_text_item));
+}
+
+static fz_text *
+fz_display_text(fz_display_list *list, fz_display_node *node, fz_text *text)
+{
+	fz_text *data = node_data(node);
+	*text = *data;
+	text->font = node_ref(list, node->ref);
+	text->items = (fz_text_item *)(data + 1);
+	return text;
 }
 
 static void
 fz_list_fill_path(fz_device *dev, fz_path *path, int even_odd, const fz_matrix *ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
 {
-	fz_display_node *node;
 	fz_context *ctx = dev->ctx;
-	node = fz_new_display_node(ctx, FZ_CMD_FILL_PATH, ctm, colorspace, color, alpha);
-	fz_try(ctx)
-	{
-		fz_bound_path(dev->ctx, path, NULL, ctm, &node->rect);
-		node->item.path = fz_clone_path(dev->ctx, path);
-		node->flag = even_odd;
-	}
-	fz_catch(ctx)
-	{
-		fz_free_display_node(ctx, node);
-		fz_rethrow(ctx);
-	}
-	fz_append_display_node(dev->user, node);
+	fz_display_list *list = dev->user;
+	fz_display_node *node;
+	fz_rect rect;
+
+	fz_bound_path(ctx, path, NULL, ctm, &rect);
+	node = fz_new_display_node(ctx, list, FZ_CMD_FILL_PATH, ctm, colorspace, color, alpha, fz_display_path_size(path));
+	node->rect = rect;
+	fz_copy_display_path(node, path);
+	node->flag = even_odd;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_stroke_path(fz_device *dev, fz_path *path, fz_stroke_state *stroke,
 	const fz_matrix *ctm, fz_colorspace *colorspace, float *color, float alpha)
 {
-	fz_display_node *node;
 	fz_context *ctx = dev->ctx;
-	node = fz_new_display_node(ctx, FZ_CMD_STROKE_PATH, ctm, colorspace, color, alpha);
-	fz_try(ctx)
-	{
-		fz_bound_path(dev->ctx, path, stroke, ctm, &node->rect);
-		node->item.path = fz_clone_path(dev->ctx, path);
-		node->stroke = fz_keep_stroke_state(dev->ctx, stroke);
-	}
-	fz_catch(ctx)
-	{
-		fz_free_display_node(ctx, node);
-		fz_rethrow(ctx);
-	}
-	fz_append_display_node(dev->user, node);
+	fz_display_list *list = dev->user;
+	fz_display_node *node;
+	fz_rect rect;
+	int stroke_ref;
+
+	fz_bound_path(ctx, path, stroke, ctm, &rect);
+	stroke_ref = fz_keep_display_stroke(ctx, list, stroke);
+	node = fz_new_display_node(ctx, list, FZ_CMD_STROKE_PATH, ctm, colorspace, color, alpha, fz_display_path_size(path));
+	node->rect = rect;
+	fz_copy_display_path(node, path);
+	node->stroke = stroke_ref;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_clip_path(fz_device *dev, fz_path *path, const fz_rect *rect, int even_odd, const fz_matrix *ctm)
 {
-	fz_display_node *node;
 	fz_context *ctx = dev->ctx;
-	node = fz_new_display_node(ctx, FZ_CMD_CLIP_PATH, ctm, NULL, NULL, 0);
-	fz_try(ctx)
-	{
-		fz_bound_path(dev->ctx, path, NULL, ctm, &node->rect);
-		if (rect)
-			fz_intersect_rect(&node->rect, rect);
-		node->item.path = fz_clone_path(dev->ctx, path);
-		node->flag = even_odd;
-	}
-	fz_catch(ctx)
-	{
-		fz_free_display_node(ctx, node);
-		fz_rethrow(ctx);
-	}
-	fz_append_display_node(dev->user, node);
+	fz_display_list *list = dev->user;
+	fz_display_node *node;
+	fz_rect bbox;
+
+	fz_bound_path(ctx, path, NULL, ctm, &bbox);
+	if (rect)
+		fz_intersect_rect(&bbox, rect);
+	node = fz_new_display_node(ctx, list, FZ_CMD_CLIP_PATH, ctm, NULL, NULL, 0, fz_display_path_size(path));
+	node->rect = bbox;
+	fz_copy_display_path(node, path);
+	node->flag = even_odd;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_clip_stroke_path(fz_device *dev, fz_path *path, const fz_rect *rect, fz_stroke_state *stroke, const fz_matrix *ctm)
 {
-	fz_display_node *node;
 	fz_context *ctx = dev->ctx;
-	node = fz_new_display_node(ctx, FZ_CMD_CLIP_STROKE_PATH, ctm, NULL, NULL, 0);
-	fz_try(ctx)
-	{
-		fz_bound_path(dev->ctx, path, stroke, ctm, &node->rect);
-		if (rect)
-			fz_intersect_rect(&node->rect, rect);
-		node->item.path = fz_clone_path(dev->ctx, path);
-		node->stroke = fz_keep_stroke_state(dev->ctx, stroke);
-	}
-	fz_catch(ctx)
-	{
-		fz_free_display_node(ctx, node);
-		fz_rethrow(ctx);
-	}
-	fz_append_display_node(dev->user, node);
+	fz_display_list *list = dev->user;
+	fz_display_node *node;
+	fz_rect bbox;
+	int stroke_ref;
+
+	fz_bound_path(ctx, path, stroke, ctm, &bbox);
+	if (rect)
+		fz_intersect_rect(&bbox, rect);
+	stroke_ref = fz_keep_display_stroke(ctx, list, stroke);
+	node = fz_new_display_node(ctx, list, FZ_CMD_CLIP_STROKE_PATH, ctm, NULL, NULL, 0, fz_display_path_size(path));
+	node->rect = bbox;
+	fz_copy_display_path(node, path);
+	node->stroke = stroke_ref;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_fill_text(fz_device *dev, fz_text *text, const fz_matrix *ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
 {
-	fz_display_node *node;
 	fz_context *ctx = dev->ctx;
-	node = fz_new_display_node(ctx, FZ_CMD_FILL_TEXT, ctm, colorspace, color, alpha);
-	fz_try(ctx)
-	{
-		fz_bound_text(dev->ctx, text, ctm, &node->rect);
-		node->item.text = fz_clone_text(dev->ctx, text);
-	}
-	fz_catch(ctx)
-	{
-		fz_free_display_node(ctx, node);
-		fz_rethrow(ctx);
-	}
-	fz_append_display_node(dev->user, node);
+	fz_display_list *list = dev->user;
+	fz_display_node *node;
+	fz_rect rect;
+	int font;
+
+	fz_bound_text(ctx, text, ctm, &rect);
+	font = fz_keep_display_ref(ctx, list, FZ_REF_FONT, text->font);
+	node = fz_new_display_node(ctx, list, FZ_CMD_FILL_TEXT, ctm, colorspace, color, alpha, fz_display_text_size(text));
+	node->rect = rect;
+	fz_copy_display_text(node, text);
+	node->ref = font;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
 {
-	fz_display_node *node;
 	fz_context *ctx = dev->ctx;
-	node = fz_new_display_node(ctx, FZ_CMD_STROKE_TEXT, ctm, colorspace, color, alpha);
-	node->item.text = NULL;
-	fz_try(ctx)
-	{
-		fz_bound_text(dev->ctx, text, ctm, &node->rect);
-		fz_adjust_rect_for_stroke(&node->rect, stroke, ctm);
-		node->item.text = fz_clone_text(dev->ctx, text);
-		node->stroke = fz_keep_stroke_state(dev->ctx, stroke);
-	}
-	fz_catch(ctx)
-	{
-		fz_free_display_node(ctx, node);
-		fz_rethrow(ctx);
-	}
-	fz_append_display_node(dev->user, node);
+	fz_display_list *list = dev->user;
+	fz_display_node *node;
+	fz_rect rect;
+	int stroke_ref;
+	int font;
+
+	fz_bound_text(ctx, text, ctm, &rect);
+	fz_adjust_rect_for_stroke(&rect, stroke, ctm);
+	font = fz_keep_display_ref(ctx, list, FZ_REF_FONT, text->font);
+	stroke_ref = fz_keep_display_stroke(ctx, list, stroke);
+	node = fz_new_display_node(ctx, list, FZ_CMD_STROKE_TEXT, ctm, colorspace, color, alpha, fz_display_text_size(text));
+	node->rect = rect;
+	fz_copy_display_text(node, text);
+	node->ref = font;
+	node->stroke = stroke_ref;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_clip_text(fz_device *dev, fz_text *text, const fz_matrix *ctm, int accumulate)
 {
+	fz_context *ctx = dev->ctx;
+	fz_display_list *list = dev->user;
 	fz_display_node *node;
+	fz_rect rect;
+	int font;
+
+	fz_bound_text(ctx, text, ctm, &rect);
+	/* when accumulating, be conservative about culling */
+	if (accumulate)
+		rect = fz_infinite_rect;
+	font = fz_keep_display_ref(ctx, list, FZ_REF_FONT, text->font);
+	node = fz_new_display_node(ctx, list, FZ_CMD_CLIP_TEXT, ctm, NULL, NULL, 0, fz_display_text_size(text));
+	node->rect = rect;
+	fz_copy_display_text(node, text);
+	node->ref = font;
+	node->flag = accumulate;
+	fz_append_display_node(ctx, list, node);
+}
+
+static void
+fz_list_clip_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm)
+{
 	fz_context *ctx = dev->ctx;
-	node = fz_new_display_node(ctx, FZ_CMD_CLIP_TEXT, ctm, NULL, NULL, 0);
-	fz_try(ctx)
-	{
-		fz_bound_text(dev->ctx, text, ctm, &node->rect);
-		node->item.text = fz_clone_text(dev->ctx, text);
-		node->flag = accumulate;
-		/* when accumulating, be conservative about culling */
-		if (accumulate)
-			node->rect = fz_infinite_rect;
-	}
-	fz_catch(ctx)
-	{
-		fz_free_display_node(ctx, node);
-		fz_rethrow(ctx);
-	}
-	fz_append_display_node(dev->user, node);
-}
-
-static void
-fz_list_clip_stroke_text(fz_device *dev, fz_text *text, fz_stroke_state *stroke, const fz_matrix *ctm)
-{
+	fz_display_list *list = dev->user;
 	fz_display_node *node;
-	fz_context *ctx = dev->ctx;
-	node = fz_new_display_node(ctx, FZ_CMD_CLIP_STROKE_TEXT, ctm, NULL, NULL, 0);
-	fz_try(ctx)
-	{
-		fz_bound_text(dev->ctx, text, ctm, &node->rect);
-		fz_adjust_rect_for_stroke(&node->rect, stroke, ctm);
-		node->item.text = fz_clone_text(dev->ctx, text);
-		node->stroke = fz_keep_stroke_state(dev->ctx, stroke);
-	}
-	fz_catch(ctx)
-	{
-		fz_free_display_node(ctx, node);
-		fz_rethrow(ctx);
-	}
-	fz_append_display_node(dev->user, node);
+	fz_rect rect;
+	int stroke_ref;
+	int font;
+
+	fz_bound_text(ctx, text, ctm, &rect);
+	fz_adjust_rect_for_stroke(&rect, stroke, ctm);
+	font = fz_keep_display_ref(ctx, list, FZ_REF_FONT, text->font);
+	stroke_ref = fz_keep_display_stroke(ctx, list, stroke);
+	node = fz_new_display_node(ctx, list, FZ_CMD_CLIP_STROKE_TEXT, ctm, NULL, NULL, 0, fz_display_text_size(text));
+	node->rect = rect;
+	fz_copy_display_text(node, text);
+	node->ref = font;
+	node->stroke = stroke_ref;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_ignore_text(fz_device *dev, fz_text *text, const fz_matrix *ctm)
 {
-	fz_display_node *node;
 	fz_context *ctx = dev->ctx;
-	node = fz_new_display_node(ctx, FZ_CMD_IGNORE_TEXT, ctm, NULL, NULL, 0);
-	fz_try(ctx)
-	{
-		fz_bound_text(dev->ctx, text, ctm, &node->rect);
-		node->item.text = fz_clone_text(dev->ctx, text);
-	}
-	fz_catch(ctx)
-	{
-		fz_free_display_node(ctx, node);
-		fz_rethrow(ctx);
-	}
-	fz_append_display_node(dev->user, node);
+	fz_display_list *list = dev->user;
+	fz_display_node *node;
+	fz_rect rect;
+	int font;
+
+	fz_bound_text(ctx, text, ctm, &rect);
+	font = fz_keep_display_ref(ctx, list, FZ_REF_FONT, text->font);
+	node = fz_new_display_node(ctx, list, FZ_CMD_IGNORE_TEXT, ctm, NULL, NULL, 0, fz_display_text_size(text));
+	node->rect = rect;
+	fz_copy_display_text(node, text);
+	node->ref = font;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_pop_clip(fz_device *dev)
 {
 	fz_display_node *node;
-	node = fz_new_display_node(dev->ctx, FZ_CMD_POP_CLIP, &fz_identity, NULL, NULL, 0);
-	fz_append_display_node(dev->user, node);
+	node = fz_new_display_node(dev->ctx, dev->user, FZ_CMD_POP_CLIP, &fz_identity, NULL, NULL, 0, 0);
+	fz_append_display_node(dev->ctx, dev->user, node);
 }
 
 static void
 fz_list_fill_shade(fz_device *dev, fz_shade *shade, const fz_matrix *ctm, float alpha)
 {
-	fz_display_node *node;
 	fz_context *ctx = dev->ctx;
-	node = fz_new_display_node(ctx, FZ_CMD_FILL_SHADE, ctm, NULL, NULL, alpha);
-	fz_bound_shade(ctx, shade, ctm, &node->rect);
-	node->item.shade = fz_keep_shade(ctx, shade);
-	fz_append_display_node(dev->user, node);
+	fz_display_list *list = dev->user;
+	fz_display_node *node;
+	fz_rect rect;
+	int ref;
+
+	fz_bound_shade(ctx, shade, ctm, &rect);
+	ref = fz_keep_display_ref(ctx, list, FZ_REF_SHADE, shade);
+	node = fz_new_display_node(ctx, list, FZ_CMD_FILL_SHADE, ctm, NULL, NULL, alpha, 0);
+	node->rect = rect;
+	node->ref = ref;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_fill_image(fz_device *dev, fz_image *image, const fz_matrix *ctm, float alpha)
 {
+	fz_context *ctx = dev->ctx;
+	fz_display_list *list = dev->user;
 	fz_display_node *node;
-	node = fz_new_display_node(dev->ctx, FZ_CMD_FILL_IMAGE, ctm, NULL, NULL, alpha);
+	int ref;
+
+	ref = fz_keep_display_ref(ctx, list, FZ_REF_IMAGE, image);
+	node = fz_new_display_node(ctx, list, FZ_CMD_FILL_IMAGE, ctm, NULL, NULL, alpha, 0);
 	node->rect = fz_unit_rect;
 	fz_transform_rect(&node->rect, ctm);
-	node->item.image = fz_keep_image(dev->ctx, image);
-	fz_append_display_node(dev->user, node);
+	node->ref = ref;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_fill_image_mask(fz_device *dev, fz_image *image, const fz_matrix *ctm,
 	fz_colorspace *colorspace, float *color, float alpha)
 {
+	fz_context *ctx = dev->ctx;
+	fz_display_list *list = dev->user;
 	fz_display_node *node;
-	node = fz_new_display_node(dev->ctx, FZ_CMD_FILL_IMAGE_MASK, ctm, colorspace, color, alpha);
+	int ref;
+
+	ref = fz_keep_display_ref(ctx, list, FZ_REF_IMAGE, image);
+	node = fz_new_display_node(ctx, list, FZ_CMD_FILL_IMAGE_MASK, ctm, colorspace, color, alpha, 0);
 	node->rect = fz_unit_rect;
 	fz_transform_rect(&node->rect, ctm);
-	node->item.image = fz_keep_image(dev->ctx, image);
-	fz_append_display_node(dev->user, node);
+	node->ref = ref;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_clip_image_mask(fz_device *dev, fz_image *image, const fz_rect *rect, const fz_matrix *ctm)
 {
+	fz_context *ctx = dev->ctx;
+	fz_display_list *list = dev->user;
 	fz_display_node *node;
-	node = fz_new_display_node(dev->ctx, FZ_CMD_CLIP_IMAGE_MASK, ctm, NULL, NULL, 0);
+	int ref;
+
+	ref = fz_keep_display_ref(ctx, list, FZ_REF_IMAGE, image);
+	node = fz_new_display_node(ctx, list, FZ_CMD_CLIP_IMAGE_MASK, ctm, NULL, NULL, 0, 0);
 	node->rect = fz_unit_rect;
 	fz_transform_rect(&node->rect, ctm);
 	if (rect)
 		fz_intersect_rect(&node->rect, rect);
-	node->item.image = fz_keep_image(dev->ctx, image);
-	fz_append_display_node(dev->user, node);
+	node->ref = ref;
+	fz_append_display_node(ctx, list, node);
 }
 
 static void
 fz_list_begin_mask(fz_device *dev, const fz_rect *rect, int luminosity, fz_colorspace *colorspace, float *color)
 {
 	fz_display_node *node;
-	node = fz_new_display_node(dev->ctx, FZ_CMD_BEGIN_MASK, &fz_identity, colorspace, color, 0);
+	node = fz_new_display_node(dev->ctx, dev->user, FZ_CMD_BEGIN_MASK, &fz_identity, colorspace, color, 0, 0);
 	node->rect = *rect;
 	node->flag = luminosity;
-	fz_append_display_node(dev->user, node);
+	fz_append_display_node(dev->ctx, dev->user, node);
 }
 
 static void
 fz_list_end_mask(fz_device *dev)
 {
 	fz_display_node *node;
-	node = fz_new_display_node(dev->ctx, FZ_CMD_END_MASK, &fz_identity, NULL, NULL, 0);
-	fz_append_display_node(dev->user, node);
+	node = fz_new_display_node(dev->ctx, dev->user, FZ_CMD_END_MASK, &fz_identity, NULL, NULL, 0, 0);
+	fz_append_display_node(dev->ctx, dev->user, node);
 }
 
 static void
 fz_list_begin_group(fz_device *dev, const fz_rect *rect, int isolated, int knockout, int blendmode, float alpha)
 {
 	fz_display_node *node;
-	node = fz_new_display_node(dev->ctx, FZ_CMD_BEGIN_GROUP, &fz_identity, NULL, NULL, alpha);
+	node = fz_new_display_node(dev->ctx, dev->user, FZ_CMD_BEGIN_GROUP, &fz_identity, NULL, NULL, alpha, 0);
 	node->rect = *rect;
 	node->item.blendmode = blendmode;
 	node->flag |= isolated ? ISOLATED : 0;
 	node->flag |= knockout ? KNOCKOUT : 0;
-	fz_append_display_node(dev->user, node);
+	fz_append_display_node(dev->ctx, dev->user, node);
 }
 
 static void
 fz_list_end_group(fz_device *dev)
 {
 	fz_display_node *node;
-	node = fz_new_display_node(dev->ctx, FZ_CMD_END_GROUP, &fz_identity, NULL, NULL, 0);
-	fz_append_display_node(dev->user, node);
+	node = fz_new_display_node(dev->ctx, dev->user, FZ_CMD_END_GROUP, &fz_identity, NULL, NULL, 0, 0);
+	fz_append_display_node(dev->ctx, dev->user, node);
 }
 
 static void
 fz_list_begin_tile(fz_device *dev, const fz_rect *area, const fz_rect *view, float xstep, float ystep, const fz_matrix *ctm)
 {
 	fz_display_node *node;
-	node = fz_new_display_node(dev->ctx, FZ_CMD_BEGIN_TILE, ctm, NULL, NULL, 0);
+	float *data;
+	node = fz_new_display_node(dev->ctx, dev->user, FZ_CMD_BEGIN_TILE, ctm, NULL, NULL, 0, 6 * sizeof(float));
 	node->rect = *area;
-	node->color[0] = xstep;
-	node->color[1] = ystep;
-	node->color[2] = view->x0;
-	node->color[3] = view->y0;
-	node->color[4] = view->x1;
-	node->color[5] = view->y1;
-	fz_append_display_node(dev->user, node);
+	data = node_data(node);
+	data[0] = xstep;
+	data[1] = ystep;
+	data[2] = view->x0;
+	data[3] = view->y0;
+	data[4] = view->x1;
+	data[5] = view->y1;
+	fz_append_display_node(dev->ctx, dev->user, node);
 }
 
 static void
 fz_list_end_tile(fz_device *dev)
 {
 	fz_display_node *node;
-	node = fz_new_display_node(dev->ctx, FZ_CMD_END_TILE, &fz_identity, NULL, NULL, 0);
-	fz_append_display_node(dev->user, node);
+	node = fz_new_display_node(dev->ctx, dev->user, FZ_CMD_END_TILE, &fz_identity, NULL, NULL, 0, 0);
+	fz_append_display_node(dev->ctx, dev->user, node);
+}
+
+static int
+is_opener(fz_display_node *node)
+{
+	switch (node->cmd)
+	{
+	case FZ_CMD_CLIP_PATH:
+	case FZ_CMD_CLIP_STROKE_PATH:
+	case FZ_CMD_CLIP_STROKE_TEXT:
+	case FZ_CMD_CLIP_IMAGE_MASK:
+	case FZ_CMD_BEGIN_MASK:
+	case FZ_CMD_BEGIN_GROUP:
+	case FZ_CMD_BEGIN_TILE:
+		return 1;
+	case FZ_CMD_CLIP_TEXT:
+		/* Accumulated text has no extra pops */
+		return node->flag != 2;
+	default:
+		return 0;
+	}
+}
+
+static int
+closes(fz_display_node *node, fz_display_node *opener)
+{
+	switch (node->cmd)
+	{
+	case FZ_CMD_POP_CLIP:
+		return opener->cmd != FZ_CMD_BEGIN_GROUP && opener->cmd != FZ_CMD_BEGIN_TILE;
+	case FZ_CMD_END_GROUP:
+		return opener->cmd == FZ_CMD_BEGIN_GROUP;
+	case FZ_CMD_END_TILE:
+		return opener->cmd == FZ_CMD_BEGIN_TILE;
+	default:
+		return 0;
+	}
+}
+
+static int
+cmp_skip(const void *a_, const void *b_)
+{
+	const fz_display_skip *a = a_;
+	const fz_display_skip *b = b_;
+	if (a->first != b->first)
+		return a->first - b->first;
+	/* Largest run first */
+	return b->last - a->last;
+}
+
+static void
+fz_add_display_skip(fz_context *ctx, fz_display_list *list, int *cap, int first, int last, fz_display_node *node, const fz_rect *rect)
+{
+	fz_display_skip *skip;
+
+	if (list->skip_len == *cap)
+	{
+		int newcap = *cap ? *cap * 2 : 256;
+		list->skip = fz_resize_array(ctx, list->skip, newcap, sizeof(fz_display_skip));
+		*cap = newcap;
+	}
+	skip = &list->skip[list->skip_len++];
+	skip->first = first;
+	skip->last = last;
+	skip->node = node;
+	skip->rect = *rect;
+}
+
+/*
+	Match openers with their pops, filling in end[i] as the index just
+	after the subtree starting at node i (n + 1 for an opener that is
+	never popped). Returns 0 if the nesting is broken.
+*/
+static int
+fz_match_display_nodes(fz_display_list *list, fz_display_node **nodes, int *end, int *stack)
+{
+	fz_display_node *node;
+	int i, depth = 0;
+
+	for (i = 0, node = list->first; node; node = fz_next_display_node(list, node), i++)
+	{
+		nodes[i] = node;
+		end[i] = i + 1;
+		if (is_opener(node))
+			stack[depth++] = i;
+		else if (node->cmd == FZ_CMD_POP_CLIP || node->cmd == FZ_CMD_END_GROUP || node->cmd == FZ_CMD_END_TILE)
+		{
+			if (depth == 0 || !closes(node, nodes[stack[depth-1]]))
+				return 0;
+			end[stack[--depth]] = i + 1;
+		}
+	}
+	while (depth > 0)
+		end[stack[--depth]] = i + 1;
+	return 1;
+}
+
+static void
+fz_index_display_runs(fz_context *ctx, fz_display_list *list, fz_display_node **nodes, int *end, int *work, int *sib, fz_rect *rects)
+{
+	int n = list->len;
+	int cap = 0;
+	int top = 0;
+
+	/* Index each run of siblings, starting with the top level and
+	 * working inwards. */
+	work[top++] = 0;
+	work[top++] = n;
+	while (top > 0)
+	{
+		int e = work[--top];
+		int s = work[--top];
+		int count = 0;
+		int i, k, size;
+
+		for (i = s; i < e; i = end[i])
+		{
+			fz_display_node *node = nodes[i];
+
+			sib[count] = i;
+			if (node->cmd == FZ_CMD_BEGIN_TILE || node->cmd == FZ_CMD_END_MASK)
+			{
+				/* Tiles (and anything in them) are never culled,
+				 * and the end of a mask always runs unless we are
+				 * clipped. */
+				rects[count] = fz_infinite_rect;
+			}
+			else
+			{
+				rects[count] = node->rect;
+				if (end[i] > i + 2)
+				{
+					/* The contents run up to the pop */
+					work[top++] = i + 1;
+					work[top++] = end[i] - 1;
+				}
+			}
+			count++;
+		}
+
+		/* Fold the rects into blocks of 16, 256, ... siblings; after
+		 * each pass rects[k] covers block k at that size. */
+		for (size = 1 << SKIP_BLOCK_BITS; size >> SKIP_BLOCK_BITS < count; size <<= SKIP_BLOCK_BITS)
+		{
+			int step = size >> SKIP_BLOCK_BITS;
+
+			for (k = 0; k < count; k += size)
+			{
+				int q = k + size < count ? k + size : count;
+				fz_rect rect = rects[k / step];
+				int j, first, last;
+
+				for (j = k + step; j < q; j += step)
+					fz_union_rect(&rect, &rects[j / step]);
+				rects[k / size] = rect;
+
+				/* Skip runs that the level below already covers */
+				if (step > 1 && q - k <= step)
+					continue;
+				first = sib[k];
+				last = end[sib[q-1]] - 1;
+				if (last >= n)
+					last = n - 1;
+				if (last > first)
+					fz_add_display_skip(ctx, list, &cap, first, last, nodes[last], &rect);
+			}
+		}
+	}
+
+	qsort(list->skip, list->skip_len, sizeof(fz_display_skip), cmp_skip);
+}
+
+static void
+fz_index_display_list(fz_context *ctx, fz_display_list *list)
+{
+	fz_display_node **nodes = NULL;
+	int *end = NULL;
+	int *work = NULL;
+	int *sib = NULL;
+	fz_rect *rects = NULL;
+	int n = list->len;
+
+	if (list->skip || n < SKIP_MIN_NODES)
+		return;
+
+	fz_var(nodes);
+	fz_var(end);
+	fz_var(work);
+	fz_var(sib);
+	fz_var(rects);
+
+	fz_try(ctx)
+	{
+		nodes = fz_malloc_array(ctx, n, sizeof(fz_display_node *));
+		end = fz_malloc_array(ctx, n, sizeof(int));
+		work = fz_malloc_array(ctx, 2 * n + 2, sizeof(int));
+		sib = fz_malloc_array(ctx, n, sizeof(int));
+		rects = fz_malloc_array(ctx, n, sizeof(fz_rect));
+
+		/* Lists with broken nesting are left unindexed */
+		if (fz_match_display_nodes(list, nodes, end, work))
+			fz_index_display_runs(ctx, list, nodes, end, work, sib, rects);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, nodes);
+		fz_free(ctx, end);
+		fz_free(ctx, work);
+		fz_free(ctx, sib);
+		fz_free(ctx, rects);
+	}
+	fz_catch(ctx)
+	{
+		/* The index is only an optimisation */
+		fz_free(ctx, list->skip);
+		list->skip = NULL;
+		list->skip_len = 0;
+	}
+}
+
+static fz_display_node *
+fz_move_display_node(fz_display_chunk *from, fz_display_chunk *to, fz_display_node *node)
+{
+	unsigned char *p = (unsigned char *)node;
+	if (p >= chunk_data(from) && p < chunk_data(from) + from->len)
+		return (fz_display_node *)(chunk_data(to) + (p - chunk_data(from)));
+	return node;
+}
+
+/*
+	Give back the unused end of the last chunk, keeping room for a link
+	in case more nodes are added later.
+*/
+static void
+fz_trim_display_list(fz_context *ctx, fz_display_list *list)
+{
+	fz_display_chunk *tail = list->tail;
+	fz_display_chunk *chunk;
+	int cap, i;
+
+	if (!tail)
+		return;
+	cap = tail->len + sizeof(fz_display_node);
+	if (cap >= tail->cap)
+		return;
+	chunk = fz_malloc_no_throw(ctx, sizeof(fz_display_chunk) + cap);
+	if (!chunk)
+		return;
+	memcpy(chunk, tail, sizeof(fz_display_chunk) + tail->len);
+	chunk->data = (unsigned char *)(chunk + 1);
+	chunk->cap = cap;
+
+	if (list->head == tail)
+		list->head = chunk;
+	else
+	{
+		fz_display_chunk *prev = list->head;
+		fz_display_node *link;
+		while (prev->next != tail)
+			prev = prev->next;
+		prev->next = chunk;
+		link = (fz_display_node *)(chunk_data(prev) + prev->len);
+		link->item.link = (fz_display_node *)chunk_data(chunk);
+	}
+	list->first = fz_move_display_node(tail, chunk, list->first);
+	list->last = fz_move_display_node(tail, chunk, list->last);
+	for (i = 0; i < list->top && i < STACK_SIZE; i++)
+		list->stack[i].update = fz_move_display_node(tail, chunk, list->stack[i].update);
+	list->tail = chunk;
+	fz_free(ctx, tail);
+}
+
+static void
+fz_list_free_user(fz_device *dev)
+{
+	fz_trim_display_list(dev->ctx, dev->user);
+	fz_index_display_list(dev->ctx, dev->user);
 }
 
 fz_device *
 fz_new_list_device(fz_context *ctx, fz_display_list *list)
 {
-	fz_device *dev = fz_new_device(ctx, list);
+	fz_device *dev;
+
+	if (list->map)
+		fz_throw(ctx, "cannot add to a display list loaded from a file");
+	dev = fz_new_device(ctx, list);
 
 	dev->fill_path = fz_list_fill_path;
 	dev->stroke_path = fz_list_stroke_path;
@@ -558,9 +1199,77 @@ fz_new_list_device(fz_context *ctx, fz_display_list *list)
 	dev->begin_tile = fz_list_begin_tile;
 	dev->end_tile = fz_list_end_tile;
 
+	dev->free_user = fz_list_free_user;
+
 	return dev;
 }
 
+static void
+fz_map_display_file(fz_context *ctx, fz_display_list *list, const char *filename)
+{
+#ifdef _WIN32
+	FILE *file;
+	long len;
+
+	file = fopen(filename, "rb");
+	if (!file)
+		fz_throw(ctx, "cannot open file '%s': %s", filename, strerror(errno));
+	fz_try(ctx)
+	{
+		fseek(file, 0, SEEK_END);
+		len = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		if (len < 0 || len > INT_MAX)
+			fz_throw(ctx, "cannot read file '%s': bad size", filename);
+		list->map = fz_malloc(ctx, len ? len : 1);
+		list->map_len = len;
+		if (fread(list->map, 1, len, file) != (size_t)len)
+			fz_throw(ctx, "cannot read file '%s': %s", filename, strerror(errno));
+	}
+	fz_always(ctx)
+	{
+		fclose(file);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+#else
+	struct stat info;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY, 0);
+	if (fd < 0)
+		fz_throw(ctx, "cannot open file '%s': %s", filename, strerror(errno));
+	if (fstat(fd, &info) < 0 || info.st_size <= 0 || info.st_size > INT_MAX)
+	{
+		close(fd);
+		fz_throw(ctx, "cannot map file '%s': bad size", filename);
+	}
+	map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		fz_throw(ctx, "cannot map file '%s': %s", filename, strerror(errno));
+	list->map = map;
+	list->map_len = info.st_size;
+	list->mapped = 1;
+#endif
+}
+
+static void
+fz_unmap_display_file(fz_context *ctx, fz_display_list *list)
+{
+#ifndef _WIN32
+	if (list->mapped)
+		munmap(list->map, list->map_len);
+	else
+#endif
+		fz_free(ctx, list->map);
+	list->map = NULL;
+	list->map_len = 0;
+}
+
 fz_display_list *
 fz_new_display_list(fz_context *ctx)
 {
@@ -568,6 +1277,20 @@ fz_new_display_list(fz_context *ctx)
 	list->first = NULL;
 	list->last = NULL;
 	list->len = 0;
+	list->head = NULL;
+	list->tail = NULL;
+	list->blocks = NULL;
+	list->ref_len = 0;
+	list->ref_cap = 0;
+	list->refs = NULL;
+	list->ref_table = NULL;
+	list->stroke = NULL;
+	list->stroke_ref = -1;
+	list->skip_len = 0;
+	list->skip = NULL;
+	list->map = NULL;
+	list->map_len = 0;
+	list->mapped = 0;
 	list->top = 0;
 	list->tiled = 0;
 	return list;
@@ -576,17 +1299,20 @@ fz_new_display_list(fz_context *ctx)
 void
 fz_free_display_list(fz_context *ctx, fz_display_list *list)
 {
-	fz_display_node *node;
+	int i;
 
 	if (list == NULL)
 		return;
-	node = list->first;
-	while (node)
-	{
-		fz_display_node *next = node->next;
-		fz_free_display_node(ctx, node);
-		node = next;
-	}
+	fz_free_display_chunks(ctx, list->head);
+	fz_free_display_chunks(ctx, list->blocks);
+	for (i = 0; i < list->ref_len; i++)
+		fz_drop_display_ptr(ctx, list->refs[i].kind, list->refs[i].ptr);
+	fz_free(ctx, list->refs);
+	if (list->ref_table)
+		fz_free_hash(ctx, list->ref_table);
+	fz_free(ctx, list->skip);
+	if (list->map)
+		fz_unmap_display_file(ctx, list);
 	fz_free(ctx, list);
 }
 
@@ -594,11 +1320,15 @@ void
 fz_run_display_list(fz_display_list *list, fz_device *dev, const fz_matrix *top_ctm, const fz_rect *scissor, fz_cookie *cookie)
 {
 	fz_display_node *node;
+	fz_display_skip *skip = list->skip;
+	fz_display_skip *skip_end = list->skip + list->skip_len;
 	fz_matrix ctm;
+	fz_path path;
+	fz_text text;
 	int clipped = 0;
 	int tiled = 0;
 	int empty;
-	int progress = 0;
+	int index;
 	fz_context *ctx = dev->ctx;
 
 	if (!scissor)
@@ -610,14 +1340,40 @@ fz_run_display_list(fz_display_list *list, fz_device *dev, const fz_matrix *top_
 		cookie->progress = 0;
 	}
 
-	for (node = list->first; node; node = node->next)
+	for (node = list->first, index = 0; node; node = fz_next_display_node(list, node), index++)
 	{
 		/* Check the cookie for aborting */
 		if (cookie)
 		{
 			if (cookie->abort)
 				break;
-			cookie->progress = progress++;
+			cookie->progress = index;
+		}
+
+		/* skip whole runs of nodes that cannot be visible */
+
+		while (skip < skip_end && skip->first < index)
+			skip++;
+		if (!tiled && skip < skip_end && skip->first == index)
+		{
+			fz_display_skip *run = NULL;
+
+			/* While clipped nothing in a run can be drawn */
+			if (clipped)
+				run = skip;
+			for (; !run && skip < skip_end && skip->first == index; skip++)
+			{
+				fz_rect rect = skip->rect;
+				fz_intersect_rect(fz_transform_rect(&rect, top_ctm), scissor);
+				if (fz_is_empty_rect(&rect))
+					run = skip;
+			}
+			if (run)
+			{
+				node = run->node;
+				index = run->last;
+				continue;
+			}
 		}
 
 		/* cull objects to draw using a quick visibility test */
@@ -673,59 +1429,59 @@ visible:
 			switch (node->cmd)
 			{
 			case FZ_CMD_FILL_PATH:
-				fz_fill_path(dev, node->item.path, node->flag, &ctm,
-					node->colorspace, node->color, node->alpha);
+				fz_fill_path(dev, fz_display_path(node, &path), node->flag, &ctm,
+					node_ref(list, node->colorspace), node_color(node), node->alpha);
 				break;
 			case FZ_CMD_STROKE_PATH:
-				fz_stroke_path(dev, node->item.path, node->stroke, &ctm,
-					node->colorspace, node->color, node->alpha);
+				fz_stroke_path(dev, fz_display_path(node, &path), node_ref(list, node->stroke), &ctm,
+					node_ref(list, node->colorspace), node_color(node), node->alpha);
 				break;
 			case FZ_CMD_CLIP_PATH:
 			{
 				fz_rect rect = node->rect;
 				fz_transform_rect(&rect, top_ctm);
-				fz_clip_path(dev, node->item.path, &rect, node->flag, &ctm);
+				fz_clip_path(dev, fz_display_path(node, &path), &rect, node->flag, &ctm);
 				break;
 			}
 			case FZ_CMD_CLIP_STROKE_PATH:
 			{
 				fz_rect rect = node->rect;
 				fz_transform_rect(&rect, top_ctm);
-				fz_clip_stroke_path(dev, node->item.path, &rect, node->stroke, &ctm);
+				fz_clip_stroke_path(dev, fz_display_path(node, &path), &rect, node_ref(list, node->stroke), &ctm);
 				break;
 			}
 			case FZ_CMD_FILL_TEXT:
-				fz_fill_text(dev, node->item.text, &ctm,
-					node->colorspace, node->color, node->alpha);
+				fz_fill_text(dev, fz_display_text(list, node, &text), &ctm,
+					node_ref(list, node->colorspace), node_color(node), node->alpha);
 				break;
 			case FZ_CMD_STROKE_TEXT:
-				fz_stroke_text(dev, node->item.text, node->stroke, &ctm,
-					node->colorspace, node->color, node->alpha);
+				fz_stroke_text(dev, fz_display_text(list, node, &text), node_ref(list, node->stroke), &ctm,
+					node_ref(list, node->colorspace), node_color(node), node->alpha);
 				break;
 			case FZ_CMD_CLIP_TEXT:
-				fz_clip_text(dev, node->item.text, &ctm, node->flag);
+				fz_clip_text(dev, fz_display_text(list, node, &text), &ctm, node->flag);
 				break;
 			case FZ_CMD_CLIP_STROKE_TEXT:
-				fz_clip_stroke_text(dev, node->item.text, node->stroke, &ctm);
+				fz_clip_stroke_text(dev, fz_display_text(list, node, &text), node_ref(list, node->stroke), &ctm);
 				break;
 			case FZ_CMD_IGNORE_TEXT:
-				fz_ignore_text(dev, node->item.text, &ctm);
+				fz_ignore_text(dev, fz_display_text(list, node, &text), &ctm);
 				break;
 			case FZ_CMD_FILL_SHADE:
-				fz_fill_shade(dev, node->item.shade, &ctm, node->alpha);
+				fz_fill_shade(dev, node_ref(list, node->ref), &ctm, node->alpha);
 				break;
 			case FZ_CMD_FILL_IMAGE:
-				fz_fill_image(dev, node->item.image, &ctm, node->alpha);
+				fz_fill_image(dev, node_ref(list, node->ref), &ctm, node->alpha);
 				break;
 			case FZ_CMD_FILL_IMAGE_MASK:
-				fz_fill_image_mask(dev, node->item.image, &ctm,
-					node->colorspace, node->color, node->alpha);
+				fz_fill_image_mask(dev, node_ref(list, node->ref), &ctm,
+					node_ref(list, node->colorspace), node_color(node), node->alpha);
 				break;
 			case FZ_CMD_CLIP_IMAGE_MASK:
 			{
 				fz_rect rect = node->rect;
 				fz_transform_rect(&rect, top_ctm);
-				fz_clip_image_mask(dev, node->item.image, &rect, &ctm);
+				fz_clip_image_mask(dev, node_ref(list, node->ref), &rect, &ctm);
 				break;
 			}
 			case FZ_CMD_POP_CLIP:
@@ -735,7 +1491,7 @@ visible:
 			{
 				fz_rect rect = node->rect;
 				fz_transform_rect(&rect, top_ctm);
-				fz_begin_mask(dev, &rect, node->flag, node->colorspace, node->color);
+				fz_begin_mask(dev, &rect, node->flag, node_ref(list, node->colorspace), node_color(node));
 				break;
 			}
 			case FZ_CMD_END_MASK:
@@ -756,12 +1512,13 @@ visible:
 			case FZ_CMD_BEGIN_TILE:
 			{
 				fz_rect rect;
+				float *data = node_data(node);
 				tiled++;
-				rect.x0 = node->color[2];
-				rect.y0 = node->color[3];
-				rect.x1 = node->color[4];
-				rect.y1 = node->color[5];
-				fz_begin_tile(dev, &node->rect, &rect, node->color[0], node->color[1], &ctm);
+				rect.x0 = data[2];
+				rect.y0 = data[3];
+				rect.x1 = data[4];
+				rect.y1 = data[5];
+				fz_begin_tile(dev, &node->rect, &rect, data[0], data[1], &ctm);
 				break;
 			}
 			case FZ_CMD_END_TILE:
@@ -779,3 +1536,1136 @@ visible:
 		}
 	}
 }
+
+/*
+	Saved display lists.
+
+	A saved list is a cache for the build that wrote it, not an
+	interchange format. The nodes are written as they are held in
+	memory, so that a loaded file can be mapped and replayed in place;
+	the header records the sizes of the structures involved, so a file
+	from a different build is rejected rather than misread.
+
+	The header is followed by a directory with one entry per resource,
+	then the resources and then the nodes. Each distinct resource is
+	stored once and is identified by the MD5 digest of its contents,
+	so fonts and images used by several resources are shared, both in
+	the file and once loaded.
+
+	Colorspaces are stored by name. Only the device colorspaces can be
+	stored, so colors in any other colorspace are converted to RGB on
+	the way out. Images are stored decoded, at full resolution.
+*/
+
+#define FZ_DISPLAY_FILE_VERSION 1
+
+typedef struct fz_display_file_header_s fz_display_file_header;
+typedef struct fz_display_file_ref_s fz_display_file_ref;
+typedef struct fz_display_file_image_s fz_display_file_image;
+typedef struct fz_display_file_font_s fz_display_file_font;
+typedef struct fz_display_file_type3_s fz_display_file_type3;
+
+struct fz_display_file_header_s
+{
+	char magic[8];
+	int version;
+	int sizes[8];
+	int len; /* number of nodes */
+	int ref_len;
+	int nodes; /* offset of the nodes in the file */
+	int nodes_size;
+};
+
+struct fz_display_file_ref_s
+{
+	int kind;
+	int offset;
+	int size;
+	unsigned char digest[16];
+};
+
+struct fz_display_file_image_s
+{
+	int w, h, n;
+	int interpolate;
+	int xres, yres;
+	char colorspace[16];
+};
+
+struct fz_display_file_font_s
+{
+	int type3; /* followed by a type3 record instead of the font file */
+	char name[32];
+	int substitute, bold, italic, hint;
+	int use_glyph_bbox;
+	int index; /* of the font within the font file */
+	fz_rect bbox;
+	int width_count; /* followed by the width table */
+	int size; /* followed by the font file */
+};
+
+struct fz_display_file_type3_s
+{
+	fz_matrix matrix;
+	float widths[256];
+	unsigned char flags[256];
+	int sizes[256]; /* followed by a saved list for each glyph */
+};
+
+static const char fz_display_file_magic[8] = "MUDLIST";
+
+static void
+fz_display_file_sizes(int *sizes)
+{
+	sizes[0] = sizeof(void *);
+	sizes[1] = sizeof(fz_display_node);
+	sizes[2] = sizeof(fz_path);
+	sizes[3] = sizeof(fz_path_item);
+	sizes[4] = sizeof(fz_text);
+	sizes[5] = sizeof(fz_text_item);
+	sizes[6] = sizeof(fz_stroke_state);
+	sizes[7] = sizeof(fz_shade);
+}
+
+static int
+fz_is_device_colorspace(fz_colorspace *cs)
+{
+	return cs == fz_device_gray || cs == fz_device_rgb || cs == fz_device_bgr || cs == fz_device_cmyk;
+}
+
+static void
+fz_save_colorspace_name(char *name, fz_colorspace *cs)
+{
+	memset(name, 0, 16);
+	if (cs && !fz_is_device_colorspace(cs))
+		cs = fz_device_rgb;
+	if (cs)
+		fz_strlcpy(name, cs->name, 16);
+}
+
+static fz_colorspace *
+fz_load_colorspace_name(fz_context *ctx, char *name)
+{
+	if (!memchr(name, 0, 16))
+		fz_throw(ctx, "bad colorspace in display list file");
+	if (name[0] == 0)
+		return NULL;
+	if (!strcmp(name, "DeviceGray") || !strcmp(name, "DeviceRGB") ||
+		!strcmp(name, "DeviceBGR") || !strcmp(name, "DeviceCMYK"))
+		return fz_find_device_colorspace(ctx, name);
+	fz_throw(ctx, "unknown colorspace '%s' in display list file", name);
+	return NULL;
+}
+
+/* The size of the path, text or tile data owned by a node */
+static int
+fz_display_data_size(fz_display_node *node)
+{
+	switch (node->cmd)
+	{
+	case FZ_CMD_FILL_PATH:
+	case FZ_CMD_STROKE_PATH:
+	case FZ_CMD_CLIP_PATH:
+	case FZ_CMD_CLIP_STROKE_PATH:
+		return fz_display_path_size(node_data(node));
+	case FZ_CMD_FILL_TEXT:
+	case FZ_CMD_STROKE_TEXT:
+	case FZ_CMD_CLIP_TEXT:
+	case FZ_CMD_CLIP_STROKE_TEXT:
+	case FZ_CMD_IGNORE_TEXT:
+		return fz_display_text_size(node_data(node));
+	case FZ_CMD_BEGIN_TILE:
+		return 6 * sizeof(float);
+	default:
+		return 0;
+	}
+}
+
+static void fz_save_display_list(fz_context *ctx, fz_buffer *buf, fz_display_list *list);
+static fz_display_list *fz_load_display_glyph(fz_context *ctx, unsigned char *data, int len);
+
+static void
+fz_write_display_pad(fz_context *ctx, fz_buffer *buf, int align)
+{
+	static unsigned char zeros[16] = { 0 };
+	fz_write_buffer(ctx, buf, zeros, (align - buf->len % align) % align);
+}
+
+static void
+fz_save_display_stroke(fz_context *ctx, fz_buffer *buf, fz_stroke_state *stroke)
+{
+	fz_write_buffer(ctx, buf, (unsigned char *)stroke, offsetof(fz_stroke_state, dash_list));
+	fz_write_buffer(ctx, buf, (unsigned char *)stroke->dash_list, stroke->dash_len * sizeof(float));
+}
+
+static void
+fz_save_display_shade(fz_context *ctx, fz_buffer *buf, fz_shade *shade)
+{
+	fz_colorspace *cs = shade->colorspace;
+	int convert = !fz_is_device_colorspace(cs);
+	fz_shade *copy;
+	char name[16];
+	float color[FZ_MAX_COLORS];
+	int i, count, has_buffer;
+
+	if (convert && !shade->use_function && shade->type != FZ_FUNCTION_BASED)
+		fz_throw(ctx, "cannot save mesh shading in colorspace '%s'", cs->name);
+
+	copy = fz_malloc_struct(ctx, fz_shade);
+	fz_try(ctx)
+	{
+		*copy = *shade;
+		memset(&copy->storable, 0, sizeof(copy->storable));
+		copy->colorspace = NULL;
+		copy->buffer = NULL;
+		if (shade->type == FZ_FUNCTION_BASED)
+			copy->u.f.fn_vals = NULL;
+		if (convert)
+		{
+			fz_convert_color(ctx, fz_device_rgb, copy->background, cs, shade->background);
+			for (i = 0; i < 256; i++)
+			{
+				fz_convert_color(ctx, fz_device_rgb, copy->function[i], cs, shade->function[i]);
+				copy->function[i][3] = shade->function[i][cs->n];
+			}
+		}
+		fz_write_buffer(ctx, buf, (unsigned char *)copy, sizeof(fz_shade));
+		fz_save_colorspace_name(name, cs);
+		fz_write_buffer(ctx, buf, (unsigned char *)name, sizeof name);
+
+		if (shade->type == FZ_FUNCTION_BASED)
+		{
+			count = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1);
+			for (i = 0; i < count; i++)
+			{
+				float *v = shade->u.f.fn_vals + i * cs->n;
+				if (convert)
+				{
+					fz_convert_color(ctx, fz_device_rgb, color, cs, v);
+					fz_write_buffer(ctx, buf, (unsigned char *)color, 3 * sizeof(float));
+				}
+				else
+					fz_write_buffer(ctx, buf, (unsigned char *)v, cs->n * sizeof(float));
+			}
+		}
+
+		has_buffer = shade->buffer != NULL;
+		fz_write_buffer(ctx, buf, (unsigned char *)&has_buffer, sizeof has_buffer);
+		if (has_buffer)
+		{
+			fz_buffer *data = shade->buffer->buffer;
+			fz_write_buffer(ctx, buf, (unsigned char *)&shade->buffer->params, sizeof(fz_compression_params));
+			fz_write_buffer(ctx, buf, (unsigned char *)&data->len, sizeof data->len);
+			fz_write_buffer(ctx, buf, data->data, data->len);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, copy);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+fz_save_display_image(fz_context *ctx, fz_buffer *buf, fz_image *image)
+{
+	fz_display_file_image rec;
+	fz_pixmap *pix = NULL;
+	fz_pixmap *conv = NULL;
+
+	fz_var(pix);
+	fz_var(conv);
+
+	fz_try(ctx)
+	{
+		pix = fz_image_to_pixmap(ctx, image, image->w, image->h);
+		if (pix->colorspace && !fz_is_device_colorspace(pix->colorspace))
+		{
+			conv = fz_new_pixmap(ctx, fz_device_rgb, pix->w, pix->h);
+			fz_convert_pixmap(ctx, conv, pix);
+			conv->interpolate = pix->interpolate;
+			conv->xres = pix->xres;
+			conv->yres = pix->yres;
+			fz_drop_pixmap(ctx, pix);
+			pix = conv;
+			conv = NULL;
+		}
+
+		memset(&rec, 0, sizeof rec);
+		rec.w = pix->w;
+		rec.h = pix->h;
+		rec.n = pix->n;
+		rec.interpolate = pix->interpolate;
+		rec.xres = pix->xres;
+		rec.yres = pix->yres;
+		fz_save_colorspace_name(rec.colorspace, pix->colorspace);
+		fz_write_buffer(ctx, buf, (unsigned char *)&rec, sizeof rec);
+		fz_write_buffer(ctx, buf, pix->samples, pix->w * pix->h * pix->n);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_drop_pixmap(ctx, conv);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/* The glyphs of type3 fonts are saved as display lists of their own */
+static void
+fz_save_display_type3(fz_context *ctx, fz_buffer *buf, fz_font *font)
+{
+	fz_display_file_type3 *rec;
+	int pos, i;
+
+	fz_write_display_pad(ctx, buf, 16);
+	pos = buf->len;
+	rec = fz_malloc_struct(ctx, fz_display_file_type3);
+	fz_try(ctx)
+	{
+		rec->matrix = font->t3matrix;
+		for (i = 0; i < 256; i++)
+		{
+			rec->widths[i] = font->t3widths[i];
+			rec->flags[i] = font->t3flags[i];
+		}
+		fz_write_buffer(ctx, buf, (unsigned char *)rec, sizeof *rec);
+		for (i = 0; i < 256; i++)
+		{
+			int start;
+			if (!font->t3lists[i])
+				continue;
+			fz_write_display_pad(ctx, buf, 16);
+			start = buf->len;
+			fz_save_display_list(ctx, buf, font->t3lists[i]);
+			rec->sizes[i] = buf->len - start;
+		}
+		memcpy(buf->data + pos, rec, sizeof *rec);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, rec);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+fz_save_display_font(fz_context *ctx, fz_buffer *buf, fz_font *font)
+{
+	fz_display_file_font rec;
+	fz_buffer *data = NULL;
+
+	memset(&rec, 0, sizeof rec);
+	fz_strlcpy(rec.name, font->name, sizeof rec.name);
+	rec.use_glyph_bbox = font->use_glyph_bbox;
+	rec.bbox = font->bbox;
+	if (font->t3procs)
+	{
+		rec.type3 = 1;
+		fz_write_buffer(ctx, buf, (unsigned char *)&rec, sizeof rec);
+		fz_save_display_type3(ctx, buf, font);
+		return;
+	}
+
+	data = fz_font_file_data(ctx, font, &rec.index);
+	fz_try(ctx)
+	{
+		rec.substitute = font->ft_substitute;
+		rec.bold = font->ft_bold;
+		rec.italic = font->ft_italic;
+		rec.hint = font->ft_hint;
+		rec.width_count = font->width_table ? font->width_count : 0;
+		rec.size = data->len;
+		fz_write_buffer(ctx, buf, (unsigned char *)&rec, sizeof rec);
+		if (rec.width_count)
+			fz_write_buffer(ctx, buf, (unsigned char *)font->width_table, rec.width_count * sizeof(int));
+		fz_write_buffer(ctx, buf, data->data, data->len);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, data);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+fz_save_display_ref(fz_context *ctx, fz_buffer *buf, fz_display_ref *ref)
+{
+	char name[16];
+
+	switch (ref->kind)
+	{
+	case FZ_REF_COLORSPACE:
+		fz_save_colorspace_name(name, ref->ptr);
+		fz_write_buffer(ctx, buf, (unsigned char *)name, sizeof name);
+		break;
+	case FZ_REF_STROKE:
+		fz_save_display_stroke(ctx, buf, ref->ptr);
+		break;
+	case FZ_REF_SHADE:
+		fz_save_display_shade(ctx, buf, ref->ptr);
+		break;
+	case FZ_REF_IMAGE:
+		fz_save_display_image(ctx, buf, ref->ptr);
+		break;
+	case FZ_REF_FONT:
+		fz_save_display_font(ctx, buf, ref->ptr);
+		break;
+	}
+}
+
+/* Write a node as a self-contained record, with its data inline */
+static void
+fz_save_display_node(fz_context *ctx, fz_buffer *buf, fz_display_list *list, fz_display_node *node)
+{
+	fz_display_node out = *node;
+	fz_colorspace *cs = node_ref(list, node->colorspace);
+	float color[FZ_MAX_COLORS];
+	int extra = fz_display_data_size(node);
+#ifndef NDEBUG
+	int start = buf->len;
+#endif
+
+	if (cs && !fz_is_device_colorspace(cs))
+	{
+		fz_convert_color(ctx, fz_device_rgb, color, cs, node_color(node));
+		out.ncolor = 3;
+	}
+	else
+		memcpy(color, node_color(node), node->ncolor * sizeof(float));
+
+	out.big = 0;
+	memset(&out.item, 0, sizeof out.item);
+	if (node->cmd == FZ_CMD_BEGIN_GROUP)
+		out.item.blendmode = node->item.blendmode;
+	out.size = ALIGN_NODE(sizeof(fz_display_node) + out.ncolor * sizeof(float)) + ALIGN_NODE(extra);
+
+	fz_write_buffer(ctx, buf, (unsigned char *)&out, sizeof out);
+	fz_write_buffer(ctx, buf, (unsigned char *)color, out.ncolor * sizeof(float));
+	fz_write_display_pad(ctx, buf, sizeof(void *));
+	if (node->cmd >= FZ_CMD_FILL_TEXT && node->cmd <= FZ_CMD_IGNORE_TEXT)
+	{
+		/* the font is found through the node, not the text */
+		fz_text text = *(fz_text *)node_data(node);
+		text.font = NULL;
+		fz_write_buffer(ctx, buf, (unsigned char *)&text, sizeof text);
+		fz_write_buffer(ctx, buf, (unsigned char *)((fz_text *)node_data(node) + 1), extra - sizeof text);
+	}
+	else
+		fz_write_buffer(ctx, buf, node_data(node), extra);
+	fz_write_display_pad(ctx, buf, sizeof(void *));
+	assert(buf->len - start == out.size);
+}
+
+/*
+	Append a saved list to buf, which must be 16 byte aligned. All
+	offsets in a saved list are relative to its start, so the glyphs
+	of type3 fonts are saved as lists of their own within the font.
+*/
+static void
+fz_save_display_list(fz_context *ctx, fz_buffer *buf, fz_display_list *list)
+{
+	fz_display_file_header header;
+	fz_display_file_ref *dir = NULL;
+	fz_buffer *res = NULL;
+	fz_display_node *node;
+	int base = buf->len;
+	int i, k;
+
+	fz_var(dir);
+	fz_var(res);
+
+	fz_try(ctx)
+	{
+		memset(&header, 0, sizeof header);
+		dir = fz_calloc(ctx, list->ref_len ? list->ref_len : 1, sizeof(fz_display_file_ref));
+
+		/* leave room for the header and directory; they are filled in last */
+		fz_write_buffer(ctx, buf, (unsigned char *)&header, sizeof header);
+		fz_write_buffer(ctx, buf, (unsigned char *)dir, list->ref_len * sizeof(fz_display_file_ref));
+
+		for (i = 0; i < list->ref_len; i++)
+		{
+			fz_md5 md5;
+
+			res = fz_new_buffer(ctx, 256);
+			fz_save_display_ref(ctx, res, &list->refs[i]);
+			fz_md5_init(&md5);
+			fz_md5_update(&md5, res->data, res->len);
+			fz_md5_final(&md5, dir[i].digest);
+			dir[i].kind = list->refs[i].kind;
+			dir[i].size = res->len;
+
+			for (k = 0; k < i; k++)
+				if (dir[k].kind == dir[i].kind && dir[k].size == dir[i].size &&
+					!memcmp(dir[k].digest, dir[i].digest, 16))
+					break;
+			if (k < i)
+				dir[i].offset = dir[k].offset;
+			else
+			{
+				fz_write_display_pad(ctx, buf, 16);
+				dir[i].offset = buf->len - base;
+				fz_write_buffer(ctx, buf, res->data, res->len);
+			}
+			fz_drop_buffer(ctx, res);
+			res = NULL;
+		}
+
+		fz_write_display_pad(ctx, buf, 16);
+		header.nodes = buf->len - base;
+		for (node = list->first; node; node = fz_next_display_node(list, node))
+		{
+			fz_save_display_node(ctx, buf, list, node);
+			header.len++;
+		}
+		header.nodes_size = buf->len - base - header.nodes;
+
+		memcpy(header.magic, fz_display_file_magic, sizeof header.magic);
+		header.version = FZ_DISPLAY_FILE_VERSION;
+		fz_display_file_sizes(header.sizes);
+		header.ref_len = list->ref_len;
+		memcpy(buf->data + base, &header, sizeof header);
+		memcpy(buf->data + base + sizeof header, dir, list->ref_len * sizeof(fz_display_file_ref));
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, res);
+		fz_free(ctx, dir);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+void
+fz_write_display_list(fz_context *ctx, fz_display_list *list, const char *filename)
+{
+	fz_buffer *buf;
+	FILE *file;
+	int n, len;
+
+	buf = fz_new_buffer(ctx, 64 << 10);
+	fz_try(ctx)
+	{
+		fz_save_display_list(ctx, buf, list);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_rethrow(ctx);
+	}
+
+	file = fopen(filename, "wb");
+	if (!file)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_throw(ctx, "cannot open file '%s': %s", filename, strerror(errno));
+	}
+	len = buf->len;
+	n = fwrite(buf->data, 1, len, file);
+	fz_drop_buffer(ctx, buf);
+	if (fclose(file) != 0 || n != len)
+		fz_throw(ctx, "cannot write display list to '%s': %s", filename, strerror(errno));
+}
+
+/* Bounds checked reading of a resource from a mapped file */
+typedef struct fz_display_reader_s
+{
+	fz_context *ctx;
+	unsigned char *start, *p, *end;
+} fz_display_reader;
+
+static void *
+fz_display_read(fz_display_reader *r, int len)
+{
+	void *p = r->p;
+	if (len < 0 || len > r->end - r->p)
+		fz_throw(r->ctx, "truncated resource in display list file");
+	r->p += len;
+	return p;
+}
+
+static void
+fz_display_read_pad(fz_display_reader *r, int align)
+{
+	fz_display_read(r, (align - (r->p - r->start) % align) % align);
+}
+
+static fz_stroke_state *
+fz_load_display_stroke(fz_display_reader *r)
+{
+	fz_stroke_state *head = fz_display_read(r, offsetof(fz_stroke_state, dash_list));
+	fz_stroke_state *stroke;
+
+	if (head->dash_len < 0)
+		fz_throw(r->ctx, "bad stroke state in display list file");
+	stroke = fz_new_stroke_state_with_len(r->ctx, head->dash_len);
+	fz_try(r->ctx)
+	{
+		memcpy(stroke->dash_list, fz_display_read(r, head->dash_len * sizeof(float)), head->dash_len * sizeof(float));
+		memcpy(stroke, head, offsetof(fz_stroke_state, dash_list));
+		stroke->refs = 1;
+	}
+	fz_catch(r->ctx)
+	{
+		fz_drop_stroke_state(r->ctx, stroke);
+		fz_rethrow(r->ctx);
+	}
+	return stroke;
+}
+
+static fz_shade *
+fz_load_display_shade(fz_display_reader *r)
+{
+	fz_context *ctx = r->ctx;
+	fz_shade *rec = fz_display_read(r, sizeof(fz_shade));
+	fz_shade *shade;
+	int count, len, *has_buffer;
+
+	shade = fz_malloc_struct(ctx, fz_shade);
+	memcpy(shade, rec, sizeof(fz_shade));
+	FZ_INIT_STORABLE(shade, 1, fz_free_shade_imp, FZ_STORE_SHADE);
+	shade->colorspace = NULL;
+	shade->buffer = NULL;
+	if (shade->type == FZ_FUNCTION_BASED)
+		shade->u.f.fn_vals = NULL;
+
+	fz_try(ctx)
+	{
+		shade->colorspace = fz_load_colorspace_name(ctx, fz_display_read(r, 16));
+		if (!shade->colorspace || shade->type < FZ_FUNCTION_BASED || shade->type > FZ_MESH_TYPE7)
+			fz_throw(ctx, "bad shading in display list file");
+		if (shade->type == FZ_FUNCTION_BASED)
+		{
+			if (shade->u.f.xdivs < 0 || shade->u.f.ydivs < 0 || shade->u.f.xdivs > 4096 || shade->u.f.ydivs > 4096)
+				fz_throw(ctx, "bad shading in display list file");
+			count = (shade->u.f.xdivs + 1) * (shade->u.f.ydivs + 1) * shade->colorspace->n;
+			shade->u.f.fn_vals = fz_malloc_array(ctx, count, sizeof(float));
+			memcpy(shade->u.f.fn_vals, fz_display_read(r, count * sizeof(float)), count * sizeof(float));
+		}
+		has_buffer = fz_display_read(r, sizeof(int));
+		if (*has_buffer)
+		{
+			shade->buffer = fz_malloc_struct(ctx, fz_compressed_buffer);
+			memcpy(&shade->buffer->params, fz_display_read(r, sizeof(fz_compression_params)), sizeof(fz_compression_params));
+			len = *(int *)fz_display_read(r, sizeof(int));
+			shade->buffer->buffer = fz_new_buffer(ctx, len);
+			fz_write_buffer(ctx, shade->buffer->buffer, fz_display_read(r, len), len);
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_shade(ctx, shade);
+		fz_rethrow(ctx);
+	}
+	return shade;
+}
+
+static fz_image *
+fz_load_display_image(fz_display_reader *r)
+{
+	fz_context *ctx = r->ctx;
+	fz_display_file_image *rec = fz_display_read(r, sizeof(fz_display_file_image));
+	fz_colorspace *cs = fz_load_colorspace_name(ctx, rec->colorspace);
+	fz_pixmap *pix;
+
+	if (rec->w <= 0 || rec->h <= 0 || rec->n != (cs ? cs->n + 1 : 1) || rec->h > INT_MAX / rec->w / rec->n)
+		fz_throw(ctx, "bad image in display list file");
+	pix = fz_new_pixmap(ctx, cs, rec->w, rec->h);
+	fz_try(ctx)
+	{
+		memcpy(pix->samples, fz_display_read(r, rec->w * rec->h * rec->n), rec->w * rec->h * rec->n);
+		pix->interpolate = rec->interpolate;
+		pix->xres = rec->xres;
+		pix->yres = rec->yres;
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_rethrow(ctx);
+	}
+	return fz_new_image_from_pixmap(ctx, pix);
+}
+
+static fz_font *
+fz_load_display_type3(fz_display_reader *r, fz_display_file_font *head, char *name)
+{
+	fz_context *ctx = r->ctx;
+	fz_display_file_type3 *rec;
+	fz_font *font;
+	int i;
+
+	fz_display_read_pad(r, 16);
+	rec = fz_display_read(r, sizeof *rec);
+	font = fz_new_type3_font(ctx, name, &rec->matrix);
+	fz_try(ctx)
+	{
+		font->bbox = head->bbox;
+		for (i = 0; i < 256; i++)
+		{
+			font->t3widths[i] = rec->widths[i];
+			font->t3flags[i] = rec->flags[i];
+			if (rec->sizes[i] == 0)
+				continue;
+			fz_display_read_pad(r, 16);
+			font->t3lists[i] = fz_load_display_glyph(ctx, fz_display_read(r, rec->sizes[i]), rec->sizes[i]);
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_font(ctx, font);
+		fz_rethrow(ctx);
+	}
+	return font;
+}
+
+static fz_font *
+fz_load_display_font(fz_display_reader *r)
+{
+	fz_context *ctx = r->ctx;
+	fz_display_file_font *rec = fz_display_read(r, sizeof(fz_display_file_font));
+	unsigned char *widths, *file, *data;
+	char name[sizeof rec->name];
+	fz_font *font;
+
+	fz_strlcpy(name, rec->name, sizeof name);
+	if (rec->type3)
+		return fz_load_display_type3(r, rec, name);
+
+	if (rec->width_count < 0 || rec->width_count > INT_MAX / (int)sizeof(int) || rec->size <= 0)
+		fz_throw(ctx, "bad font in display list file");
+	widths = fz_display_read(r, rec->width_count * sizeof(int));
+	file = fz_display_read(r, rec->size);
+
+	/* fonts outlive the list in the glyph cache, so take a copy */
+	data = fz_malloc(ctx, rec->size);
+	memcpy(data, file, rec->size);
+	fz_try(ctx)
+	{
+		font = fz_new_font_from_memory(ctx, name, data, rec->size, rec->index, rec->use_glyph_bbox);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, data);
+		fz_rethrow(ctx);
+	}
+	font->ft_data = data;
+	font->ft_size = rec->size;
+	font->ft_substitute = rec->substitute;
+	font->ft_bold = rec->bold;
+	font->ft_italic = rec->italic;
+	font->ft_hint = rec->hint;
+	font->bbox = rec->bbox;
+	if (rec->width_count > 0)
+	{
+		fz_try(ctx)
+		{
+			font->width_table = fz_malloc_array(ctx, rec->width_count, sizeof(int));
+		}
+		fz_catch(ctx)
+		{
+			fz_drop_font(ctx, font);
+			fz_rethrow(ctx);
+		}
+		memcpy(font->width_table, widths, rec->width_count * sizeof(int));
+		font->width_count = rec->width_count;
+	}
+	return font;
+}
+
+static void *
+fz_load_display_ref(fz_context *ctx, fz_display_list *list, fz_display_file_ref *ref)
+{
+	fz_display_reader r;
+
+	if (ref->offset < 0 || ref->size < 0 || ref->offset > list->map_len - ref->size)
+		fz_throw(ctx, "bad resource in display list file");
+	r.ctx = ctx;
+	r.start = r.p = list->map + ref->offset;
+	r.end = r.p + ref->size;
+
+	switch (ref->kind)
+	{
+	case FZ_REF_COLORSPACE:
+		return fz_load_colorspace_name(ctx, fz_display_read(&r, 16));
+	case FZ_REF_STROKE:
+		return fz_load_display_stroke(&r);
+	case FZ_REF_SHADE:
+		return fz_load_display_shade(&r);
+	case FZ_REF_IMAGE:
+		return fz_load_display_image(&r);
+	case FZ_REF_FONT:
+		return fz_load_display_font(&r);
+	}
+	fz_throw(ctx, "unknown resource in display list file");
+	return NULL;
+}
+
+/*
+	Fonts, images and shades loaded from saved lists are shared through
+	the store, keyed by their digest, so that the lists of different
+	pages use the same objects, and so the same cached glyphs.
+*/
+typedef struct fz_display_resource_s fz_display_resource;
+typedef struct fz_display_resource_key_s fz_display_resource_key;
+
+struct fz_display_resource_s
+{
+	fz_storable storable;
+	int kind;
+	void *ptr;
+};
+
+struct fz_display_resource_key_s
+{
+	int refs;
+	int kind;
+	unsigned char digest[16];
+};
+
+static void
+fz_free_display_resource(fz_context *ctx, fz_storable *res_)
+{
+	fz_display_resource *res = (fz_display_resource *)res_;
+
+	fz_drop_display_ptr(ctx, res->kind, res->ptr);
+	fz_free(ctx, res);
+}
+
+static int
+fz_make_hash_display_resource_key(fz_store_hash *hash, void *key_)
+{
+	fz_display_resource_key *key = (fz_display_resource_key *)key_;
+
+	memcpy(&hash->u.i, key->digest, sizeof hash->u.i);
+	return 1;
+}
+
+static void *
+fz_keep_display_resource_key(fz_context *ctx, void *key_)
+{
+	fz_display_resource_key *key = (fz_display_resource_key *)key_;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	key->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return (void *)key;
+}
+
+static void
+fz_drop_display_resource_key(fz_context *ctx, void *key_)
+{
+	fz_display_resource_key *key = (fz_display_resource_key *)key_;
+	int drop;
+
+	if (key == NULL)
+		return;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = --key->refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (drop == 0)
+		fz_free(ctx, key);
+}
+
+static int
+fz_cmp_display_resource_key(void *k0_, void *k1_)
+{
+	fz_display_resource_key *k0 = (fz_display_resource_key *)k0_;
+	fz_display_resource_key *k1 = (fz_display_resource_key *)k1_;
+
+	return k0->kind == k1->kind && !memcmp(k0->digest, k1->digest, 16);
+}
+
+#ifndef NDEBUG
+static void
+fz_debug_display_resource_key(void *key_)
+{
+	fz_display_resource_key *key = (fz_display_resource_key *)key_;
+
+	printf("(display list resource %d %02x%02x%02x%02x) ", key->kind,
+		key->digest[0], key->digest[1], key->digest[2], key->digest[3]);
+}
+#endif
+
+static fz_store_type fz_display_resource_store_type =
+{
+	fz_make_hash_display_resource_key,
+	fz_keep_display_resource_key,
+	fz_drop_display_resource_key,
+	fz_cmp_display_resource_key,
+#ifndef NDEBUG
+	fz_debug_display_resource_key
+#endif
+};
+
+static void *
+fz_load_display_shared(fz_context *ctx, fz_display_list *list, fz_display_file_ref *ref)
+{
+	fz_display_resource_key key;
+	fz_display_resource_key *stored_key = NULL;
+	fz_display_resource *res = NULL;
+	fz_display_resource *existing;
+	void *ptr;
+	int kind;
+
+	switch (ref->kind)
+	{
+	case FZ_REF_SHADE: kind = FZ_STORE_SHADE; break;
+	case FZ_REF_IMAGE: kind = FZ_STORE_IMAGE; break;
+	case FZ_REF_FONT: kind = FZ_STORE_FONT; break;
+	default: return fz_load_display_ref(ctx, list, ref);
+	}
+
+	key.refs = 1;
+	key.kind = ref->kind;
+	memcpy(key.digest, ref->digest, 16);
+	res = fz_find_item(ctx, fz_free_display_resource, &key, &fz_display_resource_store_type);
+	if (res)
+	{
+		ptr = fz_keep_display_ptr(ctx, res->kind, res->ptr);
+		fz_drop_storable(ctx, &res->storable);
+		return ptr;
+	}
+
+	ptr = fz_load_display_ref(ctx, list, ref);
+
+	fz_var(stored_key);
+	fz_var(res);
+
+	/* Failing to share the resource is not an error */
+	fz_try(ctx)
+	{
+		res = fz_malloc_struct(ctx, fz_display_resource);
+		FZ_INIT_STORABLE(res, 1, fz_free_display_resource, kind);
+		res->kind = ref->kind;
+		res->ptr = fz_keep_display_ptr(ctx, ref->kind, ptr);
+		stored_key = fz_malloc_struct(ctx, fz_display_resource_key);
+		*stored_key = key;
+		existing = fz_store_item(ctx, stored_key, res, ref->size, &fz_display_resource_store_type);
+		if (existing)
+		{
+			/* someone else loaded it at the same time */
+			fz_drop_display_ptr(ctx, ref->kind, ptr);
+			ptr = fz_keep_display_ptr(ctx, existing->kind, existing->ptr);
+			fz_drop_storable(ctx, &existing->storable);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_display_resource_key(ctx, stored_key);
+		if (res)
+			fz_drop_storable(ctx, &res->storable);
+	}
+	fz_catch(ctx)
+	{
+		/* carry on with the unshared copy */
+	}
+
+	return ptr;
+}
+
+static void
+fz_load_display_refs(fz_context *ctx, fz_display_list *list, fz_display_file_ref *dir, int ref_len)
+{
+	fz_hash_table *digests;
+	int i;
+
+	list->refs = fz_malloc_array(ctx, ref_len ? ref_len : 1, sizeof(fz_display_ref));
+	list->ref_cap = ref_len;
+
+	/* map each digest to the index of the first resource with it, plus one */
+	digests = fz_new_hash_table(ctx, ref_len + 1, 16, -1);
+	fz_try(ctx)
+	{
+		for (i = 0; i < ref_len; i++)
+		{
+			void *found = fz_hash_find(ctx, digests, dir[i].digest);
+			fz_display_ref *ref = found ? &list->refs[(int)(size_t)found - 1] : NULL;
+
+			if (ref && ref->kind == dir[i].kind)
+			{
+				fz_add_display_ref(ctx, list, ref->kind, fz_keep_display_ptr(ctx, ref->kind, ref->ptr));
+			}
+			else
+			{
+				/* cannot throw, as the array is already big enough */
+				fz_add_display_ref(ctx, list, dir[i].kind, fz_load_display_shared(ctx, list, &dir[i]));
+				if (!found)
+					fz_hash_insert(ctx, digests, dir[i].digest, (void *)(size_t)(i + 1));
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free_hash(ctx, digests);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static int
+fz_check_display_ref(fz_display_list *list, int i, int kind, int required)
+{
+	if (i < 0)
+		return i == -1 && !required;
+	return i < list->ref_len && list->refs[i].kind == kind;
+}
+
+static int
+fz_check_display_node(fz_display_list *list, fz_display_node *node, int avail)
+{
+	fz_colorspace *cs;
+	int head, extra;
+
+	if (avail < (int)sizeof(fz_display_node) || node->size < (int)sizeof(fz_display_node) ||
+		node->size > avail || node->size % sizeof(void *) != 0)
+		return 0;
+	if (node->cmd >= FZ_CMD_LINK || node->big || node->ncolor > FZ_MAX_COLORS)
+		return 0;
+	head = ALIGN_NODE(sizeof(fz_display_node) + node->ncolor * sizeof(float));
+	if (head > node->size)
+		return 0;
+	extra = node->size - head;
+
+	if (!fz_check_display_ref(list, node->colorspace, FZ_REF_COLORSPACE, 0))
+		return 0;
+	cs = node_ref(list, node->colorspace);
+	if (node->ncolor != (cs ? cs->n : 0))
+		return 0;
+	if (!fz_check_display_ref(list, node->stroke, FZ_REF_STROKE,
+		node->cmd == FZ_CMD_STROKE_PATH || node->cmd == FZ_CMD_CLIP_STROKE_PATH ||
+		node->cmd == FZ_CMD_STROKE_TEXT || node->cmd == FZ_CMD_CLIP_STROKE_TEXT))
+		return 0;
+
+	switch (node->cmd)
+	{
+	case FZ_CMD_FILL_PATH:
+	case FZ_CMD_STROKE_PATH:
+	case FZ_CMD_CLIP_PATH:
+	case FZ_CMD_CLIP_STROKE_PATH:
+		if (extra < (int)sizeof(fz_path) || ((fz_path *)node_data(node))->len < 0 ||
+			((fz_path *)node_data(node))->len > (extra - (int)sizeof(fz_path)) / (int)sizeof(fz_path_item))
+			return 0;
+		return node->ref == -1;
+	case FZ_CMD_FILL_TEXT:
+	case FZ_CMD_STROKE_TEXT:
+	case FZ_CMD_CLIP_TEXT:
+	case FZ_CMD_CLIP_STROKE_TEXT:
+	case FZ_CMD_IGNORE_TEXT:
+		if (extra < (int)sizeof(fz_text) || ((fz_text *)node_data(node))->len < 0 ||
+			((fz_text *)node_data(node))->len > (extra - (int)sizeof(fz_text)) / (int)sizeof(fz_text_item))
+			return 0;
+		return fz_check_display_ref(list, node->ref, FZ_REF_FONT, 1);
+	case FZ_CMD_FILL_SHADE:
+		return fz_check_display_ref(list, node->ref, FZ_REF_SHADE, 1);
+	case FZ_CMD_FILL_IMAGE:
+	case FZ_CMD_FILL_IMAGE_MASK:
+	case FZ_CMD_CLIP_IMAGE_MASK:
+		return fz_check_display_ref(list, node->ref, FZ_REF_IMAGE, 1);
+	case FZ_CMD_BEGIN_TILE:
+		return extra >= 6 * (int)sizeof(float) && node->ref == -1;
+	default:
+		return node->ref == -1;
+	}
+}
+
+static void
+fz_load_display_file(fz_context *ctx, fz_display_list *list, const char *filename)
+{
+	fz_display_file_header *header;
+	fz_display_chunk *chunk;
+	int sizes[nelem(header->sizes)];
+	int pos;
+
+	header = (fz_display_file_header *)list->map;
+	fz_display_file_sizes(sizes);
+	if (list->map_len < (int)sizeof(fz_display_file_header) ||
+		memcmp(header->magic, fz_display_file_magic, sizeof header->magic) ||
+		header->version != FZ_DISPLAY_FILE_VERSION)
+		fz_throw(ctx, "'%s' is not a saved display list", filename);
+	if (memcmp(header->sizes, sizes, sizeof sizes))
+		fz_throw(ctx, "'%s' was saved by a different build", filename);
+	if (header->ref_len < 0 || header->ref_len > (list->map_len - (int)sizeof(fz_display_file_header)) / (int)sizeof(fz_display_file_ref) ||
+		header->nodes < 0 || header->nodes % 16 != 0 || header->nodes_size < 0 ||
+		header->nodes > list->map_len - header->nodes_size || header->len < 0)
+		fz_throw(ctx, "corrupt display list file '%s'", filename);
+
+	fz_load_display_refs(ctx, list, (fz_display_file_ref *)(header + 1), header->ref_len);
+
+	/* the nodes are used in place, as one chunk */
+	chunk = fz_malloc_struct(ctx, fz_display_chunk);
+	chunk->data = list->map + header->nodes;
+	chunk->len = chunk->cap = header->nodes_size;
+	list->head = list->tail = chunk;
+
+	for (pos = 0; pos < chunk->len; pos += list->last->size)
+	{
+		fz_display_node *node = (fz_display_node *)(chunk->data + pos);
+		if (!fz_check_display_node(list, node, chunk->len - pos))
+			fz_throw(ctx, "corrupt node in display list file '%s'", filename);
+		if (!list->first)
+			list->first = node;
+		list->last = node;
+		list->len++;
+	}
+	if (list->len != header->len)
+		fz_throw(ctx, "corrupt display list file '%s'", filename);
+
+	fz_index_display_list(ctx, list);
+}
+
+fz_display_list *
+fz_open_display_list(fz_context *ctx, const char *filename)
+{
+	fz_display_list *list = fz_new_display_list(ctx);
+
+	fz_try(ctx)
+	{
+		fz_map_display_file(ctx, list, filename);
+		fz_load_display_file(ctx, list, filename);
+	}
+	fz_catch(ctx)
+	{
+		fz_free_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+
+	return list;
+}
+
+static fz_display_list *
+fz_load_display_glyph(fz_context *ctx, unsigned char *data, int len)
+{
+	fz_display_list *list = fz_new_display_list(ctx);
+
+	fz_try(ctx)
+	{
+		list->map = fz_malloc(ctx, len);
+		list->map_len = len;
+		memcpy(list->map, data, len);
+		fz_load_display_file(ctx, list, "type3 glyph");
+	}
+	fz_catch(ctx)
+	{
+		fz_free_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+
+	return list;
+}
@@ -322,13 +322,13 @@ fz_text_extract(fz_context *ctx, fz_text_device *dev, fz_text *text, const fz_ma
 
 	if (font->ft_face)
 	{
-		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		fz_lock_ft_face(ctx, font);
 		err = FT_Set_Char_Size(font->ft_face, 64, 64, 72, 72);
 		if (err)
 			fz_warn(ctx, "freetype set character size: %s", ft_error_string(err));
 		ascender = (float)face->ascender / face->units_per_EM;
 		descender = (float)face->descender / face->units_per_EM;
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 	}
 	else if (font->t3procs && !fz_is_empty_rect(&font->bbox))
 	{
@@ -411,13 +411,13 @@ fz_text_extract(fz_context *ctx, fz_text_device *dev, fz_text *text, const fz_ma
 			/* TODO: freetype returns broken vertical metrics */
 			/* if (text->wmode) mask |= FT_LOAD_VERTICAL_LAYOUT; */
 
-			fz_lock(ctx, FZ_LOCK_FREETYPE);
+			fz_lock_ft_face(ctx, font);
 			err = FT_Set_Char_Size(font->ft_face, 64, 64, 72, 72);
 			if (err)
 				fz_warn(ctx, "freetype set character size: %s", ft_error_string(err));
 			FT_Get_Advance(font->ft_face, text->items[i].gid, mask, &ftadv);
 			adv = ftadv / 65536.0f;
-			fz_unlock(ctx, FZ_LOCK_FREETYPE);
+			fz_unlock_ft_face(ctx, font);
 
 			rect.x0 = 0;
 			rect.y0 = descender;
@@ -14,7 +14,7 @@ struct null_filter
 {
 	fz_stream *chain;
 	int remain;
-	int pos;
+	fz_off_t pos;
 };
 
 static int
@@ -40,14 +40,46 @@ close_null(fz_context *ctx, void *state_)
 	fz_close(chain);
 }
 
+static void
+close_slice(fz_context *ctx, void *state)
+{
+	fz_close((fz_stream *)state);
+}
+
 fz_stream *
-fz_open_null(fz_stream *chain, int len, int offset)
+fz_open_null(fz_stream *chain, int len, fz_off_t offset)
 {
 	struct null_filter *state;
 	fz_context *ctx = chain->ctx;
+	fz_stream *stm;
 
 	if (len < 0)
 		len = 0;
+
+	/* Memory backed streams (buffers, mapped files) hold all their data
+	 * outside the stream buffer, so hand out a slice of it instead of
+	 * copying. */
+	if (chain->bp != chain->buf)
+	{
+		fz_off_t avail = chain->ep - chain->bp;
+		if (offset < 0 || offset > avail)
+			offset = avail;
+		if (len > avail - offset)
+			len = avail - offset;
+		fz_try(ctx)
+		{
+			stm = fz_open_memory(ctx, chain->bp + offset, len);
+		}
+		fz_catch(ctx)
+		{
+			fz_close(chain);
+			fz_rethrow(ctx);
+		}
+		stm->state = chain;
+		stm->close = close_slice;
+		return stm;
+	}
+
 	fz_try(ctx)
 	{
 		state = fz_malloc_struct(ctx, struct null_filter);
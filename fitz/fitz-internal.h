@@ -31,6 +31,10 @@ void fz_new_aa_context(fz_context *ctx);
 void fz_free_aa_context(fz_context *ctx);
 void fz_copy_aa_context(fz_context *dst, fz_context *src);
 
+/* Run jobs through the client's jobs context, or one after the other */
+int fz_count_jobs(fz_context *ctx);
+void fz_run_jobs(fz_context *ctx, void (*fn)(void *), void **jobs, int n);
+
 /* Default allocator */
 extern fz_alloc_context fz_alloc_default;
 
@@ -249,6 +253,9 @@ float fz_atof(const char *s);
 /* atoi that copes with NULL */
 int fz_atoi(const char *s);
 
+/* atoi for file offsets, clamped rather than overflowing */
+fz_off_t fz_atoo(const char *s);
+
 /*
  * Generic hash-table with fixed-length keys.
  */
@@ -308,21 +315,6 @@ float fz_matrix_max_expansion(const fz_matrix *m);
  * For further encapsulation in filters, or not.
  */
 
-/* md5 digests */
-
-typedef struct fz_md5_s fz_md5;
-
-struct fz_md5_s
-{
-	unsigned int state[4];
-	unsigned int count[2];
-	unsigned char buffer[64];
-};
-
-void fz_md5_init(fz_md5 *state);
-void fz_md5_update(fz_md5 *state, const unsigned char *input, unsigned inlen);
-void fz_md5_final(fz_md5 *state, unsigned char digest[16]);
-
 /* sha-256 digests */
 
 typedef struct fz_sha256_s fz_sha256;
@@ -420,7 +412,9 @@ void aes_crypt_cbc( fz_aes *ctx, int mode, int length,
 
 	Most objects offer fz_keep_XXXX/fz_drop_XXXX functions derived
 	from fz_keep_storable/fz_drop_storable. Creation of such objects
-	includes a call to FZ_INIT_STORABLE to set up the fz_storable header.
+	includes a call to FZ_INIT_STORABLE to set up the fz_storable header,
+	including the kind of resource (FZ_STORE_IMAGE etc), which decides
+	the store budget the object is counted against.
  */
 
 typedef struct fz_storable_s fz_storable;
@@ -430,11 +424,12 @@ typedef void (fz_store_free_fn)(fz_context *, fz_storable *);
 struct fz_storable_s {
 	int refs;
 	fz_store_free_fn *free;
+	int kind;
 };
 
-#define FZ_INIT_STORABLE(S_,RC,FREE) \
+#define FZ_INIT_STORABLE(S_,RC,FREE,KIND) \
 	do { fz_storable *S = &(S_)->storable; S->refs = (RC); \
-	S->free = (FREE); \
+	S->free = (FREE); S->kind = (KIND); \
 	} while (0)
 
 void *fz_keep_storable(fz_context *, fz_storable *);
@@ -669,14 +664,14 @@ struct fz_stream_s
 	int refs;
 	int error;
 	int eof;
-	int pos;
+	fz_off_t pos;
 	int avail;
 	int bits;
 	unsigned char *bp, *rp, *wp, *ep;
 	void *state;
 	int (*read)(fz_stream *stm, unsigned char *buf, int len);
 	void (*close)(fz_context *ctx, void *state);
-	void (*seek)(fz_stream *stm, int offset, int whence);
+	void (*seek)(fz_stream *stm, fz_off_t offset, int whence);
 	unsigned char buf[4096];
 };
 
@@ -785,7 +780,7 @@ static inline int fz_is_eof_bits(fz_stream *stm)
  */
 
 fz_stream *fz_open_copy(fz_stream *chain);
-fz_stream *fz_open_null(fz_stream *chain, int len, int offset);
+fz_stream *fz_open_null(fz_stream *chain, int len, fz_off_t offset);
 fz_stream *fz_open_concat(fz_context *ctx, int max, int pad);
 void fz_concat_push(fz_stream *concat, fz_stream *chain); /* Ownership of chain is passed in */
 fz_stream *fz_open_arc4(fz_stream *chain, unsigned char *key, unsigned keylen);
@@ -965,6 +960,12 @@ struct fz_image_s
 	fz_pixmap *(*get_pixmap)(fz_context *, fz_image *, int w, int h);
 };
 
+/*
+	fz_new_image_from_pixmap: Wrap an already decoded pixmap as an
+	image. Takes ownership of the pixmap, even on error.
+*/
+fz_image *fz_new_image_from_pixmap(fz_context *ctx, fz_pixmap *pix);
+
 fz_pixmap *fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *cs, int indexed);
 fz_pixmap *fz_load_jpeg(fz_context *doc, unsigned char *data, int size);
 fz_pixmap *fz_load_png(fz_context *doc, unsigned char *data, int size);
@@ -1031,6 +1032,7 @@ struct fz_font_s
 	char name[32];
 
 	void *ft_face; /* has an FT_Face if used */
+	int ft_lock; /* ... lock guarding ft_face */
 	int ft_substitute; /* ... substitute metrics */
 	int ft_bold; /* ... synthesize bold */
 	int ft_italic; /* ... synthesize italic */
@@ -1072,9 +1074,25 @@ fz_font *fz_new_type3_font(fz_context *ctx, char *name, const fz_matrix *matrix)
 fz_font *fz_new_font_from_memory(fz_context *ctx, char *name, unsigned char *data, int len, int index, int use_glyph_bbox);
 fz_font *fz_new_font_from_file(fz_context *ctx, char *name, char *path, int index, int use_glyph_bbox);
 
+/*
+	fz_font_file_data: Get a copy of the font file a font was loaded
+	from, and the index of the font within it. Throws for type3 fonts.
+*/
+fz_buffer *fz_font_file_data(fz_context *ctx, fz_font *font, int *index);
+
 fz_font *fz_keep_font(fz_context *ctx, fz_font *font);
 void fz_drop_font(fz_context *ctx, fz_font *font);
 
+/*
+	fz_lock_ft_face: Take the lock guarding the FreeType face of a
+	font. Anything that changes the state of the face (character
+	size, transform, the loaded glyph slot) must hold this lock.
+	Faces of different fonts may use different locks, so callers
+	must not hold it across calls into other fonts.
+*/
+void fz_lock_ft_face(fz_context *ctx, fz_font *font);
+void fz_unlock_ft_face(fz_context *ctx, fz_font *font);
+
 void fz_set_font_bbox(fz_context *ctx, fz_font *font, float xmin, float ymin, float xmax, float ymax);
 fz_rect *fz_bound_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm, fz_rect *r);
 int fz_glyph_cacheable(fz_context *ctx, fz_font *font, int gid);
@@ -1478,6 +1496,22 @@ void fz_paint_solid_color(unsigned char * restrict dp, int n, int w, unsigned ch
 void fz_paint_span(unsigned char * restrict dp, unsigned char * restrict sp, int n, int w, int alpha);
 void fz_paint_span_with_color(unsigned char * restrict dp, unsigned char * restrict mp, int n, int w, unsigned char *color);
 
+/*
+	fz_init_paint_kernels: Choose the span painters for the features of
+	the CPU. Called by fz_new_context.
+
+	fz_paint_kernels_name: Name of the set of span painters in use
+	("C", "SSE2", "AVX2" or "NEON").
+
+	fz_check_paint_kernels: Check every vector span painter this CPU
+	can run against the C reference on random spans, warning about each
+	set that gives different results. Returns the number of such sets
+	(so 0 is good). mudraw -K runs this.
+*/
+void fz_init_paint_kernels(fz_context *ctx);
+const char *fz_paint_kernels_name(void);
+int fz_check_paint_kernels(fz_context *ctx);
+
 void fz_paint_image(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, int alpha);
 void fz_paint_image_with_color(fz_pixmap *dst, const fz_irect *scissor, fz_pixmap *shape, fz_pixmap *img, const fz_matrix *ctm, unsigned char *colorbv);
 
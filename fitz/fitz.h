@@ -5,6 +5,10 @@
 	Include the standard libc headers.
 */
 
+#if !defined(_MSC_VER) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64 /* 64-bit off_t for lseek, fseeko & co */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
@@ -59,6 +63,11 @@ int gettimeofday(struct timeval *tv, struct timezone *tz);
 #define isnan _isnan
 #define hypotf _hypotf
 
+typedef __int64 fz_off_t;
+#define fz_lseek _lseeki64
+#define fz_fseek _fseeki64
+#define fz_ftell _ftelli64
+
 #else /* Unix or close enough */
 
 #include <unistd.h>
@@ -67,8 +76,23 @@ int gettimeofday(struct timeval *tv, struct timezone *tz);
 #define O_BINARY 0
 #endif
 
+typedef long long fz_off_t;
+#ifdef __ANDROID__
+#define fz_lseek lseek64
+#else
+#define fz_lseek lseek
+#endif
+#define fz_fseek fseeko
+#define fz_ftell ftello
+
 #endif
 
+/*
+	fz_off_t: A position within a file, wide enough for files over
+	2 gigabytes. Print with "%lld".
+*/
+#define FZ_OFF_T_MAX ((fz_off_t)0x7fffffffffffffffLL)
+
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
 #endif
@@ -193,6 +217,7 @@ typedef struct fz_warn_context_s fz_warn_context;
 typedef struct fz_font_context_s fz_font_context;
 typedef struct fz_aa_context_s fz_aa_context;
 typedef struct fz_locks_context_s fz_locks_context;
+typedef struct fz_jobs_context_s fz_jobs_context;
 typedef struct fz_store_s fz_store;
 typedef struct fz_glyph_cache_s fz_glyph_cache;
 typedef struct fz_context_s fz_context;
@@ -288,6 +313,7 @@ struct fz_context_s
 	fz_aa_context *aa;
 	fz_store *store;
 	fz_glyph_cache *glyph_cache;
+	fz_jobs_context *jobs;
 };
 
 /*
@@ -304,6 +330,23 @@ enum {
 	FZ_STORE_DEFAULT = 256 << 20,
 };
 
+/*
+	The kinds of resource held in the resource store. Each kind
+	may be given its own budget within the store with
+	fz_set_store_budget.
+*/
+enum {
+	FZ_STORE_OTHER = 0,
+	FZ_STORE_IMAGE,
+	FZ_STORE_FONT,
+	FZ_STORE_FUNCTION,
+	FZ_STORE_COLORSPACE,
+	FZ_STORE_SHADE,
+	FZ_STORE_OBJSTM,
+	FZ_STORE_CONTENT,
+	FZ_STORE_KINDS
+};
+
 /*
 	fz_new_context: Allocate context containing global state.
 
@@ -362,6 +405,19 @@ fz_context *fz_clone_context(fz_context *ctx);
 */
 void fz_free_context(fz_context *ctx);
 
+/*
+	fz_set_store_budget: Limit how much of the resource store one
+	kind of resource may use.
+
+	kind: The kind of resource (FZ_STORE_IMAGE, FZ_STORE_FONT, etc).
+
+	max: Maximum size in bytes for resources of that kind. The
+	default, FZ_STORE_UNLIMITED, lets them use all of the store.
+	Lowering a budget evicts unused resources of that kind
+	immediately.
+*/
+void fz_set_store_budget(fz_context *ctx, int kind, unsigned int max);
+
 /*
 	fz_aa_level: Get the number of bits of antialiasing we are
 	using. Between 0 and 8.
@@ -376,6 +432,34 @@ int fz_aa_level(fz_context *ctx);
 */
 void fz_set_aa_level(fz_context *ctx, int bits);
 
+/*
+	fz_set_glyph_cache_size: Set the maximum number of bytes of
+	rendered glyphs to keep in the glyph cache. The cache is shared
+	by all contexts cloned from this one. Glyphs are evicted least
+	recently used first; shrinking the cache evicts immediately.
+*/
+void fz_set_glyph_cache_size(fz_context *ctx, unsigned int max);
+
+/*
+	fz_get_glyph_cache_stats: Read the glyph cache counters.
+
+	size: The number of bytes currently held, and max the budget.
+
+	hits, misses: Lookups that found, or did not find, a cached
+	glyph.
+
+	evictions: Glyphs thrown out to keep within the budget.
+*/
+typedef struct fz_glyph_cache_stats_s fz_glyph_cache_stats;
+
+struct fz_glyph_cache_stats_s
+{
+	unsigned int size, max;
+	int hits, misses, evictions;
+};
+
+void fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats);
+
 /*
 	Locking functions
 
@@ -395,6 +479,22 @@ void fz_set_aa_level(fz_context *ctx, int bits);
 	when we already hold any lock i, where 0 <= i <= n. In order
 	to verify this, we have some debugging code, that can be
 	enabled by defining FITZ_DEBUG_LOCKING.
+
+	The resource store is striped over FZ_STORE_STRIPES locks,
+	FZ_LOCK_STORE onwards, so that lookups do not contend with
+	each other or with FZ_LOCK_ALLOC, which guards the allocator
+	and reference counts.
+
+	The glyph cache is striped over FZ_GLYPH_CACHE_STRIPES locks,
+	FZ_LOCK_GLYPHCACHE onwards, so that threads rendering
+	different glyphs do not serialize on a single lock.
+
+	Similarly, FZ_LOCK_FREETYPE only guards the FreeType library
+	itself (creating and destroying faces); each font face is
+	guarded by one of FZ_FREETYPE_FACE_STRIPES locks,
+	FZ_LOCK_FREETYPE_FACE onwards, chosen by font. Threads
+	rasterizing glyphs from different fonts can therefore run
+	concurrently.
 */
 
 struct fz_locks_context_s
@@ -404,14 +504,60 @@ struct fz_locks_context_s
 	void (*unlock)(void *user, int lock);
 };
 
+enum {
+	FZ_STORE_STRIPES = 8,
+	FZ_FREETYPE_FACE_STRIPES = 8,
+	FZ_GLYPH_CACHE_STRIPES = 8
+};
+
 enum {
 	FZ_LOCK_ALLOC = 0,
+	FZ_LOCK_STORE,
+	FZ_LOCK_STORE_LAST = FZ_LOCK_STORE + FZ_STORE_STRIPES - 1,
 	FZ_LOCK_FILE,
 	FZ_LOCK_FREETYPE,
+	FZ_LOCK_FREETYPE_FACE,
+	FZ_LOCK_FREETYPE_FACE_LAST = FZ_LOCK_FREETYPE_FACE + FZ_FREETYPE_FACE_STRIPES - 1,
 	FZ_LOCK_GLYPHCACHE,
+	FZ_LOCK_GLYPHCACHE_LAST = FZ_LOCK_GLYPHCACHE + FZ_GLYPH_CACHE_STRIPES - 1,
 	FZ_LOCK_MAX
 };
 
+/*
+	Jobs:
+
+	MuPDF never starts threads of its own. Some long operations (such
+	as scanning a damaged file to repair its xref) can split their
+	work into independent jobs, and a client that wants those run in
+	parallel passes a fz_jobs_context to fz_set_jobs_context.
+
+	run: Called with a batch of jobs: it must call fn(jobs[i]) for each
+	of the n jobs, in any order and on any threads, and return once all
+	of them have finished. The jobs neither allocate memory nor throw,
+	so they need no fz_context of their own.
+
+	count: How many jobs to split work into; usually the number of
+	threads available.
+
+	user: Passed back to run.
+
+	The structure is not copied, and must stay valid for as long as
+	the context (and any clones of it) use it.
+*/
+
+struct fz_jobs_context_s
+{
+	void *user;
+	void (*run)(void *user, void (*fn)(void *), void **jobs, int n);
+	int count;
+};
+
+/*
+	fz_set_jobs_context: Set (or with NULL, clear) the jobs context
+	used by ctx. Cloned contexts inherit it.
+*/
+void fz_set_jobs_context(fz_context *ctx, fz_jobs_context *jobs);
+
 /*
 	Memory Allocation and Scavenging:
 
@@ -1268,6 +1414,18 @@ fz_stream *fz_open_file(fz_context *ctx, const char *filename);
 */
 fz_stream *fz_open_file_w(fz_context *ctx, const wchar_t *filename);
 
+/*
+	fz_open_file_mmap: Open the named file by mapping it into memory.
+
+	Reads and seeks then work directly on the mapping, without copying
+	through the stream buffer or issuing system calls. Falls back to
+	an ordinary file stream for files that cannot be mapped (pipes,
+	devices, empty files, or platforms without mmap).
+
+	filename: Path to a file, as for fz_open_file.
+*/
+fz_stream *fz_open_file_mmap(fz_context *ctx, const char *filename);
+
 /*
 	fz_open_fd: Wrap an open file descriptor in a stream.
 
@@ -1317,7 +1475,7 @@ void fz_close(fz_stream *stm);
 /*
 	fz_tell: return the current reading position within a stream
 */
-int fz_tell(fz_stream *stm);
+fz_off_t fz_tell(fz_stream *stm);
 
 /*
 	fz_seek: Seek within a stream.
@@ -1328,7 +1486,7 @@ int fz_tell(fz_stream *stm);
 
 	whence: From where the offset is measured (see fseek).
 */
-void fz_seek(fz_stream *stm, int offset, int whence);
+void fz_seek(fz_stream *stm, fz_off_t offset, int whence);
 
 /*
 	fz_read: Read from a stream into a given data block.
@@ -1678,6 +1836,26 @@ void fz_write_png(fz_context *ctx, fz_pixmap *pixmap, char *filename, int saveal
 */
 void fz_write_pbm(fz_context *ctx, fz_bitmap *bitmap, char *filename);
 
+/*
+	fz_md5: md5 digests, computed incrementally.
+
+	fz_md5_init resets the state, fz_md5_update adds inlen more bytes
+	to the digest and fz_md5_final writes out the 16 byte digest of
+	everything added so far.
+*/
+typedef struct fz_md5_s fz_md5;
+
+struct fz_md5_s
+{
+	unsigned int state[4];
+	unsigned int count[2];
+	unsigned char buffer[64];
+};
+
+void fz_md5_init(fz_md5 *state);
+void fz_md5_update(fz_md5 *state, const unsigned char *input, unsigned inlen);
+void fz_md5_final(fz_md5 *state, unsigned char digest[16]);
+
 /*
 	fz_md5_pixmap: Return the md5 digest for a pixmap
 
@@ -1959,15 +2137,32 @@ struct fz_output_s
 	fz_context *ctx;
 	void *opaque;
 	int (*printf)(fz_output *, const char *, va_list ap);
+	int (*write)(fz_output *, const void *, int n);
 	void (*close)(fz_output *);
 };
 
 fz_output *fz_new_output_file(fz_context *, FILE *);
 
+/*
+	fz_new_output_to_filename: Open a file for writing (truncating
+	any existing file) and return an fz_output for it. The file is
+	closed again by fz_close_output.
+
+	Throws if the file cannot be opened.
+*/
+fz_output *fz_new_output_to_filename(fz_context *ctx, const char *filename);
+
 fz_output *fz_new_output_buffer(fz_context *, fz_buffer *);
 
 int fz_printf(fz_output *, const char *, ...);
 
+/*
+	fz_write_data: Write len bytes of raw data to an fz_output.
+
+	Returns the number of bytes written.
+*/
+int fz_write_data(fz_output *out, const void *data, int len);
+
 /*
 	fz_close_output: Close a previously opened fz_output stream.
 
@@ -1977,6 +2172,103 @@ int fz_printf(fz_output *, const char *, ...);
 */
 void fz_close_output(fz_output *);
 
+/*
+	Streaming image writers.
+
+	These write an image a band of rows at a time, so that a page can
+	be rendered and saved without ever holding the whole pixmap in
+	memory. Call the header function once, then the band function for
+	each band in order from the top (band 0 holds rows 0 to
+	bandheight-1; the last band may be shorter), then for png the
+	trailer.
+
+	w, h, n: The width, height and number of components (including
+	alpha) of the whole image.
+
+	samples: The first row of the band, packed as in an fz_pixmap.
+
+	savealpha: Whether to keep the alpha channel (pam and png only).
+*/
+void fz_output_pnm_header(fz_output *out, int w, int h, int n);
+void fz_output_pnm_band(fz_output *out, int w, int h, int n, int band, int bandheight, unsigned char *samples);
+
+void fz_output_pam_header(fz_output *out, int w, int h, int n, fz_colorspace *colorspace, int savealpha);
+void fz_output_pam_band(fz_output *out, int w, int h, int n, int band, int bandheight, unsigned char *samples, int savealpha);
+
+typedef struct fz_png_output_context_s fz_png_output_context;
+
+/*
+	fz_output_png_header: Write the png signature and header, and
+	return the compressor state to pass to fz_output_png_band and
+	fz_output_png_trailer.
+*/
+fz_png_output_context *fz_output_png_header(fz_output *out, int w, int h, int n, int savealpha);
+
+/*
+	PNG row filters. NONE to PAETH use that png filter on every row;
+	ADAPTIVE tries each one per row and keeps the one that looks most
+	compressible.
+*/
+enum
+{
+	FZ_PNG_FILTER_NONE,
+	FZ_PNG_FILTER_SUB,
+	FZ_PNG_FILTER_UP,
+	FZ_PNG_FILTER_AVERAGE,
+	FZ_PNG_FILTER_PAETH,
+	FZ_PNG_FILTER_ADAPTIVE
+};
+
+/*
+	fz_png_options: How to encode a png.
+
+	level: zlib compression level, 0 to 9, or -1 for the default.
+
+	filter: One of the FZ_PNG_FILTER values (default SUB).
+
+	jobs: Each band is cut into at most this many blocks of rows that
+	are filtered and deflated independently of each other.
+
+	run: If not NULL, called to process the blocks of a band: it must
+	call fn(jobs[i]) for each of the n jobs, in any order and on any
+	threads, and return once all of them have finished. The jobs
+	neither allocate memory nor throw, so they need no fz_context of
+	their own. If NULL, the jobs are run one after the other.
+
+	arg: Passed back to run.
+*/
+typedef struct fz_png_options_s fz_png_options;
+
+struct fz_png_options_s
+{
+	int level;
+	int filter;
+	int jobs;
+	void (*run)(void *arg, void (*fn)(void *), void **jobs, int n);
+	void *arg;
+};
+
+fz_png_output_context *fz_output_png_header_with_options(fz_output *out, int w, int h, int n, int savealpha, const fz_png_options *opts);
+
+/*
+	fz_write_png_with_options: Save a pixmap as a png, encoded as
+	described by opts (which may be NULL for the defaults).
+*/
+void fz_write_png_with_options(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha, const fz_png_options *opts);
+void fz_output_png_band(fz_output *out, int w, int h, int n, int band, int bandheight, unsigned char *samples, int savealpha, fz_png_output_context *poc);
+
+/*
+	fz_output_png_trailer: Flush the compressed data, end the png and
+	free the compressor state (even if it throws).
+*/
+void fz_output_png_trailer(fz_output *out, fz_png_output_context *poc);
+
+/*
+	fz_free_png_output_context: Free the compressor state of a png
+	that is being abandoned before its trailer was written.
+*/
+void fz_free_png_output_context(fz_context *ctx, fz_png_output_context *poc);
+
 /*
 	fz_print_text_sheet: Output a text sheet to a file as CSS.
 */
@@ -2147,6 +2439,35 @@ void fz_run_display_list(fz_display_list *list, fz_device *dev, const fz_matrix
 */
 void fz_free_display_list(fz_context *ctx, fz_display_list *list);
 
+/*
+	fz_write_display_list: Save a display list to a file, so that it
+	can be replayed later without the document it came from.
+
+	The file is a cache for the build of the library that wrote it,
+	and cannot be loaded by any other build. Colors and images in
+	other than the device colorspaces are converted to RGB, and
+	images are stored decoded at full resolution. Type 3 fonts and
+	mesh shadings in other than the device colorspaces cannot be
+	saved.
+
+	Throws exceptions on failure to write the file, or if the list
+	contains something that cannot be saved.
+*/
+void fz_write_display_list(fz_context *ctx, fz_display_list *list, const char *filename);
+
+/*
+	fz_open_display_list: Load a display list saved by
+	fz_write_display_list.
+
+	The file is mapped into memory and the list is replayed directly
+	from the mapping. Fonts and images are loaded once each, however
+	many times they are used. Nothing can be added to the list.
+
+	Throws exceptions if the file cannot be read, or was not written
+	by this build.
+*/
+fz_display_list *fz_open_display_list(fz_context *ctx, const char *filename);
+
 /*
 	Links
 
@@ -3120,15 +3441,27 @@ struct fz_write_options_s
 {
 	int do_ascii; /* If non-zero then attempt (where possible) to make
 				the output ascii. */
+	int do_deflate; /* If non-zero then deflate uncompressed (or, with
+				do_expand, expanded) streams. The streams are
+				compressed on the jobs context's threads, if
+				there is one. */
 	int do_expand; /* Bitflags; each non zero bit indicates an aspect
 				of the file that should be 'expanded' on
 				writing. */
 	int do_garbage; /* If non-zero then attempt (where possible) to
 				garbage collect the file before writing. */
 	int do_linear; /* If non-zero then write linearised. */
+	int do_incremental; /* If non-zero then copy the original file and
+				append only the objects changed since it was
+				opened. do_garbage and do_linear are ignored,
+				and the output must not be the input file. */
 	int continue_on_error; /* If non-zero, errors are (optionally)
 					counted and writing continues. */
 	int *errors; /* Pointer to a place to store a count of errors */
+	int *dedup_objects; /* Pointer to a place to store the number of
+				duplicate objects merged by do_garbage >= 3 */
+	fz_off_t *dedup_bytes; /* Pointer to a place to store roughly how
+				many bytes those objects would have taken */
 };
 
 /*	An enumeration of bitflags to use in the above 'do_expand' field of
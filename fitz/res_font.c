@@ -9,6 +9,23 @@
 /* 20 degrees */
 #define SHEAR 0.36397f
 
+/*
+	Older FreeType rasterizers work in a render pool owned by the
+	FT_Library, so scan converting glyphs from different faces at
+	the same time is unsafe; newer ones keep it on the stack.
+*/
+#if FREETYPE_MAJOR * 10000 + FREETYPE_MINOR * 100 + FREETYPE_PATCH < 20700
+#define FT_SHARED_RENDER_POOL
+#endif
+
+#ifdef FT_SHARED_RENDER_POOL
+#define fz_lock_ft_render(ctx) fz_lock(ctx, FZ_LOCK_FREETYPE)
+#define fz_unlock_ft_render(ctx) fz_unlock(ctx, FZ_LOCK_FREETYPE)
+#else
+#define fz_lock_ft_render(ctx) (void)0
+#define fz_unlock_ft_render(ctx) (void)0
+#endif
+
 static void fz_drop_freetype(fz_context *ctx);
 
 static fz_font *
@@ -26,6 +43,7 @@ fz_new_font(fz_context *ctx, char *name, int use_glyph_bbox, int glyph_count)
 		fz_strlcpy(font->name, "(null)", sizeof font->name);
 
 	font->ft_face = NULL;
+	font->ft_lock = FZ_LOCK_FREETYPE_FACE + ((unsigned int)((size_t)font >> 4) * 31) % FZ_FREETYPE_FACE_STRIPES;
 	font->ft_substitute = 0;
 	font->ft_bold = 0;
 	font->ft_italic = 0;
@@ -128,6 +146,18 @@ fz_drop_font(fz_context *ctx, fz_font *font)
 	fz_free(ctx, font);
 }
 
+void
+fz_lock_ft_face(fz_context *ctx, fz_font *font)
+{
+	fz_lock(ctx, font->ft_lock);
+}
+
+void
+fz_unlock_ft_face(fz_context *ctx, fz_font *font)
+{
+	fz_unlock(ctx, font->ft_lock);
+}
+
 void
 fz_set_font_bbox(fz_context *ctx, fz_font *font, float xmin, float ymin, float xmax, float ymax)
 {
@@ -321,6 +351,44 @@ fz_new_font_from_memory(fz_context *ctx, char *name, unsigned char *data, int le
 	return font;
 }
 
+fz_buffer *
+fz_font_file_data(fz_context *ctx, fz_font *font, int *index)
+{
+	FT_Face face = font->ft_face;
+	FT_Stream stream;
+	fz_buffer *buf;
+
+	if (!face)
+		fz_throw(ctx, "cannot get font file for type3 font '%s'", font->name);
+
+	stream = face->stream;
+	*index = face->face_index;
+	if (font->ft_data)
+	{
+		buf = fz_new_buffer(ctx, font->ft_size);
+		fz_write_buffer(ctx, buf, font->ft_data, font->ft_size);
+		return buf;
+	}
+
+	buf = fz_new_buffer(ctx, stream->size);
+	if (stream->base)
+		memcpy(buf->data, stream->base, stream->size);
+	else
+	{
+		unsigned long n;
+		fz_lock(ctx, font->ft_lock);
+		n = stream->read(stream, 0, buf->data, stream->size);
+		fz_unlock(ctx, font->ft_lock);
+		if (n != stream->size)
+		{
+			fz_drop_buffer(ctx, buf);
+			fz_throw(ctx, "cannot read font file for '%s'", font->name);
+		}
+	}
+	buf->len = stream->size;
+	return buf;
+}
+
 static fz_matrix *
 fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix *trm)
 {
@@ -332,7 +400,7 @@ fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix *trm
 		int realw;
 		float scale;
 
-		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		fz_lock_ft_face(ctx, font);
 		/* TODO: use FT_Get_Advance */
 		fterr = FT_Set_Char_Size(font->ft_face, 1000, 1000, 72, 72);
 		if (fterr)
@@ -344,7 +412,7 @@ fz_adjust_ft_glyph_width(fz_context *ctx, fz_font *font, int gid, fz_matrix *trm
 			fz_warn(ctx, "freetype failed to load glyph: %s", ft_error_string(fterr));
 
 		realw = ((FT_Face)font->ft_face)->glyph->metrics.horiAdvance;
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		subw = font->width_table[gid];
 		if (realw)
 			scale = (float) subw / realw;
@@ -400,7 +468,6 @@ fz_copy_ft_bitmap(fz_context *ctx, int left, int top, FT_Bitmap *bitmap)
 	return pixmap;
 }
 
-/* The glyph cache lock is always taken when this is called. */
 fz_pixmap *
 fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm, int aa)
 {
@@ -433,7 +500,7 @@ fz_render_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm
 	v.x = local_trm.e * 64;
 	v.y = local_trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	fz_lock_ft_face(ctx, font);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
@@ -482,7 +549,7 @@ retry_unhinted:
 		if (fterr)
 		{
 			fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-			fz_unlock(ctx, FZ_LOCK_FREETYPE);
+			fz_unlock_ft_face(ctx, font);
 			return NULL;
 		}
 	}
@@ -493,16 +560,18 @@ retry_unhinted:
 		FT_Outline_Translate(&face->glyph->outline, -strength * 32, -strength * 32);
 	}
 
+	fz_lock_ft_render(ctx);
 	fterr = FT_Render_Glyph(face->glyph, fz_aa_level(ctx) > 0 ? FT_RENDER_MODE_NORMAL : FT_RENDER_MODE_MONO);
+	fz_unlock_ft_render(ctx);
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype render glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		return NULL;
 	}
 
 	result = fz_copy_ft_bitmap(ctx, face->glyph->bitmap_left, face->glyph->bitmap_top, &face->glyph->bitmap);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock_ft_face(ctx, font);
 	return result;
 }
 
@@ -534,12 +603,12 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_mat
 	v.x = local_trm.e * 64;
 	v.y = local_trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	fz_lock_ft_face(ctx, font);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Set_Char_Size: %s", ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		return NULL;
 	}
 
@@ -549,7 +618,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_mat
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Load_Glyph(gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		return NULL;
 	}
 
@@ -557,7 +626,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_mat
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Stroker_New: %s", ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		return NULL;
 	}
 
@@ -583,7 +652,7 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_mat
 	{
 		fz_warn(ctx, "FT_Get_Glyph: %s", ft_error_string(fterr));
 		FT_Stroker_Done(stroker);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		return NULL;
 	}
 
@@ -593,25 +662,27 @@ fz_render_ft_stroked_glyph(fz_context *ctx, fz_font *font, int gid, const fz_mat
 		fz_warn(ctx, "FT_Glyph_Stroke: %s", ft_error_string(fterr));
 		FT_Done_Glyph(glyph);
 		FT_Stroker_Done(stroker);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		return NULL;
 	}
 
 	FT_Stroker_Done(stroker);
 
+	fz_lock_ft_render(ctx);
 	fterr = FT_Glyph_To_Bitmap(&glyph, fz_aa_level(ctx) > 0 ? FT_RENDER_MODE_NORMAL : FT_RENDER_MODE_MONO, 0, 1);
+	fz_unlock_ft_render(ctx);
 	if (fterr)
 	{
 		fz_warn(ctx, "FT_Glyph_To_Bitmap: %s", ft_error_string(fterr));
 		FT_Done_Glyph(glyph);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		return NULL;
 	}
 
 	bitmap = (FT_BitmapGlyph)glyph;
 	pixmap = fz_copy_ft_bitmap(ctx, bitmap->left, bitmap->top, &bitmap->bitmap);
 	FT_Done_Glyph(glyph);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock_ft_face(ctx, font);
 
 	return pixmap;
 }
@@ -643,7 +714,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm,
 	v.x = local_trm.e * 64;
 	v.y = local_trm.f * 64;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	fz_lock_ft_face(ctx, font);
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
 		fz_warn(ctx, "freetype setting character size: %s", ft_error_string(fterr));
@@ -653,7 +724,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm,
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		bounds->x0 = bounds->x1 = local_trm.e;
 		bounds->y0 = bounds->y1 = local_trm.f;
 		return bounds;
@@ -666,7 +737,7 @@ fz_bound_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *trm,
 	}
 
 	FT_Outline_Get_CBox(&face->glyph->outline, &cbox);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock_ft_face(ctx, font);
 	bounds->x0 = cbox.xMin / 64.0f;
 	bounds->y0 = cbox.yMin / 64.0f;
 	bounds->x1 = cbox.xMax / 64.0f;
@@ -768,7 +839,7 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *tr
 	v.x = 0;
 	v.y = 0;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	fz_lock_ft_face(ctx, font);
 
 	fterr = FT_Set_Char_Size(face, 65536, 65536, 72, 72); /* should be 64, 64 */
 	if (fterr)
@@ -779,7 +850,7 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *tr
 	if (fterr)
 	{
 		fz_warn(ctx, "freetype load glyph (gid %d): %s", gid, ft_error_string(fterr));
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		return NULL;
 	}
 
@@ -803,11 +874,11 @@ fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, const fz_matrix *tr
 	{
 		fz_warn(ctx, "freetype cannot decompose outline");
 		fz_free(ctx, cc.path);
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, font);
 		return NULL;
 	}
 
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock_ft_face(ctx, font);
 
 	return cc.path;
 }
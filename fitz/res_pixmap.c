@@ -33,7 +33,7 @@ fz_new_pixmap_with_data(fz_context *ctx, fz_colorspace *colorspace, int w, int h
 		fz_throw(ctx, "Illegal dimensions for pixmap %d %d", w, h);
 
 	pix = fz_malloc_struct(ctx, fz_pixmap);
-	FZ_INIT_STORABLE(pix, 1, fz_free_pixmap_imp);
+	FZ_INIT_STORABLE(pix, 1, fz_free_pixmap_imp, FZ_STORE_IMAGE);
 	pix->x = 0;
 	pix->y = 0;
 	pix->w = w;
@@ -432,52 +432,91 @@ fz_gamma_pixmap(fz_context *ctx, fz_pixmap *pix, float gamma)
  */
 
 void
-fz_write_pnm(fz_context *ctx, fz_pixmap *pixmap, char *filename)
+fz_output_pnm_header(fz_output *out, int w, int h, int n)
 {
-	FILE *fp;
-	unsigned char *p;
-	int len;
+	fz_context *ctx = out->ctx;
 
-	if (pixmap->n != 1 && pixmap->n != 2 && pixmap->n != 4)
+	if (n != 1 && n != 2 && n != 4)
 		fz_throw(ctx, "pixmap must be grayscale or rgb to write as pnm");
 
-	fp = fopen(filename, "wb");
-	if (!fp)
-		fz_throw(ctx, "cannot open file '%s': %s", filename, strerror(errno));
+	if (n == 1 || n == 2)
+		fz_printf(out, "P5\n");
+	if (n == 4)
+		fz_printf(out, "P6\n");
+	fz_printf(out, "%d %d\n", w, h);
+	fz_printf(out, "255\n");
+}
 
-	if (pixmap->n == 1 || pixmap->n == 2)
-		fprintf(fp, "P5\n");
-	if (pixmap->n == 4)
-		fprintf(fp, "P6\n");
-	fprintf(fp, "%d %d\n", pixmap->w, pixmap->h);
-	fprintf(fp, "255\n");
+void
+fz_output_pnm_band(fz_output *out, int w, int h, int n, int band, int bandheight, unsigned char *p)
+{
+	unsigned char buffer[3 * 1024];
+	int end = fz_mini(band * bandheight + bandheight, h);
+	int len, k;
+
+	if (band * bandheight >= h)
+		return;
 
-	len = pixmap->w * pixmap->h;
-	p = pixmap->samples;
+	len = w * (end - band * bandheight);
 
-	switch (pixmap->n)
+	switch (n)
 	{
 	case 1:
-		fwrite(p, 1, len, fp);
+		fz_write_data(out, p, len);
 		break;
 	case 2:
-		while (len--)
+		while (len)
 		{
-			putc(p[0], fp);
-			p += 2;
+			int m = fz_mini(len, sizeof(buffer));
+			for (k = 0; k < m; k++)
+			{
+				buffer[k] = p[0];
+				p += 2;
+			}
+			fz_write_data(out, buffer, m);
+			len -= m;
 		}
 		break;
 	case 4:
-		while (len--)
+		while (len)
 		{
-			putc(p[0], fp);
-			putc(p[1], fp);
-			putc(p[2], fp);
-			p += 4;
+			int m = fz_mini(len, sizeof(buffer) / 3);
+			for (k = 0; k < m; k++)
+			{
+				buffer[3*k+0] = p[0];
+				buffer[3*k+1] = p[1];
+				buffer[3*k+2] = p[2];
+				p += 4;
+			}
+			fz_write_data(out, buffer, 3 * m);
+			len -= m;
 		}
+		break;
 	}
+}
+
+void
+fz_write_pnm(fz_context *ctx, fz_pixmap *pixmap, char *filename)
+{
+	fz_output *out;
+
+	if (pixmap->n != 1 && pixmap->n != 2 && pixmap->n != 4)
+		fz_throw(ctx, "pixmap must be grayscale or rgb to write as pnm");
 
-	fclose(fp);
+	out = fz_new_output_to_filename(ctx, filename);
+	fz_try(ctx)
+	{
+		fz_output_pnm_header(out, pixmap->w, pixmap->h, pixmap->n);
+		fz_output_pnm_band(out, pixmap->w, pixmap->h, pixmap->n, 0, pixmap->h, pixmap->samples);
+	}
+	fz_always(ctx)
+	{
+		fz_close_output(out);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 }
 
 /*
@@ -485,50 +524,86 @@ fz_write_pnm(fz_context *ctx, fz_pixmap *pixmap, char *filename)
  */
 
 void
-fz_write_pam(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha)
+fz_output_pam_header(fz_output *out, int w, int h, int n, fz_colorspace *colorspace, int savealpha)
 {
-	unsigned char *sp;
-	int y, w, k;
-	FILE *fp;
-
-	int sn = pixmap->n;
-	int dn = pixmap->n;
+	int sn = n;
+	int dn = n;
 	if (!savealpha && dn > 1)
 		dn--;
 
-	fp = fopen(filename, "wb");
-	if (!fp)
-		fz_throw(ctx, "cannot open file '%s': %s", filename, strerror(errno));
-
-	fprintf(fp, "P7\n");
-	fprintf(fp, "WIDTH %d\n", pixmap->w);
-	fprintf(fp, "HEIGHT %d\n", pixmap->h);
-	fprintf(fp, "DEPTH %d\n", dn);
-	fprintf(fp, "MAXVAL 255\n");
-	if (pixmap->colorspace)
-		fprintf(fp, "# COLORSPACE %s\n", pixmap->colorspace->name);
+	fz_printf(out, "P7\n");
+	fz_printf(out, "WIDTH %d\n", w);
+	fz_printf(out, "HEIGHT %d\n", h);
+	fz_printf(out, "DEPTH %d\n", dn);
+	fz_printf(out, "MAXVAL 255\n");
+	if (colorspace)
+		fz_printf(out, "# COLORSPACE %s\n", colorspace->name);
 	switch (dn)
 	{
-	case 1: fprintf(fp, "TUPLTYPE GRAYSCALE\n"); break;
-	case 2: if (sn == 2) fprintf(fp, "TUPLTYPE GRAYSCALE_ALPHA\n"); break;
-	case 3: if (sn == 4) fprintf(fp, "TUPLTYPE RGB\n"); break;
-	case 4: if (sn == 4) fprintf(fp, "TUPLTYPE RGB_ALPHA\n"); break;
+	case 1: fz_printf(out, "TUPLTYPE GRAYSCALE\n"); break;
+	case 2: if (sn == 2) fz_printf(out, "TUPLTYPE GRAYSCALE_ALPHA\n"); break;
+	case 3: if (sn == 4) fz_printf(out, "TUPLTYPE RGB\n"); break;
+	case 4: if (sn == 4) fz_printf(out, "TUPLTYPE RGB_ALPHA\n"); break;
 	}
-	fprintf(fp, "ENDHDR\n");
+	fz_printf(out, "ENDHDR\n");
+}
+
+void
+fz_output_pam_band(fz_output *out, int w, int h, int n, int band, int bandheight, unsigned char *sp, int savealpha)
+{
+	unsigned char buffer[4 * 1024];
+	int end = fz_mini(band * bandheight + bandheight, h);
+	int sn = n;
+	int dn = n;
+	int len, k;
+
+	if (!savealpha && dn > 1)
+		dn--;
+
+	if (band * bandheight >= h)
+		return;
 
-	sp = pixmap->samples;
-	for (y = 0; y < pixmap->h; y++)
+	len = w * (end - band * bandheight);
+
+	if (sn == dn)
+	{
+		fz_write_data(out, sp, len * sn);
+		return;
+	}
+
+	while (len)
 	{
-		w = pixmap->w;
-		while (w--)
+		int m = fz_mini(len, sizeof(buffer) / dn);
+		unsigned char *dp = buffer;
+		len -= m;
+		while (m--)
 		{
 			for (k = 0; k < dn; k++)
-				putc(sp[k], fp);
+				dp[k] = sp[k];
 			sp += sn;
+			dp += dn;
 		}
+		fz_write_data(out, buffer, dp - buffer);
 	}
+}
 
-	fclose(fp);
+void
+fz_write_pam(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha)
+{
+	fz_output *out = fz_new_output_to_filename(ctx, filename);
+	fz_try(ctx)
+	{
+		fz_output_pam_header(out, pixmap->w, pixmap->h, pixmap->n, pixmap->colorspace, savealpha);
+		fz_output_pam_band(out, pixmap->w, pixmap->h, pixmap->n, 0, pixmap->h, pixmap->samples, savealpha);
+	}
+	fz_always(ctx)
+	{
+		fz_close_output(out);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 }
 
 /*
@@ -537,6 +612,65 @@ fz_write_pam(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha)
 
 #include <zlib.h>
 
+/*
+ * The image data is compressed a band at a time, each band being cut into
+ * up to 'jobs' blocks of rows. Filtering the rows of a block and then
+ * deflating it are independent of every other block, so the caller may run
+ * them on several threads (see fz_png_options). Each block is deflated as
+ * raw deflate data primed with the 32K of filtered data before it, and
+ * ended with a sync flush so that the blocks simply concatenate into one
+ * zlib stream. The adler32 checksums of the blocks are combined in order.
+ */
+
+#define PNG_MIN_BLOCK (128 << 10)
+#define PNG_WINDOW (32 << 10)
+
+typedef struct png_job_s png_job;
+
+struct png_job_s
+{
+	fz_png_output_context *poc;
+
+	/* filtering */
+	unsigned char *sp; /* first source row */
+	unsigned char *prev; /* source row above that, or NULL */
+	int rows;
+	unsigned char *scratch; /* 3 rows, then 5 candidate rows when adaptive */
+
+	/* deflating */
+	unsigned char *udata;
+	uLong ulen;
+	unsigned char *dict;
+	int dictlen;
+	z_stream stream;
+	int ready;
+	unsigned char *cdata; /* 2 spare bytes, then the deflate data */
+	uLong csize;
+	uLong clen;
+	uLong adler;
+	int ok;
+};
+
+struct fz_png_output_context_s
+{
+	fz_context *ctx;
+	int w, sn, dn;
+	int level, filter;
+	int njobs;
+	void (*run)(void *arg, void (*fn)(void *), void **jobs, int n);
+	void *arg;
+	png_job *jobs;
+	void **jobptrs;
+	unsigned char *udata;
+	uLong usize;
+	unsigned char *prev; /* last source row of the previous band */
+	int have_prev;
+	unsigned char dict[PNG_WINDOW]; /* end of the filtered data so far */
+	int dictlen;
+	int started;
+	uLong adler;
+};
+
 static inline void big32(unsigned char *buf, unsigned int v)
 {
 	buf[0] = (v >> 24) & 0xff;
@@ -545,48 +679,221 @@ static inline void big32(unsigned char *buf, unsigned int v)
 	buf[3] = (v) & 0xff;
 }
 
-static inline void put32(unsigned int v, FILE *fp)
-{
-	putc(v >> 24, fp);
-	putc(v >> 16, fp);
-	putc(v >> 8, fp);
-	putc(v, fp);
-}
-
-static void putchunk(char *tag, unsigned char *data, int size, FILE *fp)
+static void putchunk(fz_output *out, char *tag, unsigned char *data, int size)
 {
+	unsigned char buf[4];
 	unsigned int sum;
-	put32(size, fp);
-	fwrite(tag, 1, 4, fp);
-	fwrite(data, 1, size, fp);
+
+	big32(buf, size);
+	fz_write_data(out, buf, 4);
+	fz_write_data(out, tag, 4);
+	fz_write_data(out, data, size);
 	sum = crc32(0, NULL, 0);
 	sum = crc32(sum, (unsigned char*)tag, 4);
 	sum = crc32(sum, data, size);
-	put32(sum, fp);
+	big32(buf, sum);
+	fz_write_data(out, buf, 4);
 }
 
-void
-fz_write_png(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha)
+static void *fz_png_zalloc(void *opaque, unsigned int items, unsigned int size)
+{
+	return fz_malloc_array_no_throw(opaque, items, size);
+}
+
+static void fz_png_zfree(void *opaque, void *address)
+{
+	fz_free(opaque, address);
+}
+
+static inline int paeth(int a, int b, int c)
+{
+	/* The definitions of ac and bc are correct, not a typo. */
+	int ac = b - c, bc = a - c, abcc = ac + bc;
+	int pa = (ac < 0 ? -ac : ac);
+	int pb = (bc < 0 ? -bc : bc);
+	int pc = (abcc < 0 ? -abcc : abcc);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/* Filter one row of len bytes, bpp bytes to a pixel, with the given png
+ * filter type. up is the (unfiltered) row above, all zero for the first
+ * row of the image. */
+static void
+filter_row(unsigned char * restrict dp, const unsigned char * restrict sp, const unsigned char * restrict up, int len, int bpp, int type)
+{
+	int k;
+
+	switch (type)
+	{
+	case FZ_PNG_FILTER_NONE:
+		memcpy(dp, sp, len);
+		break;
+	case FZ_PNG_FILTER_SUB:
+		for (k = 0; k < bpp; k++)
+			dp[k] = sp[k];
+		for (; k < len; k++)
+			dp[k] = sp[k] - sp[k-bpp];
+		break;
+	case FZ_PNG_FILTER_UP:
+		for (k = 0; k < len; k++)
+			dp[k] = sp[k] - up[k];
+		break;
+	case FZ_PNG_FILTER_AVERAGE:
+		for (k = 0; k < bpp; k++)
+			dp[k] = sp[k] - (up[k] >> 1);
+		for (; k < len; k++)
+			dp[k] = sp[k] - ((sp[k-bpp] + up[k]) >> 1);
+		break;
+	case FZ_PNG_FILTER_PAETH:
+		for (k = 0; k < bpp; k++)
+			dp[k] = sp[k] - up[k];
+		for (; k < len; k++)
+			dp[k] = sp[k] - paeth(sp[k-bpp], up[k], up[k-bpp]);
+		break;
+	}
+}
+
+/* The usual heuristic: the filtered row whose bytes, taken as signed,
+ * have the smallest sum of absolute values is likely to compress best. */
+static int
+row_cost(const unsigned char *p, int n)
+{
+	int cost = 0;
+	while (n--)
+	{
+		int v = *p++;
+		cost += v < 128 ? v : 256 - v;
+	}
+	return cost;
+}
+
+/* Drop the alpha channel (if we are not saving it) so that every row we
+ * filter is packed. */
+static const unsigned char *
+pack_row(unsigned char *dp, const unsigned char *sp, int w, int sn, int dn)
+{
+	unsigned char *p = dp;
+	int k;
+
+	if (sn == dn)
+		return sp;
+	while (w--)
+	{
+		for (k = 0; k < dn; k++)
+			p[k] = sp[k];
+		p += dn;
+		sp += sn;
+	}
+	return dp;
+}
+
+static void
+png_filter_job(void *arg)
+{
+	png_job *job = (png_job *)arg;
+	fz_png_output_context *poc = job->poc;
+	int w = poc->w, sn = poc->sn, dn = poc->dn;
+	int stride = w * sn;
+	int len = w * dn;
+	unsigned char *rowbuf = job->scratch;
+	unsigned char *cands = job->scratch + 3 * len;
+	const unsigned char *sp = job->sp;
+	const unsigned char *cur, *up;
+	unsigned char *dp = job->udata;
+	int y, type, best, cost, bestcost;
+
+	/* rowbuf holds two packed rows and a row of zeros. */
+	if (job->prev)
+		up = pack_row(rowbuf + len, job->prev, w, sn, dn);
+	else
+		up = rowbuf + 2 * len;
+
+	for (y = 0; y < job->rows; y++)
+	{
+		cur = pack_row(rowbuf + (y & 1) * len, sp, w, sn, dn);
+		if (poc->filter == FZ_PNG_FILTER_ADAPTIVE)
+		{
+			best = 0;
+			bestcost = INT_MAX;
+			for (type = FZ_PNG_FILTER_NONE; type <= FZ_PNG_FILTER_PAETH; type++)
+			{
+				filter_row(cands + type * len, cur, up, len, dn, type);
+				cost = row_cost(cands + type * len, len);
+				if (cost < bestcost)
+				{
+					best = type;
+					bestcost = cost;
+				}
+			}
+			*dp++ = best;
+			memcpy(dp, cands + best * len, len);
+		}
+		else
+		{
+			*dp++ = poc->filter;
+			filter_row(dp, cur, up, len, dn, poc->filter);
+		}
+		dp += len;
+		up = cur;
+		sp += stride;
+	}
+}
+
+static void
+png_deflate_job(void *arg)
+{
+	png_job *job = (png_job *)arg;
+	z_stream *stream = &job->stream;
+	int err;
+
+	job->ok = 0;
+	job->adler = adler32(adler32(0, NULL, 0), job->udata, job->ulen);
+
+	if (deflateReset(stream) != Z_OK)
+		return;
+	if (job->dictlen > 0 && deflateSetDictionary(stream, job->dict, job->dictlen) != Z_OK)
+		return;
+	stream->next_in = job->udata;
+	stream->avail_in = (uInt)job->ulen;
+	stream->next_out = job->cdata + 2;
+	stream->avail_out = (uInt)(job->csize - 2);
+	err = deflate(stream, Z_SYNC_FLUSH);
+	if (err != Z_OK || stream->avail_in != 0 || stream->avail_out == 0)
+		return;
+	job->clen = stream->next_out - (job->cdata + 2);
+	job->ok = 1;
+}
+
+static void
+png_run_jobs(fz_png_output_context *poc, void (*fn)(void *), int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		poc->jobptrs[i] = &poc->jobs[i];
+	if (poc->run && n > 1)
+		poc->run(poc->arg, fn, poc->jobptrs, n);
+	else
+		for (i = 0; i < n; i++)
+			fn(poc->jobptrs[i]);
+}
+
+fz_png_output_context *
+fz_output_png_header_with_options(fz_output *out, int w, int h, int n, int savealpha, const fz_png_options *opts)
 {
 	static const unsigned char pngsig[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
-	FILE *fp;
 	unsigned char head[13];
-	unsigned char *udata = NULL;
-	unsigned char *cdata = NULL;
-	unsigned char *sp, *dp;
-	uLong usize, csize;
-	int y, x, k, sn, dn;
+	fz_context *ctx = out->ctx;
+	fz_png_output_context *poc = NULL;
 	int color;
-	int err;
+	int dn, i;
 
-	fz_var(udata);
-	fz_var(cdata);
+	fz_var(poc);
 
-	if (pixmap->n != 1 && pixmap->n != 2 && pixmap->n != 4)
+	if (n != 1 && n != 2 && n != 4)
 		fz_throw(ctx, "pixmap must be grayscale or rgb to write as png");
 
-	sn = pixmap->n;
-	dn = pixmap->n;
+	dn = n;
 	if (!savealpha && dn > 1)
 		dn--;
 
@@ -599,70 +906,275 @@ fz_write_png(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha)
 	case 4: color = 6; break;
 	}
 
-	usize = (pixmap->w * dn + 1) * pixmap->h;
-	csize = compressBound(usize);
+	big32(head+0, w);
+	big32(head+4, h);
+	head[8] = 8; /* depth */
+	head[9] = color;
+	head[10] = 0; /* compression */
+	head[11] = 0; /* filter */
+	head[12] = 0; /* interlace */
+
 	fz_try(ctx)
 	{
-		udata = fz_malloc(ctx, usize);
-		cdata = fz_malloc(ctx, csize);
+		poc = fz_malloc_struct(ctx, fz_png_output_context);
+		poc->ctx = ctx;
+		poc->w = w;
+		poc->sn = n;
+		poc->dn = dn;
+		poc->level = Z_DEFAULT_COMPRESSION;
+		poc->filter = FZ_PNG_FILTER_SUB;
+		poc->njobs = 1;
+		if (opts)
+		{
+			if (opts->level >= 0 && opts->level <= 9)
+				poc->level = opts->level;
+			if (opts->filter >= FZ_PNG_FILTER_NONE && opts->filter <= FZ_PNG_FILTER_ADAPTIVE)
+				poc->filter = opts->filter;
+			if (opts->jobs > 1)
+				poc->njobs = opts->jobs;
+			poc->run = opts->run;
+			poc->arg = opts->arg;
+		}
+		poc->adler = adler32(0, NULL, 0);
+		poc->prev = fz_malloc(ctx, w * n);
+		poc->jobs = fz_calloc(ctx, poc->njobs, sizeof(png_job));
+		poc->jobptrs = fz_calloc(ctx, poc->njobs, sizeof(void *));
+		for (i = 0; i < poc->njobs; i++)
+		{
+			png_job *job = &poc->jobs[i];
+			job->poc = poc;
+			job->stream.zalloc = fz_png_zalloc;
+			job->stream.zfree = fz_png_zfree;
+			job->stream.opaque = ctx;
+			if (deflateInit2(&job->stream, poc->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				fz_throw(ctx, "cannot compress image data");
+			job->ready = 1;
+			job->scratch = fz_calloc(ctx, poc->filter == FZ_PNG_FILTER_ADAPTIVE ? 8 : 3, w * dn);
+		}
+
+		fz_write_data(out, pngsig, 8);
+		putchunk(out, "IHDR", head, 13);
 	}
 	fz_catch(ctx)
 	{
-		fz_free(ctx, udata);
+		fz_free_png_output_context(ctx, poc);
 		fz_rethrow(ctx);
 	}
 
-	sp = pixmap->samples;
-	dp = udata;
-	for (y = 0; y < pixmap->h; y++)
+	return poc;
+}
+
+fz_png_output_context *
+fz_output_png_header(fz_output *out, int w, int h, int n, int savealpha)
+{
+	return fz_output_png_header_with_options(out, w, h, n, savealpha, NULL);
+}
+
+void
+fz_output_png_band(fz_output *out, int w, int h, int n, int band, int bandheight, unsigned char *sp, int savealpha, fz_png_output_context *poc)
+{
+	fz_context *ctx = out->ctx;
+	int rows, rowlen, blocks, blockrows, i, y, len;
+	uLong usize;
+
+	if (!poc)
+		return;
+
+	rows = fz_mini(bandheight, h - band * bandheight);
+	if (rows <= 0)
+		return;
+
+	rowlen = w * poc->dn + 1;
+	usize = (uLong)rowlen * rows;
+
+	blocks = usize / PNG_MIN_BLOCK;
+	blocks = fz_maxi(1, fz_mini(blocks, fz_mini(poc->njobs, rows)));
+	blockrows = (rows + blocks - 1) / blocks;
+	blocks = (rows + blockrows - 1) / blockrows;
+
+	if (poc->usize < usize)
 	{
-		*dp++ = 1; /* sub prediction filter */
-		for (x = 0; x < pixmap->w; x++)
+		fz_free(ctx, poc->udata);
+		poc->udata = NULL;
+		poc->usize = 0;
+		poc->udata = fz_malloc(ctx, usize);
+		poc->usize = usize;
+	}
+
+	for (i = 0, y = 0; i < blocks; i++, y += blockrows)
+	{
+		png_job *job = &poc->jobs[i];
+		uLong csize;
+
+		job->rows = fz_mini(blockrows, rows - y);
+		job->sp = sp + (size_t)y * w * n;
+		job->prev = y > 0 ? job->sp - w * n : poc->have_prev ? poc->prev : NULL;
+		job->udata = poc->udata + (size_t)y * rowlen;
+		job->ulen = (uLong)job->rows * rowlen;
+
+		/* Room for the 2 byte zlib header, the block and its sync
+		 * flush marker. */
+		csize = deflateBound(&job->stream, job->ulen) + 2 + 16;
+		if (job->csize < csize)
 		{
-			for (k = 0; k < dn; k++)
-			{
-				if (x == 0)
-					dp[k] = sp[k];
-				else
-					dp[k] = sp[k] - sp[k-sn];
-			}
-			sp += sn;
-			dp += dn;
+			fz_free(ctx, job->cdata);
+			job->cdata = NULL;
+			job->csize = 0;
+			job->cdata = fz_malloc(ctx, csize);
+			job->csize = csize;
+		}
+
+		if (y > 0)
+		{
+			job->dictlen = fz_mini(PNG_WINDOW, y * rowlen);
+			job->dict = job->udata - job->dictlen;
+		}
+		else
+		{
+			job->dictlen = poc->dictlen;
+			job->dict = poc->dict;
 		}
 	}
 
-	err = compress(cdata, &csize, udata, usize);
-	if (err != Z_OK)
+	png_run_jobs(poc, png_filter_job, blocks);
+	png_run_jobs(poc, png_deflate_job, blocks);
+
+	for (i = 0; i < blocks; i++)
 	{
-		fz_free(ctx, udata);
-		fz_free(ctx, cdata);
-		fz_throw(ctx, "cannot compress image data");
+		png_job *job = &poc->jobs[i];
+		unsigned char *data = job->cdata + 2;
+		int clen = job->clen;
+
+		if (!job->ok)
+			fz_throw(ctx, "cannot compress image data");
+
+		if (!poc->started)
+		{
+			/* zlib header: deflate with a 32K window */
+			int flevel = poc->level < 0 ? 2 : poc->level < 2 ? 0 : poc->level < 6 ? 1 : poc->level == 6 ? 2 : 3;
+			data -= 2;
+			clen += 2;
+			data[0] = 0x78;
+			data[1] = flevel << 6;
+			data[1] += 31 - (((data[0] << 8) | data[1]) % 31);
+			poc->started = 1;
+		}
+		putchunk(out, "IDAT", data, clen);
+		poc->adler = adler32_combine(poc->adler, job->adler, job->ulen);
 	}
 
-	fp = fopen(filename, "wb");
-	if (!fp)
+	/* Keep what the next band needs: the last source row, and the end
+	 * of the filtered data to prime the compressor with. */
+	memcpy(poc->prev, sp + (size_t)(rows - 1) * w * n, w * n);
+	poc->have_prev = 1;
+	len = fz_mini(PNG_WINDOW, usize);
+	if (poc->dictlen + len > PNG_WINDOW)
 	{
-		fz_free(ctx, udata);
-		fz_free(ctx, cdata);
-		fz_throw(ctx, "cannot open file '%s': %s", filename, strerror(errno));
+		int keep = PNG_WINDOW - len;
+		memmove(poc->dict, poc->dict + poc->dictlen - keep, keep);
+		poc->dictlen = keep;
 	}
+	memcpy(poc->dict + poc->dictlen, poc->udata + usize - len, len);
+	poc->dictlen += len;
+}
 
-	big32(head+0, pixmap->w);
-	big32(head+4, pixmap->h);
-	head[8] = 8; /* depth */
-	head[9] = color;
-	head[10] = 0; /* compression */
-	head[11] = 0; /* filter */
-	head[12] = 0; /* interlace */
+void
+fz_output_png_trailer(fz_output *out, fz_png_output_context *poc)
+{
+	fz_context *ctx = out->ctx;
+	unsigned char tail[8];
+	unsigned char block[1];
+	int n = 0;
 
-	fwrite(pngsig, 1, 8, fp);
-	putchunk("IHDR", head, 13, fp);
-	putchunk("IDAT", cdata, csize, fp);
-	putchunk("IEND", head, 0, fp);
-	fclose(fp);
+	if (!poc)
+		return;
 
-	fz_free(ctx, udata);
-	fz_free(ctx, cdata);
+	fz_try(ctx)
+	{
+		if (!poc->started)
+		{
+			tail[n++] = 0x78;
+			tail[n++] = 0x01;
+		}
+		/* An empty final fixed huffman block, then the checksum. */
+		tail[n++] = 0x03;
+		tail[n++] = 0x00;
+		big32(tail + n, poc->adler);
+		n += 4;
+		putchunk(out, "IDAT", tail, n);
+		putchunk(out, "IEND", block, 0);
+	}
+	fz_always(ctx)
+	{
+		fz_free_png_output_context(ctx, poc);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+void
+fz_free_png_output_context(fz_context *ctx, fz_png_output_context *poc)
+{
+	int i;
+
+	if (!poc)
+		return;
+	if (poc->jobs)
+	{
+		for (i = 0; i < poc->njobs; i++)
+		{
+			if (poc->jobs[i].ready)
+				deflateEnd(&poc->jobs[i].stream);
+			fz_free(ctx, poc->jobs[i].cdata);
+			fz_free(ctx, poc->jobs[i].scratch);
+		}
+	}
+	fz_free(ctx, poc->jobs);
+	fz_free(ctx, poc->jobptrs);
+	fz_free(ctx, poc->udata);
+	fz_free(ctx, poc->prev);
+	fz_free(ctx, poc);
+}
+
+void
+fz_write_png(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha)
+{
+	fz_write_png_with_options(ctx, pixmap, filename, savealpha, NULL);
+}
+
+void
+fz_write_png_with_options(fz_context *ctx, fz_pixmap *pixmap, char *filename, int savealpha, const fz_png_options *opts)
+{
+	fz_output *out;
+	fz_png_output_context *poc = NULL;
+
+	fz_var(poc);
+
+	if (pixmap->n != 1 && pixmap->n != 2 && pixmap->n != 4)
+		fz_throw(ctx, "pixmap must be grayscale or rgb to write as png");
+
+	out = fz_new_output_to_filename(ctx, filename);
+	fz_try(ctx)
+	{
+		fz_png_output_context *last;
+
+		poc = fz_output_png_header_with_options(out, pixmap->w, pixmap->h, pixmap->n, savealpha, opts);
+		fz_output_png_band(out, pixmap->w, pixmap->h, pixmap->n, 0, pixmap->h, pixmap->samples, savealpha, poc);
+		last = poc;
+		poc = NULL;
+		fz_output_png_trailer(out, last);
+	}
+	fz_always(ctx)
+	{
+		fz_close_output(out);
+	}
+	fz_catch(ctx)
+	{
+		fz_free_png_output_context(ctx, poc);
+		fz_rethrow(ctx);
+	}
 }
 
 unsigned int
@@ -693,6 +1205,58 @@ fz_drop_image(fz_context *ctx, fz_image *image)
 	fz_drop_storable(ctx, &image->storable);
 }
 
+typedef struct fz_pixmap_image_s fz_pixmap_image;
+
+struct fz_pixmap_image_s
+{
+	fz_image base;
+	fz_pixmap *pix;
+};
+
+static void
+fz_free_pixmap_image(fz_context *ctx, fz_storable *image_)
+{
+	fz_pixmap_image *image = (fz_pixmap_image *)image_;
+
+	fz_drop_colorspace(ctx, image->base.colorspace);
+	fz_drop_pixmap(ctx, image->pix);
+	fz_free(ctx, image);
+}
+
+static fz_pixmap *
+fz_pixmap_image_to_pixmap(fz_context *ctx, fz_image *image_, int w, int h)
+{
+	fz_pixmap_image *image = (fz_pixmap_image *)image_;
+
+	return fz_keep_pixmap(ctx, image->pix);
+}
+
+fz_image *
+fz_new_image_from_pixmap(fz_context *ctx, fz_pixmap *pix)
+{
+	fz_pixmap_image *image;
+
+	fz_try(ctx)
+	{
+		image = fz_malloc_struct(ctx, fz_pixmap_image);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_rethrow(ctx);
+	}
+
+	FZ_INIT_STORABLE(&image->base, 1, fz_free_pixmap_image, FZ_STORE_IMAGE);
+	image->base.w = pix->w;
+	image->base.h = pix->h;
+	image->base.mask = NULL;
+	image->base.colorspace = fz_keep_colorspace(ctx, pix->colorspace);
+	image->base.get_pixmap = fz_pixmap_image_to_pixmap;
+	image->pix = pix;
+
+	return &image->base;
+}
+
 #ifdef ARCH_ARM
 static void
 fz_subsample_pixmap_ARM(unsigned char *ptr, int w, int h, int f, int factor,
@@ -1,23 +1,40 @@
 #include "fitz-internal.h"
 
+/*
+	The store is split into FZ_STORE_STRIPES stripes, each with its own
+	lock (FZ_LOCK_STORE + stripe index), hash table and usage ordered
+	list. Items with hashable keys go to the stripe their hash selects;
+	the rest all live in stripe 0, where they are searched for slowly.
+
+	Sizes and budgets (overall and for each kind of resource) are
+	shared between the stripes and guarded by FZ_LOCK_ALLOC, as are
+	the reference counts of the stored values. A stripe lock may be
+	held while taking FZ_LOCK_ALLOC, but never while allocating, as
+	the allocator may need to scavenge the store.
+
+	Eviction takes the least recently used evictable item of each
+	stripe in turn, which approximates a single LRU across the store.
+*/
+
 typedef struct fz_item_s fz_item;
+typedef struct fz_store_stripe_s fz_store_stripe;
 
 struct fz_item_s
 {
 	void *key;
 	fz_storable *val;
 	unsigned int size;
+	int kind;
 	fz_item *next;
 	fz_item *prev;
-	fz_store *store;
 	fz_store_type *type;
 };
 
-struct fz_store_s
+struct fz_store_stripe_s
 {
-	int refs;
+	int lock;
 
-	/* Every item in the store is kept in a doubly linked list, ordered
+	/* Every item in the stripe is kept in a doubly linked list, ordered
 	 * by usage (so LRU entries are at the end). */
 	fz_item *head;
 	fz_item *tail;
@@ -25,34 +42,99 @@ struct fz_store_s
 	/* We have a hash table that allows to quickly find a subset of the
 	 * entries (those whose keys are indirect objects). */
 	fz_hash_table *hash;
+};
+
+struct fz_store_s
+{
+	int refs;
 
-	/* We keep track of the size of the store, and keep it below max. */
+	fz_store_stripe stripe[FZ_STORE_STRIPES];
+
+	/* We keep track of the size of the store, and keep it below max.
+	 * Each kind of resource may have a tighter budget of its own. */
 	unsigned int max;
 	unsigned int size;
+	unsigned int kind_max[FZ_STORE_KINDS];
+	unsigned int kind_size[FZ_STORE_KINDS];
 };
 
 void
 fz_new_store_context(fz_context *ctx, unsigned int max)
 {
 	fz_store *store;
+	int i;
+
 	store = fz_malloc_struct(ctx, fz_store);
 	fz_try(ctx)
 	{
-		store->hash = fz_new_hash_table(ctx, 4096, sizeof(fz_store_hash), FZ_LOCK_ALLOC);
+		for (i = 0; i < FZ_STORE_STRIPES; i++)
+		{
+			store->stripe[i].lock = FZ_LOCK_STORE + i;
+			store->stripe[i].hash = fz_new_hash_table(ctx, 4096 / FZ_STORE_STRIPES, sizeof(fz_store_hash), FZ_LOCK_STORE + i);
+		}
 	}
 	fz_catch(ctx)
 	{
+		for (i = 0; i < FZ_STORE_STRIPES; i++)
+			if (store->stripe[i].hash)
+				fz_free_hash(ctx, store->stripe[i].hash);
 		fz_free(ctx, store);
 		fz_rethrow(ctx);
 	}
 	store->refs = 1;
-	store->head = NULL;
-	store->tail = NULL;
 	store->size = 0;
 	store->max = max;
 	ctx->store = store;
 }
 
+static int
+store_kind(fz_storable *val)
+{
+	if (val->kind < 0 || val->kind >= FZ_STORE_KINDS)
+		return FZ_STORE_OTHER;
+	return val->kind;
+}
+
+static fz_store_stripe *
+store_stripe(fz_store *store, fz_store_hash *hash, int use_hash)
+{
+	unsigned char *s = (unsigned char *)hash;
+	unsigned int h = 0;
+	int i;
+
+	if (!use_hash)
+		return &store->stripe[0];
+	for (i = 0; i < (int)sizeof(fz_store_hash); i++)
+		h = h * 31 + s[i];
+	h ^= h >> 11;
+	return &store->stripe[h % FZ_STORE_STRIPES];
+}
+
+static void
+lru_unlink(fz_store_stripe *stripe, fz_item *item)
+{
+	if (item->next)
+		item->next->prev = item->prev;
+	else
+		stripe->tail = item->prev;
+	if (item->prev)
+		item->prev->next = item->next;
+	else
+		stripe->head = item->next;
+}
+
+static void
+lru_push_front(fz_store_stripe *stripe, fz_item *item)
+{
+	item->next = stripe->head;
+	if (item->next)
+		item->next->prev = item;
+	else
+		stripe->tail = item;
+	item->prev = NULL;
+	stripe->head = item;
+}
+
 void *
 fz_keep_storable(fz_context *ctx, fz_storable *s)
 {
@@ -91,112 +173,186 @@ fz_drop_storable(fz_context *ctx, fz_storable *s)
 		s->free(ctx, s);
 }
 
+/* Called with the stripe lock held; returns with it released. */
 static void
-evict(fz_context *ctx, fz_item *item)
+evict(fz_context *ctx, fz_store_stripe *stripe, fz_item *item)
 {
 	fz_store *store = ctx->store;
 	int drop;
 
-	store->size -= item->size;
 	/* Unlink from the linked list */
-	if (item->next)
-		item->next->prev = item->prev;
-	else
-		store->tail = item->prev;
-	if (item->prev)
-		item->prev->next = item->next;
-	else
-		store->head = item->next;
-	/* Drop a reference to the value (freeing if required) */
-	drop = (item->val->refs > 0 && --item->val->refs == 0);
+	lru_unlink(stripe, item);
 	/* Remove from the hash table */
 	if (item->type->make_hash_key)
 	{
 		fz_store_hash hash = { NULL };
 		hash.free = item->val->free;
 		if (item->type->make_hash_key(&hash, item->key))
-			fz_hash_remove(ctx, store->hash, &hash);
+			fz_hash_remove(ctx, stripe->hash, &hash);
 	}
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	store->size -= item->size;
+	store->kind_size[item->kind] -= item->size;
+	/* Drop a reference to the value (freeing if required) */
+	drop = (item->val->refs > 0 && --item->val->refs == 0);
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, stripe->lock);
 	if (drop)
 		item->val->free(ctx, item->val);
 	/* Always drops the key and free the item */
 	item->type->drop_key(ctx, item->key);
 	fz_free(ctx, item);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 }
 
-static int
-ensure_space(fz_context *ctx, unsigned int tofree)
+/* Find the least recently used item of the given kind (or any kind if
+ * kind < 0) that nobody but the store is using. Called with the stripe
+ * lock and FZ_LOCK_ALLOC held. */
+static fz_item *
+find_victim(fz_store_stripe *stripe, int kind)
+{
+	fz_item *item;
+
+	for (item = stripe->tail; item; item = item->prev)
+		if ((kind < 0 || item->kind == kind) && item->val->refs == 1)
+			return item;
+	return NULL;
+}
+
+/* Count how much of tofree we could recover by evicting. */
+static unsigned int
+count_evictable(fz_context *ctx, int kind, unsigned int tofree)
 {
-	fz_item *item, *prev;
-	unsigned int count;
 	fz_store *store = ctx->store;
+	fz_item *item;
+	unsigned int count = 0;
+	int i;
 
-	fz_assert_lock_held(ctx, FZ_LOCK_ALLOC);
+	for (i = 0; i < FZ_STORE_STRIPES && count < tofree; i++)
+	{
+		fz_store_stripe *stripe = &store->stripe[i];
 
-	/* First check that we *can* free tofree; if not, we'd rather not
-	 * cache this. */
-	count = 0;
-	for (item = store->tail; item; item = item->prev)
+		fz_lock(ctx, stripe->lock);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		for (item = stripe->tail; item && count < tofree; item = item->prev)
+			if ((kind < 0 || item->kind == kind) && item->val->refs == 1)
+				count += item->size;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, stripe->lock);
+	}
+
+	return count;
+}
+
+/* Evict items of the given kind (or any kind if kind < 0), taking the
+ * LRU evictable item from each stripe in turn until at least tofree
+ * bytes have been recovered or nothing more can go. Called without any
+ * store locks held. */
+static unsigned int
+evict_items(fz_context *ctx, int kind, unsigned int tofree)
+{
+	fz_store *store = ctx->store;
+	unsigned int count = 0;
+	int i, progress;
+
+	do
 	{
-		if (item->val->refs == 1)
+		progress = 0;
+		for (i = 0; i < FZ_STORE_STRIPES; i++)
 		{
+			fz_store_stripe *stripe = &store->stripe[i];
+			fz_item *item;
+
+			fz_lock(ctx, stripe->lock);
+			fz_lock(ctx, FZ_LOCK_ALLOC);
+			item = find_victim(stripe, kind);
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			if (!item)
+			{
+				fz_unlock(ctx, stripe->lock);
+				continue;
+			}
+			/* Only the store holds a reference to the item, and we
+			 * hold the stripe lock, so nobody can take it from
+			 * under us between the check and the eviction. */
 			count += item->size;
+			progress = 1;
+			evict(ctx, stripe, item); /* Drops the stripe lock */
 			if (count >= tofree)
-				break;
+				return count;
 		}
 	}
+	while (progress);
 
-	/* If we ran out of items to search, then we can never free enough */
-	if (item == NULL)
-	{
+	return count;
+}
+
+static int
+ensure_space(fz_context *ctx, int kind, unsigned int tofree)
+{
+	/* First check that we *can* free tofree; if not, we'd rather not
+	 * cache this. */
+	if (count_evictable(ctx, kind, tofree) < tofree)
 		return 0;
-	}
 
 	/* Actually free the items */
-	count = 0;
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->val->refs == 1)
-		{
-			/* Free this item. Evict has to drop the lock to
-			 * manage that, which could cause prev to be removed
-			 * in the meantime. To avoid that we bump its reference
-			 * count here. This may cause another simultaneous
-			 * evict process to fail to make enough space as prev is
-			 * pinned - but that will only happen if we're near to
-			 * the limit anyway, and it will only cause something to
-			 * not be cached. */
-			count += item->size;
-			if (prev)
-				prev->val->refs++;
-			evict(ctx, item); /* Drops then retakes lock */
-			/* So the store has 1 reference to prev, as do we, so
-			 * no other evict process can have thrown prev away in
-			 * the meantime. So we are safe to just decrement its
-			 * reference count here. */
-			if (prev)
-				--prev->val->refs;
+	return evict_items(ctx, kind, tofree);
+}
 
-			if (count >= tofree)
-				return count;
-		}
+/* Account for itemsize more bytes of the given kind, evicting to keep
+ * within the budgets. Returns 0 if the space cannot be found. */
+static int
+reserve_space(fz_context *ctx, int kind, unsigned int itemsize)
+{
+	fz_store *store = ctx->store;
+	unsigned int kind_max, over_kind, over_all;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	for (;;)
+	{
+		kind_max = store->kind_max[kind];
+		over_kind = 0;
+		over_all = 0;
+		if (kind_max != FZ_STORE_UNLIMITED && store->kind_size[kind] + itemsize > kind_max)
+			over_kind = store->kind_size[kind] + itemsize - kind_max;
+		if (store->max != FZ_STORE_UNLIMITED && store->size + itemsize > store->max)
+			over_all = store->size + itemsize - store->max;
+		if (!over_kind && !over_all)
+			break;
+		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		/* Evicting within the kind also helps the overall size */
+		if (over_kind && ensure_space(ctx, kind, over_kind) == 0)
+			return 0;
+		if (!over_kind && ensure_space(ctx, -1, over_all) == 0)
+			return 0;
+		fz_lock(ctx, FZ_LOCK_ALLOC);
 	}
+	store->size += itemsize;
+	store->kind_size[kind] += itemsize;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	return 1;
+}
 
-	return count;
+static void
+release_space(fz_context *ctx, int kind, unsigned int itemsize)
+{
+	fz_store *store = ctx->store;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	store->size -= itemsize;
+	store->kind_size[kind] -= itemsize;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
 void *
 fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_store_type *type)
 {
 	fz_item *item = NULL;
-	unsigned int size;
 	fz_storable *val = (fz_storable *)val_;
 	fz_store *store = ctx->store;
+	fz_store_stripe *stripe;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
+	int kind;
 
 	if (!store)
 		return NULL;
@@ -220,33 +376,27 @@ fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_
 		hash.free = val->free;
 		use_hash = type->make_hash_key(&hash, key);
 	}
+	stripe = store_stripe(store, &hash, use_hash);
+	kind = store_kind(val);
 
 	type->keep_key(ctx, key);
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	if (store->max != FZ_STORE_UNLIMITED)
+	if (!reserve_space(ctx, kind, itemsize))
 	{
-		size = store->size + itemsize;
-		while (size > store->max)
-		{
-			/* ensure_space may drop, then retake the lock */
-			if (ensure_space(ctx, size - store->max) == 0)
-			{
-				/* Failed to free any space */
-				fz_unlock(ctx, FZ_LOCK_ALLOC);
-				fz_free(ctx, item);
-				type->drop_key(ctx, key);
-				return NULL;
-			}
-		}
+		/* Failed to free any space */
+		fz_free(ctx, item);
+		type->drop_key(ctx, key);
+		return NULL;
 	}
-	store->size += itemsize;
 
 	item->key = key;
 	item->val = val;
 	item->size = itemsize;
+	item->kind = kind;
 	item->next = NULL;
 	item->type = type;
 
+	fz_lock(ctx, stripe->lock);
+
 	/* If we can index it fast, put it into the hash table */
 	if (use_hash)
 	{
@@ -255,37 +405,39 @@ fz_store_item(fz_context *ctx, void *key, void *val_, unsigned int itemsize, fz_
 		fz_try(ctx)
 		{
 			/* May drop and retake the lock */
-			existing = fz_hash_insert(ctx, store->hash, &hash, item);
+			existing = fz_hash_insert(ctx, stripe->hash, &hash, item);
 		}
 		fz_catch(ctx)
 		{
-			store->size -= itemsize;
-			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			fz_unlock(ctx, stripe->lock);
+			release_space(ctx, kind, itemsize);
 			fz_free(ctx, item);
+			type->drop_key(ctx, key);
 			return NULL;
 		}
 		if (existing)
 		{
 			/* Take a new reference */
+			fz_lock(ctx, FZ_LOCK_ALLOC);
 			if (existing->val->refs > 0)
 				existing->val->refs++;
 			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			val = existing->val;
+			fz_unlock(ctx, stripe->lock);
+			release_space(ctx, kind, itemsize);
 			fz_free(ctx, item);
-			return existing->val;
+			type->drop_key(ctx, key);
+			return val;
 		}
 	}
 	/* Now we can never fail, bump the ref */
+	fz_lock(ctx, FZ_LOCK_ALLOC);
 	if (val->refs > 0)
 		val->refs++;
-	/* Regardless of whether it's indexed, it goes into the linked list */
-	item->next = store->head;
-	if (item->next)
-		item->next->prev = item;
-	else
-		store->tail = item;
-	store->head = item;
-	item->prev = NULL;
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	/* Regardless of whether it's indexed, it goes into the linked list */
+	lru_push_front(stripe, item);
+	fz_unlock(ctx, stripe->lock);
 
 	return NULL;
 }
@@ -295,6 +447,7 @@ fz_find_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type *
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_stripe *stripe;
 	fz_store_hash hash = { NULL };
 	int use_hash = 0;
 
@@ -309,17 +462,18 @@ fz_find_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type *
 		hash.free = free;
 		use_hash = type->make_hash_key(&hash, key);
 	}
+	stripe = store_stripe(store, &hash, use_hash);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, stripe->lock);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirected objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, stripe->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = stripe->head; item; item = item->next)
 		{
 			if (item->val->free == free && !type->cmp_key(item->key, key))
 				break;
@@ -327,31 +481,20 @@ fz_find_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type *
 	}
 	if (item)
 	{
+		fz_storable *val = item->val;
+
 		/* LRU: Move the block to the front */
-		/* Unlink from present position */
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
-		/* Insert at head */
-		item->next = store->head;
-		if (item->next)
-			item->next->prev = item;
-		else
-			store->tail = item;
-		item->prev = NULL;
-		store->head = item;
+		lru_unlink(stripe, item);
+		lru_push_front(stripe, item);
 		/* And bump the refcount before returning */
-		if (item->val->refs > 0)
-			item->val->refs++;
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		if (val->refs > 0)
+			val->refs++;
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		return (void *)item->val;
+		fz_unlock(ctx, stripe->lock);
+		return (void *)val;
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	fz_unlock(ctx, stripe->lock);
 
 	return NULL;
 }
@@ -361,8 +504,9 @@ fz_remove_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type
 {
 	fz_item *item;
 	fz_store *store = ctx->store;
+	fz_store_stripe *stripe;
 	int drop;
-	fz_store_hash hash;
+	fz_store_hash hash = { NULL };
 	int use_hash = 0;
 
 	if (type->make_hash_key)
@@ -370,58 +514,81 @@ fz_remove_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type
 		hash.free = free;
 		use_hash = type->make_hash_key(&hash, key);
 	}
+	stripe = store_stripe(store, &hash, use_hash);
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
+	fz_lock(ctx, stripe->lock);
 	if (use_hash)
 	{
 		/* We can find objects keyed on indirect objects quickly */
-		item = fz_hash_find(ctx, store->hash, &hash);
+		item = fz_hash_find(ctx, stripe->hash, &hash);
 		if (item)
-			fz_hash_remove(ctx, store->hash, &hash);
+			fz_hash_remove(ctx, stripe->hash, &hash);
 	}
 	else
 	{
 		/* Others we have to hunt for slowly */
-		for (item = store->head; item; item = item->next)
+		for (item = stripe->head; item; item = item->next)
 			if (item->val->free == free && !type->cmp_key(item->key, key))
 				break;
 	}
 	if (item)
 	{
-		if (item->next)
-			item->next->prev = item->prev;
-		else
-			store->tail = item->prev;
-		if (item->prev)
-			item->prev->next = item->next;
-		else
-			store->head = item->next;
+		lru_unlink(stripe, item);
+		fz_lock(ctx, FZ_LOCK_ALLOC);
+		store->size -= item->size;
+		store->kind_size[item->kind] -= item->size;
 		drop = (item->val->refs > 0 && --item->val->refs == 0);
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, stripe->lock);
 		if (drop)
 			item->val->free(ctx, item->val);
 		type->drop_key(ctx, item->key);
 		fz_free(ctx, item);
 	}
 	else
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
+		fz_unlock(ctx, stripe->lock);
 }
 
 void
 fz_empty_store(fz_context *ctx)
 {
 	fz_store *store = ctx->store;
+	int i;
 
 	if (store == NULL)
 		return;
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
 	/* Run through all the items in the store */
-	while (store->head)
+	for (i = 0; i < FZ_STORE_STRIPES; i++)
 	{
-		evict(ctx, store->head); /* Drops then retakes lock */
+		fz_store_stripe *stripe = &store->stripe[i];
+
+		fz_lock(ctx, stripe->lock);
+		while (stripe->head)
+		{
+			evict(ctx, stripe, stripe->head); /* Drops the lock */
+			fz_lock(ctx, stripe->lock);
+		}
+		fz_unlock(ctx, stripe->lock);
 	}
+}
+
+void
+fz_set_store_budget(fz_context *ctx, int kind, unsigned int max)
+{
+	fz_store *store = ctx->store;
+	unsigned int size;
+
+	if (store == NULL || kind < 0 || kind >= FZ_STORE_KINDS)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	store->kind_max[kind] = max;
+	size = store->kind_size[kind];
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	if (max != FZ_STORE_UNLIMITED && size > max)
+		evict_items(ctx, kind, size - max);
 }
 
 fz_store *
@@ -438,7 +605,7 @@ fz_keep_store_context(fz_context *ctx)
 void
 fz_drop_store_context(fz_context *ctx)
 {
-	int refs;
+	int refs, i;
 	if (ctx == NULL || ctx->store == NULL)
 		return;
 	fz_lock(ctx, FZ_LOCK_ALLOC);
@@ -448,7 +615,8 @@ fz_drop_store_context(fz_context *ctx)
 		return;
 
 	fz_empty_store(ctx);
-	fz_free_hash(ctx, ctx->store->hash);
+	for (i = 0; i < FZ_STORE_STRIPES; i++)
+		fz_free_hash(ctx, ctx->store->stripe[i].hash);
 	fz_free(ctx, ctx->store);
 	ctx->store = NULL;
 }
@@ -459,54 +627,48 @@ fz_print_store(fz_context *ctx, FILE *out)
 {
 	fz_item *item, *next;
 	fz_store *store = ctx->store;
+	int i;
 
 	fprintf(out, "-- resource store contents --\n");
 
-	fz_lock(ctx, FZ_LOCK_ALLOC);
-	for (item = store->head; item; item = next)
+	for (i = 0; i < FZ_STORE_STRIPES; i++)
 	{
-		next = item->next;
-		if (next)
-			next->val->refs++;
-		fprintf(out, "store[*][refs=%d][size=%d] ", item->val->refs, item->size);
-		fz_unlock(ctx, FZ_LOCK_ALLOC);
-		item->type->debug(item->key);
-		fprintf(out, " = %p\n", item->val);
-		fz_lock(ctx, FZ_LOCK_ALLOC);
-		if (next)
-			next->val->refs--;
+		fz_store_stripe *stripe = &store->stripe[i];
+
+		fz_lock(ctx, stripe->lock);
+		for (item = stripe->head; item; item = next)
+		{
+			next = item->next;
+			fz_lock(ctx, FZ_LOCK_ALLOC);
+			if (next)
+				next->val->refs++;
+			fprintf(out, "store[%d][refs=%d][size=%d] ", i, item->val->refs, item->size);
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+			fz_unlock(ctx, stripe->lock);
+			item->type->debug(item->key);
+			fprintf(out, " = %p\n", item->val);
+			fz_lock(ctx, stripe->lock);
+			fz_lock(ctx, FZ_LOCK_ALLOC);
+			if (next)
+				next->val->refs--;
+			fz_unlock(ctx, FZ_LOCK_ALLOC);
+		}
+		fz_unlock(ctx, stripe->lock);
 	}
-	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 #endif
 
-/* This is now an n^2 algorithm - not ideal, but it'll only be bad if we are
- * actually managing to scavenge lots of blocks back. */
+/* Called from the allocator with FZ_LOCK_ALLOC held. The lock is
+ * dropped while we evict, as the stripe locks must be taken first. */
 static int
 scavenge(fz_context *ctx, unsigned int tofree)
 {
-	fz_store *store = ctx->store;
-	unsigned int count = 0;
-	fz_item *item, *prev;
-
-	/* Free the items */
-	for (item = store->tail; item; item = prev)
-	{
-		prev = item->prev;
-		if (item->val->refs == 1)
-		{
-			/* Free this item */
-			count += item->size;
-			evict(ctx, item); /* Drops then retakes lock */
+	unsigned int count;
 
-			if (count >= tofree)
-				break;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	count = evict_items(ctx, -1, tofree);
+	fz_lock(ctx, FZ_LOCK_ALLOC);
 
-			/* Have to restart search again, as prev may no longer
-			 * be valid due to release of lock in evict. */
-			prev = store->tail;
-		}
-	}
 	/* Success is managing to evict any blocks */
 	return count != 0;
 }
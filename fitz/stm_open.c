@@ -1,5 +1,10 @@
 #include "fitz-internal.h"
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 fz_stream *
 fz_new_stream(fz_context *ctx, void *state,
 	int(*read)(fz_stream *stm, unsigned char *buf, int len),
@@ -71,9 +76,9 @@ static int read_file(fz_stream *stm, unsigned char *buf, int len)
 	return n;
 }
 
-static void seek_file(fz_stream *stm, int offset, int whence)
+static void seek_file(fz_stream *stm, fz_off_t offset, int whence)
 {
-	int n = lseek(*(int*)stm->state, offset, whence);
+	fz_off_t n = fz_lseek(*(int*)stm->state, offset, whence);
 	if (n < 0)
 		fz_throw(stm->ctx, "cannot lseek: %s", strerror(errno));
 	stm->pos = n;
@@ -112,8 +117,8 @@ fz_open_fd(fz_context *ctx, int fd)
 	return stm;
 }
 
-fz_stream *
-fz_open_file(fz_context *ctx, const char *name)
+static int
+open_file_fd(fz_context *ctx, const char *name)
 {
 #ifdef _WIN32
 	char *s = (char*)name;
@@ -132,7 +137,13 @@ fz_open_file(fz_context *ctx, const char *name)
 #endif
 	if (fd == -1)
 		fz_throw(ctx, "cannot open %s", name);
-	return fz_open_fd(ctx, fd);
+	return fd;
+}
+
+fz_stream *
+fz_open_file(fz_context *ctx, const char *name)
+{
+	return fz_open_fd(ctx, open_file_fd(ctx, name));
 }
 
 #ifdef _WIN32
@@ -153,15 +164,19 @@ static int read_buffer(fz_stream *stm, unsigned char *buf, int len)
 	return 0;
 }
 
-static void seek_buffer(fz_stream *stm, int offset, int whence)
+static void seek_buffer(fz_stream *stm, fz_off_t offset, int whence)
 {
-	if (whence == 0)
-		stm->rp = stm->bp + offset;
+	fz_off_t len = stm->ep - stm->bp;
+
 	if (whence == 1)
-		stm->rp += offset;
+		offset += stm->rp - stm->bp;
 	if (whence == 2)
-		stm->rp = stm->ep - offset;
-	stm->rp = fz_clampp(stm->rp, stm->bp, stm->ep);
+		offset = len - offset;
+	if (offset < 0)
+		offset = 0;
+	if (offset > len)
+		offset = len;
+	stm->rp = stm->bp + offset;
 	stm->wp = stm->ep;
 }
 
@@ -208,3 +223,71 @@ fz_open_memory(fz_context *ctx, unsigned char *data, int len)
 
 	return stm;
 }
+
+/* Memory mapped file stream */
+
+#ifndef _WIN32
+
+struct mmap_state
+{
+	void *map;
+	size_t len;
+};
+
+static void close_mmap(fz_context *ctx, void *state_)
+{
+	struct mmap_state *state = (struct mmap_state *)state_;
+	if (munmap(state->map, state->len) < 0)
+		fz_warn(ctx, "munmap error: %s", strerror(errno));
+	fz_free(ctx, state);
+}
+
+#endif
+
+fz_stream *
+fz_open_file_mmap(fz_context *ctx, const char *name)
+{
+	int fd = open_file_fd(ctx, name);
+#ifndef _WIN32
+	struct mmap_state *state;
+	struct stat info;
+	fz_stream *stm;
+	void *map;
+
+	/* Pipes, devices, empty and oversized files use an ordinary file stream */
+	if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode) || info.st_size <= 0 ||
+		(unsigned long long)info.st_size > (size_t)-1 / 2)
+		return fz_open_fd(ctx, fd);
+
+	map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return fz_open_fd(ctx, fd);
+	close(fd);
+
+	fz_try(ctx)
+	{
+		state = fz_malloc_struct(ctx, struct mmap_state);
+	}
+	fz_catch(ctx)
+	{
+		munmap(map, (size_t)info.st_size);
+		fz_rethrow(ctx);
+	}
+	state->map = map;
+	state->len = (size_t)info.st_size;
+
+	stm = fz_new_stream(ctx, state, read_buffer, close_mmap);
+	stm->seek = seek_buffer;
+
+	stm->bp = map;
+	stm->rp = stm->bp;
+	stm->wp = stm->bp + state->len;
+	stm->ep = stm->wp;
+
+	stm->pos = state->len;
+
+	return stm;
+#else
+	return fz_open_fd(ctx, fd);
+#endif
+}
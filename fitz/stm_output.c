@@ -8,6 +8,22 @@ file_printf(fz_output *out, const char *fmt, va_list ap)
 	return vfprintf(file, fmt, ap);
 }
 
+static int
+file_write(fz_output *out, const void *data, int len)
+{
+	FILE *file = (FILE *)out->opaque;
+
+	return fwrite(data, 1, len, file);
+}
+
+static void
+file_close(fz_output *out)
+{
+	FILE *file = (FILE *)out->opaque;
+
+	fclose(file);
+}
+
 fz_output *
 fz_new_output_file(fz_context *ctx, FILE *file)
 {
@@ -15,10 +31,33 @@ fz_new_output_file(fz_context *ctx, FILE *file)
 	out->ctx = ctx;
 	out->opaque = file;
 	out->printf = file_printf;
+	out->write = file_write;
 	out->close = NULL;
 	return out;
 }
 
+fz_output *
+fz_new_output_to_filename(fz_context *ctx, const char *filename)
+{
+	fz_output *out = NULL;
+	FILE *file = fopen(filename, "wb");
+
+	if (!file)
+		fz_throw(ctx, "cannot open file '%s': %s", filename, strerror(errno));
+
+	fz_try(ctx)
+	{
+		out = fz_new_output_file(ctx, file);
+		out->close = file_close;
+	}
+	fz_catch(ctx)
+	{
+		fclose(file);
+		fz_rethrow(ctx);
+	}
+	return out;
+}
+
 void
 fz_close_output(fz_output *out)
 {
@@ -45,6 +84,14 @@ fz_printf(fz_output *out, const char *fmt, ...)
 	return ret;
 }
 
+int
+fz_write_data(fz_output *out, const void *data, int len)
+{
+	if (!out)
+		return 0;
+	return out->write(out, data, len);
+}
+
 static int
 buffer_printf(fz_output *out, const char *fmt, va_list list)
 {
@@ -53,6 +100,15 @@ buffer_printf(fz_output *out, const char *fmt, va_list list)
 	return fz_buffer_vprintf(out->ctx, buffer, fmt, list);
 }
 
+static int
+buffer_write(fz_output *out, const void *data, int len)
+{
+	fz_buffer *buffer = (fz_buffer *)out->opaque;
+
+	fz_write_buffer(out->ctx, buffer, (unsigned char *)data, len);
+	return len;
+}
+
 fz_output *
 fz_new_output_buffer(fz_context *ctx, fz_buffer *buf)
 {
@@ -60,6 +116,7 @@ fz_new_output_buffer(fz_context *ctx, fz_buffer *buf)
 	out->ctx = ctx;
 	out->opaque = buf;
 	out->printf = buffer_printf;
+	out->write = buffer_write;
 	out->close = NULL;
 	return out;
 }
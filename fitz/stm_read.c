@@ -7,7 +7,8 @@ fz_read(fz_stream *stm, unsigned char *buf, int len)
 {
 	int count, n;
 
-	count = fz_mini(len, stm->wp - stm->rp);
+	/* wp - rp may exceed an int for memory mapped files */
+	count = stm->wp - stm->rp < len ? stm->wp - stm->rp : len;
 	if (count)
 	{
 		memcpy(buf, stm->rp, count);
@@ -173,14 +174,14 @@ fz_read_line(fz_stream *stm, char *mem, int n)
 		*s = '\0';
 }
 
-int
+fz_off_t
 fz_tell(fz_stream *stm)
 {
 	return stm->pos - (stm->wp - stm->rp);
 }
 
 void
-fz_seek(fz_stream *stm, int offset, int whence)
+fz_seek(fz_stream *stm, fz_off_t offset, int whence)
 {
 	if (stm->seek)
 	{
@@ -191,7 +192,7 @@ fz_seek(fz_stream *stm, int offset, int whence)
 		}
 		if (whence == 0)
 		{
-			int dist = stm->pos - offset;
+			fz_off_t dist = stm->pos - offset;
 			if (dist >= 0 && dist <= stm->wp - stm->bp)
 			{
 				stm->rp = stm->wp - dist;
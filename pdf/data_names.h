@@ -0,0 +1,57 @@
+/*
+ * Names that the pdf code itself looks up or creates, plus the common
+ * keys and values of the PDF specification. Name objects for these are
+ * interned as atoms (index + 1), which dictionary lookups compare in
+ * place of the strings. Keep the list sorted (in C locale order).
+ */
+
+static const char *pdf_name_list[] = {
+"A","AA","AESV2","AESV3","AIS","AP","AS","ASCIIHexDecode","AcroForm",
+"Action","Alpha","Alternate","Annot","Annots","ArtBox","Ascent",
+"Author","AvgWidth","B","BBox","BC","BG","BM","BPC","BS","Background",
+"BaseEncoding","BaseFont","BaseState","BitsPerComponent",
+"BitsPerCoordinate","BitsPerFlag","BitsPerSample","BlackIs1","BleedBox",
+"Border","Bounds","C","C0","C1","CA","CCITTFaxDecode","CF","CFM",
+"CIDFontType0","CIDFontType0C","CIDFontType2","CIDSystemInfo",
+"CIDToGIDMap","CO","CS","CalGray","CalRGB","CapHeight","Caret",
+"Catalog","CharProcs","CharSet","Circle","Color","ColorBurn",
+"ColorDodge","ColorSpace","ColorTransform","Colors","Columns",
+"Compatible","Configs","Contents","Coords","Count","CreationDate",
+"Creator","CropBox","Crypt","D","DA","DCTDecode","DP","DV","DW","DW2",
+"DamagedRowsBeforeError","Darken","Decode","DecodeParms","Default",
+"DescendantFonts","Descent","Dest","Dests","DeviceCMYK","DeviceGray",
+"DeviceN","DeviceRGB","Di","Difference","Differences","Dirty","Dm",
+"Domain","Dur","E","EarlyChange","Encode","EncodedByteAlign","Encoding",
+"Encrypt","EncryptMetadata","EndOfBlock","EndOfLine","Exclude",
+"Exclusion","ExtGState","Extend","F","Fields","FileAttachment","Filter",
+"First","FirstChar","Fit","FitB","FitBH","FitBV","FitH","FitR","FitV",
+"Flags","FlateDecode","Font","FontBBox","FontDescriptor","FontFamily",
+"FontFile","FontFile2","FontFile3","FontMatrix","FontName",
+"FontStretch","FontWeight","Form","FormType","FreeText","Function",
+"FunctionType","Functions","G","GoTo","GoToR","Group","H","HardLight",
+"Height","Helvetica","Highlight","Hue","I","ICCBased","ID","IM",
+"Identity","Identity-H","Identity-V","Image","ImageMask","Index",
+"Indexed","Info","Ink","Intent","Interpolate","IsMap","ItalicAngle",
+"JBIG2Globals","JPXDecode","JS","K","Keywords","Kids","L","LC","LJ",
+"LW","LZWDecode","Lab","Lang","LastChar","Launch","Leading","Length",
+"Length1","Length2","Length3","Lighten","Limits","Line","Linearized",
+"Link","Luminosity","M","MK","ML","MarkInfo","Mask","Matrix","MaxWidth",
+"MediaBox","Metadata","MissingWidth","ModDate","Multiply","N","Name",
+"Named","Names","NewWindow","Next","None","Normal","O","OC","OCG",
+"OCGs","OCProperties","OE","OFF","ON","OP","OPM","ObjStm","Off","Opt",
+"Ordering","Outlines","Overlay","P","PDF","PS","Page","PageLabels",
+"PageMode","Pages","PaintType","Parent","Pattern","PatternType",
+"PolyLine","Polygon","Popup","Predictor","Prev","ProcSet","Producer",
+"Properties","QuadPoints","R","RI","Range","Rect","Ref","Registry",
+"Resources","Root","Rotate","Rows","RunLengthDecode","S","SA","SM",
+"SMask","SMaskInData","Saturation","Screen","Separation","Shading",
+"ShadingType","Size","SoftLight","Square","Squiggly","Stamp","Standard",
+"StemH","StemV","StmF","StrF","StrikeOut","StructTreeRoot","Subject",
+"Subtype","Subtype2","T","TK","TR","TR2","Text","Threads","TilingType",
+"Title","ToUnicode","Trans","Transparency","Trapped","TrimBox","Type",
+"Type1","Type1C","U","UE","URI","Underline","Usage","UseCMap",
+"UseOutlines","UserUnit","V","V2","VE","Version","VerticesPerRow",
+"ViewerPreferences","W","W2","WMode","Widget","Width","Widths",
+"WinAnsiEncoding","XHeight","XObject","XRef","XRefStm","XStep","XYZ",
+"YStep","ca","op",
+};
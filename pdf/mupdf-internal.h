@@ -7,6 +7,93 @@
 void pdf_set_str_len(pdf_obj *obj, int newlen);
 void *pdf_get_indirect_document(pdf_obj *obj);
 void pdf_set_int(pdf_obj *obj, int i);
+void pdf_set_int_offset(pdf_obj *obj, fz_off_t i);
+
+/*
+	pdf_obj_pool: Slab allocator for the objects of one document.
+
+	pdf_new_obj_pool: Create a pool. Returns NULL in Memento builds,
+	where every object is allocated on its own.
+
+	pdf_drop_obj_pool: Give up ownership of a pool. Its memory is
+	freed in one go as soon as no object from it is left alive.
+
+	pdf_pool_new_*: As the pdf_new_* functions, but take the object
+	(and the items of small arrays and dicts) from pool. A NULL pool
+	allocates from the context as usual. Objects from a pool must
+	not be dropped by a thread other than the one using the document.
+*/
+typedef struct pdf_obj_pool_s pdf_obj_pool;
+
+pdf_obj_pool *pdf_new_obj_pool(fz_context *ctx);
+void pdf_drop_obj_pool(fz_context *ctx, pdf_obj_pool *pool);
+
+pdf_obj *pdf_pool_new_null(fz_context *ctx, pdf_obj_pool *pool);
+pdf_obj *pdf_pool_new_bool(fz_context *ctx, pdf_obj_pool *pool, int b);
+pdf_obj *pdf_pool_new_int(fz_context *ctx, pdf_obj_pool *pool, fz_off_t i);
+pdf_obj *pdf_pool_new_real(fz_context *ctx, pdf_obj_pool *pool, float f);
+pdf_obj *pdf_pool_new_string(fz_context *ctx, pdf_obj_pool *pool, const char *str, int len);
+pdf_obj *pdf_pool_new_name(fz_context *ctx, pdf_obj_pool *pool, const char *str);
+pdf_obj *pdf_pool_new_indirect(fz_context *ctx, pdf_obj_pool *pool, int num, int gen, void *doc);
+pdf_obj *pdf_pool_new_array(fz_context *ctx, pdf_obj_pool *pool, int initialcap);
+pdf_obj *pdf_pool_new_dict(fz_context *ctx, pdf_obj_pool *pool, int initialcap);
+
+/*
+	pdf_doc_handle: Shared reference from the dicts and arrays of a
+	document back to it, which stays valid (but no longer leads to the
+	document) once the document is closed.
+
+	pdf_new_doc_handle: Create the handle for doc.
+
+	pdf_close_doc_handle: Detach the handle from its document, and
+	give up the document's reference to it.
+*/
+typedef struct pdf_doc_handle_s pdf_doc_handle;
+
+pdf_doc_handle *pdf_new_doc_handle(fz_context *ctx, pdf_document *doc);
+void pdf_close_doc_handle(fz_context *ctx, pdf_doc_handle *handle);
+
+/*
+	pdf_set_obj_parent: Record that obj (and every dict and array
+	inside it) is part of object num of doc. Changes made to it
+	afterwards mark that object as dirty (see pdf_mark_xref_dirty).
+	Dicts and arrays that are part of an object already keep it.
+*/
+void pdf_set_obj_parent(pdf_document *doc, pdf_obj *obj, int num);
+
+/*
+	pdf_set_parsed_obj_parent: As pdf_set_obj_parent, but for obj
+	alone. For the parser, which has done the dicts and arrays inside
+	obj already.
+*/
+void pdf_set_parsed_obj_parent(pdf_document *doc, pdf_obj *obj, int num);
+
+/*
+	pdf_dict_puts_derived: Put a value into a dict that is worked out
+	from the document itself (such as inherited page attributes or
+	cached markers) rather than being an edit. The object holding the
+	dict is not marked as dirty, and does not claim val.
+*/
+void pdf_dict_puts_derived(pdf_obj *dict, const char *key, pdf_obj *val);
+
+/*
+	pdf_objhash: Hash an object such that objects that pdf_objcmp
+	considers equal hash alike. Indirect references are not followed.
+*/
+unsigned int pdf_objhash(pdf_obj *obj);
+
+/*
+	pdf_obj_mem_size: Roughly the memory held by obj, including the
+	dicts and arrays inside it (counted once for each reference to
+	them). Indirect references are not followed.
+*/
+unsigned int pdf_obj_mem_size(pdf_obj *obj);
+
+/*
+	pdf_print_obj_len: The number of bytes pdf_fprint_obj would
+	write for obj, not counting the final newline.
+*/
+int pdf_print_obj_len(pdf_obj *obj, int tight);
 
 /*
  * PDF Images
@@ -60,7 +147,7 @@ struct pdf_lexbuf_s
 	int size;
 	int base_size;
 	int len;
-	int i;
+	fz_off_t i;
 	float f;
 	char *scratch;
 	char buffer[PDF_LEXBUF_SMALL];
@@ -81,7 +168,15 @@ int pdf_lex(fz_stream *f, pdf_lexbuf *lexbuf);
 pdf_obj *pdf_parse_array(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf);
 pdf_obj *pdf_parse_dict(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf);
 pdf_obj *pdf_parse_stm_obj(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf);
-pdf_obj *pdf_parse_ind_obj(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf, int *num, int *gen, int *stm_ofs);
+pdf_obj *pdf_parse_ind_obj(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf, int *num, int *gen, fz_off_t *stm_ofs);
+
+/*
+	pdf_parse_owned_stm_obj, pdf_parse_owned_ind_obj: As above, for
+	objects that go into the xref of doc. The dicts and arrays parsed
+	are made part of object num (see pdf_set_obj_parent).
+*/
+pdf_obj *pdf_parse_owned_stm_obj(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf, int num);
+pdf_obj *pdf_parse_owned_ind_obj(pdf_document *doc, fz_stream *f, pdf_lexbuf *buf, int *num, int *gen, fz_off_t *stm_ofs);
 
 /*
 	pdf_print_token: print a lexed token to a buffer, growing if necessary
@@ -97,13 +192,51 @@ typedef struct pdf_xref_entry_s pdf_xref_entry;
 struct pdf_xref_entry_s
 {
 	char type;	/* 0=unset (f)ree i(n)use (o)bjstm */
-	int ofs;	/* file offset / objstm object number */
 	int gen;	/* generation / objstm index */
-	int stm_ofs;	/* on-disk stream */
+	fz_off_t ofs;	/* file offset / objstm object number */
+	fz_off_t stm_ofs;	/* on-disk stream */
 	fz_buffer *stm_buf; /* in-memory stream (for updated objects) */
 	pdf_obj *obj;	/* stored/cached object */
+	char dirty;	/* changed since the document was opened */
 };
 
+/*
+	The xref keeps one packed 64-bit word per object holding just its
+	type, gen and offset, which is all a file's xref sections give us.
+	Full pdf_xref_entry records are allocated PDF_XREF_BLOCK at a time,
+	only for blocks holding an object that is loaded, updated, has a
+	stream, or whose location does not fit the packed word. Once a
+	block exists its records are authoritative.
+*/
+enum { PDF_XREF_BLOCK_SHIFT = 6, PDF_XREF_BLOCK = 1 << PDF_XREF_BLOCK_SHIFT };
+
+/*
+	pdf_get_xref_entry: Return the full record for object num (which
+	must be in range), allocating its block first if need be. The
+	record stays put until the xref is shrunk, renumbered or freed.
+*/
+pdf_xref_entry *pdf_get_xref_entry(pdf_document *doc, int num);
+
+/*
+	pdf_peek_xref_entry: Copy out the record for object num (which must
+	be in range) without allocating anything.
+*/
+void pdf_peek_xref_entry(pdf_document *doc, int num, pdf_xref_entry *entry);
+
+/*
+	pdf_set_xref_entry: Set the type, offset and gen of object num,
+	leaving any cached object or stream alone.
+*/
+void pdf_set_xref_entry(pdf_document *doc, int num, int type, fz_off_t ofs, int gen);
+
+/*
+	pdf_mark_xref_dirty: Note that object num has changed since the
+	document was opened, so that an incremental save will write it,
+	and that anything cached from the document's objects may be stale.
+	Object 0 stands for the trailer.
+*/
+void pdf_mark_xref_dirty(pdf_document *doc, int num);
+
 typedef struct pdf_crypt_s pdf_crypt;
 typedef struct pdf_ocg_descriptor_s pdf_ocg_descriptor;
 typedef struct pdf_ocg_entry_s pdf_ocg_entry;
@@ -138,6 +271,23 @@ struct pdf_hotspot_s
 
 typedef struct pdf_js_s pdf_js;
 
+/* Where the last page looked up in the page tree was found: the node
+ * holding it (covering pages start to start+count-1), the index of the
+ * page in its Kids and its page number, and the attributes inherited
+ * down to that node. See pdf_page.c. */
+typedef struct pdf_page_hint_s pdf_page_hint;
+
+struct pdf_page_hint_s
+{
+	pdf_obj *node;
+	int start, count;
+	int pos, base;
+	pdf_obj *resources;
+	pdf_obj *mediabox;
+	pdf_obj *cropbox;
+	pdf_obj *rotate;
+};
+
 struct pdf_document_s
 {
 	fz_document super;
@@ -146,23 +296,32 @@ struct pdf_document_s
 	fz_stream *file;
 
 	int version;
-	int startxref;
-	int file_size;
+	fz_off_t startxref;
+	fz_off_t file_size;
+	int repaired;
 	pdf_crypt *crypt;
 	pdf_obj *trailer;
 	pdf_ocg_descriptor *ocg;
 	pdf_hotspot hotspot;
 
 	int len;
-	pdf_xref_entry *table;
+	unsigned long long *xref_packed;
+	pdf_xref_entry **xref_blocks;
 
 	int page_len;
 	int page_cap;
 	pdf_obj **page_objs;
 	pdf_obj **page_refs;
+	int page_tree_complete;
+	pdf_page_hint page_hint;
+	fz_hash_table *page_index;
 	int resources_localised;
 
 	pdf_lexbuf_large lexbuf;
+	pdf_obj_pool *obj_pool;
+	pdf_doc_handle *handle;
+	int obj_stm_hits;
+	int obj_stm_misses;
 
 	pdf_annot *focus;
 	pdf_obj *focus_obj;
@@ -180,11 +339,21 @@ pdf_document *pdf_open_document_no_run_with_stream(fz_context *ctx, fz_stream *f
 
 void pdf_localise_page_resources(pdf_document *xref);
 
+/*
+	pdf_lookup_page_obj, pdf_lookup_page_ref: Find the page dictionary
+	(or the indirect reference to it) for page number needle (0 based),
+	loading only the part of the page tree needed to get there. Throws
+	if there is no such page.
+*/
+pdf_obj *pdf_lookup_page_obj(pdf_document *doc, int needle);
+pdf_obj *pdf_lookup_page_ref(pdf_document *doc, int needle);
+void pdf_drop_page_tree(pdf_document *doc);
+
 void pdf_cache_object(pdf_document *doc, int num, int gen);
 
 fz_stream *pdf_open_inline_stream(pdf_document *doc, pdf_obj *stmobj, int length, fz_stream *chain, fz_compression_params *params);
 fz_compressed_buffer *pdf_load_compressed_stream(pdf_document *doc, int num, int gen);
-fz_stream *pdf_open_stream_with_offset(pdf_document *doc, int num, int gen, pdf_obj *dict, int stm_ofs);
+fz_stream *pdf_open_stream_with_offset(pdf_document *doc, int num, int gen, pdf_obj *dict, fz_off_t stm_ofs);
 fz_stream *pdf_open_compressed_stream(fz_context *ctx, fz_compressed_buffer *);
 fz_stream *pdf_open_contents_stream(pdf_document *xref, pdf_obj *obj);
 fz_buffer *pdf_load_raw_renumbered_stream(pdf_document *doc, int num, int gen, int orig_num, int orig_gen);
@@ -194,6 +363,8 @@ fz_stream *pdf_open_raw_renumbered_stream(pdf_document *doc, int num, int gen, i
 void pdf_repair_xref(pdf_document *doc, pdf_lexbuf *buf);
 void pdf_repair_obj_stms(pdf_document *doc);
 void pdf_resize_xref(pdf_document *doc, int newcap);
+void pdf_free_xref(pdf_document *doc);
+void pdf_renumber_xref(pdf_document *doc, int *use_list, int *renumber_map);
 pdf_obj *pdf_new_ref(pdf_document *doc, pdf_obj *obj);
 
 void pdf_print_xref(pdf_document *);
@@ -238,6 +409,7 @@ fz_pixmap *pdf_expand_indexed_pixmap(fz_context *ctx, fz_pixmap *src);
 fz_shade *pdf_load_shading(pdf_document *doc, pdf_obj *obj);
 
 fz_image *pdf_load_inline_image(pdf_document *doc, pdf_obj *rdb, pdf_obj *dict, fz_stream *file);
+int pdf_image_size(fz_context *ctx, pdf_image *image);
 int pdf_is_jpx_image(fz_context *ctx, pdf_obj *dict);
 
 /*
@@ -16,6 +16,7 @@ typedef struct pdf_obj_s pdf_obj;
 pdf_obj *pdf_new_null(fz_context *ctx);
 pdf_obj *pdf_new_bool(fz_context *ctx, int b);
 pdf_obj *pdf_new_int(fz_context *ctx, int i);
+pdf_obj *pdf_new_int_offset(fz_context *ctx, fz_off_t i);
 pdf_obj *pdf_new_real(fz_context *ctx, float f);
 pdf_obj *pdf_new_name(fz_context *ctx, const char *str);
 pdf_obj *pdf_new_string(fz_context *ctx, const char *str, int len);
@@ -54,6 +55,7 @@ void pdf_obj_unmark(pdf_obj *obj);
 /* safe, silent failure, no error reporting on type mismatches */
 int pdf_to_bool(pdf_obj *obj);
 int pdf_to_int(pdf_obj *obj);
+fz_off_t pdf_to_offset(pdf_obj *obj);
 float pdf_to_real(pdf_obj *obj);
 char *pdf_to_name(pdf_obj *obj);
 char *pdf_to_str_buf(pdf_obj *obj);
@@ -192,6 +194,26 @@ pdf_document *pdf_open_document_with_stream(fz_context *ctx, fz_stream *file);
 */
 void pdf_close_document(pdf_document *doc);
 
+/*
+	pdf_get_obj_stm_stats: Read the object stream cache counters.
+
+	Decoded object streams are held in the resource store as
+	FZ_STORE_OBJSTM, so their share of it can be set with
+	fz_set_store_budget.
+
+	hits, misses: Objects loaded from a compressed object stream
+	that was, or was not, already decoded in the store. mutool info
+	prints them.
+*/
+typedef struct pdf_obj_stm_stats_s pdf_obj_stm_stats;
+
+struct pdf_obj_stm_stats_s
+{
+	int hits, misses;
+};
+
+void pdf_get_obj_stm_stats(pdf_document *doc, pdf_obj_stm_stats *stats);
+
 int pdf_needs_password(pdf_document *doc);
 int pdf_authenticate_password(pdf_document *doc, char *pw);
 
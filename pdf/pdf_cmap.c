@@ -47,7 +47,7 @@ pdf_new_cmap(fz_context *ctx)
 	pdf_cmap *cmap;
 
 	cmap = fz_malloc_struct(ctx, pdf_cmap);
-	FZ_INIT_STORABLE(cmap, 1, pdf_free_cmap_imp);
+	FZ_INIT_STORABLE(cmap, 1, pdf_free_cmap_imp, FZ_STORE_FONT);
 
 	strcpy(cmap->cmap_name, "");
 	strcpy(cmap->usecmap_name, "");
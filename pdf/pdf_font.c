@@ -347,7 +347,7 @@ pdf_new_font_desc(fz_context *ctx)
 	pdf_font_desc *fontdesc;
 
 	fontdesc = fz_malloc_struct(ctx, pdf_font_desc);
-	FZ_INIT_STORABLE(fontdesc, 1, pdf_free_font_imp);
+	FZ_INIT_STORABLE(fontdesc, 1, pdf_free_font_imp, FZ_STORE_FONT);
 	fontdesc->size = sizeof(pdf_font_desc);
 
 	fontdesc->font = NULL;
@@ -555,7 +555,7 @@ pdf_load_simple_font(pdf_document *xref, pdf_obj *dict)
 		for (i = 0; i < 256; i++)
 			etable[i] = ft_char_index(face, i);
 
-		fz_lock(ctx, FZ_LOCK_FREETYPE);
+		fz_lock_ft_face(ctx, fontdesc->font);
 
 		/* built-in and substitute fonts may be a different type than what the document expects */
 		subtype = pdf_to_name(pdf_dict_gets(dict, "Subtype"));
@@ -672,7 +672,7 @@ pdf_load_simple_font(pdf_document *xref, pdf_obj *dict)
 					estrings[i] = (char*) pdf_standard[i];
 		}
 
-		fz_unlock(ctx, FZ_LOCK_FREETYPE);
+		fz_unlock_ft_face(ctx, fontdesc->font);
 
 		fontdesc->encoding = pdf_new_identity_cmap(ctx, 0, 1);
 		fontdesc->size += pdf_cmap_size(ctx, fontdesc->encoding);
@@ -713,7 +713,7 @@ pdf_load_simple_font(pdf_document *xref, pdf_obj *dict)
 		}
 		else
 		{
-			fz_lock(ctx, FZ_LOCK_FREETYPE);
+			fz_lock_ft_face(ctx, fontdesc->font);
 			fterr = FT_Set_Char_Size(face, 1000, 1000, 72, 72);
 			if (fterr)
 				fz_warn(ctx, "freetype set character size: %s", ft_error_string(fterr));
@@ -721,7 +721,7 @@ pdf_load_simple_font(pdf_document *xref, pdf_obj *dict)
 			{
 				pdf_add_hmtx(ctx, fontdesc, i, i, ft_width(ctx, fontdesc, i));
 			}
-			fz_unlock(ctx, FZ_LOCK_FREETYPE);
+			fz_unlock_ft_face(ctx, fontdesc->font);
 		}
 
 		pdf_end_hmtx(ctx, fontdesc);
@@ -1421,7 +1421,7 @@ pdf_load_function(pdf_document *xref, pdf_obj *dict, int in, int out)
 	}
 
 	func = fz_malloc_struct(ctx, pdf_function);
-	FZ_INIT_STORABLE(func, 1, pdf_free_function_imp);
+	FZ_INIT_STORABLE(func, 1, pdf_free_function_imp, FZ_STORE_FUNCTION);
 	func->size = sizeof(*func);
 
 	obj = pdf_dict_gets(dict, "FunctionType");
@@ -430,7 +430,7 @@ pdf_load_image_imp(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict, fz_stream *c
 		}
 
 		/* Now, do we load a ref, or do we load the actual thing? */
-		FZ_INIT_STORABLE(&image->base, 1, pdf_free_image);
+		FZ_INIT_STORABLE(&image->base, 1, pdf_free_image, FZ_STORE_IMAGE);
 		image->base.get_pixmap = pdf_image_get_pixmap;
 		image->base.w = w;
 		image->base.h = h;
@@ -556,7 +556,7 @@ pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image, int forcemask)
 		fz_drop_pixmap(ctx, img);
 		fz_rethrow(ctx);
 	}
-	FZ_INIT_STORABLE(&image->base, 1, pdf_free_image);
+	FZ_INIT_STORABLE(&image->base, 1, pdf_free_image, FZ_STORE_IMAGE);
 	image->base.get_pixmap = pdf_image_get_pixmap;
 	image->base.w = img->w;
 	image->base.h = img->h;
@@ -570,7 +570,7 @@ pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image, int forcemask)
 	image->usecolorkey = 0;
 }
 
-static int
+int
 pdf_image_size(fz_context *ctx, pdf_image *im)
 {
 	if (im == NULL)
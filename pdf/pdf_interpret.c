@@ -107,6 +107,68 @@ struct pdf_csi_s
 	fz_cookie *cookie;
 };
 
+/*
+ * Content streams are recorded the first time they are run: every token
+ * the lexer returns, every array and dict parsed out of the stream,
+ * every inline image, and every error the lexer or parser throws, in the
+ * order the interpreter asked for them. The recording is kept in the
+ * store, keyed on the contents object, and later runs replay it instead
+ * of decoding and lexing the stream again. Since the interpreter sees
+ * the same tokens, it makes the same decisions on replay, so nothing
+ * about the operators themselves needs to be recorded. A recording is
+ * only used while none of the objects the contents are made of has been
+ * changed since the document was opened.
+ */
+
+typedef struct pdf_op_s pdf_op;
+typedef struct pdf_content_ops_s pdf_content_ops;
+typedef struct pdf_content_cursor_s pdf_content_cursor;
+
+enum
+{
+	PDF_OP_OBJECT = PDF_NUM_TOKENS, /* an array or dict parsed from the stream */
+	PDF_OP_IMAGE, /* an inline image */
+	PDF_OP_THROW, /* an error from the lexer or parser */
+};
+
+struct pdf_op_s
+{
+	int tok; /* a pdf_token or one of the PDF_OP_ values */
+	int len; /* length of text, or for images, whether EI followed */
+	union
+	{
+		fz_off_t i;
+		float f;
+		int text; /* offset into the text of the recording */
+		pdf_obj *obj;
+		fz_image *image;
+	} u;
+};
+
+struct pdf_content_ops_s
+{
+	fz_storable storable;
+	int nums_len;
+	int *nums; /* the objects the contents are made of */
+	unsigned int held; /* size of the objects and images recorded */
+	int images;
+	pdf_obj *rdb; /* inline images may depend on the resources */
+	int broken;
+	int len, cap;
+	pdf_op *ops;
+	int text_len, text_cap;
+	char *text;
+};
+
+struct pdf_content_cursor_s
+{
+	fz_stream *file; /* lexing (and maybe recording), or NULL to replay */
+	pdf_content_ops *ops;
+	int pc;
+	int lexing; /* errors thrown now are lexer errors */
+	int aborted;
+};
+
 static void pdf_run_contents_object(pdf_csi *csi, pdf_obj *rdb, pdf_obj *contents);
 static void pdf_run_xobject(pdf_csi *csi, pdf_obj *resources, pdf_xobject *xobj, const fz_matrix *transform);
 static void pdf_show_pattern(pdf_csi *csi, pdf_pattern *pat, const fz_rect *area, int what);
@@ -1662,6 +1724,293 @@ pdf_run_extgstate(pdf_csi *csi, pdf_obj *rdb, pdf_obj *extgstate)
 	}
 }
 
+/*
+ * Recording and replaying content streams
+ */
+
+static void
+pdf_free_content_ops_imp(fz_context *ctx, fz_storable *ops_)
+{
+	pdf_content_ops *ops = (pdf_content_ops *)ops_;
+	int i;
+
+	for (i = 0; i < ops->len; i++)
+	{
+		if (ops->ops[i].tok == PDF_OP_OBJECT)
+			pdf_drop_obj(ops->ops[i].u.obj);
+		else if (ops->ops[i].tok == PDF_OP_IMAGE)
+			fz_drop_image(ctx, ops->ops[i].u.image);
+	}
+	pdf_drop_obj(ops->rdb);
+	fz_free(ctx, ops->nums);
+	fz_free(ctx, ops->ops);
+	fz_free(ctx, ops->text);
+	fz_free(ctx, ops);
+}
+
+static unsigned int
+pdf_content_ops_size(pdf_content_ops *ops)
+{
+	return sizeof(*ops) + ops->nums_len * sizeof(int) + ops->cap * sizeof(pdf_op) + ops->text_cap + ops->held;
+}
+
+static pdf_content_ops *
+pdf_new_content_ops(fz_context *ctx, pdf_obj *rdb, pdf_obj *contents)
+{
+	pdf_content_ops *ops;
+	pdf_obj *obj;
+	int i, n;
+
+	ops = fz_malloc_struct(ctx, pdf_content_ops);
+	FZ_INIT_STORABLE(ops, 1, pdf_free_content_ops_imp, FZ_STORE_CONTENT);
+	ops->rdb = pdf_keep_obj(rdb);
+
+	/* The contents object itself, and the streams in it if an array */
+	n = pdf_array_len(contents);
+	fz_try(ctx)
+	{
+		ops->nums = fz_malloc_array(ctx, n + 1, sizeof(int));
+	}
+	fz_catch(ctx)
+	{
+		pdf_free_content_ops_imp(ctx, &ops->storable);
+		fz_rethrow(ctx);
+	}
+	if (pdf_is_indirect(contents))
+		ops->nums[ops->nums_len++] = pdf_to_num(contents);
+	for (i = 0; i < n; i++)
+	{
+		obj = pdf_array_get(contents, i);
+		if (pdf_is_indirect(obj))
+			ops->nums[ops->nums_len++] = pdf_to_num(obj);
+	}
+	return ops;
+}
+
+/* Whether any object the recorded contents are made of has changed */
+static int
+pdf_content_ops_changed(pdf_document *xref, pdf_content_ops *ops)
+{
+	pdf_xref_entry entry;
+	int i;
+
+	for (i = 0; i < ops->nums_len; i++)
+	{
+		if (ops->nums[i] <= 0 || ops->nums[i] >= xref->len)
+			continue;
+		pdf_peek_xref_entry(xref, ops->nums[i], &entry);
+		if (entry.dirty)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+pdf_grow_content_ops(fz_context *ctx, pdf_content_ops *ops, int n)
+{
+	int cap;
+
+	/* Running out of memory only stops the recording, not the run */
+	fz_try(ctx)
+	{
+		if (ops->len == ops->cap)
+		{
+			cap = ops->cap ? ops->cap * 2 : 256;
+			ops->ops = fz_resize_array(ctx, ops->ops, cap, sizeof(pdf_op));
+			ops->cap = cap;
+		}
+		if (ops->text_len + n > ops->text_cap)
+		{
+			cap = ops->text_cap ? ops->text_cap : 1024;
+			while (cap < ops->text_len + n)
+				cap *= 2;
+			ops->text = fz_resize_array(ctx, ops->text, cap, 1);
+			ops->text_cap = cap;
+		}
+	}
+	fz_catch(ctx)
+	{
+		ops->broken = 1;
+	}
+}
+
+/* Append an op with room for n bytes of text, or return NULL. */
+static pdf_op *
+pdf_add_op(fz_context *ctx, pdf_content_ops *ops, int tok, int n)
+{
+	pdf_op *op;
+
+	if (ops->len == ops->cap || ops->text_len + n > ops->text_cap)
+		pdf_grow_content_ops(ctx, ops, n);
+	if (ops->broken)
+		return NULL;
+
+	op = &ops->ops[ops->len++];
+	op->tok = tok;
+	op->len = 0;
+	op->u.i = 0;
+	return op;
+}
+
+static void
+pdf_set_op_text(pdf_content_ops *ops, pdf_op *op, const char *text, int len)
+{
+	op->u.text = ops->text_len;
+	op->len = len;
+	memcpy(ops->text + ops->text_len, text, len);
+	ops->text[ops->text_len + len] = 0;
+	ops->text_len += len + 1;
+}
+
+static void
+pdf_record_token(fz_context *ctx, pdf_content_ops *ops, pdf_token tok, pdf_lexbuf *buf)
+{
+	pdf_op *op;
+	int len;
+
+	switch (tok)
+	{
+	case PDF_TOK_NAME:
+	case PDF_TOK_KEYWORD:
+	case PDF_TOK_STRING:
+		len = (tok == PDF_TOK_STRING ? buf->len : strlen(buf->scratch));
+		op = pdf_add_op(ctx, ops, tok, len + 1);
+		if (op)
+			pdf_set_op_text(ops, op, buf->scratch, len);
+		break;
+	case PDF_TOK_INT:
+		op = pdf_add_op(ctx, ops, tok, 0);
+		if (op)
+			op->u.i = buf->i;
+		break;
+	case PDF_TOK_REAL:
+		op = pdf_add_op(ctx, ops, tok, 0);
+		if (op)
+			op->u.f = buf->f;
+		break;
+	default:
+		pdf_add_op(ctx, ops, tok, 0);
+		break;
+	}
+}
+
+static void
+pdf_record_throw(fz_context *ctx, pdf_content_ops *ops, const char *message)
+{
+	int len = strlen(message);
+	pdf_op *op = pdf_add_op(ctx, ops, PDF_OP_THROW, len + 1);
+	if (op)
+		pdf_set_op_text(ops, op, message, len);
+}
+
+static void
+pdf_record_object(fz_context *ctx, pdf_content_ops *ops, pdf_obj *obj)
+{
+	pdf_op *op = pdf_add_op(ctx, ops, PDF_OP_OBJECT, 0);
+	if (op)
+	{
+		op->u.obj = pdf_keep_obj(obj);
+		ops->held += pdf_obj_mem_size(obj);
+	}
+}
+
+/* Returns the index of the op, so EI can be noted later, or -1 */
+static int
+pdf_record_image(fz_context *ctx, pdf_content_ops *ops, fz_image *image)
+{
+	pdf_op *op = pdf_add_op(ctx, ops, PDF_OP_IMAGE, 0);
+	if (!op)
+		return -1;
+	op->u.image = fz_keep_image(ctx, image);
+	ops->held += pdf_image_size(ctx, (pdf_image *)image);
+	ops->images++;
+	return op - ops->ops;
+}
+
+/* Throw again an error recorded at the current op, if there is one */
+static void
+pdf_replay_throw(fz_context *ctx, pdf_content_cursor *cur)
+{
+	pdf_content_ops *ops = cur->ops;
+
+	if (cur->pc < ops->len && ops->ops[cur->pc].tok == PDF_OP_THROW)
+		fz_throw(ctx, "%s", ops->text + ops->ops[cur->pc++].u.text);
+}
+
+static pdf_token
+pdf_next_token(pdf_csi *csi, pdf_content_cursor *cur, pdf_lexbuf *buf)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_content_ops *ops = cur->ops;
+	pdf_token tok;
+	pdf_op *op;
+
+	if (cur->file)
+	{
+		cur->lexing = 1;
+		tok = pdf_lex(cur->file, buf);
+		cur->lexing = 0;
+		if (ops)
+			pdf_record_token(ctx, ops, tok, buf);
+		return tok;
+	}
+
+	pdf_replay_throw(ctx, cur);
+	if (cur->pc >= ops->len)
+		return PDF_TOK_EOF;
+
+	op = &ops->ops[cur->pc++];
+	switch (op->tok)
+	{
+	case PDF_TOK_NAME:
+	case PDF_TOK_KEYWORD:
+	case PDF_TOK_STRING:
+		while (buf->size < op->len + 1)
+			pdf_lexbuf_grow(buf);
+		memcpy(buf->scratch, ops->text + op->u.text, op->len + 1);
+		buf->len = op->len;
+		break;
+	case PDF_TOK_INT:
+		buf->i = op->u.i;
+		break;
+	case PDF_TOK_REAL:
+		buf->f = op->u.f;
+		break;
+	case PDF_OP_OBJECT:
+	case PDF_OP_IMAGE:
+		/* Only if the interpreter took a different turn this time */
+		return PDF_TOK_ERROR;
+	}
+	return op->tok;
+}
+
+static pdf_obj *
+pdf_parse_content_obj(pdf_csi *csi, pdf_content_cursor *cur, pdf_lexbuf *buf, pdf_token tok)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_content_ops *ops = cur->ops;
+	pdf_obj *obj;
+
+	if (cur->file)
+	{
+		cur->lexing = 1;
+		if (tok == PDF_TOK_OPEN_ARRAY)
+			obj = pdf_parse_array(csi->xref, cur->file, buf);
+		else
+			obj = pdf_parse_dict(csi->xref, cur->file, buf);
+		cur->lexing = 0;
+		if (ops)
+			pdf_record_object(ctx, ops, obj);
+		return obj;
+	}
+
+	pdf_replay_throw(ctx, cur);
+	if (cur->pc < ops->len && ops->ops[cur->pc].tok == PDF_OP_OBJECT)
+		return pdf_keep_obj(ops->ops[cur->pc++].u.obj);
+	fz_throw(ctx, "syntax error in content stream");
+	return NULL;
+}
+
 /*
  * Operators
  */
@@ -1695,13 +2044,39 @@ static void pdf_run_BDC(pdf_csi *csi, pdf_obj *rdb)
 		csi->in_hidden_ocg++;
 }
 
-static void pdf_run_BI(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
+static void pdf_replay_BI(pdf_csi *csi, pdf_content_cursor *cur)
 {
 	fz_context *ctx = csi->dev->ctx;
+	pdf_content_ops *ops = cur->ops;
+	pdf_op *op;
+
+	pdf_replay_throw(ctx, cur);
+	if (cur->pc >= ops->len || ops->ops[cur->pc].tok != PDF_OP_IMAGE)
+		fz_throw(ctx, "syntax error in content stream");
+	op = &ops->ops[cur->pc++];
+
+	pdf_show_image(csi, op->u.image);
+
+	if (!op->len)
+		pdf_replay_throw(ctx, cur);
+}
+
+static void pdf_run_BI(pdf_csi *csi, pdf_obj *rdb, pdf_content_cursor *cur)
+{
+	fz_context *ctx = csi->dev->ctx;
+	fz_stream *file = cur->file;
 	int ch;
 	fz_image *img;
 	pdf_obj *obj;
+	int at = -1;
+
+	if (!file)
+	{
+		pdf_replay_BI(csi, cur);
+		return;
+	}
 
+	cur->lexing = 1;
 	obj = pdf_parse_dict(csi->xref, file, &csi->xref->lexbuf.base);
 
 	/* read whitespace after ID keyword */
@@ -1722,18 +2097,26 @@ static void pdf_run_BI(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
 	{
 		fz_rethrow(ctx);
 	}
+	cur->lexing = 0;
+
+	if (cur->ops)
+		at = pdf_record_image(ctx, cur->ops, img);
 
 	pdf_show_image(csi, img);
 
 	fz_drop_image(ctx, img);
 
 	/* find EI */
+	cur->lexing = 1;
 	ch = fz_read_byte(file);
 	while (ch != 'E' && ch != EOF)
 		ch = fz_read_byte(file);
 	ch = fz_read_byte(file);
 	if (ch != 'I')
 		fz_throw(ctx, "syntax error after inline image");
+	cur->lexing = 0;
+	if (at >= 0)
+		cur->ops->ops[at].len = 1;
 }
 
 static void pdf_run_B(pdf_csi *csi)
@@ -2461,7 +2844,7 @@ static void pdf_run_dquote(pdf_csi *csi)
 #define C(a,b,c) (a | b << 8 | c << 16)
 
 static int
-pdf_run_keyword(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, char *buf)
+pdf_run_keyword(pdf_csi *csi, pdf_obj *rdb, pdf_content_cursor *cur, char *buf)
 {
 	fz_context *ctx = csi->dev->ctx;
 	int key;
@@ -2486,7 +2869,7 @@ pdf_run_keyword(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, char *buf)
 	case B('B','*'): pdf_run_Bstar(csi); break;
 	case C('B','D','C'): pdf_run_BDC(csi, rdb); break;
 	case B('B','I'):
-		pdf_run_BI(csi, rdb, file);
+		pdf_run_BI(csi, rdb, cur);
 		break;
 	case C('B','M','C'): pdf_run_BMC(csi); break;
 	case B('B','T'): pdf_run_BT(csi); break;
@@ -2601,7 +2984,7 @@ pdf_run_keyword(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, char *buf)
 }
 
 static void
-pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
+pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, pdf_content_cursor *cur, pdf_lexbuf *buf)
 {
 	fz_context *ctx = csi->dev->ctx;
 	pdf_token tok = PDF_TOK_ERROR;
@@ -2632,13 +3015,14 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 				{
 					if (csi->cookie->abort)
 					{
+						cur->aborted = 1;
 						tok = PDF_TOK_EOF;
 						break;
 					}
 					csi->cookie->progress++;
 				}
 
-				tok = pdf_lex(file, buf);
+				tok = pdf_next_token(csi, cur, buf);
 
 				if (in_array)
 				{
@@ -2688,7 +3072,7 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 							pdf_drop_obj(csi->obj);
 							csi->obj = NULL;
 						}
-						csi->obj = pdf_parse_array(csi->xref, file, buf);
+						csi->obj = pdf_parse_content_obj(csi, cur, buf, tok);
 					}
 					else
 					{
@@ -2702,7 +3086,7 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 						pdf_drop_obj(csi->obj);
 						csi->obj = NULL;
 					}
-					csi->obj = pdf_parse_dict(csi->xref, file, buf);
+					csi->obj = pdf_parse_content_obj(csi, cur, buf, tok);
 					break;
 
 				case PDF_TOK_NAME:
@@ -2745,7 +3129,7 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 					break;
 
 				case PDF_TOK_KEYWORD:
-					if (pdf_run_keyword(csi, rdb, file, buf->scratch))
+					if (pdf_run_keyword(csi, rdb, cur, buf->scratch))
 					{
 						tok = PDF_TOK_EOF;
 					}
@@ -2760,6 +3144,13 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 		}
 		fz_catch(ctx)
 		{
+			/* Errors from lexing have to be thrown again on replay */
+			if (cur->lexing)
+			{
+				cur->lexing = 0;
+				if (cur->file && cur->ops)
+					pdf_record_throw(ctx, cur->ops, fz_caught(ctx));
+			}
 			/* Swallow the error */
 			if (csi->cookie)
 				csi->cookie->errors++;
@@ -2781,7 +3172,7 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
  */
 
 static void
-pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
+pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, pdf_content_cursor *cur)
 {
 	fz_context *ctx = csi->dev->ctx;
 	pdf_lexbuf *buf;
@@ -2790,7 +3181,7 @@ pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
 
 	fz_var(buf);
 
-	if (file == NULL)
+	if (cur->file == NULL && cur->ops == NULL)
 		return;
 
 	buf = fz_malloc(ctx, sizeof(*buf)); /* we must be re-entrant for type3 fonts */
@@ -2801,10 +3192,11 @@ pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
 	csi->gbot = csi->gtop;
 	fz_try(ctx)
 	{
-		pdf_run_stream(csi, rdb, file, buf);
+		pdf_run_stream(csi, rdb, cur, buf);
 	}
 	fz_catch(ctx)
 	{
+		cur->aborted = 1;
 		fz_warn(ctx, "Content stream parsing error - rendering truncated");
 	}
 	while (csi->gtop > csi->gbot)
@@ -2815,23 +3207,82 @@ pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
 	fz_free(ctx, buf);
 }
 
+/*
+ * Find a recording of contents that is still good to replay with rdb.
+ * Recordings made before the document was last edited are thrown away.
+ */
+static pdf_content_ops *
+pdf_find_content_ops(pdf_csi *csi, pdf_obj *rdb, pdf_obj *contents)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_content_ops *ops;
+
+	ops = pdf_find_item(ctx, pdf_free_content_ops_imp, contents);
+	if (!ops)
+		return NULL;
+	if (!pdf_content_ops_changed(csi->xref, ops))
+	{
+		if (!ops->images || !pdf_objcmp(ops->rdb, rdb))
+			return ops;
+	}
+	pdf_remove_item(ctx, pdf_free_content_ops_imp, contents);
+	fz_drop_storable(ctx, &ops->storable);
+	return NULL;
+}
+
+static void
+pdf_store_content_ops(pdf_csi *csi, pdf_obj *contents, pdf_content_ops *ops)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_content_ops *existing;
+
+	/* The stream may have run itself, and stored a recording already */
+	existing = pdf_find_item(ctx, pdf_free_content_ops_imp, contents);
+	if (existing)
+	{
+		fz_drop_storable(ctx, &existing->storable);
+		return;
+	}
+	pdf_store_item(ctx, contents, ops, pdf_content_ops_size(ops));
+}
+
 static void
 pdf_run_contents_object(pdf_csi *csi, pdf_obj *rdb, pdf_obj *contents)
 {
 	fz_context *ctx = csi->dev->ctx;
-	fz_stream *file = NULL;
+	pdf_content_cursor cur = { NULL };
 
 	if (contents == NULL)
 		return;
 
-	file = pdf_open_contents_stream(csi->xref, contents);
+	cur.ops = pdf_find_content_ops(csi, rdb, contents);
+	if (!cur.ops)
+	{
+		cur.file = pdf_open_contents_stream(csi->xref, contents);
+		if (cur.file)
+		{
+			fz_try(ctx)
+			{
+				cur.ops = pdf_new_content_ops(ctx, rdb, contents);
+			}
+			fz_catch(ctx)
+			{
+				/* Run without recording */
+			}
+		}
+	}
+
 	fz_try(ctx)
 	{
-		pdf_run_contents_stream(csi, rdb, file);
+		pdf_run_contents_stream(csi, rdb, &cur);
+		if (cur.file && cur.ops && !cur.aborted && !cur.ops->broken && !pdf_content_ops_changed(csi->xref, cur.ops))
+			pdf_store_content_ops(csi, contents, cur.ops);
 	}
 	fz_always(ctx)
 	{
-		fz_close(file);
+		fz_close(cur.file);
+		if (cur.ops)
+			fz_drop_storable(ctx, &cur.ops->storable);
 	}
 	fz_catch(ctx)
 	{
@@ -2843,19 +3294,19 @@ static void
 pdf_run_contents_buffer(pdf_csi *csi, pdf_obj *rdb, fz_buffer *contents)
 {
 	fz_context *ctx = csi->dev->ctx;
-	fz_stream *file = NULL;
+	pdf_content_cursor cur = { NULL };
 
 	if (contents == NULL)
 		return;
 
-	file = fz_open_buffer(ctx, contents);
+	cur.file = fz_open_buffer(ctx, contents);
 	fz_try(ctx)
 	{
-		pdf_run_contents_stream(csi, rdb, file);
+		pdf_run_contents_stream(csi, rdb, &cur);
 	}
 	fz_always(ctx)
 	{
-		fz_close(file);
+		fz_close(cur.file);
 	}
 	fz_catch(ctx)
 	{
@@ -66,7 +66,7 @@ static int
 lex_number(fz_stream *f, pdf_lexbuf *buf, int c)
 {
 	int neg = 0;
-	int i = 0;
+	fz_off_t i = 0;
 	int n;
 	int d;
 	float v;
@@ -94,8 +94,8 @@ lex_number(fz_stream *f, pdf_lexbuf *buf, int c)
 		case '.':
 			goto loop_after_dot;
 		case RANGE_0_9:
-			i = 10*i + c - '0';
-			/* FIXME: Need overflow check here; do we care? */
+			if (i < (FZ_OFF_T_MAX - 9) / 10)
+				i = 10*i + c - '0';
 			break;
 		default:
 			fz_unread_byte(f);
@@ -535,7 +535,7 @@ void pdf_print_token(fz_context *ctx, fz_buffer *fzbuf, int tok, pdf_lexbuf *buf
 		fz_buffer_printf(ctx, fzbuf, "}");
 		break;
 	case PDF_TOK_INT:
-		fz_buffer_printf(ctx, fzbuf, "%d", buf->i);
+		fz_buffer_printf(ctx, fzbuf, "%lld", buf->i);
 		break;
 	case PDF_TOK_REAL:
 		{
@@ -1,6 +1,8 @@
 #include "fitz-internal.h"
 #include "mupdf-internal.h"
 
+#include "data_names.h"
+
 typedef enum pdf_objkind_e
 {
 	PDF_NULL = 0,
@@ -25,27 +27,36 @@ struct pdf_obj_s
 	int refs;
 	char kind;
 	char marked;
+	unsigned char pool_class;
 	fz_context *ctx;
+	pdf_obj_pool *pool;
 	union
 	{
 		int b;
-		int i;
+		fz_off_t i;
 		float f;
 		struct {
 			unsigned short len;
 			char buf[1];
 		} s;
-		char n[1];
+		struct {
+			int atom;
+			char buf[1];
+		} n;
 		struct {
 			int len;
 			int cap;
 			pdf_obj **items;
+			int parent_num;
+			pdf_doc_handle *owner;
 		} a;
 		struct {
 			char sorted;
 			int len;
 			int cap;
 			struct keyval *items;
+			int parent_num;
+			pdf_doc_handle *owner;
 		} d;
 		struct {
 			int num;
@@ -55,66 +66,232 @@ struct pdf_obj_s
 	} u;
 };
 
-pdf_obj *
-pdf_new_null(fz_context *ctx)
+/*
+ * Objects parsed from a document, and the item arrays of its smaller
+ * dicts and arrays, are carved out of slabs owned by the document instead
+ * of each being allocated on its own. Every size class keeps a free list.
+ * Objects already follow the threading rules of their document (their
+ * reference counts are not locked either), so the pool takes no locks.
+ * The slabs are freed all at once, when the document has been closed and
+ * the last object from the pool has been dropped. Objects made with a
+ * NULL pool come from the context allocator as before.
+ */
+
+#define PDF_POOL_SLAB_SIZE (64 << 10)
+#define PDF_POOL_CLASSES 9
+#define PDF_POOL_MAX 512
+
+static const unsigned short pdf_pool_class_size[PDF_POOL_CLASSES] =
 {
-	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(null)");
+	32, 48, 64, 96, 128, 192, 256, 384, 512
+};
+
+struct pdf_obj_pool_s
+{
+	int live;
+	int closed;
+	void *free[PDF_POOL_CLASSES];
+	unsigned char *cur, *end;
+	void *slabs;
+};
+
+pdf_obj_pool *
+pdf_new_obj_pool(fz_context *ctx)
+{
+#ifdef MEMENTO
+	/* Let Memento see every object */
+	return NULL;
+#else
+	return fz_malloc_struct(ctx, pdf_obj_pool);
+#endif
+}
+
+static void
+pdf_free_obj_pool(fz_context *ctx, pdf_obj_pool *pool)
+{
+	void *slab, *next;
+
+	for (slab = pool->slabs; slab; slab = next)
+	{
+		next = *(void **)slab;
+		fz_free(ctx, slab);
+	}
+	fz_free(ctx, pool);
+}
+
+void
+pdf_drop_obj_pool(fz_context *ctx, pdf_obj_pool *pool)
+{
+	if (!pool)
+		return;
+	pool->closed = 1;
+	if (pool->live == 0)
+		pdf_free_obj_pool(ctx, pool);
+}
+
+/* Returns the size class (1 based) of a pooled block, or 0 for the heap */
+static inline int
+pdf_pool_class(pdf_obj_pool *pool, unsigned int size)
+{
+	int c;
+
+	if (!pool || size > PDF_POOL_MAX)
+		return 0;
+	for (c = 0; size > pdf_pool_class_size[c]; c++)
+		;
+	return c + 1;
+}
+
+static void *
+pdf_pool_alloc(fz_context *ctx, pdf_obj_pool *pool, int cls, unsigned int size)
+{
+	unsigned char *slab;
+	void *p;
+
+	if (!cls)
+		return fz_malloc(ctx, size);
+
+	size = pdf_pool_class_size[cls - 1];
+	p = pool->free[cls - 1];
+	if (p)
+		pool->free[cls - 1] = *(void **)p;
+	else
+	{
+		if (pool->cur + size > pool->end)
+		{
+			slab = fz_malloc(ctx, PDF_POOL_SLAB_SIZE);
+			*(void **)slab = pool->slabs;
+			pool->slabs = slab;
+			pool->cur = slab + 16;
+			pool->end = slab + PDF_POOL_SLAB_SIZE;
+		}
+		p = pool->cur;
+		pool->cur += size;
+	}
+	pool->live++;
+	return p;
+}
+
+static void
+pdf_pool_free(fz_context *ctx, pdf_obj_pool *pool, int cls, void *p)
+{
+	if (!cls)
+	{
+		fz_free(ctx, p);
+		return;
+	}
+	*(void **)p = pool->free[cls - 1];
+	pool->free[cls - 1] = p;
+	if (--pool->live == 0 && pool->closed)
+		pdf_free_obj_pool(ctx, pool);
+}
+
+static pdf_obj *
+pdf_alloc_obj(fz_context *ctx, pdf_obj_pool *pool, int kind, unsigned int size)
+{
+	int cls = pdf_pool_class(pool, size);
+	pdf_obj *obj = pdf_pool_alloc(ctx, pool, cls, size);
 	obj->ctx = ctx;
 	obj->refs = 1;
-	obj->kind = PDF_NULL;
+	obj->kind = kind;
 	obj->marked = 0;
+	obj->pool_class = cls;
+	obj->pool = cls ? pool : NULL;
 	return obj;
 }
 
+/* Scalars only need room for their own member of the union */
+#define PDF_OBJ_SIZE(member) (offsetof(pdf_obj, u) + sizeof(((pdf_obj *)0)->u.member))
+
+static void
+pdf_free_obj(pdf_obj *obj)
+{
+	pdf_pool_free(obj->ctx, obj->pool, obj->pool_class, obj);
+}
+
+/* Item arrays come from the pool of their dict or array, if it has one */
+static void *
+pdf_alloc_items(pdf_obj *obj, int n, unsigned int size)
+{
+	if (n > (int)(UINT_MAX / size))
+		fz_throw(obj->ctx, "too many items in pdf object (%d)", n);
+	return pdf_pool_alloc(obj->ctx, obj->pool, pdf_pool_class(obj->pool, n * size), n * size);
+}
+
+static void
+pdf_free_items(pdf_obj *obj, void *items, int n, unsigned int size)
+{
+	pdf_pool_free(obj->ctx, obj->pool, pdf_pool_class(obj->pool, n * size), items);
+}
+
 pdf_obj *
-pdf_new_bool(fz_context *ctx, int b)
+pdf_pool_new_null(fz_context *ctx, pdf_obj_pool *pool)
+{
+	return Memento_label(pdf_alloc_obj(ctx, pool, PDF_NULL, PDF_OBJ_SIZE(b)), "pdf_obj(null)");
+}
+
+pdf_obj *
+pdf_new_null(fz_context *ctx)
+{
+	return pdf_pool_new_null(ctx, NULL);
+}
+
+pdf_obj *
+pdf_pool_new_bool(fz_context *ctx, pdf_obj_pool *pool, int b)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(bool)");
-	obj->ctx = ctx;
-	obj->refs = 1;
-	obj->kind = PDF_BOOL;
-	obj->marked = 0;
+	obj = Memento_label(pdf_alloc_obj(ctx, pool, PDF_BOOL, PDF_OBJ_SIZE(b)), "pdf_obj(bool)");
 	obj->u.b = b;
 	return obj;
 }
 
+pdf_obj *
+pdf_new_bool(fz_context *ctx, int b)
+{
+	return pdf_pool_new_bool(ctx, NULL, b);
+}
+
 pdf_obj *
 pdf_new_int(fz_context *ctx, int i)
+{
+	return pdf_pool_new_int(ctx, NULL, i);
+}
+
+pdf_obj *
+pdf_new_int_offset(fz_context *ctx, fz_off_t i)
+{
+	return pdf_pool_new_int(ctx, NULL, i);
+}
+
+pdf_obj *
+pdf_pool_new_int(fz_context *ctx, pdf_obj_pool *pool, fz_off_t i)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(int)");
-	obj->ctx = ctx;
-	obj->refs = 1;
-	obj->kind = PDF_INT;
-	obj->marked = 0;
+	obj = Memento_label(pdf_alloc_obj(ctx, pool, PDF_INT, PDF_OBJ_SIZE(i)), "pdf_obj(int)");
 	obj->u.i = i;
 	return obj;
 }
 
 pdf_obj *
-pdf_new_real(fz_context *ctx, float f)
+pdf_pool_new_real(fz_context *ctx, pdf_obj_pool *pool, float f)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(real)");
-	obj->ctx = ctx;
-	obj->refs = 1;
-	obj->kind = PDF_REAL;
-	obj->marked = 0;
+	obj = Memento_label(pdf_alloc_obj(ctx, pool, PDF_REAL, PDF_OBJ_SIZE(f)), "pdf_obj(real)");
 	obj->u.f = f;
 	return obj;
 }
 
 pdf_obj *
-pdf_new_string(fz_context *ctx, const char *str, int len)
+pdf_new_real(fz_context *ctx, float f)
+{
+	return pdf_pool_new_real(ctx, NULL, f);
+}
+
+pdf_obj *
+pdf_pool_new_string(fz_context *ctx, pdf_obj_pool *pool, const char *str, int len)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj, u.s.buf) + len + 1), "pdf_obj(string)");
-	obj->ctx = ctx;
-	obj->refs = 1;
-	obj->kind = PDF_STRING;
-	obj->marked = 0;
+	obj = Memento_label(pdf_alloc_obj(ctx, pool, PDF_STRING, offsetof(pdf_obj, u.s.buf) + len + 1), "pdf_obj(string)");
 	obj->u.s.len = len;
 	memcpy(obj->u.s.buf, str, len);
 	obj->u.s.buf[len] = '\0';
@@ -122,27 +299,105 @@ pdf_new_string(fz_context *ctx, const char *str, int len)
 }
 
 pdf_obj *
-pdf_new_name(fz_context *ctx, const char *str)
+pdf_new_string(fz_context *ctx, const char *str, int len)
+{
+	return pdf_pool_new_string(ctx, NULL, str, len);
+}
+
+/*
+ * Interned names. Each entry of pdf_name_list is an atom (its index + 1);
+ * name objects remember their atom, and two atoms are equal exactly when
+ * the names are. Anything not in the list has atom 0 and is compared by
+ * its characters. The hash index over the list is built on first use; a
+ * lookup that races with the build can at worst miss, which only costs
+ * a string compare later on.
+ */
+
+#define PDF_NAME_HASH_SIZE 1024
+
+static unsigned short pdf_name_hash[PDF_NAME_HASH_SIZE];
+static int pdf_name_hash_done = 0;
+
+static unsigned int
+pdf_hash_name(const char *s)
+{
+	unsigned int h = 0;
+	while (*s)
+		h = h * 31 + (unsigned char)*s++;
+	return h & (PDF_NAME_HASH_SIZE - 1);
+}
+
+static void
+pdf_build_name_hash(void)
+{
+	unsigned int h;
+	int i;
+
+	for (i = 0; i < nelem(pdf_name_list); i++)
+	{
+		h = pdf_hash_name(pdf_name_list[i]);
+		while (pdf_name_hash[h])
+			h = (h + 1) & (PDF_NAME_HASH_SIZE - 1);
+		pdf_name_hash[h] = i + 1;
+	}
+	pdf_name_hash_done = 1;
+}
+
+static int
+pdf_name_atom(const char *s)
+{
+	unsigned int h;
+	int a;
+
+	if (!pdf_name_hash_done)
+		pdf_build_name_hash();
+
+	h = pdf_hash_name(s);
+	while ((a = pdf_name_hash[h]) != 0)
+	{
+		if (!strcmp(pdf_name_list[a - 1], s))
+			return a;
+		h = (h + 1) & (PDF_NAME_HASH_SIZE - 1);
+	}
+	return 0;
+}
+
+/* Atoms are allocated in sorted order, so they compare like strcmp */
+static inline int
+pdf_namecmp(pdf_obj *k, const char *key, int atom)
+{
+	if (atom && k->u.n.atom)
+		return k->u.n.atom - atom;
+	return strcmp(k->u.n.buf, key);
+}
+
+pdf_obj *
+pdf_pool_new_name(fz_context *ctx, pdf_obj_pool *pool, const char *str)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, offsetof(pdf_obj, u.n) + strlen(str) + 1), "pdf_obj(name)");
-	obj->ctx = ctx;
-	obj->refs = 1;
-	obj->kind = PDF_NAME;
-	obj->marked = 0;
-	strcpy(obj->u.n, str);
+	obj = Memento_label(pdf_alloc_obj(ctx, pool, PDF_NAME, offsetof(pdf_obj, u.n.buf) + strlen(str) + 1), "pdf_obj(name)");
+	obj->u.n.atom = pdf_name_atom(str);
+	strcpy(obj->u.n.buf, str);
 	return obj;
 }
 
+pdf_obj *
+pdf_new_name(fz_context *ctx, const char *str)
+{
+	return pdf_pool_new_name(ctx, NULL, str);
+}
+
 pdf_obj *
 pdf_new_indirect(fz_context *ctx, int num, int gen, void *xref)
+{
+	return pdf_pool_new_indirect(ctx, NULL, num, gen, xref);
+}
+
+pdf_obj *
+pdf_pool_new_indirect(fz_context *ctx, pdf_obj_pool *pool, int num, int gen, void *xref)
 {
 	pdf_obj *obj;
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(indirect)");
-	obj->ctx = ctx;
-	obj->refs = 1;
-	obj->kind = PDF_INDIRECT;
-	obj->marked = 0;
+	obj = Memento_label(pdf_alloc_obj(ctx, pool, PDF_INDIRECT, PDF_OBJ_SIZE(r)), "pdf_obj(indirect)");
 	obj->u.r.num = num;
 	obj->u.r.gen = gen;
 	obj->u.r.xref = xref;
@@ -232,12 +487,30 @@ int pdf_to_int(pdf_obj *obj)
 	if (!obj)
 		return 0;
 	if (obj->kind == PDF_INT)
-		return obj->u.i;
+	{
+		if (obj->u.i > INT_MAX)
+			return INT_MAX;
+		if (obj->u.i < INT_MIN)
+			return INT_MIN;
+		return (int)obj->u.i;
+	}
 	if (obj->kind == PDF_REAL)
 		return (int)(obj->u.f + 0.5f); /* No roundf in MSVC */
 	return 0;
 }
 
+fz_off_t pdf_to_offset(pdf_obj *obj)
+{
+	RESOLVE(obj);
+	if (!obj)
+		return 0;
+	if (obj->kind == PDF_INT)
+		return obj->u.i;
+	if (obj->kind == PDF_REAL)
+		return (fz_off_t)(obj->u.f + 0.5f);
+	return 0;
+}
+
 float pdf_to_real(pdf_obj *obj)
 {
 	RESOLVE(obj);
@@ -255,7 +528,7 @@ char *pdf_to_name(pdf_obj *obj)
 	RESOLVE(obj);
 	if (!obj || obj->kind != PDF_NAME)
 		return "";
-	return obj->u.n;
+	return obj->u.n.buf;
 }
 
 char *pdf_to_str_buf(pdf_obj *obj)
@@ -275,6 +548,11 @@ int pdf_to_str_len(pdf_obj *obj)
 }
 
 void pdf_set_int(pdf_obj *obj, int i)
+{
+	pdf_set_int_offset(obj, i);
+}
+
+void pdf_set_int_offset(pdf_obj *obj, fz_off_t i)
 {
 	if (!obj || obj->kind != PDF_INT)
 		return;
@@ -342,7 +620,7 @@ pdf_objcmp(pdf_obj *a, pdf_obj *b)
 		return a->u.b - b->u.b;
 
 	case PDF_INT:
-		return a->u.i - b->u.i;
+		return a->u.i < b->u.i ? -1 : a->u.i > b->u.i;
 
 	case PDF_REAL:
 		if (a->u.f < b->u.f)
@@ -367,7 +645,7 @@ pdf_objcmp(pdf_obj *a, pdf_obj *b)
 		return memcmp(a->u.s.buf, b->u.s.buf, a->u.s.len);
 
 	case PDF_NAME:
-		return strcmp(a->u.n, b->u.n);
+		return pdf_namecmp(a, b->u.n.buf, b->u.n.atom);
 
 	case PDF_INDIRECT:
 		if (a->u.r.num == b->u.r.num)
@@ -398,6 +676,101 @@ pdf_objcmp(pdf_obj *a, pdf_obj *b)
 	return 1;
 }
 
+static unsigned int
+pdf_hash_bytes(unsigned int h, const unsigned char *s, int n)
+{
+	while (n--)
+		h = (h ^ *s++) * 16777619;
+	return h;
+}
+
+unsigned int
+pdf_objhash(pdf_obj *obj)
+{
+	unsigned int h;
+	int i;
+
+	if (!obj)
+		return 0;
+
+	h = (2166136261u ^ obj->kind) * 16777619;
+
+	switch (obj->kind)
+	{
+	case PDF_BOOL:
+		return h ^ obj->u.b;
+
+	case PDF_INT:
+		return pdf_hash_bytes(h, (unsigned char *)&obj->u.i, sizeof obj->u.i);
+
+	case PDF_REAL:
+		/* 0 and -0 compare equal */
+		if (obj->u.f == 0)
+			return h;
+		return pdf_hash_bytes(h, (unsigned char *)&obj->u.f, sizeof obj->u.f);
+
+	case PDF_STRING:
+		return pdf_hash_bytes(h, (unsigned char *)obj->u.s.buf, obj->u.s.len);
+
+	case PDF_NAME:
+		return pdf_hash_bytes(h, (unsigned char *)obj->u.n.buf, strlen(obj->u.n.buf));
+
+	case PDF_INDIRECT:
+		h = pdf_hash_bytes(h, (unsigned char *)&obj->u.r.num, sizeof obj->u.r.num);
+		return pdf_hash_bytes(h, (unsigned char *)&obj->u.r.gen, sizeof obj->u.r.gen);
+
+	case PDF_ARRAY:
+		for (i = 0; i < obj->u.a.len; i++)
+			h = (h ^ pdf_objhash(obj->u.a.items[i])) * 16777619;
+		return h;
+
+	case PDF_DICT:
+		/* pdf_objcmp compares entries in order, so we may too */
+		for (i = 0; i < obj->u.d.len; i++)
+		{
+			h = (h ^ pdf_objhash(obj->u.d.items[i].k)) * 16777619;
+			h = (h ^ pdf_objhash(obj->u.d.items[i].v)) * 16777619;
+		}
+		return h;
+	}
+	return h;
+}
+
+unsigned int
+pdf_obj_mem_size(pdf_obj *obj)
+{
+	unsigned int size;
+	int i;
+
+	if (!obj)
+		return 0;
+
+	switch (obj->kind)
+	{
+	case PDF_STRING:
+		return offsetof(pdf_obj, u.s.buf) + obj->u.s.len + 1;
+
+	case PDF_NAME:
+		return offsetof(pdf_obj, u.n.buf) + strlen(obj->u.n.buf) + 1;
+
+	case PDF_ARRAY:
+		size = sizeof(pdf_obj) + obj->u.a.cap * sizeof(pdf_obj *);
+		for (i = 0; i < obj->u.a.len; i++)
+			size += pdf_obj_mem_size(obj->u.a.items[i]);
+		return size;
+
+	case PDF_DICT:
+		size = sizeof(pdf_obj) + obj->u.d.cap * sizeof(struct keyval);
+		for (i = 0; i < obj->u.d.len; i++)
+		{
+			size += pdf_obj_mem_size(obj->u.d.items[i].k);
+			size += pdf_obj_mem_size(obj->u.d.items[i].v);
+		}
+		return size;
+	}
+	return sizeof(pdf_obj);
+}
+
 static char *
 pdf_objkindstr(pdf_obj *obj)
 {
@@ -420,26 +793,30 @@ pdf_objkindstr(pdf_obj *obj)
 
 pdf_obj *
 pdf_new_array(fz_context *ctx, int initialcap)
+{
+	return pdf_pool_new_array(ctx, NULL, initialcap);
+}
+
+pdf_obj *
+pdf_pool_new_array(fz_context *ctx, pdf_obj_pool *pool, int initialcap)
 {
 	pdf_obj *obj;
 	int i;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(array)");
-	obj->ctx = ctx;
-	obj->refs = 1;
-	obj->kind = PDF_ARRAY;
-	obj->marked = 0;
+	obj = Memento_label(pdf_alloc_obj(ctx, pool, PDF_ARRAY, sizeof(pdf_obj)), "pdf_obj(array)");
 
 	obj->u.a.len = 0;
 	obj->u.a.cap = initialcap > 1 ? initialcap : 6;
+	obj->u.a.parent_num = 0;
+	obj->u.a.owner = NULL;
 
 	fz_try(ctx)
 	{
-		obj->u.a.items = Memento_label(fz_malloc_array(ctx, obj->u.a.cap, sizeof(pdf_obj*)), "pdf_obj(array items)");
+		obj->u.a.items = Memento_label(pdf_alloc_items(obj, obj->u.a.cap, sizeof(pdf_obj*)), "pdf_obj(array items)");
 	}
 	fz_catch(ctx)
 	{
-		fz_free(ctx, obj);
+		pdf_free_obj(obj);
 		fz_rethrow(ctx);
 	}
 	for (i = 0; i < obj->u.a.cap; i++)
@@ -448,13 +825,122 @@ pdf_new_array(fz_context *ctx, int initialcap)
 	return obj;
 }
 
+/*
+ * Dicts and arrays held (directly or not) by an object in the xref of a
+ * document remember which one, so that changing them can mark it as
+ * changed since the document was opened. They reach the document through
+ * a small shared handle that is cleared when the document is closed, as
+ * objects may outlive it. Anything put into them that does not belong to
+ * an object already is claimed by the same object.
+ */
+
+struct pdf_doc_handle_s
+{
+	int refs;
+	pdf_document *doc;
+};
+
+pdf_doc_handle *
+pdf_new_doc_handle(fz_context *ctx, pdf_document *doc)
+{
+	pdf_doc_handle *handle = fz_malloc_struct(ctx, pdf_doc_handle);
+	handle->refs = 1;
+	handle->doc = doc;
+	return handle;
+}
+
+static void
+pdf_drop_doc_handle(fz_context *ctx, pdf_doc_handle *handle)
+{
+	if (handle && --handle->refs == 0)
+		fz_free(ctx, handle);
+}
+
+void
+pdf_close_doc_handle(fz_context *ctx, pdf_doc_handle *handle)
+{
+	if (!handle)
+		return;
+	handle->doc = NULL;
+	pdf_drop_doc_handle(ctx, handle);
+}
+
+static int
+pdf_claim_obj(pdf_doc_handle **owner, int *parent_num, pdf_doc_handle *handle, int num)
+{
+	if (*owner && (*owner)->doc)
+		return 0;
+	pdf_drop_doc_handle(handle->doc->ctx, *owner);
+	handle->refs++;
+	*owner = handle;
+	*parent_num = num;
+	return 1;
+}
+
+void
+pdf_set_obj_parent(pdf_document *doc, pdf_obj *obj, int num)
+{
+	int i;
+
+	if (!obj || !doc->handle)
+		return;
+
+	if (obj->kind == PDF_ARRAY)
+	{
+		if (!pdf_claim_obj(&obj->u.a.owner, &obj->u.a.parent_num, doc->handle, num))
+			return;
+		for (i = 0; i < obj->u.a.len; i++)
+			pdf_set_obj_parent(doc, obj->u.a.items[i], num);
+	}
+	else if (obj->kind == PDF_DICT)
+	{
+		if (!pdf_claim_obj(&obj->u.d.owner, &obj->u.d.parent_num, doc->handle, num))
+			return;
+		for (i = 0; i < obj->u.d.len; i++)
+			pdf_set_obj_parent(doc, obj->u.d.items[i].v, num);
+	}
+}
+
+void
+pdf_set_parsed_obj_parent(pdf_document *doc, pdf_obj *obj, int num)
+{
+	if (!obj || !doc->handle)
+		return;
+	if (obj->kind == PDF_ARRAY)
+		pdf_claim_obj(&obj->u.a.owner, &obj->u.a.parent_num, doc->handle, num);
+	else if (obj->kind == PDF_DICT)
+		pdf_claim_obj(&obj->u.d.owner, &obj->u.d.parent_num, doc->handle, num);
+}
+
+static void
+pdf_obj_altered(pdf_obj *obj, pdf_obj *val)
+{
+	pdf_doc_handle *owner;
+	int num;
+
+	if (obj->kind == PDF_ARRAY)
+		owner = obj->u.a.owner, num = obj->u.a.parent_num;
+	else
+		owner = obj->u.d.owner, num = obj->u.d.parent_num;
+
+	if (!owner || !owner->doc)
+		return;
+
+	pdf_set_obj_parent(owner->doc, val, num);
+	pdf_mark_xref_dirty(owner->doc, num);
+}
+
 static void
 pdf_array_grow(pdf_obj *obj)
 {
 	int i;
 	int new_cap = (obj->u.a.cap * 3) / 2;
+	pdf_obj **items;
 
-	obj->u.a.items = fz_resize_array(obj->ctx, obj->u.a.items, new_cap, sizeof(pdf_obj*));
+	items = pdf_alloc_items(obj, new_cap, sizeof(pdf_obj*));
+	memcpy(items, obj->u.a.items, obj->u.a.len * sizeof(pdf_obj*));
+	pdf_free_items(obj, obj->u.a.items, obj->u.a.cap, sizeof(pdf_obj*));
+	obj->u.a.items = items;
 	obj->u.a.cap = new_cap;
 
 	for (i = obj->u.a.len ; i < obj->u.a.cap; i++)
@@ -522,6 +1008,7 @@ pdf_array_put(pdf_obj *obj, int i, pdf_obj *item)
 	{
 		pdf_drop_obj(obj->u.a.items[i]);
 		obj->u.a.items[i] = pdf_keep_obj(item);
+		pdf_obj_altered(obj, item);
 	}
 }
 
@@ -540,6 +1027,7 @@ pdf_array_push(pdf_obj *obj, pdf_obj *item)
 			pdf_array_grow(obj);
 		obj->u.a.items[obj->u.a.len] = pdf_keep_obj(item);
 		obj->u.a.len++;
+		pdf_obj_altered(obj, item);
 	}
 }
 
@@ -578,6 +1066,7 @@ pdf_array_insert(pdf_obj *obj, pdf_obj *item)
 		memmove(obj->u.a.items + 1, obj->u.a.items, obj->u.a.len * sizeof(pdf_obj*));
 		obj->u.a.items[0] = pdf_keep_obj(item);
 		obj->u.a.len++;
+		pdf_obj_altered(obj, item);
 	}
 }
 
@@ -692,32 +1181,36 @@ static int keyvalcmp(const void *ap, const void *bp)
 {
 	const struct keyval *a = ap;
 	const struct keyval *b = bp;
-	return strcmp(pdf_to_name(a->k), pdf_to_name(b->k));
+	return pdf_namecmp(a->k, b->k->u.n.buf, b->k->u.n.atom);
 }
 
 pdf_obj *
 pdf_new_dict(fz_context *ctx, int initialcap)
+{
+	return pdf_pool_new_dict(ctx, NULL, initialcap);
+}
+
+pdf_obj *
+pdf_pool_new_dict(fz_context *ctx, pdf_obj_pool *pool, int initialcap)
 {
 	pdf_obj *obj;
 	int i;
 
-	obj = Memento_label(fz_malloc(ctx, sizeof(pdf_obj)), "pdf_obj(dict)");
-	obj->ctx = ctx;
-	obj->refs = 1;
-	obj->kind = PDF_DICT;
-	obj->marked = 0;
+	obj = Memento_label(pdf_alloc_obj(ctx, pool, PDF_DICT, sizeof(pdf_obj)), "pdf_obj(dict)");
 
 	obj->u.d.sorted = 0;
 	obj->u.d.len = 0;
 	obj->u.d.cap = initialcap > 1 ? initialcap : 10;
+	obj->u.d.parent_num = 0;
+	obj->u.d.owner = NULL;
 
 	fz_try(ctx)
 	{
-		obj->u.d.items = Memento_label(fz_malloc_array(ctx, obj->u.d.cap, sizeof(struct keyval)), "pdf_obj(dict items)");
+		obj->u.d.items = Memento_label(pdf_alloc_items(obj, obj->u.d.cap, sizeof(struct keyval)), "pdf_obj(dict items)");
 	}
 	fz_catch(ctx)
 	{
-		fz_free(ctx, obj);
+		pdf_free_obj(obj);
 		fz_rethrow(ctx);
 	}
 	for (i = 0; i < obj->u.d.cap; i++)
@@ -734,8 +1227,12 @@ pdf_dict_grow(pdf_obj *obj)
 {
 	int i;
 	int new_cap = (obj->u.d.cap * 3) / 2;
+	struct keyval *items;
 
-	obj->u.d.items = fz_resize_array(obj->ctx, obj->u.d.items, new_cap, sizeof(struct keyval));
+	items = pdf_alloc_items(obj, new_cap, sizeof(struct keyval));
+	memcpy(items, obj->u.d.items, obj->u.d.len * sizeof(struct keyval));
+	pdf_free_items(obj, obj->u.d.items, obj->u.d.cap, sizeof(struct keyval));
+	obj->u.d.items = items;
 	obj->u.d.cap = new_cap;
 
 	for (i = obj->u.d.len; i < obj->u.d.cap; i++)
@@ -801,14 +1298,14 @@ pdf_dict_get_val(pdf_obj *obj, int i)
 }
 
 static int
-pdf_dict_finds(pdf_obj *obj, const char *key, int *location)
+pdf_dict_finds(pdf_obj *obj, const char *key, int atom, int *location)
 {
 	if (obj->u.d.sorted && obj->u.d.len > 0)
 	{
 		int l = 0;
 		int r = obj->u.d.len - 1;
 
-		if (strcmp(pdf_to_name(obj->u.d.items[r].k), key) < 0)
+		if (pdf_namecmp(obj->u.d.items[r].k, key, atom) < 0)
 		{
 			if (location)
 				*location = r + 1;
@@ -818,7 +1315,7 @@ pdf_dict_finds(pdf_obj *obj, const char *key, int *location)
 		while (l <= r)
 		{
 			int m = (l + r) >> 1;
-			int c = -strcmp(pdf_to_name(obj->u.d.items[m].k), key);
+			int c = -pdf_namecmp(obj->u.d.items[m].k, key, atom);
 			if (c < 0)
 				r = m - 1;
 			else if (c > 0)
@@ -831,6 +1328,20 @@ pdf_dict_finds(pdf_obj *obj, const char *key, int *location)
 		}
 	}
 
+	else if (atom)
+	{
+		int i;
+		for (i = 0; i < obj->u.d.len; i++)
+		{
+			pdf_obj *k = obj->u.d.items[i].k;
+			if (k->u.n.atom == atom || (!k->u.n.atom && !strcmp(k->u.n.buf, key)))
+				return i;
+		}
+
+		if (location)
+			*location = obj->u.d.len;
+	}
+
 	else
 	{
 		int i;
@@ -845,8 +1356,8 @@ pdf_dict_finds(pdf_obj *obj, const char *key, int *location)
 	return -1;
 }
 
-pdf_obj *
-pdf_dict_gets(pdf_obj *obj, const char *key)
+static pdf_obj *
+pdf_dict_get_atom(pdf_obj *obj, const char *key, int atom)
 {
 	int i;
 
@@ -854,13 +1365,22 @@ pdf_dict_gets(pdf_obj *obj, const char *key)
 	if (!obj || obj->kind != PDF_DICT)
 		return NULL;
 
-	i = pdf_dict_finds(obj, key, NULL);
+	i = pdf_dict_finds(obj, key, atom, NULL);
 	if (i >= 0)
 		return obj->u.d.items[i].v;
 
 	return NULL;
 }
 
+pdf_obj *
+pdf_dict_gets(pdf_obj *obj, const char *key)
+{
+	RESOLVE(obj);
+	if (!obj || obj->kind != PDF_DICT)
+		return NULL;
+	return pdf_dict_get_atom(obj, key, pdf_name_atom(key));
+}
+
 pdf_obj *
 pdf_dict_getp(pdf_obj *obj, const char *keys)
 {
@@ -896,7 +1416,7 @@ pdf_dict_get(pdf_obj *obj, pdf_obj *key)
 {
 	if (!key || key->kind != PDF_NAME)
 		return NULL;
-	return pdf_dict_gets(obj, pdf_to_name(key));
+	return pdf_dict_get_atom(obj, key->u.n.buf, key->u.n.atom);
 }
 
 pdf_obj *
@@ -909,8 +1429,8 @@ pdf_dict_getsa(pdf_obj *obj, const char *key, const char *abbrev)
 	return pdf_dict_gets(obj, abbrev);
 }
 
-void
-pdf_dict_put(pdf_obj *obj, pdf_obj *key, pdf_obj *val)
+static void
+pdf_dict_put_imp(pdf_obj *obj, pdf_obj *key, pdf_obj *val, int edit)
 {
 	int location;
 	char *s;
@@ -943,14 +1463,13 @@ pdf_dict_put(pdf_obj *obj, pdf_obj *key, pdf_obj *val)
 	if (obj->u.d.len > 100 && !obj->u.d.sorted)
 		pdf_sort_dict(obj);
 
-	i = pdf_dict_finds(obj, s, &location);
+	i = pdf_dict_finds(obj, s, key->u.n.atom, &location);
 	if (i >= 0 && i < obj->u.d.len)
 	{
-		if (obj->u.d.items[i].v != val)
-		{
-			pdf_drop_obj(obj->u.d.items[i].v);
-			obj->u.d.items[i].v = pdf_keep_obj(val);
-		}
+		if (obj->u.d.items[i].v == val)
+			return;
+		pdf_drop_obj(obj->u.d.items[i].v);
+		obj->u.d.items[i].v = pdf_keep_obj(val);
 	}
 	else
 	{
@@ -967,6 +1486,15 @@ pdf_dict_put(pdf_obj *obj, pdf_obj *key, pdf_obj *val)
 		obj->u.d.items[i].v = pdf_keep_obj(val);
 		obj->u.d.len ++;
 	}
+
+	if (edit)
+		pdf_obj_altered(obj, val);
+}
+
+void
+pdf_dict_put(pdf_obj *obj, pdf_obj *key, pdf_obj *val)
+{
+	pdf_dict_put_imp(obj, key, val, 1);
 }
 
 void
@@ -989,6 +1517,26 @@ pdf_dict_puts(pdf_obj *obj, const char *key, pdf_obj *val)
 	}
 }
 
+void
+pdf_dict_puts_derived(pdf_obj *obj, const char *key, pdf_obj *val)
+{
+	fz_context *ctx = obj->ctx;
+	pdf_obj *keyobj = pdf_new_name(ctx, key);
+
+	fz_try(ctx)
+	{
+		pdf_dict_put_imp(obj, keyobj, val, 0);
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(keyobj);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
 void
 pdf_dict_puts_drop(pdf_obj *obj, const char *key, pdf_obj *val)
 {
@@ -1093,8 +1641,8 @@ pdf_dict_putp_drop(pdf_obj *obj, const char *keys, pdf_obj *val)
 	}
 }
 
-void
-pdf_dict_dels(pdf_obj *obj, const char *key)
+static void
+pdf_dict_del_atom(pdf_obj *obj, const char *key, int atom)
 {
 	RESOLVE(obj);
 
@@ -1104,7 +1652,7 @@ pdf_dict_dels(pdf_obj *obj, const char *key)
 		fz_warn(obj->ctx, "assert: not a dict (%s)", pdf_objkindstr(obj));
 	else
 	{
-		int i = pdf_dict_finds(obj, key, NULL);
+		int i = pdf_dict_finds(obj, key, atom, NULL);
 		if (i >= 0)
 		{
 			pdf_drop_obj(obj->u.d.items[i].k);
@@ -1112,10 +1660,17 @@ pdf_dict_dels(pdf_obj *obj, const char *key)
 			obj->u.d.sorted = 0;
 			obj->u.d.items[i] = obj->u.d.items[obj->u.d.len-1];
 			obj->u.d.len --;
+			pdf_obj_altered(obj, NULL);
 		}
 	}
 }
 
+void
+pdf_dict_dels(pdf_obj *obj, const char *key)
+{
+	pdf_dict_del_atom(obj, key, pdf_name_atom(key));
+}
+
 void
 pdf_dict_del(pdf_obj *obj, pdf_obj *key)
 {
@@ -1123,7 +1678,7 @@ pdf_dict_del(pdf_obj *obj, pdf_obj *key)
 	if (!key || key->kind != PDF_NAME)
 		fz_warn(obj->ctx, "assert: key is not a name (%s)", pdf_objkindstr(obj));
 	else
-		pdf_dict_dels(obj, key->u.n);
+		pdf_dict_del_atom(obj, key->u.n.buf, key->u.n.atom);
 }
 
 void
@@ -1177,8 +1732,9 @@ pdf_free_array(pdf_obj *obj)
 	for (i = 0; i < obj->u.a.len; i++)
 		pdf_drop_obj(obj->u.a.items[i]);
 
-	fz_free(obj->ctx, obj->u.a.items);
-	fz_free(obj->ctx, obj);
+	pdf_free_items(obj, obj->u.a.items, obj->u.a.cap, sizeof(pdf_obj*));
+	pdf_drop_doc_handle(obj->ctx, obj->u.a.owner);
+	pdf_free_obj(obj);
 }
 
 static void
@@ -1191,8 +1747,9 @@ pdf_free_dict(pdf_obj *obj)
 		pdf_drop_obj(obj->u.d.items[i].v);
 	}
 
-	fz_free(obj->ctx, obj->u.d.items);
-	fz_free(obj->ctx, obj);
+	pdf_free_items(obj, obj->u.d.items, obj->u.d.cap, sizeof(struct keyval));
+	pdf_drop_doc_handle(obj->ctx, obj->u.d.owner);
+	pdf_free_obj(obj);
 }
 
 void
@@ -1207,7 +1764,7 @@ pdf_drop_obj(pdf_obj *obj)
 	else if (obj->kind == PDF_DICT)
 		pdf_free_dict(obj);
 	else
-		fz_free(obj->ctx, obj);
+		pdf_free_obj(obj);
 }
 
 pdf_obj *pdf_new_obj_from_str(fz_context *ctx, const char *src)
@@ -1476,7 +2033,7 @@ static void fmt_obj(struct fmt *fmt, pdf_obj *obj)
 		fmt_puts(fmt, pdf_to_bool(obj) ? "true" : "false");
 	else if (pdf_is_int(obj))
 	{
-		sprintf(buf, "%d", pdf_to_int(obj));
+		sprintf(buf, "%lld", pdf_to_offset(obj));
 		fmt_puts(fmt, buf);
 	}
 	else if (pdf_is_real(obj))
@@ -1536,6 +2093,12 @@ pdf_sprint_obj(char *s, int n, pdf_obj *obj, int tight)
 	return fmt.len;
 }
 
+int
+pdf_print_obj_len(pdf_obj *obj, int tight)
+{
+	return pdf_sprint_obj(NULL, 0, obj, tight);
+}
+
 int
 pdf_fprint_obj(FILE *fp, pdf_obj *obj, int tight)
 {
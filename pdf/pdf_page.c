@@ -17,7 +17,7 @@ put_marker_bool(fz_context *ctx, pdf_obj *rdb, char *marker, int val)
 	tmp = pdf_new_bool(ctx, val);
 	fz_try(ctx)
 	{
-		pdf_dict_puts(rdb, marker, tmp);
+		pdf_dict_puts_derived(rdb, marker, tmp);
 	}
 	fz_always(ctx)
 	{
@@ -40,11 +40,163 @@ struct pdf_page_load_s
 	struct info info;
 };
 
+/*
+	The page tree is not walked when the document is opened. The page
+	count is taken from the /Count of the root, once it has been checked
+	against the counts of the root's kids, and page n is found by
+	descending from the root, skipping over whole subtrees by their
+	/Count, so only the nodes on the way (and the pages before n in the
+	node that holds it) are ever loaded. Every page met on the way is
+	remembered in page_refs/page_objs. The node in which the last page
+	was found is kept in page_hint, so that going through the pages in
+	order continues from there rather than from the root.
+
+	Each node is checked in the same way before we descend into it. If
+	the counts turn out not to match the tree we fall back to walking
+	the whole tree in order, as pdf_load_page_tree_node does, and the
+	number of pages found by the walk is the page count from then on.
+
+	Going the other way, from a page object to its number, uses
+	page_index: a hash from object number to page number, filled in as
+	pages are found. A page that is not in it yet is placed by climbing
+	its /Parent chain and adding up the /Count of the kids before it,
+	and the answer checked by looking that page up. Entries are checked
+	against page_refs when they are used, so inserting or deleting pages
+	only needs page_refs to be kept right; stale entries are dropped.
+*/
+
+#define PAGE_TREE_MAX_DEPTH 64
+#define PAGE_TREE_MAX_SCAN 1024
+
+static void
+inherit_page_info(pdf_obj *node, struct info *info)
+{
+	pdf_obj *obj;
+
+	obj = pdf_dict_gets(node, "Resources");
+	if (obj)
+		info->resources = obj;
+	obj = pdf_dict_gets(node, "MediaBox");
+	if (obj)
+		info->mediabox = obj;
+	obj = pdf_dict_gets(node, "CropBox");
+	if (obj)
+		info->cropbox = obj;
+	obj = pdf_dict_gets(node, "Rotate");
+	if (obj)
+		info->rotate = obj;
+}
+
+/* Inherited attributes are copied in, but that is not an edit of the page */
+static void
+apply_page_info(pdf_obj *dict, struct info *info)
+{
+	if (info->resources && !pdf_dict_gets(dict, "Resources"))
+		pdf_dict_puts_derived(dict, "Resources", info->resources);
+	if (info->mediabox && !pdf_dict_gets(dict, "MediaBox"))
+		pdf_dict_puts_derived(dict, "MediaBox", info->mediabox);
+	if (info->cropbox && !pdf_dict_gets(dict, "CropBox"))
+		pdf_dict_puts_derived(dict, "CropBox", info->cropbox);
+	if (info->rotate && !pdf_dict_gets(dict, "Rotate"))
+		pdf_dict_puts_derived(dict, "Rotate", info->rotate);
+}
+
+static void
+pdf_drop_page_hint(pdf_page_hint *hint)
+{
+	pdf_drop_obj(hint->node);
+	pdf_drop_obj(hint->resources);
+	pdf_drop_obj(hint->mediabox);
+	pdf_drop_obj(hint->cropbox);
+	pdf_drop_obj(hint->rotate);
+	memset(hint, 0, sizeof(*hint));
+}
+
+static void
+pdf_set_page_hint(pdf_page_hint *hint, pdf_obj *node, int start, int count, int pos, int base, struct info *info)
+{
+	pdf_drop_page_hint(hint);
+	hint->node = pdf_keep_obj(node);
+	hint->start = start;
+	hint->count = count;
+	hint->pos = pos;
+	hint->base = base;
+	hint->resources = pdf_keep_obj(info->resources);
+	hint->mediabox = pdf_keep_obj(info->mediabox);
+	hint->cropbox = pdf_keep_obj(info->cropbox);
+	hint->rotate = pdf_keep_obj(info->rotate);
+}
+
+void
+pdf_drop_page_tree(pdf_document *xref)
+{
+	fz_context *ctx = xref->ctx;
+	int i;
+
+	for (i = 0; i < xref->page_cap; i++)
+	{
+		if (xref->page_objs)
+			pdf_drop_obj(xref->page_objs[i]);
+		if (xref->page_refs)
+			pdf_drop_obj(xref->page_refs[i]);
+	}
+	fz_free(ctx, xref->page_objs);
+	fz_free(ctx, xref->page_refs);
+	xref->page_objs = NULL;
+	xref->page_refs = NULL;
+	xref->page_len = 0;
+	xref->page_cap = 0;
+	xref->page_tree_complete = 0;
+	pdf_drop_page_hint(&xref->page_hint);
+	if (xref->page_index)
+		fz_free_hash(ctx, xref->page_index);
+	xref->page_index = NULL;
+}
+
+/* Returns the page number for object num, or -1 if it is not known. */
+static int
+pdf_find_page_index(pdf_document *xref, int num)
+{
+	fz_context *ctx = xref->ctx;
+	void *found;
+	int number;
+
+	if (!xref->page_index)
+		return -1;
+	found = fz_hash_find(ctx, xref->page_index, &num);
+	if (!found)
+		return -1;
+	number = (int)(size_t)found - 1;
+	if (number < xref->page_len && pdf_to_num(xref->page_refs[number]) == num)
+		return number;
+	fz_hash_remove(ctx, xref->page_index, &num);
+	return -1;
+}
+
+static void
+pdf_index_page(pdf_document *xref, int number, pdf_obj *ref)
+{
+	fz_context *ctx = xref->ctx;
+	int num = pdf_to_num(ref);
+	int old;
+
+	if (num <= 0)
+		return;
+	if (!xref->page_index)
+		xref->page_index = fz_new_hash_table(ctx, 256, sizeof(int), -1);
+	/* A page that appears twice is numbered by its first appearance */
+	old = pdf_find_page_index(xref, num);
+	if (old >= 0 && old <= number)
+		return;
+	if (old >= 0)
+		fz_hash_remove(ctx, xref->page_index, &num);
+	fz_hash_insert(ctx, xref->page_index, &num, (void *)(size_t)(number + 1));
+}
+
 static void
 pdf_load_page_tree_node(pdf_document *xref, pdf_obj *node, struct info info)
 {
 	pdf_obj *dict, *kids, *count;
-	pdf_obj *obj;
 	fz_context *ctx = xref->ctx;
 	pdf_page_load *stack = NULL;
 	int stacklen = -1;
@@ -66,18 +218,7 @@ pdf_load_page_tree_node(pdf_document *xref, pdf_obj *node, struct info info)
 				if (pdf_is_array(kids) && pdf_is_int(count))
 				{
 					/* Push this onto the stack */
-					obj = pdf_dict_gets(node, "Resources");
-					if (obj)
-						info.resources = obj;
-					obj = pdf_dict_gets(node, "MediaBox");
-					if (obj)
-						info.mediabox = obj;
-					obj = pdf_dict_gets(node, "CropBox");
-					if (obj)
-						info.cropbox = obj;
-					obj = pdf_dict_gets(node, "Rotate");
-					if (obj)
-						info.rotate = obj;
+					inherit_page_info(node, &info);
 					stacklen++;
 					if (stacklen == stackmax)
 					{
@@ -92,25 +233,21 @@ pdf_load_page_tree_node(pdf_document *xref, pdf_obj *node, struct info info)
 				}
 				else if ((dict = pdf_to_dict(node)) != NULL)
 				{
-					if (info.resources && !pdf_dict_gets(dict, "Resources"))
-						pdf_dict_puts(dict, "Resources", info.resources);
-					if (info.mediabox && !pdf_dict_gets(dict, "MediaBox"))
-						pdf_dict_puts(dict, "MediaBox", info.mediabox);
-					if (info.cropbox && !pdf_dict_gets(dict, "CropBox"))
-						pdf_dict_puts(dict, "CropBox", info.cropbox);
-					if (info.rotate && !pdf_dict_gets(dict, "Rotate"))
-						pdf_dict_puts(dict, "Rotate", info.rotate);
+					apply_page_info(dict, &info);
 
 					if (xref->page_len == xref->page_cap)
 					{
 						fz_warn(ctx, "found more pages than expected");
 						xref->page_refs = fz_resize_array(ctx, xref->page_refs, xref->page_cap+1, sizeof(pdf_obj*));
 						xref->page_objs = fz_resize_array(ctx, xref->page_objs, xref->page_cap+1, sizeof(pdf_obj*));
+						xref->page_refs[xref->page_cap] = NULL;
+						xref->page_objs[xref->page_cap] = NULL;
 						xref->page_cap ++;
 					}
 
 					xref->page_refs[xref->page_len] = pdf_keep_obj(node);
 					xref->page_objs[xref->page_len] = pdf_keep_obj(dict);
+					pdf_index_page(xref, xref->page_len, node);
 					xref->page_len ++;
 					pdf_obj_unmark(node);
 				}
@@ -145,17 +282,13 @@ pdf_load_page_tree_node(pdf_document *xref, pdf_obj *node, struct info info)
 	}
 }
 
-static void
-pdf_load_page_tree(pdf_document *xref)
+static pdf_obj *
+pdf_page_tree_root(pdf_document *xref, int *countp)
 {
 	fz_context *ctx = xref->ctx;
 	pdf_obj *catalog;
 	pdf_obj *pages;
 	pdf_obj *count;
-	struct info info;
-
-	if (xref->page_refs)
-		return;
 
 	catalog = pdf_dict_gets(xref->trailer, "Root");
 	pages = pdf_dict_gets(catalog, "Pages");
@@ -166,10 +299,109 @@ pdf_load_page_tree(pdf_document *xref)
 	if (!pdf_is_int(count) || pdf_to_int(count) < 0)
 		fz_throw(ctx, "missing page count");
 
-	xref->page_cap = pdf_to_int(count);
+	*countp = pdf_to_int(count);
+	return pages;
+}
+
+/*
+	Check that the /Count of a node is the number of pages its kids hold,
+	telling interior nodes from pages as pdf_load_page_tree_node does.
+	Only the kids themselves are looked at, not their subtrees.
+*/
+static int
+pdf_page_node_matches_count(pdf_obj *node, int count)
+{
+	pdf_obj *kids, *kid, *kidcount;
+	int i, len, c, sum = 0;
+
+	kids = pdf_dict_gets(node, "Kids");
+	if (!pdf_is_array(kids))
+		return 0;
+	len = pdf_array_len(kids);
+	for (i = 0; i < len; i++)
+	{
+		kid = pdf_array_get(kids, i);
+		kidcount = pdf_dict_gets(kid, "Count");
+		if (pdf_is_array(pdf_dict_gets(kid, "Kids")) && pdf_is_int(kidcount))
+		{
+			c = pdf_to_int(kidcount);
+			if (c < 0 || c > count - sum)
+				return 0;
+			sum += c;
+		}
+		else if (pdf_is_dict(kid))
+		{
+			if (sum == count)
+				return 0;
+			sum++;
+		}
+	}
+	return sum == count;
+}
+
+static void pdf_load_page_tree(pdf_document *xref);
+
+/* Set up the (empty) page arrays, sized by the root's /Count. If that
+ * count does not match the root's kids, walk the whole tree instead. */
+static void
+pdf_init_page_tree(pdf_document *xref)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_obj *pages;
+	int count;
+
+	if (xref->page_refs)
+		return;
+
+	pages = pdf_page_tree_root(xref, &count);
+
+	xref->page_objs = fz_calloc(ctx, fz_maxi(count, 1), sizeof(pdf_obj*));
+	fz_try(ctx)
+	{
+		xref->page_refs = fz_calloc(ctx, fz_maxi(count, 1), sizeof(pdf_obj*));
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, xref->page_objs);
+		xref->page_objs = NULL;
+		fz_rethrow(ctx);
+	}
+	xref->page_cap = fz_maxi(count, 1);
+	xref->page_len = count;
+	xref->page_tree_complete = 0;
+
+	if (!pdf_page_node_matches_count(pages, count))
+	{
+		fz_warn(ctx, "page tree does not match its counts; loading all of it");
+		pdf_load_page_tree(xref);
+	}
+}
+
+/* Walk the whole tree, replacing whatever we found lazily. */
+static void
+pdf_load_page_tree(pdf_document *xref)
+{
+	pdf_obj *pages;
+	struct info info;
+	int i, count;
+
+	pdf_init_page_tree(xref);
+	if (xref->page_tree_complete)
+		return;
+
+	pages = pdf_page_tree_root(xref, &count);
+
+	pdf_drop_page_hint(&xref->page_hint);
+	if (xref->page_index)
+		fz_empty_hash(xref->ctx, xref->page_index);
+	for (i = 0; i < xref->page_cap; i++)
+	{
+		pdf_drop_obj(xref->page_objs[i]);
+		pdf_drop_obj(xref->page_refs[i]);
+		xref->page_objs[i] = NULL;
+		xref->page_refs[i] = NULL;
+	}
 	xref->page_len = 0;
-	xref->page_refs = fz_malloc_array(ctx, xref->page_cap, sizeof(pdf_obj*));
-	xref->page_objs = fz_malloc_array(ctx, xref->page_cap, sizeof(pdf_obj*));
 
 	info.resources = NULL;
 	info.mediabox = NULL;
@@ -177,25 +409,249 @@ pdf_load_page_tree(pdf_document *xref)
 	info.rotate = NULL;
 
 	pdf_load_page_tree_node(xref, pages, info);
+	xref->page_tree_complete = 1;
+}
+
+static void
+pdf_remember_page(pdf_document *xref, int number, pdf_obj *ref, struct info *info)
+{
+	pdf_obj *dict;
+
+	if (number >= xref->page_len || xref->page_refs[number])
+		return;
+	dict = pdf_to_dict(ref);
+	apply_page_info(dict, info);
+	xref->page_refs[number] = pdf_keep_obj(ref);
+	xref->page_objs[number] = pdf_keep_obj(dict);
+	pdf_index_page(xref, number, ref);
+}
+
+/*
+	Find page 'needle' by descending the tree by the /Count of each
+	node, checking each node's /Count before going into it. Returns 1 if
+	it was found (and is now in page_refs), or 0 if the tree is not what
+	its counts say.
+*/
+static int
+pdf_lookup_page_lazily(pdf_document *xref, int needle)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_page_hint *hint = &xref->page_hint;
+	pdf_obj *path[PAGE_TREE_MAX_DEPTH];
+	pdf_obj *node, *kids, *kid, *count;
+	struct info info;
+	int start, nodecount, pos, base;
+	int depth = 0, found = 0, descended;
+	int i, len, c;
+
+	if (hint->node && needle >= hint->base && needle < hint->start + hint->count)
+	{
+		node = hint->node;
+		start = hint->start;
+		nodecount = hint->count;
+		pos = hint->pos;
+		base = hint->base;
+		info.resources = hint->resources;
+		info.mediabox = hint->mediabox;
+		info.cropbox = hint->cropbox;
+		info.rotate = hint->rotate;
+	}
+	else
+	{
+		node = pdf_page_tree_root(xref, &nodecount);
+		start = 0;
+		pos = 0;
+		base = 0;
+		info.resources = NULL;
+		info.mediabox = NULL;
+		info.cropbox = NULL;
+		info.rotate = NULL;
+		inherit_page_info(node, &info);
+	}
+
+	fz_try(ctx)
+	{
+		while (!found && depth < PAGE_TREE_MAX_DEPTH && !pdf_obj_mark(node))
+		{
+			path[depth++] = node;
+			kids = pdf_dict_gets(node, "Kids");
+			len = pdf_array_len(kids);
+			descended = 0;
+			for (i = pos; i < len && !found && !descended; i++)
+			{
+				kid = pdf_array_get(kids, i);
+				count = pdf_dict_gets(kid, "Count");
+				if (pdf_is_array(pdf_dict_gets(kid, "Kids")) && pdf_is_int(count))
+				{
+					c = pdf_to_int(count);
+					if (c < 0)
+						break;
+					if (needle < base + c)
+					{
+						if (!pdf_page_node_matches_count(kid, c))
+							break;
+						node = kid;
+						start = base;
+						nodecount = c;
+						pos = 0;
+						inherit_page_info(node, &info);
+						descended = 1;
+					}
+					else
+						base += c;
+				}
+				else if (pdf_is_dict(kid))
+				{
+					pdf_remember_page(xref, base, kid, &info);
+					if (base == needle)
+					{
+						pdf_set_page_hint(hint, node, start, nodecount, i, base, &info);
+						found = 1;
+					}
+					else
+						base++;
+				}
+			}
+			if (!descended)
+				break;
+		}
+	}
+	fz_always(ctx)
+	{
+		while (depth > 0)
+			pdf_obj_unmark(path[--depth]);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return found;
+}
+
+static void
+pdf_load_page_entry(pdf_document *xref, int needle)
+{
+	fz_context *ctx = xref->ctx;
+
+	pdf_init_page_tree(xref);
+	if (needle < 0 || needle >= xref->page_len)
+		fz_throw(ctx, "cannot find page %d", needle + 1);
+	if (xref->page_refs[needle])
+		return;
+
+	if (!xref->page_tree_complete && !pdf_lookup_page_lazily(xref, needle))
+	{
+		fz_warn(ctx, "page tree does not match its counts; loading all of it");
+		pdf_load_page_tree(xref);
+		if (needle >= xref->page_len)
+			fz_throw(ctx, "cannot find page %d", needle + 1);
+	}
+
+	if (!xref->page_refs[needle])
+		fz_throw(ctx, "cannot find page %d", needle + 1);
+}
+
+pdf_obj *
+pdf_lookup_page_obj(pdf_document *xref, int needle)
+{
+	pdf_load_page_entry(xref, needle);
+	return xref->page_objs[needle];
+}
+
+pdf_obj *
+pdf_lookup_page_ref(pdf_document *xref, int needle)
+{
+	pdf_load_page_entry(xref, needle);
+	return xref->page_refs[needle];
 }
 
 int
 pdf_count_pages(pdf_document *xref)
 {
-	pdf_load_page_tree(xref);
+	pdf_init_page_tree(xref);
 	return xref->page_len;
 }
 
+/*
+	Work out the number of a page from where it sits in the tree: climb
+	the /Parent chain, counting the pages in the kids before it at each
+	level. Gives up (returning -1) on very wide nodes, where loading the
+	whole tree once is cheaper than scanning them for every link.
+*/
+static int
+pdf_guess_page_number(pdf_document *xref, pdf_obj *page)
+{
+	pdf_obj *node, *parent, *kids, *kid, *count;
+	int number = 0, scanned = 0;
+	int depth, i, len;
+
+	node = page;
+	for (depth = 0; depth < PAGE_TREE_MAX_DEPTH; depth++)
+	{
+		parent = pdf_dict_gets(node, "Parent");
+		if (!parent)
+			return number;
+		kids = pdf_dict_gets(parent, "Kids");
+		len = pdf_array_len(kids);
+		for (i = 0; i < len; i++)
+		{
+			kid = pdf_array_get(kids, i);
+			if (kid == node || (pdf_is_indirect(kid) && pdf_to_num(kid) == pdf_to_num(node)))
+				break;
+			if (++scanned > PAGE_TREE_MAX_SCAN)
+				return -1;
+			count = pdf_dict_gets(kid, "Count");
+			if (pdf_is_array(pdf_dict_gets(kid, "Kids")) && pdf_is_int(count))
+				number += pdf_to_int(count);
+			else if (pdf_is_dict(kid))
+				number++;
+		}
+		if (i == len)
+			return -1;
+		node = parent;
+	}
+	return -1;
+}
+
 int
 pdf_lookup_page_number(pdf_document *xref, pdf_obj *page)
 {
-	int i, num = pdf_to_num(page);
+	fz_context *ctx = xref->ctx;
+	int i, number, num = pdf_to_num(page);
+
+	if (num <= 0)
+	{
+		/* Not an indirect object, so not in the index */
+		pdf_load_page_tree(xref);
+		for (i = 0; i < xref->page_len; i++)
+			if (num == pdf_to_num(xref->page_refs[i]))
+				return i;
+		return -1;
+	}
+
+	pdf_init_page_tree(xref);
+	number = pdf_find_page_index(xref, num);
+	if (number >= 0 || xref->page_tree_complete)
+		return number;
+
+	number = pdf_guess_page_number(xref, page);
+	if (number >= 0 && number < xref->page_len)
+	{
+		fz_try(ctx)
+		{
+			pdf_load_page_entry(xref, number);
+		}
+		fz_catch(ctx)
+		{
+			number = -1;
+		}
+		if (number >= 0 && pdf_to_num(xref->page_refs[number]) == num)
+			return number;
+	}
 
 	pdf_load_page_tree(xref);
-	for (i = 0; i < xref->page_len; i++)
-		if (num == pdf_to_num(xref->page_refs[i]))
-			return i;
-	return -1;
+	return pdf_find_page_index(xref, num);
 }
 
 /* We need to know whether to install a page-level transparency group */
@@ -342,11 +798,7 @@ pdf_load_page(pdf_document *xref, int number)
 	float userunit;
 	fz_matrix mat;
 
-	pdf_load_page_tree(xref);
-	if (number < 0 || number >= xref->page_len)
-		fz_throw(ctx, "cannot find page %d", number + 1);
-
-	pageobj = xref->page_objs[number];
+	pageobj = pdf_lookup_page_obj(xref, number);
 	pageref = xref->page_refs[number];
 
 	page = fz_malloc_struct(ctx, pdf_page);
@@ -228,19 +228,29 @@ pdf_to_utf8_name(pdf_document *xref, pdf_obj *src)
 	return dst;
 }
 
-pdf_obj *
-pdf_parse_array(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
+/*
+ * With a non-zero num, the dicts and arrays parsed are made part of
+ * object num of xref as they are finished, innermost first, which saves
+ * walking the object afterwards to do so.
+ */
+
+static pdf_obj *pdf_parse_dict_imp(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf, int num);
+
+static pdf_obj *
+pdf_parse_array_imp(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf, int num)
 {
 	pdf_obj *ary = NULL;
 	pdf_obj *obj = NULL;
-	int a = 0, b = 0, n = 0;
+	fz_off_t a = 0, b = 0;
+	int n = 0;
 	pdf_token tok;
 	fz_context *ctx = file->ctx;
+	pdf_obj_pool *pool = xref ? xref->obj_pool : NULL;
 	pdf_obj *op;
 
 	fz_var(obj);
 
-	ary = pdf_new_array(ctx, 4);
+	ary = pdf_pool_new_array(ctx, pool, 4);
 
 	fz_try(ctx)
 	{
@@ -252,14 +262,14 @@ pdf_parse_array(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 			{
 				if (n > 0)
 				{
-					obj = pdf_new_int(ctx, a);
+					obj = pdf_pool_new_int(ctx, pool, a);
 					pdf_array_push(ary, obj);
 					pdf_drop_obj(obj);
 					obj = NULL;
 				}
 				if (n > 1)
 				{
-					obj = pdf_new_int(ctx, b);
+					obj = pdf_pool_new_int(ctx, pool, b);
 					pdf_array_push(ary, obj);
 					pdf_drop_obj(obj);
 					obj = NULL;
@@ -269,7 +279,7 @@ pdf_parse_array(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 
 			if (tok == PDF_TOK_INT && n == 2)
 			{
-				obj = pdf_new_int(ctx, a);
+				obj = pdf_pool_new_int(ctx, pool, a);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
@@ -294,7 +304,7 @@ pdf_parse_array(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 			case PDF_TOK_R:
 				if (n != 2)
 					fz_throw(ctx, "cannot parse indirect reference in array");
-				obj = pdf_new_indirect(ctx, a, b, xref);
+				obj = pdf_pool_new_indirect(ctx, pool, a, b, xref);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
@@ -302,51 +312,51 @@ pdf_parse_array(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 				break;
 
 			case PDF_TOK_OPEN_ARRAY:
-				obj = pdf_parse_array(xref, file, buf);
+				obj = pdf_parse_array_imp(xref, file, buf, num);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
 				break;
 
 			case PDF_TOK_OPEN_DICT:
-				obj = pdf_parse_dict(xref, file, buf);
+				obj = pdf_parse_dict_imp(xref, file, buf, num);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
 				break;
 
 			case PDF_TOK_NAME:
-				obj = pdf_new_name(ctx, buf->scratch);
+				obj = pdf_pool_new_name(ctx, pool, buf->scratch);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
 				break;
 			case PDF_TOK_REAL:
-				obj = pdf_new_real(ctx, buf->f);
+				obj = pdf_pool_new_real(ctx, pool, buf->f);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
 				break;
 			case PDF_TOK_STRING:
-				obj = pdf_new_string(ctx, buf->scratch, buf->len);
+				obj = pdf_pool_new_string(ctx, pool, buf->scratch, buf->len);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
 				break;
 			case PDF_TOK_TRUE:
-				obj = pdf_new_bool(ctx, 1);
+				obj = pdf_pool_new_bool(ctx, pool, 1);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
 				break;
 			case PDF_TOK_FALSE:
-				obj = pdf_new_bool(ctx, 0);
+				obj = pdf_pool_new_bool(ctx, pool, 0);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
 				break;
 			case PDF_TOK_NULL:
-				obj = pdf_new_null(ctx);
+				obj = pdf_pool_new_null(ctx, pool);
 				pdf_array_push(ary, obj);
 				pdf_drop_obj(obj);
 				obj = NULL;
@@ -365,20 +375,29 @@ end:
 		pdf_drop_obj(ary);
 		fz_throw(ctx, "cannot parse array");
 	}
+	if (num)
+		pdf_set_parsed_obj_parent(xref, op, num);
 	return op;
 }
 
 pdf_obj *
-pdf_parse_dict(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
+pdf_parse_array(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
+{
+	return pdf_parse_array_imp(xref, file, buf, 0);
+}
+
+static pdf_obj *
+pdf_parse_dict_imp(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf, int num)
 {
 	pdf_obj *dict;
 	pdf_obj *key = NULL;
 	pdf_obj *val = NULL;
 	pdf_token tok;
-	int a, b;
+	fz_off_t a, b;
 	fz_context *ctx = file->ctx;
+	pdf_obj_pool *pool = xref ? xref->obj_pool : NULL;
 
-	dict = pdf_new_dict(ctx, 8);
+	dict = pdf_pool_new_dict(ctx, pool, 8);
 
 	fz_var(key);
 	fz_var(val);
@@ -399,26 +418,26 @@ pdf_parse_dict(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 			if (tok != PDF_TOK_NAME)
 				fz_throw(ctx, "invalid key in dict");
 
-			key = pdf_new_name(ctx, buf->scratch);
+			key = pdf_pool_new_name(ctx, pool, buf->scratch);
 
 			tok = pdf_lex(file, buf);
 
 			switch (tok)
 			{
 			case PDF_TOK_OPEN_ARRAY:
-				val = pdf_parse_array(xref, file, buf);
+				val = pdf_parse_array_imp(xref, file, buf, num);
 				break;
 
 			case PDF_TOK_OPEN_DICT:
-				val = pdf_parse_dict(xref, file, buf);
+				val = pdf_parse_dict_imp(xref, file, buf, num);
 				break;
 
-			case PDF_TOK_NAME: val = pdf_new_name(ctx, buf->scratch); break;
-			case PDF_TOK_REAL: val = pdf_new_real(ctx, buf->f); break;
-			case PDF_TOK_STRING: val = pdf_new_string(ctx, buf->scratch, buf->len); break;
-			case PDF_TOK_TRUE: val = pdf_new_bool(ctx, 1); break;
-			case PDF_TOK_FALSE: val = pdf_new_bool(ctx, 0); break;
-			case PDF_TOK_NULL: val = pdf_new_null(ctx); break;
+			case PDF_TOK_NAME: val = pdf_pool_new_name(ctx, pool, buf->scratch); break;
+			case PDF_TOK_REAL: val = pdf_pool_new_real(ctx, pool, buf->f); break;
+			case PDF_TOK_STRING: val = pdf_pool_new_string(ctx, pool, buf->scratch, buf->len); break;
+			case PDF_TOK_TRUE: val = pdf_pool_new_bool(ctx, pool, 1); break;
+			case PDF_TOK_FALSE: val = pdf_pool_new_bool(ctx, pool, 0); break;
+			case PDF_TOK_NULL: val = pdf_pool_new_null(ctx, pool); break;
 
 			case PDF_TOK_INT:
 				/* 64-bit to allow for numbers > INT_MAX and overflow */
@@ -427,7 +446,7 @@ pdf_parse_dict(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 				if (tok == PDF_TOK_CLOSE_DICT || tok == PDF_TOK_NAME ||
 					(tok == PDF_TOK_KEYWORD && !strcmp(buf->scratch, "ID")))
 				{
-					val = pdf_new_int(ctx, a);
+					val = pdf_pool_new_int(ctx, pool, a);
 					pdf_dict_put(dict, key, val);
 					pdf_drop_obj(val);
 					val = NULL;
@@ -441,7 +460,7 @@ pdf_parse_dict(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 					tok = pdf_lex(file, buf);
 					if (tok == PDF_TOK_R)
 					{
-						val = pdf_new_indirect(ctx, a, b, xref);
+						val = pdf_pool_new_indirect(ctx, pool, a, b, xref);
 						break;
 					}
 				}
@@ -465,45 +484,68 @@ pdf_parse_dict(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
 		pdf_drop_obj(val);
 		fz_throw(ctx, "cannot parse dict");
 	}
+	if (num)
+		pdf_set_parsed_obj_parent(xref, dict, num);
 	return dict;
 }
 
 pdf_obj *
-pdf_parse_stm_obj(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
+pdf_parse_dict(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
+{
+	return pdf_parse_dict_imp(xref, file, buf, 0);
+}
+
+static pdf_obj *
+pdf_parse_stm_obj_imp(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf, int num)
 {
 	pdf_token tok;
 	fz_context *ctx = file->ctx;
+	pdf_obj_pool *pool = xref ? xref->obj_pool : NULL;
 
 	tok = pdf_lex(file, buf);
 
 	switch (tok)
 	{
 	case PDF_TOK_OPEN_ARRAY:
-		return pdf_parse_array(xref, file, buf);
+		return pdf_parse_array_imp(xref, file, buf, num);
 	case PDF_TOK_OPEN_DICT:
-		return pdf_parse_dict(xref, file, buf);
-	case PDF_TOK_NAME: return pdf_new_name(ctx, buf->scratch); break;
-	case PDF_TOK_REAL: return pdf_new_real(ctx, buf->f); break;
-	case PDF_TOK_STRING: return pdf_new_string(ctx, buf->scratch, buf->len); break;
-	case PDF_TOK_TRUE: return pdf_new_bool(ctx, 1); break;
-	case PDF_TOK_FALSE: return pdf_new_bool(ctx, 0); break;
-	case PDF_TOK_NULL: return pdf_new_null(ctx); break;
-	case PDF_TOK_INT: return pdf_new_int(ctx, buf->i); break;
+		return pdf_parse_dict_imp(xref, file, buf, num);
+	case PDF_TOK_NAME: return pdf_pool_new_name(ctx, pool, buf->scratch); break;
+	case PDF_TOK_REAL: return pdf_pool_new_real(ctx, pool, buf->f); break;
+	case PDF_TOK_STRING: return pdf_pool_new_string(ctx, pool, buf->scratch, buf->len); break;
+	case PDF_TOK_TRUE: return pdf_pool_new_bool(ctx, pool, 1); break;
+	case PDF_TOK_FALSE: return pdf_pool_new_bool(ctx, pool, 0); break;
+	case PDF_TOK_NULL: return pdf_pool_new_null(ctx, pool); break;
+	case PDF_TOK_INT: return pdf_pool_new_int(ctx, pool, buf->i); break;
 	default: fz_throw(ctx, "unknown token in object stream");
 	}
 	return NULL; /* Stupid MSVC */
 }
 
 pdf_obj *
-pdf_parse_ind_obj(pdf_document *xref,
+pdf_parse_stm_obj(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf)
+{
+	return pdf_parse_stm_obj_imp(xref, file, buf, 0);
+}
+
+pdf_obj *
+pdf_parse_owned_stm_obj(pdf_document *xref, fz_stream *file, pdf_lexbuf *buf, int num)
+{
+	return pdf_parse_stm_obj_imp(xref, file, buf, num);
+}
+
+static pdf_obj *
+pdf_parse_ind_obj_imp(pdf_document *xref,
 	fz_stream *file, pdf_lexbuf *buf,
-	int *onum, int *ogen, int *ostmofs)
+	int *onum, int *ogen, fz_off_t *ostmofs, int owned)
 {
 	pdf_obj *obj = NULL;
-	int num = 0, gen = 0, stm_ofs;
+	int num = 0, gen = 0;
+	fz_off_t stm_ofs;
 	pdf_token tok;
-	int a, b;
+	fz_off_t a, b;
 	fz_context *ctx = file->ctx;
+	pdf_obj_pool *pool = xref ? xref->obj_pool : NULL;
 
 	fz_var(obj);
 
@@ -526,19 +568,19 @@ pdf_parse_ind_obj(pdf_document *xref,
 	switch (tok)
 	{
 	case PDF_TOK_OPEN_ARRAY:
-		obj = pdf_parse_array(xref, file, buf);
+		obj = pdf_parse_array_imp(xref, file, buf, owned ? num : 0);
 		break;
 
 	case PDF_TOK_OPEN_DICT:
-		obj = pdf_parse_dict(xref, file, buf);
+		obj = pdf_parse_dict_imp(xref, file, buf, owned ? num : 0);
 		break;
 
-	case PDF_TOK_NAME: obj = pdf_new_name(ctx, buf->scratch); break;
-	case PDF_TOK_REAL: obj = pdf_new_real(ctx, buf->f); break;
-	case PDF_TOK_STRING: obj = pdf_new_string(ctx, buf->scratch, buf->len); break;
-	case PDF_TOK_TRUE: obj = pdf_new_bool(ctx, 1); break;
-	case PDF_TOK_FALSE: obj = pdf_new_bool(ctx, 0); break;
-	case PDF_TOK_NULL: obj = pdf_new_null(ctx); break;
+	case PDF_TOK_NAME: obj = pdf_pool_new_name(ctx, pool, buf->scratch); break;
+	case PDF_TOK_REAL: obj = pdf_pool_new_real(ctx, pool, buf->f); break;
+	case PDF_TOK_STRING: obj = pdf_pool_new_string(ctx, pool, buf->scratch, buf->len); break;
+	case PDF_TOK_TRUE: obj = pdf_pool_new_bool(ctx, pool, 1); break;
+	case PDF_TOK_FALSE: obj = pdf_pool_new_bool(ctx, pool, 0); break;
+	case PDF_TOK_NULL: obj = pdf_pool_new_null(ctx, pool); break;
 
 	case PDF_TOK_INT:
 		a = buf->i;
@@ -546,7 +588,7 @@ pdf_parse_ind_obj(pdf_document *xref,
 
 		if (tok == PDF_TOK_STREAM || tok == PDF_TOK_ENDOBJ)
 		{
-			obj = pdf_new_int(ctx, a);
+			obj = pdf_pool_new_int(ctx, pool, a);
 			goto skip;
 		}
 		if (tok == PDF_TOK_INT)
@@ -555,14 +597,14 @@ pdf_parse_ind_obj(pdf_document *xref,
 			tok = pdf_lex(file, buf);
 			if (tok == PDF_TOK_R)
 			{
-				obj = pdf_new_indirect(ctx, a, b, xref);
+				obj = pdf_pool_new_indirect(ctx, pool, a, b, xref);
 				break;
 			}
 		}
 		fz_throw(ctx, "expected 'R' keyword (%d %d R)", num, gen);
 
 	case PDF_TOK_ENDOBJ:
-		obj = pdf_new_null(ctx);
+		obj = pdf_pool_new_null(ctx, pool);
 		goto skip;
 
 	default:
@@ -610,3 +652,19 @@ skip:
 	if (ostmofs) *ostmofs = stm_ofs;
 	return obj;
 }
+
+pdf_obj *
+pdf_parse_ind_obj(pdf_document *xref,
+	fz_stream *file, pdf_lexbuf *buf,
+	int *onum, int *ogen, fz_off_t *ostmofs)
+{
+	return pdf_parse_ind_obj_imp(xref, file, buf, onum, ogen, ostmofs, 0);
+}
+
+pdf_obj *
+pdf_parse_owned_ind_obj(pdf_document *xref,
+	fz_stream *file, pdf_lexbuf *buf,
+	int *onum, int *ogen, fz_off_t *ostmofs)
+{
+	return pdf_parse_ind_obj_imp(xref, file, buf, onum, ogen, ostmofs, 1);
+}
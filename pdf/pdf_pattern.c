@@ -46,7 +46,7 @@ pdf_load_pattern(pdf_document *xref, pdf_obj *dict)
 	}
 
 	pat = fz_malloc_struct(ctx, pdf_pattern);
-	FZ_INIT_STORABLE(pat, 1, pdf_free_pattern_imp);
+	FZ_INIT_STORABLE(pat, 1, pdf_free_pattern_imp, FZ_STORE_OTHER);
 	pat->resources = NULL;
 	pat->contents = NULL;
 
@@ -6,21 +6,272 @@
 /* Define in PDF 1.7 to be 8388607, but mupdf is more lenient. */
 #define MAX_OBJECT_NUMBER (10 << 20)
 
+/* Files smaller than this are not worth scanning in parallel */
+#define MIN_PARALLEL_SCAN (4 << 20)
+
+/* Give up on the endstream index if it would take more entries than this */
+#define MAX_ENDSTREAM_INDEX (16 << 20)
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SCAN_SSE2
+#include <emmintrin.h>
+#endif
+
 struct entry
 {
 	int num;
 	int gen;
-	int ofs;
-	int stm_ofs;
-	int stm_len;
+	fz_off_t ofs;
+	fz_off_t stm_ofs;
+	fz_off_t stm_len;
 };
 
+/*
+ * Streams with a missing or wrong /Length are recovered by searching for
+ * the next "endstream", which is where nearly all the time goes when
+ * repairing a large file.
+ *
+ * For a memory backed file (mapped or in a buffer) the whole file is first
+ * searched in chunks, one job per chunk, and the hits are merged into one
+ * sorted index. The token walk below stays serial, so that strings,
+ * comments and broken objects swallow exactly what they always did, and
+ * asks the index for the first "endstream" at or after the stream start:
+ * the same answer the byte by byte search gives.
+ */
+
+struct endstream_index
+{
+	fz_off_t *ofs;
+	int len;
+};
+
+struct endstream_job
+{
+	const unsigned char *data;
+	fz_off_t len;
+	fz_off_t start, end;
+	fz_off_t *ofs; /* NULL to only count the hits */
+	int count;
+};
+
+/* Find the first "endstream" lying entirely within [s, e). */
+static const unsigned char *
+find_endstream(const unsigned char *s, const unsigned char *e)
+{
+	const unsigned char *p = s;
+
+	if (e - s < 9)
+		return NULL;
+	e -= 8; /* end of the possible starts */
+
+#ifdef HAVE_SCAN_SSE2
+	{
+		const __m128i ce = _mm_set1_epi8('e');
+		const __m128i cn = _mm_set1_epi8('n');
+		int mask, k;
+
+		/* look for "en" sixteen starts at a time */
+		for (; e - p >= 16; p += 16)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i *)p);
+			__m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+			mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, ce), _mm_cmpeq_epi8(b, cn)));
+			for (k = 0; mask; k++, mask >>= 1)
+				if ((mask & 1) && !memcmp(p + k, "endstream", 9))
+					return p + k;
+		}
+	}
+#endif
+
+	while (p < e)
+	{
+		p = memchr(p, 'e', e - p);
+		if (!p)
+			return NULL;
+		if (!memcmp(p, "endstream", 9))
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+/* One step of a shift-and match of "endstream" */
+static unsigned int
+match_endstream(unsigned int state, int c)
+{
+	static const char pat[] = "endstream";
+	unsigned int bits = 0;
+	int i;
+
+	for (i = 0; i < 9; i++)
+		if (pat[i] == c)
+			bits |= 1 << i;
+	return ((state << 1) | 1) & bits;
+}
+
+/*
+ * Leave file just past the first "endstream" at or after ofs and return
+ * its offset, or leave file at its end and return -1.
+ */
+static fz_off_t
+seek_past_endstream(fz_stream *file, fz_off_t ofs, struct endstream_index *index)
+{
+	const unsigned char *p;
+	unsigned int state = 0;
+	int lo, hi, mid;
+
+	if (index)
+	{
+		lo = 0;
+		hi = index->len;
+		while (lo < hi)
+		{
+			mid = lo + (hi - lo) / 2;
+			if (index->ofs[mid] < ofs)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < index->len)
+		{
+			fz_seek(file, index->ofs[lo] + 9, 0);
+			return index->ofs[lo];
+		}
+		fz_seek(file, 0, 2);
+		return -1;
+	}
+
+	/* Search the stream's buffer, carrying partial matches across refills */
+	fz_seek(file, ofs, 0);
+	for (;;)
+	{
+		if (file->rp == file->wp)
+		{
+			fz_fill_buffer(file);
+			if (file->rp == file->wp)
+				return -1;
+		}
+
+		while (state && file->rp < file->wp)
+		{
+			state = match_endstream(state, *file->rp++);
+			if (state & (1 << 8))
+				return fz_tell(file) - 9;
+		}
+		if (state)
+			continue;
+
+		p = find_endstream(file->rp, file->wp);
+		if (p)
+		{
+			file->rp = (unsigned char *)p + 9;
+			return fz_tell(file) - 9;
+		}
+
+		p = file->wp - file->rp > 8 ? file->wp - 8 : file->rp;
+		while (p < file->wp)
+			state = match_endstream(state, *p++);
+		file->rp = file->wp;
+	}
+}
+
 static void
-pdf_repair_obj(fz_stream *file, pdf_lexbuf *buf, int *stmofsp, int *stmlenp, pdf_obj **encrypt, pdf_obj **id)
+scan_endstream_job(void *arg)
+{
+	struct endstream_job *job = (struct endstream_job *)arg;
+	const unsigned char *p = job->data + job->start;
+	const unsigned char *e = job->data + (job->len - job->end > 8 ? job->end + 8 : job->len);
+	int n = 0;
+
+	while ((p = find_endstream(p, e)) != NULL)
+	{
+		if (job->ofs)
+			job->ofs[n] = p - job->data;
+		n++;
+		p += 9;
+	}
+	job->count = n;
+}
+
+/* Build the index of every "endstream" in a memory backed file. */
+static void
+pdf_index_endstreams(fz_context *ctx, fz_stream *file, struct endstream_index *index)
+{
+	struct endstream_job *jobs = NULL;
+	void **args = NULL;
+	fz_off_t len, chunk;
+	int i, n, total;
+
+	index->ofs = NULL;
+	index->len = 0;
+
+	n = fz_count_jobs(ctx);
+	len = file->ep - file->bp;
+	if (n < 2 || file->bp == file->buf || len < MIN_PARALLEL_SCAN)
+		return;
+
+	fz_var(jobs);
+	fz_var(args);
+
+	fz_try(ctx)
+	{
+		jobs = fz_malloc_array(ctx, n, sizeof(struct endstream_job));
+		args = fz_malloc_array(ctx, n, sizeof(void *));
+
+		chunk = (len + n - 1) / n;
+		for (i = 0; i < n; i++)
+		{
+			jobs[i].data = file->bp;
+			jobs[i].len = len;
+			jobs[i].start = chunk * i < len ? chunk * i : len;
+			jobs[i].end = chunk * (i + 1) < len ? chunk * (i + 1) : len;
+			jobs[i].ofs = NULL;
+			jobs[i].count = 0;
+			args[i] = &jobs[i];
+		}
+
+		/* count, then fill in each chunk's slice of the index */
+		fz_run_jobs(ctx, scan_endstream_job, args, n);
+		total = 0;
+		for (i = 0; i < n; i++)
+		{
+			if (jobs[i].count > MAX_ENDSTREAM_INDEX - total)
+				break;
+			total += jobs[i].count;
+		}
+
+		if (i == n && total > 0)
+		{
+			index->ofs = fz_malloc_array(ctx, total, sizeof(fz_off_t));
+			index->len = total;
+			total = 0;
+			for (i = 0; i < n; i++)
+			{
+				jobs[i].ofs = index->ofs + total;
+				total += jobs[i].count;
+			}
+			fz_run_jobs(ctx, scan_endstream_job, args, n);
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, jobs);
+		fz_free(ctx, args);
+	}
+	fz_catch(ctx)
+	{
+		/* fall back to searching as we go */
+		fz_free(ctx, index->ofs);
+		index->ofs = NULL;
+		index->len = 0;
+	}
+}
+
+static void
+pdf_repair_obj(fz_stream *file, pdf_lexbuf *buf, fz_off_t *stmofsp, fz_off_t *stmlenp, pdf_obj **encrypt, pdf_obj **id, struct endstream_index *index)
 {
 	pdf_token tok;
-	int stm_len;
-	int n;
+	fz_off_t stm_len;
 	fz_context *ctx = file->ctx;
 
 	*stmofsp = 0;
@@ -68,7 +319,7 @@ pdf_repair_obj(fz_stream *file, pdf_lexbuf *buf, int *stmofsp, int *stmlenp, pdf
 
 		obj = pdf_dict_gets(dict, "Length");
 		if (!pdf_is_indirect(obj) && pdf_is_int(obj))
-			stm_len = pdf_to_int(obj);
+			stm_len = pdf_to_offset(obj);
 
 		pdf_drop_obj(dict);
 	}
@@ -116,18 +367,7 @@ pdf_repair_obj(fz_stream *file, pdf_lexbuf *buf, int *stmofsp, int *stmlenp, pdf
 			fz_seek(file, *stmofsp, 0);
 		}
 
-		n = fz_read(file, (unsigned char *) buf->scratch, 9);
-		if (n < 0)
-			fz_throw(ctx, "cannot read from file");
-
-		while (memcmp(buf->scratch, "endstream", 9) != 0)
-		{
-			c = fz_read_byte(file);
-			if (c == EOF)
-				break;
-			memmove(&buf->scratch[0], &buf->scratch[1], 8);
-			buf->scratch[8] = c;
-		}
+		seek_past_endstream(file, *stmofsp, index->ofs ? index : NULL);
 
 		*stmlenp = fz_tell(file) - *stmofsp - 9;
 
@@ -141,6 +381,7 @@ atobjend:
 static void
 pdf_repair_obj_stm(pdf_document *xref, int num, int gen)
 {
+	pdf_xref_entry *x;
 	pdf_obj *obj;
 	fz_stream *stm = NULL;
 	pdf_token tok;
@@ -182,12 +423,13 @@ pdf_repair_obj_stm(pdf_document *xref, int num, int gen)
 			if (n >= xref->len)
 				pdf_resize_xref(xref, n + 1);
 
-			xref->table[n].ofs = num;
-			xref->table[n].gen = i;
-			xref->table[n].stm_ofs = 0;
-			pdf_drop_obj(xref->table[n].obj);
-			xref->table[n].obj = NULL;
-			xref->table[n].type = 'o';
+			x = pdf_get_xref_entry(xref, n);
+			x->ofs = num;
+			x->gen = i;
+			x->stm_ofs = 0;
+			pdf_drop_obj(x->obj);
+			x->obj = NULL;
+			x->type = 'o';
 
 			tok = pdf_lex(stm, &buf);
 			if (tok != PDF_TOK_INT)
@@ -209,6 +451,7 @@ pdf_repair_obj_stm(pdf_document *xref, int num, int gen)
 void
 pdf_repair_xref(pdf_document *xref, pdf_lexbuf *buf)
 {
+	pdf_xref_entry x;
 	pdf_obj *dict, *obj;
 	pdf_obj *length;
 
@@ -222,10 +465,12 @@ pdf_repair_xref(pdf_document *xref, pdf_lexbuf *buf)
 	int listcap;
 	int maxnum = 0;
 
+	struct endstream_index index = { NULL, 0 };
+
 	int num = 0;
 	int gen = 0;
-	int tmpofs, numofs = 0, genofs = 0;
-	int stm_len, stm_ofs = 0;
+	fz_off_t tmpofs, numofs = 0, genofs = 0;
+	fz_off_t stm_len, stm_ofs = 0;
 	pdf_token tok;
 	int next;
 	int i, n, c;
@@ -236,8 +481,10 @@ pdf_repair_xref(pdf_document *xref, pdf_lexbuf *buf)
 	fz_var(root);
 	fz_var(info);
 	fz_var(list);
+	fz_var(index);
 
 	xref->dirty = 1;
+	xref->repaired = 1;
 
 	fz_seek(xref->file, 0, 0);
 
@@ -247,6 +494,8 @@ pdf_repair_xref(pdf_document *xref, pdf_lexbuf *buf)
 		listcap = 1024;
 		list = fz_malloc_array(ctx, listcap, sizeof(struct entry));
 
+		pdf_index_endstreams(ctx, xref->file, &index);
+
 		/* look for '%PDF' version marker within first kilobyte of file */
 		n = fz_read(xref->file, (unsigned char *)buf->scratch, fz_mini(buf->size, 1024));
 		if (n < 0)
@@ -297,7 +546,7 @@ pdf_repair_xref(pdf_document *xref, pdf_lexbuf *buf)
 			{
 				fz_try(ctx)
 				{
-					pdf_repair_obj(xref->file, buf, &stm_ofs, &stm_len, &encrypt, &id);
+					pdf_repair_obj(xref->file, buf, &stm_ofs, &stm_len, &encrypt, &id, &index);
 				}
 				fz_catch(ctx)
 				{
@@ -402,18 +651,18 @@ pdf_repair_xref(pdf_document *xref, pdf_lexbuf *buf)
 
 		for (i = 0; i < listlen; i++)
 		{
-			xref->table[list[i].num].type = 'n';
-			xref->table[list[i].num].ofs = list[i].ofs;
-			xref->table[list[i].num].gen = list[i].gen;
+			pdf_set_xref_entry(xref, list[i].num, 'n', list[i].ofs, list[i].gen);
 
-			xref->table[list[i].num].stm_ofs = list[i].stm_ofs;
+			pdf_peek_xref_entry(xref, list[i].num, &x);
+			if (x.stm_ofs != list[i].stm_ofs)
+				pdf_get_xref_entry(xref, list[i].num)->stm_ofs = list[i].stm_ofs;
 
 			/* correct stream length for unencrypted documents */
 			if (!encrypt && list[i].stm_len >= 0)
 			{
 				dict = pdf_load_object(xref, list[i].num, list[i].gen);
 
-				length = pdf_new_int(ctx, list[i].stm_len);
+				length = pdf_new_int_offset(ctx, list[i].stm_len);
 				pdf_dict_puts(dict, "Length", length);
 				pdf_drop_obj(length);
 
@@ -421,20 +670,16 @@ pdf_repair_xref(pdf_document *xref, pdf_lexbuf *buf)
 			}
 		}
 
-		xref->table[0].type = 'f';
-		xref->table[0].ofs = 0;
-		xref->table[0].gen = 65535;
-		xref->table[0].stm_ofs = 0;
-		xref->table[0].obj = NULL;
+		/* object 0 is never repaired, so has no cached object or stream */
+		pdf_set_xref_entry(xref, 0, 'f', 0, 65535);
 
 		next = 0;
 		for (i = xref->len - 1; i >= 0; i--)
 		{
-			if (xref->table[i].type == 'f')
+			pdf_peek_xref_entry(xref, i, &x);
+			if (x.type == 'f')
 			{
-				xref->table[i].ofs = next;
-				if (xref->table[i].gen < 65535)
-					xref->table[i].gen ++;
+				pdf_set_xref_entry(xref, i, 'f', next, x.gen < 65535 ? x.gen + 1 : x.gen);
 				next = i;
 			}
 		}
@@ -489,6 +734,7 @@ pdf_repair_xref(pdf_document *xref, pdf_lexbuf *buf)
 		}
 
 		fz_free(ctx, list);
+		fz_free(ctx, index.ofs);
 	}
 	fz_catch(ctx)
 	{
@@ -497,6 +743,7 @@ pdf_repair_xref(pdf_document *xref, pdf_lexbuf *buf)
 		pdf_drop_obj(root);
 		pdf_drop_obj(info);
 		fz_free(ctx, list);
+		fz_free(ctx, index.ofs);
 		fz_rethrow(ctx);
 	}
 }
@@ -505,12 +752,14 @@ void
 pdf_repair_obj_stms(pdf_document *xref)
 {
 	fz_context *ctx = xref->ctx;
+	pdf_xref_entry x;
 	pdf_obj *dict;
 	int i;
 
 	for (i = 0; i < xref->len; i++)
 	{
-		if (xref->table[i].stm_ofs)
+		pdf_peek_xref_entry(xref, i, &x);
+		if (x.stm_ofs)
 		{
 			dict = pdf_load_object(xref, i, 0);
 			fz_try(ctx)
@@ -531,6 +780,15 @@ pdf_repair_obj_stms(pdf_document *xref)
 
 	/* Ensure that streamed objects reside inside a known non-streamed object */
 	for (i = 0; i < xref->len; i++)
-		if (xref->table[i].type == 'o' && xref->table[xref->table[i].ofs].type != 'n')
-			fz_throw(xref->ctx, "invalid reference to non-object-stream: %d (%d 0 R)", xref->table[i].ofs, i);
+	{
+		pdf_peek_xref_entry(xref, i, &x);
+		if (x.type == 'o')
+		{
+			int ofs = x.ofs;
+			if (ofs >= 0 && ofs < xref->len)
+				pdf_peek_xref_entry(xref, ofs, &x);
+			if (x.type != 'n')
+				fz_throw(xref->ctx, "invalid reference to non-object-stream: %d (%d 0 R)", ofs, i);
+		}
+	}
 }
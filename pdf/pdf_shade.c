@@ -331,7 +331,7 @@ pdf_load_shading_dict(pdf_document *xref, pdf_obj *dict, const fz_matrix *transf
 	fz_try(ctx)
 	{
 		shade = fz_malloc_struct(ctx, fz_shade);
-		FZ_INIT_STORABLE(shade, 1, fz_free_shade_imp);
+		FZ_INIT_STORABLE(shade, 1, fz_free_shade_imp, FZ_STORE_SHADE);
 		shade->type = FZ_MESH_TYPE4;
 		shade->use_background = 0;
 		shade->use_function = 0;
@@ -7,12 +7,15 @@
 int
 pdf_is_stream(pdf_document *xref, int num, int gen)
 {
+	pdf_xref_entry *x;
+
 	if (num < 0 || num >= xref->len)
 		return 0;
 
 	pdf_cache_object(xref, num, gen);
 
-	return xref->table[num].stm_ofs != 0 || xref->table[num].stm_buf;
+	x = pdf_get_xref_entry(xref, num);
+	return x->stm_ofs != 0 || x->stm_buf;
 }
 
 /*
@@ -223,14 +226,14 @@ build_filter_chain(fz_stream *chain, pdf_document *xref, pdf_obj *fs, pdf_obj *p
  * orig_num and orig_gen are used purely to seed the encryption.
  */
 static fz_stream *
-pdf_open_raw_filter(fz_stream *chain, pdf_document *xref, pdf_obj *stmobj, int num, int orig_num, int orig_gen, int offset)
+pdf_open_raw_filter(fz_stream *chain, pdf_document *xref, pdf_obj *stmobj, int num, int orig_num, int orig_gen, fz_off_t offset)
 {
 	fz_context *ctx = chain->ctx;
 	int hascrypt;
 	int len;
 
-	if (num > 0 && num < xref->len && xref->table[num].stm_buf)
-		return fz_open_buffer(ctx, xref->table[num].stm_buf);
+	if (num > 0 && num < xref->len && pdf_get_xref_entry(xref, num)->stm_buf)
+		return fz_open_buffer(ctx, pdf_get_xref_entry(xref, num)->stm_buf);
 
 	/* don't close chain when we close this filter */
 	fz_keep_stream(chain);
@@ -258,7 +261,7 @@ pdf_open_raw_filter(fz_stream *chain, pdf_document *xref, pdf_obj *stmobj, int n
  * to stream length and decrypting.
  */
 static fz_stream *
-pdf_open_filter(fz_stream *chain, pdf_document *xref, pdf_obj *stmobj, int num, int gen, int offset, fz_compression_params *imparams)
+pdf_open_filter(fz_stream *chain, pdf_document *xref, pdf_obj *stmobj, int num, int gen, fz_off_t offset, fz_compression_params *imparams)
 {
 	pdf_obj *filters;
 	pdf_obj *params;
@@ -325,7 +328,7 @@ pdf_open_raw_renumbered_stream(pdf_document *xref, int num, int gen, int orig_nu
 	if (num < 0 || num >= xref->len)
 		fz_throw(xref->ctx, "object id out of range (%d %d R)", num, gen);
 
-	x = xref->table + num;
+	x = pdf_get_xref_entry(xref, num);
 
 	pdf_cache_object(xref, num, gen);
 
@@ -343,7 +346,7 @@ pdf_open_image_stream(pdf_document *xref, int num, int gen, int orig_num, int or
 	if (num < 0 || num >= xref->len)
 		fz_throw(xref->ctx, "object id out of range (%d %d R)", num, gen);
 
-	x = xref->table + num;
+	x = pdf_get_xref_entry(xref, num);
 
 	pdf_cache_object(xref, num, gen);
 
@@ -365,7 +368,7 @@ pdf_open_stream(pdf_document *xref, int num, int gen)
 }
 
 fz_stream *
-pdf_open_stream_with_offset(pdf_document *xref, int num, int gen, pdf_obj *dict, int stm_ofs)
+pdf_open_stream_with_offset(pdf_document *xref, int num, int gen, pdf_obj *dict, fz_off_t stm_ofs)
 {
 	if (stm_ofs == 0)
 		fz_throw(xref->ctx, "object is not a stream");
@@ -390,8 +393,8 @@ pdf_load_raw_renumbered_stream(pdf_document *xref, int num, int gen, int orig_nu
 	int len;
 	fz_buffer *buf;
 
-	if (num > 0 && num < xref->len && xref->table[num].stm_buf)
-		return fz_keep_buffer(xref->ctx, xref->table[num].stm_buf);
+	if (num > 0 && num < xref->len && pdf_get_xref_entry(xref, num)->stm_buf)
+		return fz_keep_buffer(xref->ctx, pdf_get_xref_entry(xref, num)->stm_buf);
 
 	dict = pdf_load_object(xref, num, gen);
 
@@ -434,8 +437,8 @@ pdf_load_image_stream(pdf_document *xref, int num, int gen, int orig_num, int or
 
 	fz_var(buf);
 
-	if (num > 0 && num < xref->len && xref->table[num].stm_buf)
-		return fz_keep_buffer(xref->ctx, xref->table[num].stm_buf);
+	if (num > 0 && num < xref->len && pdf_get_xref_entry(xref, num)->stm_buf)
+		return fz_keep_buffer(xref->ctx, pdf_get_xref_entry(xref, num)->stm_buf);
 
 	dict = pdf_load_object(xref, num, gen);
 
@@ -1,6 +1,8 @@
 #include "fitz-internal.h"
 #include "mupdf-internal.h"
 
+#include <zlib.h>
+
 /* #define DEBUG_LINEARIZATION */
 /* #define DEBUG_HEAP_SORT */
 /* #define DEBUG_WRITING */
@@ -30,8 +32,8 @@ typedef struct {
 	int num_shared;
 	int page_object_number;
 	int num_objects;
-	int min_ofs;
-	int max_ofs;
+	fz_off_t min_ofs;
+	fz_off_t max_ofs;
 	/* Extensible list of objects used on this page */
 	int cap;
 	int len;
@@ -44,6 +46,8 @@ typedef struct {
 	page_objects *page[1];
 } page_objects_list;
 
+typedef struct deflate_job_s deflate_job;
+
 struct pdf_write_options_s
 {
 	FILE *out;
@@ -51,20 +55,23 @@ struct pdf_write_options_s
 	int do_expand;
 	int do_garbage;
 	int do_linear;
+	int do_deflate;
 	int *use_list;
-	int *ofs_list;
+	fz_off_t *ofs_list;
 	int *gen_list;
 	int *renumber_map;
 	int continue_on_error;
 	int *errors;
+	int dedup_objects;
+	fz_off_t dedup_bytes;
 	/* The following extras are required for linearization */
 	int *rev_renumber_map;
 	int *rev_gen_list;
 	int start;
-	int first_xref_offset;
-	int main_xref_offset;
-	int first_xref_entry_offset;
-	int file_len;
+	fz_off_t first_xref_offset;
+	fz_off_t main_xref_offset;
+	fz_off_t first_xref_entry_offset;
+	fz_off_t file_len;
 	int hints_shared_offset;
 	int hintstream_len;
 	pdf_obj *linear_l;
@@ -78,6 +85,13 @@ struct pdf_write_options_s
 	pdf_obj *hints_length;
 	int page_count;
 	page_objects_list *page_object_lists;
+	/* Streams deflated ahead of writing; see deflateahead */
+	int deflate_slots;
+	deflate_job *deflate;
+	int deflate_len;
+	int deflate_pos;
+	int deflate_from;
+	int deflate_next;
 };
 
 /*
@@ -481,7 +495,7 @@ page_objects_dump(pdf_write_options *opts)
 			int o = p->object[j];
 			fprintf(stderr, "\tObject %d: use=%x\n", o, opts->use_list[o]);
 		}
-		fprintf(stderr, "Byte range=%d->%d\n", p->min_ofs, p->max_ofs);
+		fprintf(stderr, "Byte range=%lld->%lld\n", p->min_ofs, p->max_ofs);
 		fprintf(stderr, "Number of objects=%d, Number of shared objects=%d\n", p->num_objects, p->num_shared);
 		fprintf(stderr, "Page object number=%d\n", p->page_object_number);
 	}
@@ -494,7 +508,7 @@ objects_dump(pdf_document *xref, pdf_write_options *opts)
 
 	for (i=0; i < xref->len; i++)
 	{
-		fprintf(stderr, "Object %d use=%x offset=%d\n", i, opts->use_list[i], opts->ofs_list[i]);
+		fprintf(stderr, "Object %d use=%x offset=%lld\n", i, opts->use_list[i], opts->ofs_list[i]);
 	}
 }
 #endif
@@ -561,101 +575,138 @@ static void sweepobj(pdf_document *xref, pdf_write_options *opts, pdf_obj *obj)
 }
 
 /*
- * Scan for and remove duplicate objects (slow)
+ * Scan for and remove duplicate objects
+ *
+ * Objects are hashed on their contents (and, for streams, an md5 of
+ * their raw data), and only compared in full against the objects that
+ * went before them with the same hash. The first object in each run
+ * of duplicates is kept.
  */
 
+typedef struct
+{
+	unsigned int hash;
+	int stream;
+	unsigned char digest[16];
+} dedup_key;
+
+static fz_buffer *loaddedupstream(pdf_document *xref, int num, dedup_key *key)
+{
+	fz_buffer *buf;
+	fz_md5 md5;
+
+	buf = pdf_load_raw_renumbered_stream(xref, num, 0, num, 0);
+	fz_md5_init(&md5);
+	fz_md5_update(&md5, buf->data, buf->len);
+	fz_md5_final(&md5, key->digest);
+	return buf;
+}
+
+static int samestream(pdf_document *xref, fz_buffer *buf, int other)
+{
+	fz_context *ctx = xref->ctx;
+	fz_buffer *obuf;
+	int same;
+
+	obuf = pdf_load_raw_renumbered_stream(xref, other, 0, other, 0);
+	same = (buf->len == obuf->len && memcmp(buf->data, obuf->data, buf->len) == 0);
+	fz_drop_buffer(ctx, obuf);
+	return same;
+}
+
 static void removeduplicateobjs(pdf_document *xref, pdf_write_options *opts)
 {
-	int num, other;
 	fz_context *ctx = xref->ctx;
+	fz_hash_table *table = NULL;
+	fz_buffer *buf = NULL;
+	int *next = NULL;
+	int num, other, first;
+	dedup_key key;
+	pdf_obj *a;
 
-	for (num = 1; num < xref->len; num++)
+	fz_var(table);
+	fz_var(buf);
+	fz_var(next);
+
+	fz_try(ctx)
 	{
-		/* Only compare an object to objects preceding it */
-		for (other = 1; other < num; other++)
-		{
-			pdf_obj *a, *b;
-			int differ, newnum, streama, streamb;
+		table = fz_new_hash_table(ctx, 4096, sizeof(dedup_key), -1);
+		next = fz_calloc(ctx, xref->len, sizeof(int));
 
-			if (num == other || !opts->use_list[num] || !opts->use_list[other])
+		for (num = 1; num < xref->len; num++)
+		{
+			if (!opts->use_list[num])
 				continue;
 
+			memset(&key, 0, sizeof key);
+
 			/*
-			 * Comparing stream objects data contents would take too long.
-			 *
 			 * pdf_is_stream calls pdf_cache_object and ensures
 			 * that the xref table has the objects loaded.
 			 */
 			fz_try(ctx)
 			{
-				streama = pdf_is_stream(xref, num, 0);
-				streamb = pdf_is_stream(xref, other, 0);
-				differ = streama || streamb;
-				if (streama && streamb && opts->do_garbage >= 4)
-					differ = 0;
+				key.stream = pdf_is_stream(xref, num, 0);
+				if (key.stream && opts->do_garbage >= 4)
+					buf = loaddedupstream(xref, num, &key);
 			}
 			fz_catch(ctx)
 			{
 				/* Assume different */
-				differ = 1;
+				continue;
 			}
-			if (differ)
+			/* Comparing stream data is only done at -gggg */
+			if (key.stream && !buf)
 				continue;
 
-			a = xref->table[num].obj;
-			b = xref->table[other].obj;
-
-			a = pdf_resolve_indirect(a);
-			b = pdf_resolve_indirect(b);
-
-			if (pdf_objcmp(a, b))
-				continue;
+			a = pdf_resolve_indirect(pdf_get_xref_entry(xref, num)->obj);
+			key.hash = pdf_objhash(a);
 
-			if (streama && streamb)
+			first = (int)(size_t)fz_hash_find(ctx, table, &key);
+			for (other = first; other; other = next[other])
 			{
-				/* Check to see if streams match too. */
-				fz_buffer *sa = NULL;
-				fz_buffer *sb = NULL;
-
-				fz_var(sa);
-				fz_var(sb);
-
-				differ = 1;
-				fz_try(ctx)
-				{
-					unsigned char *dataa, *datab;
-					int lena, lenb;
-					sa = pdf_load_raw_renumbered_stream(xref, num, 0, num, 0);
-					sb = pdf_load_raw_renumbered_stream(xref, other, 0, other, 0);
-					lena = fz_buffer_storage(ctx, sa, &dataa);
-					lenb = fz_buffer_storage(ctx, sb, &datab);
-					if (lena == lenb && memcmp(dataa, datab, lena) == 0)
-						differ = 0;
-				}
-				fz_always(ctx)
-				{
-					fz_drop_buffer(ctx, sa);
-					fz_drop_buffer(ctx, sb);
-				}
-				fz_catch(ctx)
-				{
-					fz_rethrow(ctx);
-				}
-				if (differ)
+				pdf_obj *b = pdf_resolve_indirect(pdf_get_xref_entry(xref, other)->obj);
+				if (!opts->use_list[other] || pdf_objcmp(a, b))
+					continue;
+				if (buf && !samestream(xref, buf, other))
 					continue;
+				break;
 			}
 
-			/* Keep the lowest numbered object */
-			newnum = fz_mini(num, other);
-			opts->renumber_map[num] = newnum;
-			opts->renumber_map[other] = newnum;
-			opts->rev_renumber_map[newnum] = num; /* Either will do */
-			opts->use_list[fz_maxi(num, other)] = 0;
+			if (other)
+			{
+				/* Keep the lowest numbered object */
+				opts->renumber_map[num] = other;
+				opts->rev_renumber_map[other] = num; /* Either will do */
+				opts->use_list[num] = 0;
+				opts->dedup_objects++;
+				opts->dedup_bytes += pdf_print_obj_len(a, opts->do_expand == 0);
+				if (buf)
+					opts->dedup_bytes += buf->len;
+			}
+			else if (first)
+			{
+				next[num] = next[first];
+				next[first] = num;
+			}
+			else
+				fz_hash_insert(ctx, table, &key, (void *)(size_t)num);
 
-			/* One duplicate was found, do not look for another */
-			break;
+			fz_drop_buffer(ctx, buf);
+			buf = NULL;
 		}
 	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_free(ctx, next);
+		if (table)
+			fz_free_hash(ctx, table);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
 }
 
 /*
@@ -752,8 +803,6 @@ static void renumberobj(pdf_document *xref, pdf_write_options *opts, pdf_obj *ob
 
 static void renumberobjs(pdf_document *xref, pdf_write_options *opts)
 {
-	pdf_xref_entry *oldxref;
-	int newlen;
 	int num;
 	fz_context *ctx = xref->ctx;
 	int *new_use_list;
@@ -766,7 +815,7 @@ static void renumberobjs(pdf_document *xref, pdf_write_options *opts)
 		renumberobj(xref, opts, xref->trailer);
 		for (num = 0; num < xref->len; num++)
 		{
-			pdf_obj *obj = xref->table[num].obj;
+			pdf_obj *obj = pdf_get_xref_entry(xref, num)->obj;
 
 			if (pdf_is_indirect(obj))
 			{
@@ -780,40 +829,21 @@ static void renumberobjs(pdf_document *xref, pdf_write_options *opts)
 			}
 		}
 
-		/* Create new table for the reordered, compacted xref */
-		oldxref = xref->table;
-		xref->table = fz_malloc_array(ctx, xref->len + 3, sizeof(pdf_xref_entry));
-		xref->table[0] = oldxref[0];
-
-		/* Move used objects into the new compacted xref */
-		newlen = 0;
 		for (num = 1; num < xref->len; num++)
-		{
 			if (opts->use_list[num])
-			{
-				if (newlen < opts->renumber_map[num])
-					newlen = opts->renumber_map[num];
-				xref->table[opts->renumber_map[num]] = oldxref[num];
 				new_use_list[opts->renumber_map[num]] = opts->use_list[num];
-			}
-			else
-			{
-				pdf_drop_obj(oldxref[num].obj);
-			}
-		}
+
+		/* Move used objects into the reordered, compacted xref */
+		pdf_renumber_xref(xref, opts->use_list, opts->renumber_map);
 	}
 	fz_catch(ctx)
 	{
 		fz_free(ctx, new_use_list);
 		fz_rethrow(ctx);
 	}
-	fz_free(ctx, oldxref);
 	fz_free(ctx, opts->use_list);
 	opts->use_list = new_use_list;
 
-	/* Update the used objects count in compacted xref */
-	xref->len = newlen + 1;
-
 	for (num = 1; num < xref->len; num++)
 	{
 		opts->renumber_map[num] = num;
@@ -1112,7 +1142,7 @@ add_linearization_objs(pdf_document *xref, pdf_write_options *opts)
 		pdf_dict_puts_drop(hint_obj, "Filter", pdf_new_name(ctx, "FlateDecode"));
 		opts->hints_length = pdf_new_int(ctx, INT_MIN);
 		pdf_dict_puts(hint_obj, "Length", opts->hints_length);
-		xref->table[hint_num].stm_ofs = -1;
+		pdf_get_xref_entry(xref, hint_num)->stm_ofs = -1;
 	}
 	fz_always(ctx)
 	{
@@ -1386,13 +1416,13 @@ linearize(pdf_document *xref, pdf_write_options *opts)
 static void
 update_linearization_params(pdf_document *xref, pdf_write_options *opts)
 {
-	int offset;
-	pdf_set_int(opts->linear_l, opts->file_len);
+	fz_off_t offset;
+	pdf_set_int_offset(opts->linear_l, opts->file_len);
 	/* Primary hint stream offset (of object, not stream!) */
-	pdf_set_int(opts->linear_h0, opts->ofs_list[xref->len-1]);
+	pdf_set_int_offset(opts->linear_h0, opts->ofs_list[xref->len-1]);
 	/* Primary hint stream length (of object, not stream!) */
 	offset = (opts->start == 1 ? opts->main_xref_offset : opts->ofs_list[1] + opts->hintstream_len);
-	pdf_set_int(opts->linear_h1, offset - opts->ofs_list[xref->len-1]);
+	pdf_set_int_offset(opts->linear_h1, offset - opts->ofs_list[xref->len-1]);
 	/* Object number of first pages page object (the first object of page 0) */
 	pdf_set_int(opts->linear_o, opts->page_object_lists->page[0]->object[0]);
 	/* Offset of end of first page (first page is followed by primary
@@ -1400,11 +1430,11 @@ update_linearization_params(pdf_document *xref, pdf_write_options *opts)
 	 * primary hint stream counts as part of the first pages data, I think.
 	 */
 	offset = (opts->start == 1 ? opts->main_xref_offset : opts->ofs_list[1] + opts->hintstream_len);
-	pdf_set_int(opts->linear_e, offset);
+	pdf_set_int_offset(opts->linear_e, offset);
 	/* Number of pages in document */
 	pdf_set_int(opts->linear_n, opts->page_count);
 	/* Offset of first entry in main xref table */
-	pdf_set_int(opts->linear_t, opts->first_xref_entry_offset + opts->hintstream_len);
+	pdf_set_int_offset(opts->linear_t, opts->first_xref_entry_offset + opts->hintstream_len);
 	/* Offset of shared objects hint table in the primary hint stream */
 	pdf_set_int(opts->hints_s, opts->hints_shared_offset);
 	/* Primary hint stream length */
@@ -1422,7 +1452,7 @@ static void preloadobjstms(pdf_document *xref)
 
 	for (num = 0; num < xref->len; num++)
 	{
-		if (xref->table[num].type == 'o')
+		if (pdf_get_xref_entry(xref, num)->type == 'o')
 		{
 			obj = pdf_load_object(xref, num, 0);
 			pdf_drop_obj(obj);
@@ -1522,6 +1552,180 @@ static void addhexfilter(pdf_document *xref, pdf_obj *dict)
 	pdf_drop_obj(newdp);
 }
 
+static void addflatefilter(pdf_document *xref, pdf_obj *dict)
+{
+	pdf_obj *flate;
+	fz_context *ctx = xref->ctx;
+
+	flate = pdf_new_name(ctx, "FlateDecode");
+	pdf_dict_puts(dict, "Filter", flate);
+	pdf_dict_dels(dict, "DecodeParms");
+	pdf_drop_obj(flate);
+}
+
+/*
+ * Deflating streams. Each stream is compressed by a deflate_job, with
+ * its zlib state set up (and all its memory allocated) beforehand, so
+ * that the jobs can be run on the client's threads. When there are
+ * threads to run them on, deflateahead loads the streams of a run of
+ * objects that are about to be written, and deflates them all at
+ * once; the objects are still written one at a time, in order, and
+ * pick up their deflated streams as they go. Otherwise each stream is
+ * deflated as it is written.
+ */
+
+#define DEFLATE_AHEAD_BYTES (64 << 20)
+
+struct deflate_job_s
+{
+	z_stream z;
+	int ready;
+	int num;
+	int truncated;
+	fz_buffer *src;
+	fz_buffer *dst;
+	int ok;
+};
+
+static void *deflate_zalloc(void *opaque, unsigned int items, unsigned int size)
+{
+	return fz_malloc_array_no_throw(opaque, items, size);
+}
+
+static void deflate_zfree(void *opaque, void *address)
+{
+	fz_free(opaque, address);
+}
+
+static void deflate_run_job(void *arg)
+{
+	deflate_job *job = (deflate_job *)arg;
+	z_stream *z = &job->z;
+
+	job->ok = 0;
+	if (deflateReset(z) != Z_OK)
+		return;
+	z->next_in = job->src->data;
+	z->avail_in = job->src->len;
+	z->next_out = job->dst->data;
+	z->avail_out = job->dst->cap;
+	if (deflate(z, Z_FINISH) != Z_STREAM_END)
+		return;
+	job->dst->len = z->next_out - job->dst->data;
+	job->ok = 1;
+}
+
+static void initdeflatejob(fz_context *ctx, deflate_job *job)
+{
+	if (job->ready)
+		return;
+	job->z.zalloc = deflate_zalloc;
+	job->z.zfree = deflate_zfree;
+	job->z.opaque = ctx;
+	if (deflateInit(&job->z, Z_DEFAULT_COMPRESSION) != Z_OK)
+		fz_throw(ctx, "cannot deflate stream");
+	job->ready = 1;
+}
+
+/* Make room for the deflated stream. */
+static void preparedeflatejob(fz_context *ctx, deflate_job *job)
+{
+	initdeflatejob(ctx, job);
+	job->dst = fz_new_buffer(ctx, deflateBound(&job->z, job->src->len));
+}
+
+/* Swap the source for its deflated form, if that turned out smaller. */
+static int finishdeflatejob(fz_context *ctx, deflate_job *job, fz_buffer **buf)
+{
+	int deflated = job->ok && job->dst->len < job->src->len;
+
+	if (deflated)
+	{
+		*buf = job->dst;
+		fz_drop_buffer(ctx, job->src);
+	}
+	else
+	{
+		*buf = job->src;
+		fz_drop_buffer(ctx, job->dst);
+	}
+	job->src = job->dst = NULL;
+	return deflated;
+}
+
+static void dropdeflated(fz_context *ctx, pdf_write_options *opts)
+{
+	int i;
+
+	for (i = opts->deflate_pos; i < opts->deflate_len; i++)
+	{
+		fz_drop_buffer(ctx, opts->deflate[i].src);
+		fz_drop_buffer(ctx, opts->deflate[i].dst);
+		opts->deflate[i].src = opts->deflate[i].dst = NULL;
+	}
+	opts->deflate_pos = opts->deflate_len = 0;
+}
+
+static void freedeflate(fz_context *ctx, pdf_write_options *opts)
+{
+	int i;
+
+	if (!opts->deflate)
+		return;
+	dropdeflated(ctx, opts);
+	for (i = 0; i <= opts->deflate_slots; i++)
+	{
+		if (opts->deflate[i].ready)
+			deflateEnd(&opts->deflate[i].z);
+	}
+	fz_free(ctx, opts->deflate);
+	opts->deflate = NULL;
+}
+
+/* Deflate buf in place, if that makes it smaller. */
+static int deflatebuf(fz_context *ctx, pdf_write_options *opts, fz_buffer **buf)
+{
+	/* The last slot is kept free for this */
+	deflate_job *job = &opts->deflate[opts->deflate_slots];
+
+	job->src = *buf;
+	fz_try(ctx)
+	{
+		preparedeflatejob(ctx, job);
+	}
+	fz_catch(ctx)
+	{
+		job->src = NULL;
+		fz_rethrow(ctx);
+	}
+	deflate_run_job(job);
+	return finishdeflatejob(ctx, job, buf);
+}
+
+/* Take the stream that deflateahead prepared for object num, if any. */
+static deflate_job *takedeflated(pdf_write_options *opts, int num)
+{
+	deflate_job *job;
+
+	if (opts->deflate_pos >= opts->deflate_len)
+		return NULL;
+	job = &opts->deflate[opts->deflate_pos];
+	if (job->num != num)
+		return NULL;
+	opts->deflate_pos++;
+	return job;
+}
+
+static int deflatable(pdf_write_options *opts, int num, pdf_obj *obj, int expand)
+{
+	if (!opts->do_deflate)
+		return 0;
+	/* The hint stream's length is fixed before it is written */
+	if (opts->use_list[num] & USE_HINTS)
+		return 0;
+	return expand || !pdf_dict_gets(obj, "Filter");
+}
+
 static void copystream(pdf_document *xref, pdf_write_options *opts, pdf_obj *obj_orig, int num, int gen)
 {
 	fz_buffer *buf, *tmp;
@@ -1530,10 +1734,28 @@ static void copystream(pdf_document *xref, pdf_write_options *opts, pdf_obj *obj
 	fz_context *ctx = xref->ctx;
 	int orig_num = opts->rev_renumber_map[num];
 	int orig_gen = opts->rev_gen_list[num];
-
-	buf = pdf_load_raw_renumbered_stream(xref, num, gen, orig_num, orig_gen);
+	int deflate = deflatable(opts, num, obj_orig, 0);
+	int deflated = 0;
+	int encoded = 0;
+	deflate_job *job;
+
+	job = deflate ? takedeflated(opts, num) : NULL;
+	if (job)
+		deflated = finishdeflatejob(ctx, job, &buf);
+	else
+	{
+		buf = pdf_load_raw_renumbered_stream(xref, num, gen, orig_num, orig_gen);
+		if (deflate)
+			deflated = deflatebuf(ctx, opts, &buf);
+	}
 
 	obj = pdf_copy_dict(ctx, obj_orig);
+	if (deflated)
+	{
+		addflatefilter(xref, obj);
+		encoded = 1;
+	}
+
 	if (opts->do_ascii && isbinarystream(buf))
 	{
 		tmp = hexbuf(ctx, buf->data, buf->len);
@@ -1541,7 +1763,11 @@ static void copystream(pdf_document *xref, pdf_write_options *opts, pdf_obj *obj
 		buf = tmp;
 
 		addhexfilter(xref, obj);
+		encoded = 1;
+	}
 
+	if (encoded)
+	{
 		newlen = pdf_new_int(ctx, buf->len);
 		pdf_dict_puts(obj, "Length", newlen);
 		pdf_drop_obj(newlen);
@@ -1566,14 +1792,30 @@ static void expandstream(pdf_document *xref, pdf_write_options *opts, pdf_obj *o
 	int orig_num = opts->rev_renumber_map[num];
 	int orig_gen = opts->rev_gen_list[num];
 	int truncated = 0;
+	int deflate = deflatable(opts, num, obj_orig, 1);
+	int deflated = 0;
+	deflate_job *job;
 
-	buf = pdf_load_renumbered_stream(xref, num, gen, orig_num, orig_gen, (opts->continue_on_error ? &truncated : NULL));
+	job = deflate ? takedeflated(opts, num) : NULL;
+	if (job)
+	{
+		truncated = job->truncated;
+		deflated = finishdeflatejob(ctx, job, &buf);
+	}
+	else
+	{
+		buf = pdf_load_renumbered_stream(xref, num, gen, orig_num, orig_gen, (opts->continue_on_error ? &truncated : NULL));
+		if (deflate)
+			deflated = deflatebuf(ctx, opts, &buf);
+	}
 	if (truncated && opts->errors)
 		(*opts->errors)++;
 
 	obj = pdf_copy_dict(ctx, obj_orig);
 	pdf_dict_dels(obj, "Filter");
 	pdf_dict_dels(obj, "DecodeParms");
+	if (deflated)
+		addflatefilter(xref, obj);
 
 	if (opts->do_ascii && isbinarystream(buf))
 	{
@@ -1626,18 +1868,131 @@ static int filter_implies_image(pdf_document *xref, pdf_obj *o)
 	return 0;
 }
 
+static int expandable(pdf_document *xref, pdf_write_options *opts, pdf_obj *obj)
+{
+	int dontexpand = 0;
+	if (opts->do_expand != 0 && opts->do_expand != fz_expand_all)
+	{
+		pdf_obj *o;
+
+		if ((o = pdf_dict_gets(obj, "Type"), !strcmp(pdf_to_name(o), "XObject")) &&
+			(o = pdf_dict_gets(obj, "Subtype"), !strcmp(pdf_to_name(o), "Image")))
+			dontexpand = !(opts->do_expand & fz_expand_images);
+		if (o = pdf_dict_gets(obj, "Type"), !strcmp(pdf_to_name(o), "Font"))
+			dontexpand = !(opts->do_expand & fz_expand_fonts);
+		if (o = pdf_dict_gets(obj, "Type"), !strcmp(pdf_to_name(o), "FontDescriptor"))
+			dontexpand = !(opts->do_expand & fz_expand_fonts);
+		if ((o = pdf_dict_gets(obj, "Length1")) != NULL)
+			dontexpand = !(opts->do_expand & fz_expand_fonts);
+		if ((o = pdf_dict_gets(obj, "Length2")) != NULL)
+			dontexpand = !(opts->do_expand & fz_expand_fonts);
+		if ((o = pdf_dict_gets(obj, "Length3")) != NULL)
+			dontexpand = !(opts->do_expand & fz_expand_fonts);
+		if (o = pdf_dict_gets(obj, "Subtype"), !strcmp(pdf_to_name(o), "Type1C"))
+			dontexpand = !(opts->do_expand & fz_expand_fonts);
+		if (o = pdf_dict_gets(obj, "Subtype"), !strcmp(pdf_to_name(o), "CIDFontType0C"))
+			dontexpand = !(opts->do_expand & fz_expand_fonts);
+		if (o = pdf_dict_gets(obj, "Filter"), filter_implies_image(xref, o))
+			dontexpand = !(opts->do_expand & fz_expand_images);
+		if (pdf_dict_gets(obj, "Width") != NULL && pdf_dict_gets(obj, "Height") != NULL)
+			dontexpand = !(opts->do_expand & fz_expand_images);
+	}
+	return opts->do_expand && !dontexpand && !pdf_is_jpx_image(xref->ctx, obj);
+}
+
+/*
+ * Keys starting with '.' are markers that we cache in dicts while using
+ * the document (see put_marker_bool); they must not be written out.
+ */
+
+static int hasprivatekeys(pdf_obj *obj)
+{
+	int i, n;
+
+	if (pdf_is_indirect(obj))
+		return 0;
+	if (pdf_is_array(obj))
+	{
+		n = pdf_array_len(obj);
+		for (i = 0; i < n; i++)
+			if (hasprivatekeys(pdf_array_get(obj, i)))
+				return 1;
+	}
+	else if (pdf_is_dict(obj))
+	{
+		n = pdf_dict_len(obj);
+		for (i = 0; i < n; i++)
+			if (pdf_to_name(pdf_dict_get_key(obj, i))[0] == '.' || hasprivatekeys(pdf_dict_get_val(obj, i)))
+				return 1;
+	}
+	return 0;
+}
+
+static pdf_obj *withoutprivatekeys(fz_context *ctx, pdf_obj *obj)
+{
+	pdf_obj *copy;
+	char *key;
+	int i, n;
+
+	if (!hasprivatekeys(obj))
+		return pdf_keep_obj(obj);
+
+	if (pdf_is_array(obj))
+	{
+		n = pdf_array_len(obj);
+		copy = pdf_new_array(ctx, n);
+		fz_try(ctx)
+		{
+			for (i = 0; i < n; i++)
+				pdf_array_push_drop(copy, withoutprivatekeys(ctx, pdf_array_get(obj, i)));
+		}
+		fz_catch(ctx)
+		{
+			pdf_drop_obj(copy);
+			fz_rethrow(ctx);
+		}
+	}
+	else
+	{
+		n = pdf_dict_len(obj);
+		copy = pdf_new_dict(ctx, n);
+		fz_try(ctx)
+		{
+			for (i = 0; i < n; i++)
+			{
+				key = pdf_to_name(pdf_dict_get_key(obj, i));
+				if (key[0] != '.')
+					pdf_dict_puts_drop(copy, key, withoutprivatekeys(ctx, pdf_dict_get_val(obj, i)));
+			}
+		}
+		fz_catch(ctx)
+		{
+			pdf_drop_obj(copy);
+			fz_rethrow(ctx);
+		}
+	}
+	return copy;
+}
+
 static void writeobject(pdf_document *xref, pdf_write_options *opts, int num, int gen)
 {
-	pdf_obj *obj;
+	pdf_obj *obj = NULL;
 	pdf_obj *type;
+	pdf_obj *clean;
 	fz_context *ctx = xref->ctx;
 
+	fz_var(obj);
+
 	fz_try(ctx)
 	{
 		obj = pdf_load_object(xref, num, gen);
+		clean = withoutprivatekeys(ctx, obj);
+		pdf_drop_obj(obj);
+		obj = clean;
 	}
 	fz_catch(ctx)
 	{
+		pdf_drop_obj(obj);
 		if (opts->continue_on_error)
 		{
 			fprintf(opts->out, "%d %d obj\nnull\nendobj\n", num, gen);
@@ -1674,7 +2029,7 @@ static void writeobject(pdf_document *xref, pdf_write_options *opts, int num, in
 		pdf_fprint_obj(opts->out, obj, opts->do_expand == 0);
 		fprintf(opts->out, "endobj\n\n");
 	}
-	else if (xref->table[num].stm_ofs < 0 && xref->table[num].stm_buf == NULL)
+	else if (pdf_get_xref_entry(xref, num)->stm_ofs < 0 && pdf_get_xref_entry(xref, num)->stm_buf == NULL)
 	{
 		fprintf(opts->out, "%d %d obj\n", num, gen);
 		pdf_fprint_obj(opts->out, obj, opts->do_expand == 0);
@@ -1682,36 +2037,9 @@ static void writeobject(pdf_document *xref, pdf_write_options *opts, int num, in
 	}
 	else
 	{
-		int dontexpand = 0;
-		if (opts->do_expand != 0 && opts->do_expand != fz_expand_all)
-		{
-			pdf_obj *o;
-
-			if ((o = pdf_dict_gets(obj, "Type"), !strcmp(pdf_to_name(o), "XObject")) &&
-				(o = pdf_dict_gets(obj, "Subtype"), !strcmp(pdf_to_name(o), "Image")))
-				dontexpand = !(opts->do_expand & fz_expand_images);
-			if (o = pdf_dict_gets(obj, "Type"), !strcmp(pdf_to_name(o), "Font"))
-				dontexpand = !(opts->do_expand & fz_expand_fonts);
-			if (o = pdf_dict_gets(obj, "Type"), !strcmp(pdf_to_name(o), "FontDescriptor"))
-				dontexpand = !(opts->do_expand & fz_expand_fonts);
-			if ((o = pdf_dict_gets(obj, "Length1")) != NULL)
-				dontexpand = !(opts->do_expand & fz_expand_fonts);
-			if ((o = pdf_dict_gets(obj, "Length2")) != NULL)
-				dontexpand = !(opts->do_expand & fz_expand_fonts);
-			if ((o = pdf_dict_gets(obj, "Length3")) != NULL)
-				dontexpand = !(opts->do_expand & fz_expand_fonts);
-			if (o = pdf_dict_gets(obj, "Subtype"), !strcmp(pdf_to_name(o), "Type1C"))
-				dontexpand = !(opts->do_expand & fz_expand_fonts);
-			if (o = pdf_dict_gets(obj, "Subtype"), !strcmp(pdf_to_name(o), "CIDFontType0C"))
-				dontexpand = !(opts->do_expand & fz_expand_fonts);
-			if (o = pdf_dict_gets(obj, "Filter"), filter_implies_image(xref, o))
-				dontexpand = !(opts->do_expand & fz_expand_images);
-			if (pdf_dict_gets(obj, "Width") != NULL && pdf_dict_gets(obj, "Height") != NULL)
-				dontexpand = !(opts->do_expand & fz_expand_images);
-		}
 		fz_try(ctx)
 		{
-			if (opts->do_expand && !dontexpand && !pdf_is_jpx_image(ctx, obj))
+			if (expandable(xref, opts, obj))
 				expandstream(xref, opts, obj, num, gen);
 			else
 				copystream(xref, opts, obj, num, gen);
@@ -1736,7 +2064,7 @@ static void writeobject(pdf_document *xref, pdf_write_options *opts, int num, in
 	pdf_drop_obj(obj);
 }
 
-static void writexref(pdf_document *xref, pdf_write_options *opts, int from, int to, int first, int main_xref_offset, int startxref)
+static void writexref(pdf_document *xref, pdf_write_options *opts, int from, int to, int first, fz_off_t main_xref_offset, fz_off_t startxref)
 {
 	pdf_obj *trailer = NULL;
 	pdf_obj *obj;
@@ -1745,13 +2073,16 @@ static void writexref(pdf_document *xref, pdf_write_options *opts, int from, int
 	fz_context *ctx = xref->ctx;
 
 	fprintf(opts->out, "xref\n%d %d\n", from, to - from);
-	opts->first_xref_entry_offset = ftell(opts->out);
+	opts->first_xref_entry_offset = fz_ftell(opts->out);
 	for (num = from; num < to; num++)
 	{
+		/* xref table entries have room for 10 digits only */
+		if (opts->ofs_list[num] > 9999999999LL)
+			fz_throw(ctx, "object offset too large for xref table (%d 0 R)", num);
 		if (opts->use_list[num])
-			fprintf(opts->out, "%010d %05d n \n", opts->ofs_list[num], opts->gen_list[num]);
+			fprintf(opts->out, "%010lld %05d n \n", opts->ofs_list[num], opts->gen_list[num]);
 		else
-			fprintf(opts->out, "%010d %05d f \n", opts->ofs_list[num], opts->gen_list[num]);
+			fprintf(opts->out, "%010lld %05d f \n", opts->ofs_list[num], opts->gen_list[num]);
 	}
 	fprintf(opts->out, "\n");
 
@@ -1783,7 +2114,7 @@ static void writexref(pdf_document *xref, pdf_write_options *opts, int from, int
 		}
 		if (main_xref_offset != 0)
 		{
-			nobj = pdf_new_int(ctx, main_xref_offset);
+			nobj = pdf_new_int_offset(ctx, main_xref_offset);
 			pdf_dict_puts(trailer, "Prev", nobj);
 			pdf_drop_obj(nobj);
 			nobj = NULL;
@@ -1804,13 +2135,13 @@ static void writexref(pdf_document *xref, pdf_write_options *opts, int from, int
 
 	pdf_drop_obj(trailer);
 
-	fprintf(opts->out, "startxref\n%d\n%%%%EOF\n", startxref);
+	fprintf(opts->out, "startxref\n%lld\n%%%%EOF\n", startxref);
 }
 
 static void
-padto(FILE *file, int target)
+padto(FILE *file, fz_off_t target)
 {
-	int pos = ftell(file);
+	fz_off_t pos = fz_ftell(file);
 
 	assert(pos <= target);
 	while (pos < target)
@@ -1820,32 +2151,146 @@ padto(FILE *file, int target)
 	}
 }
 
-static void
-dowriteobject(pdf_document *xref, pdf_write_options *opts, int num, int pass)
+static int
+writtengen(pdf_write_options *opts, int num, pdf_xref_entry *entry)
 {
-	if (xref->table[num].type == 'f')
-		opts->gen_list[num] = xref->table[num].gen;
-	if (xref->table[num].type == 'n')
-		opts->gen_list[num] = xref->table[num].gen;
-	if (xref->table[num].type == 'o')
-		opts->gen_list[num] = 0;
-
 	/* If we are renumbering, then make sure all generation numbers are
 	 * zero (except object 0 which must be free, and have a gen number of
 	 * 65535). Changing the generation numbers (and indeed object numbers)
 	 * will break encryption - so only do this if we are renumbering
 	 * anyway. */
 	if (opts->do_garbage >= 2)
-		opts->gen_list[num] = (num == 0 ? 65535 : 0);
+		return (num == 0 ? 65535 : 0);
+	if (entry->type == 'o')
+		return 0;
+	return entry->gen;
+}
+
+/* Load the stream of object num, if it is one that should be deflated. */
+static fz_buffer *
+loaddeflatable(pdf_document *xref, pdf_write_options *opts, int num, int gen, int *truncated)
+{
+	fz_context *ctx = xref->ctx;
+	fz_buffer *buf = NULL;
+	pdf_obj *obj, *type;
+	int expand;
+
+	obj = pdf_load_object(xref, num, gen);
+	fz_try(ctx)
+	{
+		type = pdf_dict_gets(obj, "Type");
+		if (pdf_is_name(type) && (!strcmp(pdf_to_name(type), "ObjStm") || !strcmp(pdf_to_name(type), "XRef")))
+			expand = -1;
+		else if (!pdf_is_stream(xref, num, gen))
+			expand = -1;
+		else if (pdf_get_xref_entry(xref, num)->stm_ofs < 0 && pdf_get_xref_entry(xref, num)->stm_buf == NULL)
+			expand = -1;
+		else
+		{
+			expand = expandable(xref, opts, obj);
+			if (!deflatable(opts, num, obj, expand))
+				expand = -1;
+		}
+
+		if (expand > 0)
+			buf = pdf_load_renumbered_stream(xref, num, gen, opts->rev_renumber_map[num], opts->rev_gen_list[num], (opts->continue_on_error ? truncated : NULL));
+		else if (expand == 0)
+			buf = pdf_load_raw_renumbered_stream(xref, num, gen, opts->rev_renumber_map[num], opts->rev_gen_list[num]);
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(obj);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return buf;
+}
+
+/*
+ * Load and deflate the streams of the objects from num (up to, but not
+ * including, to) that will be written next, stopping when every job
+ * slot is full or enough data has been loaded. Does nothing unless the
+ * context can run jobs in parallel, or if num has been seen already.
+ */
+static void
+deflateahead(pdf_document *xref, pdf_write_options *opts, int num, int to)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_xref_entry entry;
+	deflate_job *job;
+	void **args;
+	int i, n, gen;
+	int bytes = 0;
+
+	if (!opts->do_deflate || opts->deflate_slots < 2)
+		return;
+	if (num >= opts->deflate_from && num < opts->deflate_next)
+		return;
+
+	dropdeflated(ctx, opts);
+	opts->deflate_from = num;
+
+	for (n = 0; num < to && n < opts->deflate_slots && bytes < DEFLATE_AHEAD_BYTES; num++)
+	{
+		if (opts->do_garbage && !opts->use_list[num])
+			continue;
+		pdf_peek_xref_entry(xref, num, &entry);
+		if (entry.type != 'n' && entry.type != 'o')
+			continue;
+		gen = writtengen(opts, num, &entry);
+
+		job = &opts->deflate[n];
+		job->truncated = 0;
+		fz_try(ctx)
+		{
+			job->src = loaddeflatable(xref, opts, num, gen, &job->truncated);
+			if (job->src)
+				preparedeflatejob(ctx, job);
+		}
+		fz_catch(ctx)
+		{
+			/* Leave it to writeobject to report the error */
+			fz_drop_buffer(ctx, job->src);
+			job->src = NULL;
+		}
+		if (job->src)
+		{
+			job->num = num;
+			bytes += job->src->len;
+			n++;
+		}
+	}
+	opts->deflate_next = num;
+
+	if (n == 0)
+		return;
+	args = fz_malloc_array(ctx, n, sizeof(void *));
+	for (i = 0; i < n; i++)
+		args[i] = &opts->deflate[i];
+	fz_run_jobs(ctx, deflate_run_job, args, n);
+	fz_free(ctx, args);
+	opts->deflate_len = n;
+}
+
+static void
+dowriteobject(pdf_document *xref, pdf_write_options *opts, int num, int pass)
+{
+	pdf_xref_entry entry;
+
+	pdf_peek_xref_entry(xref, num, &entry);
+	opts->gen_list[num] = writtengen(opts, num, &entry);
 
 	if (opts->do_garbage && !opts->use_list[num])
 		return;
 
-	if (xref->table[num].type == 'n' || xref->table[num].type == 'o')
+	if (entry.type == 'n' || entry.type == 'o')
 	{
 		if (pass > 0)
 			padto(opts->out, opts->ofs_list[num]);
-		opts->ofs_list[num] = ftell(opts->out);
+		opts->ofs_list[num] = fz_ftell(opts->out);
 		writeobject(xref, opts, num, opts->gen_list[num]);
 	}
 	else
@@ -1860,29 +2305,37 @@ writeobjects(pdf_document *xref, pdf_write_options *opts, int pass)
 	fprintf(opts->out, "%%PDF-%d.%d\n", xref->version / 10, xref->version % 10);
 	fprintf(opts->out, "%%\316\274\341\277\246\n\n");
 
+	dropdeflated(xref->ctx, opts);
+	opts->deflate_from = opts->deflate_next = 0;
+
+	deflateahead(xref, opts, opts->start, opts->start+1);
 	dowriteobject(xref, opts, opts->start, pass);
 
 	if (opts->do_linear)
 	{
 		/* Write first xref */
 		if (pass == 0)
-			opts->first_xref_offset = ftell(opts->out);
+			opts->first_xref_offset = fz_ftell(opts->out);
 		else
 			padto(opts->out, opts->first_xref_offset);
 		writexref(xref, opts, opts->start, xref->len, 1, opts->main_xref_offset, 0);
 	}
 
 	for (num = opts->start+1; num < xref->len; num++)
+	{
+		deflateahead(xref, opts, num, xref->len);
 		dowriteobject(xref, opts, num, pass);
+	}
 	if (opts->do_linear && pass == 1)
 	{
-		int offset = (opts->start == 1 ? opts->main_xref_offset : opts->ofs_list[1] + opts->hintstream_len);
+		fz_off_t offset = (opts->start == 1 ? opts->main_xref_offset : opts->ofs_list[1] + opts->hintstream_len);
 		padto(opts->out, offset);
 	}
 	for (num = 1; num < opts->start; num++)
 	{
 		if (pass == 1)
 			opts->ofs_list[num] += opts->hintstream_len;
+		deflateahead(xref, opts, num, opts->start);
 		dowriteobject(xref, opts, num, pass);
 	}
 }
@@ -1925,7 +2378,8 @@ make_page_offset_hints(pdf_document *xref, pdf_write_options *opts, fz_buffer *b
 	max_shared_length = 0;
 	for (i=1; i < xref->len; i++)
 	{
-		int min, max, page;
+		fz_off_t min, max;
+		int page;
 
 		min = opts->ofs_list[i];
 		if (i == opts->start-1 || (opts->start == 1 && i == xref->len-1))
@@ -2138,7 +2592,7 @@ make_page_offset_hints(pdf_document *xref, pdf_write_options *opts, fz_buffer *b
 	for (j = 0; j < pop[0]->len; j++)
 	{
 		int o = pop[0]->object[j];
-		int min, max;
+		fz_off_t min, max;
 		min = opts->ofs_list[o];
 		if (o == opts->start-1)
 			max = opts->main_xref_offset;
@@ -2152,7 +2606,7 @@ make_page_offset_hints(pdf_document *xref, pdf_write_options *opts, fz_buffer *b
 	/* Item 1: Shared object group length (shared objects) */
 	for (i = min_shared_object; i <= max_shared_object; i++)
 	{
-		int min, max;
+		fz_off_t min, max;
 		min = opts->ofs_list[i];
 		if (i == opts->start-1)
 			max = opts->main_xref_offset;
@@ -2202,21 +2656,325 @@ static void dump_object_details(pdf_document *xref, pdf_write_options *opts)
 
 	for (i = 0; i < xref->len; i++)
 	{
-		fprintf(stderr, "%d@%d: use=%d\n", i, opts->ofs_list[i], opts->use_list[i]);
+		fprintf(stderr, "%d@%lld: use=%d\n", i, opts->ofs_list[i], opts->use_list[i]);
 	}
 }
 #endif
 
+/*
+ * Incremental saving: the original file is copied across untouched, and
+ * only the objects that have changed since it was opened are appended,
+ * followed by a new xref section (or xref stream, if that is what the
+ * file ended with) that chains back to the original one with /Prev.
+ */
+
+#define COPY_CHUNK (1 << 20)
+
+static void
+copyoriginal(pdf_document *xref, FILE *out)
+{
+	fz_context *ctx = xref->ctx;
+	unsigned char *buf;
+	fz_off_t left = xref->file_size;
+	int n, last = '\n';
+
+	buf = fz_malloc(ctx, COPY_CHUNK);
+	fz_try(ctx)
+	{
+		fz_seek(xref->file, 0, 0);
+		while (left > 0)
+		{
+			n = fz_read(xref->file, buf, left < COPY_CHUNK ? (int)left : COPY_CHUNK);
+			if (n <= 0)
+				fz_throw(ctx, "cannot read original file");
+			if (fwrite(buf, 1, n, out) != (size_t)n)
+				fz_throw(ctx, "cannot write output file");
+			last = buf[n - 1];
+			left -= n;
+		}
+		if (last != '\n' && last != '\r')
+			fputc('\n', out);
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+/* Does the last xref section of the original file live in a stream? */
+static int
+endsinxrefstream(pdf_document *xref)
+{
+	int c;
+
+	fz_seek(xref->file, xref->startxref, 0);
+	do
+		c = fz_read_byte(xref->file);
+	while (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f' || c == 0);
+	return c != 'x';
+}
+
+static pdf_obj *
+incrementaltrailer(pdf_document *xref, int size)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_obj *trailer, *obj;
+
+	trailer = pdf_new_dict(ctx, 8);
+	fz_try(ctx)
+	{
+		pdf_dict_puts_drop(trailer, "Size", pdf_new_int(ctx, size));
+		pdf_dict_puts_drop(trailer, "Prev", pdf_new_int_offset(ctx, xref->startxref));
+		obj = pdf_dict_gets(xref->trailer, "Root");
+		if (obj)
+			pdf_dict_puts(trailer, "Root", obj);
+		obj = pdf_dict_gets(xref->trailer, "Info");
+		if (obj)
+			pdf_dict_puts(trailer, "Info", obj);
+		obj = pdf_dict_gets(xref->trailer, "ID");
+		if (obj)
+			pdf_dict_puts(trailer, "ID", obj);
+	}
+	fz_catch(ctx)
+	{
+		pdf_drop_obj(trailer);
+		fz_rethrow(ctx);
+	}
+
+	return trailer;
+}
+
+/*
+ * use_list[num] is 'n' or 'f' for the objects in the new section, and
+ * zero for those left as they were.
+ */
+static void
+writeincrementalxref(pdf_document *xref, pdf_write_options *opts)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_obj *trailer;
+	fz_off_t startxref = fz_ftell(opts->out);
+	int num, end;
+
+	fprintf(opts->out, "xref\n");
+	for (num = 0; num < xref->len; num = end)
+	{
+		if (!opts->use_list[num])
+		{
+			end = num + 1;
+			continue;
+		}
+		for (end = num; end < xref->len && opts->use_list[end]; end++)
+			if (opts->ofs_list[end] > 9999999999LL)
+				fz_throw(ctx, "object offset too large for xref table (%d 0 R)", end);
+		fprintf(opts->out, "%d %d\n", num, end - num);
+		for (; num < end; num++)
+			fprintf(opts->out, "%010lld %05d %c \n", opts->ofs_list[num], opts->gen_list[num], opts->use_list[num]);
+	}
+	fprintf(opts->out, "\n");
+
+	trailer = incrementaltrailer(xref, xref->len);
+	fprintf(opts->out, "trailer\n");
+	pdf_fprint_obj(opts->out, trailer, opts->do_expand == 0);
+	fprintf(opts->out, "\n");
+	pdf_drop_obj(trailer);
+
+	fprintf(opts->out, "startxref\n%lld\n%%%%EOF\n", startxref);
+}
+
+static void
+writeincrementalxrefstream(pdf_document *xref, pdf_write_options *opts)
+{
+	fz_context *ctx = xref->ctx;
+	fz_buffer *buf = NULL;
+	pdf_obj *dict = NULL;
+	pdf_obj *index, *w;
+	int num = xref->len;
+	int ofsbytes, i, end;
+	fz_off_t startxref = fz_ftell(opts->out);
+
+	fz_var(buf);
+	fz_var(dict);
+
+	/* The xref stream is a new object, and goes in its own section */
+	opts->use_list[num] = 'n';
+	opts->ofs_list[num] = startxref;
+	opts->gen_list[num] = 0;
+	ofsbytes = startxref > 0xffffffffLL ? 8 : 4;
+
+	fz_try(ctx)
+	{
+		dict = incrementaltrailer(xref, num + 1);
+		pdf_dict_puts_drop(dict, "Type", pdf_new_name(ctx, "XRef"));
+		w = pdf_new_array(ctx, 3);
+		pdf_dict_puts_drop(dict, "W", w);
+		pdf_array_push_drop(w, pdf_new_int(ctx, 1));
+		pdf_array_push_drop(w, pdf_new_int(ctx, ofsbytes));
+		pdf_array_push_drop(w, pdf_new_int(ctx, 2));
+		index = pdf_new_array(ctx, 2);
+		pdf_dict_puts_drop(dict, "Index", index);
+
+		buf = fz_new_buffer(ctx, 1024);
+		for (i = 0; i <= num; i = end)
+		{
+			if (!opts->use_list[i])
+			{
+				end = i + 1;
+				continue;
+			}
+			for (end = i; end <= num && opts->use_list[end]; end++)
+				;
+			pdf_array_push_drop(index, pdf_new_int(ctx, i));
+			pdf_array_push_drop(index, pdf_new_int(ctx, end - i));
+			for (; i < end; i++)
+			{
+				int k;
+				fz_write_buffer_byte(ctx, buf, opts->use_list[i] == 'n' ? 1 : 0);
+				for (k = ofsbytes - 1; k >= 0; k--)
+					fz_write_buffer_byte(ctx, buf, (opts->ofs_list[i] >> (k * 8)) & 0xff);
+				fz_write_buffer_byte(ctx, buf, (opts->gen_list[i] >> 8) & 0xff);
+				fz_write_buffer_byte(ctx, buf, opts->gen_list[i] & 0xff);
+			}
+		}
+		pdf_dict_puts_drop(dict, "Length", pdf_new_int(ctx, buf->len));
+
+		fprintf(opts->out, "%d 0 obj\n", num);
+		pdf_fprint_obj(opts->out, dict, opts->do_expand == 0);
+		fprintf(opts->out, "stream\n");
+		fwrite(buf->data, 1, buf->len, opts->out);
+		fprintf(opts->out, "\nendstream\nendobj\n\n");
+		fprintf(opts->out, "startxref\n%lld\n%%%%EOF\n", startxref);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		pdf_drop_obj(dict);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
+static void
+writeincremental(pdf_document *xref, char *filename, fz_write_options *fz_opts)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_write_options opts = { 0 };
+	pdf_xref_entry entry;
+	int num, xrefstm, changed;
+
+	if (xref->repaired)
+		fz_throw(ctx, "cannot save a repaired document incrementally");
+	if (xref->crypt)
+		fz_throw(ctx, "cannot save an encrypted document incrementally");
+
+	xrefstm = endsinxrefstream(xref);
+
+	opts.out = fopen(filename, "wb");
+	if (!opts.out)
+		fz_throw(ctx, "cannot open output file '%s'", filename);
+
+	fz_try(ctx)
+	{
+		opts.do_expand = fz_opts->do_expand;
+		opts.do_ascii = fz_opts->do_ascii;
+		opts.do_deflate = fz_opts->do_deflate;
+		opts.continue_on_error = fz_opts->continue_on_error;
+		opts.errors = fz_opts->errors;
+		/* One extra entry for the xref stream, if we need one */
+		opts.use_list = fz_calloc(ctx, xref->len + 1, sizeof(int));
+		opts.ofs_list = fz_calloc(ctx, xref->len + 1, sizeof(fz_off_t));
+		opts.gen_list = fz_calloc(ctx, xref->len + 1, sizeof(int));
+		opts.renumber_map = fz_malloc_array(ctx, xref->len + 1, sizeof(int));
+		opts.rev_renumber_map = fz_malloc_array(ctx, xref->len + 1, sizeof(int));
+		opts.rev_gen_list = fz_malloc_array(ctx, xref->len + 1, sizeof(int));
+		if (opts.do_deflate)
+			opts.deflate = fz_calloc(ctx, 1, sizeof(deflate_job));
+
+		changed = 0;
+		for (num = 0; num < xref->len; num++)
+		{
+			opts.renumber_map[num] = num;
+			opts.rev_renumber_map[num] = num;
+			pdf_peek_xref_entry(xref, num, &entry);
+			opts.rev_gen_list[num] = entry.gen;
+			changed |= entry.dirty;
+		}
+
+		copyoriginal(xref, opts.out);
+
+		/* Add nothing if nothing (not even the trailer) has changed */
+		if (changed)
+		{
+			for (num = 1; num < xref->len; num++)
+			{
+				pdf_peek_xref_entry(xref, num, &entry);
+				if (!entry.dirty)
+					continue;
+				if (entry.type == 'n' || entry.type == 'o')
+				{
+					opts.use_list[num] = 'n';
+					opts.gen_list[num] = (entry.type == 'o' ? 0 : entry.gen);
+					opts.ofs_list[num] = fz_ftell(opts.out);
+					/* writeobject clears use_list for object and xref streams */
+					writeobject(xref, &opts, num, opts.gen_list[num]);
+				}
+				else
+				{
+					opts.use_list[num] = 'f';
+					opts.gen_list[num] = entry.gen;
+				}
+			}
+
+			if (xrefstm)
+				writeincrementalxrefstream(xref, &opts);
+			else
+				writeincrementalxref(xref, &opts);
+		}
+
+		/* The per-object dirty flags stay set, as they are relative to
+		 * the file we opened, which is what the next save copies. */
+		xref->dirty = 0;
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, opts.use_list);
+		fz_free(ctx, opts.ofs_list);
+		fz_free(ctx, opts.gen_list);
+		fz_free(ctx, opts.renumber_map);
+		fz_free(ctx, opts.rev_renumber_map);
+		fz_free(ctx, opts.rev_gen_list);
+		freedeflate(ctx, &opts);
+		fclose(opts.out);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+}
+
 void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz_opts)
 {
 	int lastfree;
 	int num;
+	pdf_xref_entry entry;
 	pdf_write_options opts = { 0 };
 	fz_context *ctx;
 
 	if (!xref)
 		return;
 
+	if (fz_opts && fz_opts->do_incremental)
+	{
+		writeincremental(xref, filename, fz_opts);
+		return;
+	}
+
 	ctx = xref->ctx;
 
 	opts.out = fopen(filename, "wb");
@@ -2229,19 +2987,26 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 		opts.do_garbage = fz_opts ? fz_opts->do_garbage : 0;
 		opts.do_ascii = fz_opts ? fz_opts->do_ascii: 0;
 		opts.do_linear = fz_opts ? fz_opts->do_linear: 0;
+		opts.do_deflate = fz_opts ? fz_opts->do_deflate : 0;
 		opts.start = 0;
 		opts.main_xref_offset = INT_MIN;
 		/* We deliberately make these arrays long enough to cope with
 		 * 1 to n access rather than 0..n-1, and add space for 2 new
 		 * extra entries that may be required for linearization. */
 		opts.use_list = fz_malloc_array(ctx, xref->len + 3, sizeof(int));
-		opts.ofs_list = fz_malloc_array(ctx, xref->len + 3, sizeof(int));
+		opts.ofs_list = fz_malloc_array(ctx, xref->len + 3, sizeof(fz_off_t));
 		opts.gen_list = fz_calloc(ctx, xref->len + 3, sizeof(int));
 		opts.renumber_map = fz_malloc_array(ctx, xref->len + 3, sizeof(int));
 		opts.rev_renumber_map = fz_malloc_array(ctx, xref->len + 3, sizeof(int));
 		opts.rev_gen_list = fz_malloc_array(ctx, xref->len + 3, sizeof(int));
 		opts.continue_on_error = fz_opts->continue_on_error;
 		opts.errors = fz_opts->errors;
+		if (opts.do_deflate)
+		{
+			if (fz_count_jobs(ctx) > 1)
+				opts.deflate_slots = fz_count_jobs(ctx) * 2;
+			opts.deflate = fz_calloc(ctx, opts.deflate_slots + 1, sizeof(deflate_job));
+		}
 
 		for (num = 0; num < xref->len; num++)
 		{
@@ -2249,7 +3014,8 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 			opts.ofs_list[num] = 0;
 			opts.renumber_map[num] = num;
 			opts.rev_renumber_map[num] = num;
-			opts.rev_gen_list[num] = xref->table[num].gen;
+			pdf_peek_xref_entry(xref, num, &entry);
+			opts.rev_gen_list[num] = entry.gen;
 		}
 
 		/* Make sure any objects hidden in compressed streams have been loaded */
@@ -2264,7 +3030,13 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 
 		/* Coalesce and renumber duplicate objects */
 		if (opts.do_garbage >= 3)
+		{
 			removeduplicateobjs(xref, &opts);
+			if (fz_opts->dedup_objects)
+				*fz_opts->dedup_objects = opts.dedup_objects;
+			if (fz_opts->dedup_bytes)
+				*fz_opts->dedup_bytes = opts.dedup_bytes;
+		}
 
 		/* Compact xref by renumbering and removing unused objects */
 		if (opts.do_garbage >= 2 || opts.do_linear)
@@ -2299,15 +3071,15 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 
 		if (opts.do_linear)
 		{
-			opts.main_xref_offset = ftell(opts.out);
+			opts.main_xref_offset = fz_ftell(opts.out);
 			writexref(xref, &opts, 0, opts.start, 0, 0, opts.first_xref_offset);
-			opts.file_len = ftell(opts.out);
+			opts.file_len = fz_ftell(opts.out);
 
 			make_hint_stream(xref, &opts);
 			opts.file_len += opts.hintstream_len;
 			opts.main_xref_offset += opts.hintstream_len;
 			update_linearization_params(xref, &opts);
-			fseek(opts.out, 0, 0);
+			fz_fseek(opts.out, 0, 0);
 			writeobjects(xref, &opts, 1);
 
 			padto(opts.out, opts.main_xref_offset);
@@ -2315,7 +3087,7 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 		}
 		else
 		{
-			opts.first_xref_offset = ftell(opts.out);
+			opts.first_xref_offset = fz_ftell(opts.out);
 			writexref(xref, &opts, 0, xref->len, 1, 0, opts.first_xref_offset);
 		}
 
@@ -2333,6 +3105,7 @@ void pdf_write_document(pdf_document *xref, char *filename, fz_write_options *fz
 		fz_free(ctx, opts.renumber_map);
 		fz_free(ctx, opts.rev_renumber_map);
 		fz_free(ctx, opts.rev_gen_list);
+		freedeflate(ctx, &opts);
 		pdf_drop_obj(opts.linear_l);
 		pdf_drop_obj(opts.linear_h0);
 		pdf_drop_obj(opts.linear_h1);
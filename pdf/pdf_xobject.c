@@ -47,7 +47,7 @@ pdf_load_xobject(pdf_document *xref, pdf_obj *dict)
 	}
 
 	form = fz_malloc_struct(ctx, pdf_xobject);
-	FZ_INIT_STORABLE(form, 1, pdf_free_xobject_imp);
+	FZ_INIT_STORABLE(form, 1, pdf_free_xobject_imp, FZ_STORE_OTHER);
 	form->resources = NULL;
 	form->contents = NULL;
 	form->colorspace = NULL;
@@ -178,7 +178,7 @@ pdf_new_xobject(pdf_document *xref, const fz_rect *bbox, const fz_matrix *mat)
 		obj = NULL;
 
 		form = fz_malloc_struct(ctx, pdf_xobject);
-		FZ_INIT_STORABLE(form, 1, pdf_free_xobject_imp);
+		FZ_INIT_STORABLE(form, 1, pdf_free_xobject_imp, FZ_STORE_OTHER);
 		form->resources = NULL;
 		form->contents = NULL;
 		form->colorspace = NULL;
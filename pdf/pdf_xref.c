@@ -29,19 +29,26 @@ static void
 pdf_read_start_xref(pdf_document *xref)
 {
 	unsigned char buf[1024];
-	int t, n;
+	fz_off_t t;
+	int n;
 	int i;
 
 	fz_seek(xref->file, 0, 2);
 
 	xref->file_size = fz_tell(xref->file);
 
-	t = fz_maxi(0, xref->file_size - (int)sizeof buf);
+	t = xref->file_size - ((int)sizeof buf - 1);
+	if (t < 0)
+		t = 0;
 	fz_seek(xref->file, t, 0);
 
-	n = fz_read(xref->file, buf, sizeof buf);
+	n = fz_read(xref->file, buf, sizeof buf - 1);
 	if (n < 0)
 		fz_throw(xref->ctx, "cannot read from file");
+	/* The compiler cannot tell that fz_throw does not return */
+	if (n < 0)
+		n = 0;
+	buf[n] = 0;
 
 	for (i = n - 9; i >= 0; i--)
 	{
@@ -50,7 +57,7 @@ pdf_read_start_xref(pdf_document *xref)
 			i += 9;
 			while (iswhite(buf[i]) && i < n)
 				i ++;
-			xref->startxref = atoi((char*)(buf + i));
+			xref->startxref = fz_atoo((char*)(buf + i));
 
 			return;
 		}
@@ -68,7 +75,7 @@ pdf_read_old_trailer(pdf_document *xref, pdf_lexbuf *buf)
 {
 	int len;
 	char *s;
-	int t;
+	fz_off_t t;
 	pdf_token tok;
 	int c;
 
@@ -97,7 +104,7 @@ pdf_read_old_trailer(pdf_document *xref, pdf_lexbuf *buf)
 		if (t < 0)
 			fz_throw(xref->ctx, "cannot tell in file");
 
-		fz_seek(xref->file, t + 20 * len, 0);
+		fz_seek(xref->file, t + 20 * (fz_off_t)len, 0);
 	}
 
 	fz_try(xref->ctx)
@@ -159,26 +166,270 @@ pdf_read_trailer(pdf_document *xref, pdf_lexbuf *buf)
 
 /*
  * xref tables
+ *
+ * A packed word is laid out as: bits 0-1 the type (unset, f, n, o),
+ * bits 2-17 the gen (or objstm index), bits 18-63 the offset (or objstm
+ * number). Anything that does not fit goes into a full record instead.
  */
 
+#define PACKED_GEN_MAX 0xffff
+#define PACKED_OFS_MAX (((fz_off_t)1 << 46) - 1)
+
+static int
+pack_xref_entry(unsigned long long *word, int type, fz_off_t ofs, int gen)
+{
+	unsigned long long code;
+
+	switch (type)
+	{
+	case 0: code = 0; break;
+	case 'f': code = 1; break;
+	case 'n': code = 2; break;
+	case 'o': code = 3; break;
+	default: return 0;
+	}
+	if (ofs < 0 || ofs > PACKED_OFS_MAX || gen < 0 || gen > PACKED_GEN_MAX)
+		return 0;
+	*word = code | ((unsigned long long)gen << 2) | ((unsigned long long)ofs << 18);
+	return 1;
+}
+
+static void
+unpack_xref_entry(unsigned long long word, pdf_xref_entry *x)
+{
+	x->type = "\0fno"[word & 3];
+	x->gen = (word >> 2) & PACKED_GEN_MAX;
+	x->ofs = (fz_off_t)(word >> 18);
+	x->stm_ofs = 0;
+	x->stm_buf = NULL;
+	x->obj = NULL;
+	x->dirty = 0;
+}
+
+static void
+clear_xref_entry(pdf_xref_entry *x)
+{
+	x->type = 0;
+	x->gen = 0;
+	x->ofs = 0;
+	x->stm_ofs = 0;
+	x->stm_buf = NULL;
+	x->obj = NULL;
+	x->dirty = 0;
+}
+
+pdf_xref_entry *
+pdf_get_xref_entry(pdf_document *xref, int num)
+{
+	pdf_xref_entry *block = xref->xref_blocks[num >> PDF_XREF_BLOCK_SHIFT];
+	int i, base;
+
+	if (!block)
+	{
+		block = fz_malloc_array(xref->ctx, PDF_XREF_BLOCK, sizeof(pdf_xref_entry));
+		base = num & ~(PDF_XREF_BLOCK - 1);
+		for (i = 0; i < PDF_XREF_BLOCK; i++)
+		{
+			if (base + i < xref->len)
+				unpack_xref_entry(xref->xref_packed[base + i], &block[i]);
+			else
+				clear_xref_entry(&block[i]);
+		}
+		xref->xref_blocks[num >> PDF_XREF_BLOCK_SHIFT] = block;
+	}
+
+	return &block[num & (PDF_XREF_BLOCK - 1)];
+}
+
+void
+pdf_peek_xref_entry(pdf_document *xref, int num, pdf_xref_entry *entry)
+{
+	pdf_xref_entry *block = xref->xref_blocks[num >> PDF_XREF_BLOCK_SHIFT];
+
+	if (block)
+		*entry = block[num & (PDF_XREF_BLOCK - 1)];
+	else
+		unpack_xref_entry(xref->xref_packed[num], entry);
+}
+
+static int
+pdf_xref_type(pdf_document *xref, int num)
+{
+	pdf_xref_entry *block = xref->xref_blocks[num >> PDF_XREF_BLOCK_SHIFT];
+
+	if (block)
+		return block[num & (PDF_XREF_BLOCK - 1)].type;
+	return "\0fno"[xref->xref_packed[num] & 3];
+}
+
+void
+pdf_set_xref_entry(pdf_document *xref, int num, int type, fz_off_t ofs, int gen)
+{
+	pdf_xref_entry *x;
+
+	if (!xref->xref_blocks[num >> PDF_XREF_BLOCK_SHIFT])
+		if (pack_xref_entry(&xref->xref_packed[num], type, ofs, gen))
+			return;
+
+	x = pdf_get_xref_entry(xref, num);
+	x->type = type;
+	x->ofs = ofs;
+	x->gen = gen;
+}
+
+void
+pdf_mark_xref_dirty(pdf_document *xref, int num)
+{
+	if (num >= 0 && num < xref->len)
+		pdf_get_xref_entry(xref, num)->dirty = 1;
+}
+
 void
 pdf_resize_xref(pdf_document *xref, int newlen)
 {
+	fz_context *ctx = xref->ctx;
+	int oldblocks = (xref->len + PDF_XREF_BLOCK - 1) >> PDF_XREF_BLOCK_SHIFT;
+	int newblocks = (newlen + PDF_XREF_BLOCK - 1) >> PDF_XREF_BLOCK_SHIFT;
+	pdf_xref_entry *block;
 	int i;
 
-	xref->table = fz_resize_array(xref->ctx, xref->table, newlen, sizeof(pdf_xref_entry));
-	for (i = xref->len; i < newlen; i++)
+	if (newlen < xref->len)
 	{
-		xref->table[i].type = 0;
-		xref->table[i].ofs = 0;
-		xref->table[i].gen = 0;
-		xref->table[i].stm_ofs = 0;
-		xref->table[i].stm_buf = NULL;
-		xref->table[i].obj = NULL;
+		/* Keep the arrays; drop whatever falls off the end */
+		for (i = newlen; i < xref->len; i++)
+		{
+			block = xref->xref_blocks[i >> PDF_XREF_BLOCK_SHIFT];
+			if (block)
+			{
+				pdf_drop_obj(block[i & (PDF_XREF_BLOCK - 1)].obj);
+				fz_drop_buffer(ctx, block[i & (PDF_XREF_BLOCK - 1)].stm_buf);
+				clear_xref_entry(&block[i & (PDF_XREF_BLOCK - 1)]);
+			}
+		}
+		for (i = newblocks; i < oldblocks; i++)
+		{
+			fz_free(ctx, xref->xref_blocks[i]);
+			xref->xref_blocks[i] = NULL;
+		}
+		xref->len = newlen;
+		return;
 	}
+
+	xref->xref_packed = fz_resize_array(ctx, xref->xref_packed, newlen, sizeof(unsigned long long));
+	xref->xref_blocks = fz_resize_array(ctx, xref->xref_blocks, newblocks, sizeof(pdf_xref_entry *));
+	for (i = xref->len; i < newlen; i++)
+		xref->xref_packed[i] = 0;
+	for (i = oldblocks; i < newblocks; i++)
+		xref->xref_blocks[i] = NULL;
 	xref->len = newlen;
 }
 
+void
+pdf_free_xref(pdf_document *xref)
+{
+	fz_context *ctx = xref->ctx;
+	int nblocks = (xref->len + PDF_XREF_BLOCK - 1) >> PDF_XREF_BLOCK_SHIFT;
+	pdf_xref_entry *block;
+	int i, k;
+
+	for (i = 0; i < nblocks; i++)
+	{
+		block = xref->xref_blocks[i];
+		if (!block)
+			continue;
+		for (k = 0; k < PDF_XREF_BLOCK; k++)
+		{
+			pdf_drop_obj(block[k].obj);
+			fz_drop_buffer(ctx, block[k].stm_buf);
+		}
+		fz_free(ctx, block);
+	}
+	fz_free(ctx, xref->xref_blocks);
+	fz_free(ctx, xref->xref_packed);
+	xref->xref_blocks = NULL;
+	xref->xref_packed = NULL;
+	xref->len = 0;
+}
+
+/*
+ * Move the used objects to their new numbers (object 0 stays put) and
+ * drop the rest.
+ */
+void
+pdf_renumber_xref(pdf_document *xref, int *use_list, int *renumber_map)
+{
+	fz_context *ctx = xref->ctx;
+	unsigned long long *old_packed = xref->xref_packed;
+	pdf_xref_entry **old_blocks = xref->xref_blocks;
+	int old_len = xref->len;
+	unsigned long long word;
+	pdf_xref_entry e, *block;
+	int num, to, newlen = 0;
+
+	for (num = 1; num < old_len; num++)
+		if (use_list[num] && renumber_map[num] > newlen)
+			newlen = renumber_map[num];
+
+	xref->xref_packed = NULL;
+	xref->xref_blocks = NULL;
+	xref->len = 0;
+
+	fz_try(ctx)
+	{
+		pdf_resize_xref(xref, newlen + 1);
+
+		/* Allocate every full record we need before moving anything */
+		for (num = 0; num < old_len; num++)
+		{
+			if (num > 0 && !use_list[num])
+				continue;
+			to = num > 0 ? renumber_map[num] : 0;
+			block = old_blocks[num >> PDF_XREF_BLOCK_SHIFT];
+			if (block)
+			{
+				e = block[num & (PDF_XREF_BLOCK - 1)];
+				if (e.obj || e.stm_buf || e.stm_ofs || !pack_xref_entry(&word, e.type, e.ofs, e.gen))
+					pdf_get_xref_entry(xref, to);
+			}
+		}
+	}
+	fz_catch(ctx)
+	{
+		pdf_free_xref(xref);
+		xref->xref_packed = old_packed;
+		xref->xref_blocks = old_blocks;
+		xref->len = old_len;
+		fz_rethrow(ctx);
+	}
+
+	for (num = 0; num < old_len; num++)
+	{
+		block = old_blocks[num >> PDF_XREF_BLOCK_SHIFT];
+		if (block)
+			e = block[num & (PDF_XREF_BLOCK - 1)];
+		else
+			unpack_xref_entry(old_packed[num], &e);
+
+		if (num > 0 && !use_list[num])
+		{
+			pdf_drop_obj(e.obj);
+			fz_drop_buffer(ctx, e.stm_buf);
+			continue;
+		}
+
+		to = num > 0 ? renumber_map[num] : 0;
+		if (xref->xref_blocks[to >> PDF_XREF_BLOCK_SHIFT])
+			*pdf_get_xref_entry(xref, to) = e;
+		else
+			pdf_set_xref_entry(xref, to, e.type, e.ofs, e.gen);
+	}
+
+	for (num = 0; num < (old_len + PDF_XREF_BLOCK - 1) >> PDF_XREF_BLOCK_SHIFT; num++)
+		fz_free(ctx, old_blocks[num]);
+	fz_free(ctx, old_blocks);
+	fz_free(ctx, old_packed);
+}
+
 pdf_obj *
 pdf_new_ref(pdf_document *xref, pdf_obj *obj)
 {
@@ -232,7 +483,7 @@ pdf_read_old_xref(pdf_document *xref, pdf_lexbuf *buf)
 			n = fz_read(xref->file, (unsigned char *) buf->scratch, 20);
 			if (n < 0)
 				fz_throw(xref->ctx, "cannot read xref table");
-			if (!xref->table[i].type)
+			if (!pdf_xref_type(xref, i))
 			{
 				s = buf->scratch;
 
@@ -240,11 +491,9 @@ pdf_read_old_xref(pdf_document *xref, pdf_lexbuf *buf)
 				while (*s != '\0' && iswhite(*s))
 					s++;
 
-				xref->table[i].ofs = atoi(s);
-				xref->table[i].gen = atoi(s + 11);
-				xref->table[i].type = s[17];
 				if (s[17] != 'f' && s[17] != 'n' && s[17] != 'o')
-					fz_throw(xref->ctx, "unexpected xref type: %#x (%d %d R)", s[17], i, xref->table[i].gen);
+					fz_throw(xref->ctx, "unexpected xref type: %#x (%d %d R)", s[17], i, atoi(s + 11));
+				pdf_set_xref_entry(xref, i, s[17], fz_atoo(s), atoi(s + 11));
 			}
 		}
 	}
@@ -281,7 +530,7 @@ pdf_read_new_xref_section(pdf_document *xref, fz_stream *stm, int i0, int i1, in
 	for (i = i0; i < i0 + i1; i++)
 	{
 		int a = 0;
-		int b = 0;
+		fz_off_t b = 0;
 		int c = 0;
 
 		if (fz_is_eof(stm))
@@ -294,12 +543,10 @@ pdf_read_new_xref_section(pdf_document *xref, fz_stream *stm, int i0, int i1, in
 		for (n = 0; n < w2; n++)
 			c = (c << 8) + fz_read_byte(stm);
 
-		if (!xref->table[i].type)
+		if (!pdf_xref_type(xref, i))
 		{
 			int t = w0 ? a : 1;
-			xref->table[i].type = t == 0 ? 'f' : t == 1 ? 'n' : t == 2 ? 'o' : 0;
-			xref->table[i].ofs = w1 ? b : 0;
-			xref->table[i].gen = w2 ? c : 0;
+			pdf_set_xref_entry(xref, i, t == 0 ? 'f' : t == 1 ? 'n' : t == 2 ? 'o' : 0, w1 ? b : 0, w2 ? c : 0);
 		}
 	}
 }
@@ -312,7 +559,8 @@ pdf_read_new_xref(pdf_document *xref, pdf_lexbuf *buf)
 	pdf_obj *trailer = NULL;
 	pdf_obj *index = NULL;
 	pdf_obj *obj = NULL;
-	int num, gen, stm_ofs;
+	int num, gen;
+	fz_off_t stm_ofs;
 	int size, w0, w1, w2;
 	int t;
 	fz_context *ctx = xref->ctx;
@@ -394,7 +642,7 @@ pdf_read_new_xref(pdf_document *xref, pdf_lexbuf *buf)
 
 /* File is locked on entry, and exit (but may be dropped in the middle) */
 static pdf_obj *
-pdf_read_xref(pdf_document *xref, int ofs, pdf_lexbuf *buf)
+pdf_read_xref(pdf_document *xref, fz_off_t ofs, pdf_lexbuf *buf)
 {
 	int c;
 	fz_context *ctx = xref->ctx;
@@ -417,7 +665,7 @@ pdf_read_xref(pdf_document *xref, int ofs, pdf_lexbuf *buf)
 	}
 	fz_catch(ctx)
 	{
-		fz_throw(ctx, "cannot read xref (ofs=%d)", ofs);
+		fz_throw(ctx, "cannot read xref (ofs=%lld)", ofs);
 	}
 	return trailer;
 }
@@ -428,16 +676,16 @@ struct ofs_list_s
 {
 	int max;
 	int len;
-	int *list;
+	fz_off_t *list;
 };
 
 static void
-do_read_xref_sections(pdf_document *xref, int ofs, pdf_lexbuf *buf, ofs_list *offsets)
+do_read_xref_sections(pdf_document *xref, fz_off_t ofs, pdf_lexbuf *buf, ofs_list *offsets)
 {
 	pdf_obj *trailer = NULL;
 	fz_context *ctx = xref->ctx;
-	int xrefstmofs = 0;
-	int prevofs = 0;
+	fz_off_t xrefstmofs = 0;
+	fz_off_t prevofs = 0;
 
 	fz_var(trailer);
 	fz_var(xrefstmofs);
@@ -456,12 +704,12 @@ do_read_xref_sections(pdf_document *xref, int ofs, pdf_lexbuf *buf, ofs_list *of
 			}
 			if (i < offsets->len)
 			{
-				fz_warn(ctx, "ignoring xref recursion with offset %d", ofs);
+				fz_warn(ctx, "ignoring xref recursion with offset %lld", ofs);
 				break;
 			}
 			if (offsets->len == offsets->max)
 			{
-				offsets->list = fz_resize_array(ctx, offsets->list, offsets->max*2, sizeof(int));
+				offsets->list = fz_resize_array(ctx, offsets->list, offsets->max*2, sizeof(*offsets->list));
 				offsets->max *= 2;
 			}
 			offsets->list[offsets->len++] = ofs;
@@ -469,8 +717,8 @@ do_read_xref_sections(pdf_document *xref, int ofs, pdf_lexbuf *buf, ofs_list *of
 			trailer = pdf_read_xref(xref, ofs, buf);
 
 			/* FIXME: do we overwrite free entries properly? */
-			xrefstmofs = pdf_to_int(pdf_dict_gets(trailer, "XRefStm"));
-			prevofs = pdf_to_int(pdf_dict_gets(trailer, "Prev"));
+			xrefstmofs = pdf_to_offset(pdf_dict_gets(trailer, "XRefStm"));
+			prevofs = pdf_to_offset(pdf_dict_gets(trailer, "Prev"));
 
 			if (xrefstmofs < 0)
 				fz_throw(ctx, "negative xref stream offset");
@@ -493,19 +741,19 @@ do_read_xref_sections(pdf_document *xref, int ofs, pdf_lexbuf *buf, ofs_list *of
 	fz_catch(ctx)
 	{
 		pdf_drop_obj(trailer);
-		fz_throw(ctx, "cannot read xref at offset %d", ofs);
+		fz_throw(ctx, "cannot read xref at offset %lld", ofs);
 	}
 }
 
 static void
-pdf_read_xref_sections(pdf_document *xref, int ofs, pdf_lexbuf *buf)
+pdf_read_xref_sections(pdf_document *xref, fz_off_t ofs, pdf_lexbuf *buf)
 {
 	fz_context *ctx = xref->ctx;
 	ofs_list list;
 
 	list.len = 0;
 	list.max = 10;
-	list.list = fz_malloc_array(ctx, 10, sizeof(int));
+	list.list = fz_malloc_array(ctx, 10, sizeof(*list.list));
 	fz_try(ctx)
 	{
 		do_read_xref_sections(xref, ofs, buf, &list);
@@ -529,6 +777,7 @@ pdf_read_xref_sections(pdf_document *xref, int ofs, pdf_lexbuf *buf)
 static void
 pdf_load_xref(pdf_document *xref, pdf_lexbuf *buf)
 {
+	pdf_xref_entry x;
 	int size;
 	int i;
 	fz_context *ctx = xref->ctx;
@@ -549,24 +798,25 @@ pdf_load_xref(pdf_document *xref, pdf_lexbuf *buf)
 	pdf_read_xref_sections(xref, xref->startxref, buf);
 
 	/* broken pdfs where first object is not free */
-	if (xref->table[0].type != 'f')
+	if (xref->len < 1 || pdf_xref_type(xref, 0) != 'f')
 		fz_throw(ctx, "first object in xref is not free");
 
 	/* broken pdfs where object offsets are out of range */
 	for (i = 0; i < xref->len; i++)
 	{
-		if (xref->table[i].type == 'n')
+		pdf_peek_xref_entry(xref, i, &x);
+		if (x.type == 'n')
 		{
 			/* Special case code: "0000000000 * n" means free,
 			 * according to some producers (inc Quartz) */
-			if (xref->table[i].ofs == 0)
-				xref->table[i].type = 'f';
-			else if (xref->table[i].ofs <= 0 || xref->table[i].ofs >= xref->file_size)
-				fz_throw(ctx, "object offset out of range: %d (%d 0 R)", xref->table[i].ofs, i);
+			if (x.ofs == 0)
+				pdf_set_xref_entry(xref, i, 'f', x.ofs, x.gen);
+			else if (x.ofs <= 0 || x.ofs >= xref->file_size)
+				fz_throw(ctx, "object offset out of range: %lld (%d 0 R)", x.ofs, i);
 		}
-		if (xref->table[i].type == 'o')
-			if (xref->table[i].ofs <= 0 || xref->table[i].ofs >= xref->len || xref->table[xref->table[i].ofs].type != 'n')
-				fz_throw(ctx, "invalid reference to an objstm that does not exist: %d (%d 0 R)", xref->table[i].ofs, i);
+		if (x.type == 'o')
+			if (x.ofs <= 0 || x.ofs >= xref->len || pdf_xref_type(xref, x.ofs) != 'n')
+				fz_throw(ctx, "invalid reference to an objstm that does not exist: %lld (%d 0 R)", x.ofs, i);
 	}
 }
 
@@ -753,12 +1003,7 @@ pdf_init_document(pdf_document *xref)
 	}
 	fz_catch(ctx)
 	{
-		if (xref->table)
-		{
-			fz_free(xref->ctx, xref->table);
-			xref->table = NULL;
-			xref->len = 0;
-		}
+		pdf_free_xref(xref);
 		if (xref->trailer)
 		{
 			pdf_drop_obj(xref->trailer);
@@ -792,7 +1037,7 @@ pdf_init_document(pdf_document *xref)
 
 			for (i = 1; i < xref->len; i++)
 			{
-				if (xref->table[i].type == 0 || xref->table[i].type == 'f')
+				if (pdf_xref_type(xref, i) == 0 || pdf_xref_type(xref, i) == 'f')
 					continue;
 
 				fz_try(ctx)
@@ -832,6 +1077,10 @@ pdf_init_document(pdf_document *xref)
 				dict = NULL;
 			}
 		}
+
+		/* Changes to the trailer are noted against the free object 0 */
+		pdf_set_obj_parent(xref, xref->trailer, 0);
+
 		xref->js = pdf_new_js(xref);
 		pdf_js_load_document_level(xref->js);
 	}
@@ -856,42 +1105,20 @@ pdf_init_document(pdf_document *xref)
 void
 pdf_close_document(pdf_document *xref)
 {
-	int i;
 	fz_context *ctx;
 
 	if (!xref)
 		return;
 	ctx = xref->ctx;
 
-	pdf_drop_js(xref->js);
+	/* Objects still held elsewhere no longer lead back to us */
+	pdf_close_doc_handle(ctx, xref->handle);
 
-	if (xref->table)
-	{
-		for (i = 0; i < xref->len; i++)
-		{
-			if (xref->table[i].obj)
-			{
-				pdf_drop_obj(xref->table[i].obj);
-				xref->table[i].obj = NULL;
-				fz_drop_buffer(ctx, xref->table[i].stm_buf);
-			}
-		}
-		fz_free(xref->ctx, xref->table);
-	}
+	pdf_drop_js(xref->js);
 
-	if (xref->page_objs)
-	{
-		for (i = 0; i < xref->page_len; i++)
-			pdf_drop_obj(xref->page_objs[i]);
-		fz_free(ctx, xref->page_objs);
-	}
+	pdf_free_xref(xref);
 
-	if (xref->page_refs)
-	{
-		for (i = 0; i < xref->page_len; i++)
-			pdf_drop_obj(xref->page_refs[i]);
-		fz_free(ctx, xref->page_refs);
-	}
+	pdf_drop_page_tree(xref);
 
 	if (xref->focus_obj)
 		pdf_drop_obj(xref->focus_obj);
@@ -907,22 +1134,27 @@ pdf_close_document(pdf_document *xref)
 
 	pdf_lexbuf_fin(&xref->lexbuf.base);
 
+	/* Objects still held elsewhere keep the pool alive until dropped */
+	pdf_drop_obj_pool(ctx, xref->obj_pool);
+
 	fz_free(ctx, xref);
 }
 
 void
 pdf_print_xref(pdf_document *xref)
 {
+	pdf_xref_entry x;
 	int i;
 	printf("xref\n0 %d\n", xref->len);
 	for (i = 0; i < xref->len; i++)
 	{
-		printf("%05d: %010d %05d %c (stm_ofs=%d; stm_buf=%p)\n", i,
-			xref->table[i].ofs,
-			xref->table[i].gen,
-			xref->table[i].type ? xref->table[i].type : '-',
-			xref->table[i].stm_ofs,
-			xref->table[i].stm_buf);
+		pdf_peek_xref_entry(xref, i, &x);
+		printf("%05d: %010lld %05d %c (stm_ofs=%lld; stm_buf=%p)\n", i,
+			x.ofs,
+			x.gen,
+			x.type ? x.type : '-',
+			x.stm_ofs,
+			x.stm_buf);
 	}
 }
 
@@ -930,23 +1162,47 @@ pdf_print_xref(pdf_document *xref)
  * compressed object streams
  */
 
-static void
-pdf_load_obj_stm(pdf_document *xref, int num, int gen, pdf_lexbuf *buf)
-{
-	fz_stream *stm = NULL;
-	pdf_obj *objstm = NULL;
-	int *numbuf = NULL;
-	int *ofsbuf = NULL;
+/*
+ * Decoded object streams, with their tables of object numbers and
+ * offsets, are kept in the store. Objects are parsed from them one at a
+ * time as they are asked for, and going back to a stream does not mean
+ * inflating and indexing it all over again.
+ */
 
-	pdf_obj *obj;
+typedef struct pdf_obj_stm_s pdf_obj_stm;
+
+struct pdf_obj_stm_s
+{
+	fz_storable storable;
+	fz_buffer *buf;
 	int first;
 	int count;
-	int i;
-	pdf_token tok;
+	int *nums;
+	int *ofs;
+};
+
+static void
+pdf_free_obj_stm_imp(fz_context *ctx, fz_storable *stm_)
+{
+	pdf_obj_stm *stm = (pdf_obj_stm *)stm_;
+
+	fz_drop_buffer(ctx, stm->buf);
+	fz_free(ctx, stm->nums);
+	fz_free(ctx, stm->ofs);
+	fz_free(ctx, stm);
+}
+
+static pdf_obj_stm *
+pdf_decode_obj_stm(pdf_document *xref, int num, int gen, pdf_lexbuf *buf)
+{
+	fz_stream *file = NULL;
+	pdf_obj *objstm = NULL;
+	pdf_obj_stm *stm = NULL;
 	fz_context *ctx = xref->ctx;
+	pdf_token tok;
+	int i;
 
-	fz_var(numbuf);
-	fz_var(ofsbuf);
+	fz_var(file);
 	fz_var(objstm);
 	fz_var(stm);
 
@@ -954,77 +1210,125 @@ pdf_load_obj_stm(pdf_document *xref, int num, int gen, pdf_lexbuf *buf)
 	{
 		objstm = pdf_load_object(xref, num, gen);
 
-		count = pdf_to_int(pdf_dict_gets(objstm, "N"));
-		first = pdf_to_int(pdf_dict_gets(objstm, "First"));
+		stm = fz_malloc_struct(ctx, pdf_obj_stm);
+		FZ_INIT_STORABLE(stm, 1, pdf_free_obj_stm_imp, FZ_STORE_OBJSTM);
+		stm->count = pdf_to_int(pdf_dict_gets(objstm, "N"));
+		stm->first = pdf_to_int(pdf_dict_gets(objstm, "First"));
 
-		if (count < 0)
+		if (stm->count < 0)
 			fz_throw(ctx, "negative number of objects in object stream");
-		if (first < 0)
+		if (stm->first < 0)
 			fz_throw(ctx, "first object in object stream resides outside stream");
 
-		numbuf = fz_calloc(ctx, count, sizeof(int));
-		ofsbuf = fz_calloc(ctx, count, sizeof(int));
+		stm->nums = fz_calloc(ctx, stm->count, sizeof(int));
+		stm->ofs = fz_calloc(ctx, stm->count, sizeof(int));
+		stm->buf = pdf_load_stream(xref, num, gen);
 
-		stm = pdf_open_stream(xref, num, gen);
-		for (i = 0; i < count; i++)
+		file = fz_open_buffer(ctx, stm->buf);
+		for (i = 0; i < stm->count; i++)
 		{
-			tok = pdf_lex(stm, buf);
+			tok = pdf_lex(file, buf);
 			if (tok != PDF_TOK_INT)
 				fz_throw(ctx, "corrupt object stream (%d %d R)", num, gen);
-			numbuf[i] = buf->i;
+			stm->nums[i] = buf->i;
 
-			tok = pdf_lex(stm, buf);
+			tok = pdf_lex(file, buf);
 			if (tok != PDF_TOK_INT)
 				fz_throw(ctx, "corrupt object stream (%d %d R)", num, gen);
-			ofsbuf[i] = buf->i;
+			stm->ofs[i] = buf->i;
 		}
+	}
+	fz_always(ctx)
+	{
+		fz_close(file);
+		pdf_drop_obj(objstm);
+	}
+	fz_catch(ctx)
+	{
+		if (stm)
+			pdf_free_obj_stm_imp(ctx, &stm->storable);
+		fz_throw(ctx, "cannot open object stream (%d %d R)", num, gen);
+	}
+
+	return stm;
+}
+
+static pdf_obj_stm *
+pdf_load_obj_stm(pdf_document *xref, int num, int gen, pdf_lexbuf *buf)
+{
+	fz_context *ctx = xref->ctx;
+	pdf_obj_stm *stm = NULL;
+	pdf_obj *key;
 
-		fz_seek(stm, first, 0);
+	fz_var(stm);
 
-		for (i = 0; i < count; i++)
+	key = pdf_new_indirect(ctx, num, gen, xref);
+	fz_try(ctx)
+	{
+		stm = pdf_find_item(ctx, pdf_free_obj_stm_imp, key);
+		if (stm)
+			xref->obj_stm_hits++;
+		else
 		{
-			fz_seek(stm, first + ofsbuf[i], 0);
+			xref->obj_stm_misses++;
+			stm = pdf_decode_obj_stm(xref, num, gen, buf);
+			pdf_store_item(ctx, key, stm, sizeof(pdf_obj_stm) + stm->buf->cap + stm->count * 2 * sizeof(int));
+		}
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(key);
+	}
+	fz_catch(ctx)
+	{
+		if (stm)
+			fz_drop_storable(ctx, &stm->storable);
+		fz_rethrow(ctx);
+	}
 
-			obj = pdf_parse_stm_obj(xref, stm, buf);
+	return stm;
+}
 
-			if (numbuf[i] < 1 || numbuf[i] >= xref->len)
-			{
-				pdf_drop_obj(obj);
-				fz_throw(ctx, "object id (%d 0 R) out of range (0..%d)", numbuf[i], xref->len - 1);
-			}
+/* Parse object number num, which should be at index idx, out of an object stream */
+static pdf_obj *
+pdf_parse_obj_stm_object(pdf_document *xref, pdf_obj_stm *stm, int num, int idx, pdf_lexbuf *buf)
+{
+	fz_context *ctx = xref->ctx;
+	fz_stream *file;
+	pdf_obj *obj = NULL;
 
-			if (xref->table[numbuf[i]].type == 'o' && xref->table[numbuf[i]].ofs == num)
-			{
-				/* If we already have an entry for this object,
-				 * we'd like to drop it and use the new one -
-				 * but this means that anyone currently holding
-				 * a pointer to the old one will be left with a
-				 * stale pointer. Instead, we drop the new one
-				 * and trust that the old one is correct. */
-				if (xref->table[numbuf[i]].obj) {
-					if (pdf_objcmp(xref->table[numbuf[i]].obj, obj))
-						fz_warn(ctx, "Encountered new definition for object %d - keeping the original one", numbuf[i]);
-					pdf_drop_obj(obj);
-				} else
-					xref->table[numbuf[i]].obj = obj;
-			}
-			else
-			{
-				pdf_drop_obj(obj);
-			}
-		}
+	if (idx < 0 || idx >= stm->count || stm->nums[idx] != num)
+	{
+		for (idx = 0; idx < stm->count; idx++)
+			if (stm->nums[idx] == num)
+				break;
+		if (idx == stm->count)
+			return NULL;
+	}
+
+	file = fz_open_buffer(ctx, stm->buf);
+	fz_try(ctx)
+	{
+		fz_seek(file, stm->first + stm->ofs[idx], 0);
+		obj = pdf_parse_owned_stm_obj(xref, file, buf, num);
 	}
 	fz_always(ctx)
 	{
-		fz_close(stm);
-		fz_free(xref->ctx, ofsbuf);
-		fz_free(xref->ctx, numbuf);
-		pdf_drop_obj(objstm);
+		fz_close(file);
 	}
 	fz_catch(ctx)
 	{
-		fz_throw(ctx, "cannot open object stream (%d %d R)", num, gen);
+		fz_rethrow(ctx);
 	}
+
+	return obj;
+}
+
+void
+pdf_get_obj_stm_stats(pdf_document *doc, pdf_obj_stm_stats *stats)
+{
+	stats->hits = doc->obj_stm_hits;
+	stats->misses = doc->obj_stm_misses;
 }
 
 /*
@@ -1041,7 +1345,7 @@ pdf_cache_object(pdf_document *xref, int num, int gen)
 	if (num < 0 || num >= xref->len)
 		fz_throw(ctx, "object out of range (%d %d R); xref size %d", num, gen, xref->len);
 
-	x = &xref->table[num];
+	x = pdf_get_xref_entry(xref, num);
 
 	if (x->obj)
 		return;
@@ -1057,7 +1361,7 @@ pdf_cache_object(pdf_document *xref, int num, int gen)
 
 		fz_try(ctx)
 		{
-			x->obj = pdf_parse_ind_obj(xref, xref->file, &xref->lexbuf.base,
+			x->obj = pdf_parse_owned_ind_obj(xref, xref->file, &xref->lexbuf.base,
 					&rnum, &rgen, &x->stm_ofs);
 		}
 		fz_catch(ctx)
@@ -1077,19 +1381,38 @@ pdf_cache_object(pdf_document *xref, int num, int gen)
 	}
 	else if (x->type == 'o')
 	{
-		if (!x->obj)
+		pdf_obj_stm *stm;
+		pdf_obj *obj = NULL;
+
+		fz_try(ctx)
 		{
-			fz_try(ctx)
-			{
-				pdf_load_obj_stm(xref, x->ofs, 0, &xref->lexbuf.base);
-			}
-			fz_catch(ctx)
-			{
-				fz_throw(ctx, "cannot load object stream containing object (%d %d R)", num, gen);
-			}
-			if (!x->obj)
-				fz_throw(ctx, "object (%d %d R) was not found in its object stream", num, gen);
+			stm = pdf_load_obj_stm(xref, x->ofs, 0, &xref->lexbuf.base);
+		}
+		fz_catch(ctx)
+		{
+			fz_throw(ctx, "cannot load object stream containing object (%d %d R)", num, gen);
+		}
+		fz_try(ctx)
+		{
+			obj = pdf_parse_obj_stm_object(xref, stm, num, x->gen, &xref->lexbuf.base);
 		}
+		fz_always(ctx)
+		{
+			fz_drop_storable(ctx, &stm->storable);
+		}
+		fz_catch(ctx)
+		{
+			fz_throw(ctx, "cannot parse object (%d %d R) in its object stream", num, gen);
+		}
+		if (!obj)
+			fz_throw(ctx, "object (%d %d R) was not found in its object stream", num, gen);
+
+		/* Loading the object stream may have repaired the xref */
+		x = pdf_get_xref_entry(xref, num);
+		if (x->obj)
+			pdf_drop_obj(obj);
+		else
+			x->obj = obj;
 	}
 	else
 	{
@@ -1111,9 +1434,9 @@ pdf_load_object(pdf_document *xref, int num, int gen)
 		fz_throw(ctx, "cannot load object (%d %d R) into cache", num, gen);
 	}
 
-	assert(xref->table[num].obj);
+	assert(pdf_get_xref_entry(xref, num)->obj);
 
-	return pdf_keep_obj(xref->table[num].obj);
+	return pdf_keep_obj(pdf_get_xref_entry(xref, num)->obj);
 }
 
 pdf_obj *
@@ -1147,9 +1470,9 @@ pdf_resolve_indirect(pdf_obj *ref)
 			fz_warn(ctx, "cannot load object (%d %d R) into cache", num, gen);
 			return NULL;
 		}
-		if (!xref->table[num].obj)
+		ref = pdf_get_xref_entry(xref, num)->obj;
+		if (!ref)
 			return NULL;
-		ref = xref->table[num].obj;
 	}
 
 	return ref;
@@ -1166,13 +1489,16 @@ pdf_create_object(pdf_document *xref)
 {
 	/* TODO: reuse free object slots by properly linking free object chains in the ofs field */
 	int num = xref->len;
+	pdf_xref_entry *x;
 	pdf_resize_xref(xref, num + 1);
-	xref->table[num].type = 'f';
-	xref->table[num].ofs = -1;
-	xref->table[num].gen = 0;
-	xref->table[num].stm_ofs = 0;
-	xref->table[num].stm_buf = NULL;
-	xref->table[num].obj = NULL;
+	x = pdf_get_xref_entry(xref, num);
+	x->type = 'f';
+	x->ofs = -1;
+	x->gen = 0;
+	x->stm_ofs = 0;
+	x->stm_buf = NULL;
+	x->obj = NULL;
+	pdf_mark_xref_dirty(xref, num);
 	return num;
 }
 
@@ -1187,7 +1513,7 @@ pdf_delete_object(pdf_document *xref, int num)
 		return;
 	}
 
-	x = &xref->table[num];
+	x = pdf_get_xref_entry(xref, num);
 
 	fz_drop_buffer(xref->ctx, x->stm_buf);
 	pdf_drop_obj(x->obj);
@@ -1198,6 +1524,7 @@ pdf_delete_object(pdf_document *xref, int num)
 	x->stm_ofs = 0;
 	x->stm_buf = NULL;
 	x->obj = NULL;
+	pdf_mark_xref_dirty(xref, num);
 }
 
 void
@@ -1211,13 +1538,16 @@ pdf_update_object(pdf_document *xref, int num, pdf_obj *newobj)
 		return;
 	}
 
-	x = &xref->table[num];
+	x = pdf_get_xref_entry(xref, num);
 
 	pdf_drop_obj(x->obj);
 
 	x->type = 'n';
 	x->ofs = 0;
 	x->obj = pdf_keep_obj(newobj);
+	pdf_mark_xref_dirty(xref, num);
+
+	pdf_set_obj_parent(xref, newobj, num);
 }
 
 void
@@ -1231,10 +1561,11 @@ pdf_update_stream(pdf_document *xref, int num, fz_buffer *newbuf)
 		return;
 	}
 
-	x = &xref->table[num];
+	x = pdf_get_xref_entry(xref, num);
 
 	fz_drop_buffer(xref->ctx, x->stm_buf);
 	x->stm_buf = fz_keep_buffer(xref->ctx, newbuf);
+	pdf_mark_xref_dirty(xref, num);
 }
 
 int
@@ -1361,6 +1692,8 @@ pdf_new_document(fz_context *ctx, fz_stream *file)
 	doc->super.write = (void*)pdf_write_document;
 
 	pdf_lexbuf_init(ctx, &doc->lexbuf.base, PDF_LEXBUF_LARGE);
+	doc->obj_pool = pdf_new_obj_pool(ctx);
+	doc->handle = pdf_new_doc_handle(ctx, doc);
 	doc->file = fz_keep_stream(file);
 	doc->ctx = ctx;
 
@@ -1385,7 +1718,7 @@ pdf_open_document_no_run(fz_context *ctx, const char *filename)
 
 	fz_try(ctx)
 	{
-		file = fz_open_file(ctx, filename);
+		file = fz_open_file_mmap(ctx, filename);
 		doc = pdf_new_document(ctx, file);
 		pdf_init_document(doc);
 	}
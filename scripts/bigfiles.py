@@ -0,0 +1,179 @@
+#!/usr/bin/env python
+
+# Check that files larger than 4GB open and render.
+#
+# Writes sparse files (so they take almost no disk space) with everything
+# that matters placed past 2^32 bytes:
+#	big.pdf		objects and classic xref table past 4GB
+#	bigstm.pdf	objects and xref stream past 4GB
+#	big.xps		ZIP64 archive with its parts past 4GB
+# together with small copies of the same documents, then runs mudraw -5
+# and mutool show on them and checks that each big file draws the same
+# as its small copy.
+#
+# usage: python scripts/bigfiles.py [bindir] [tmpdir]
+# bindir defaults to build/debug; tmpdir to a new temporary directory,
+# which is removed afterwards.
+
+import os, sys, struct, subprocess, tempfile, shutil, zlib
+
+GAP = (1 << 32) + 4096
+
+PAGE = b"0 0 1 rg 10 10 80 80 re f 1 0 0 rg 30 30 40 40 re f"
+
+def pdf_objects():
+	return [
+		b"<< /Type /Catalog /Pages 2 0 R >>",
+		b"<< /Type /Pages /Kids [ 3 0 R ] /Count 1 >>",
+		b"<< /Type /Page /Parent 2 0 R /MediaBox [ 0 0 100 100 ] /Contents 4 0 R >>",
+		b"<< /Length " + str(len(PAGE)).encode() + b" >>\nstream\n" + PAGE + b"\nendstream",
+	]
+
+def write_pdf(name, gap, xrefstm):
+	f = open(name, "wb")
+	f.write(b"%PDF-1.5\n%\xe2\xe3\xcf\xd3\n")
+	if gap:
+		f.seek(gap)
+	offsets = []
+	for i, obj in enumerate(pdf_objects()):
+		offsets.append(f.tell())
+		f.write(str(i + 1).encode() + b" 0 obj\n" + obj + b"\nendobj\n")
+	start = f.tell()
+	if xrefstm:
+		n = len(offsets) + 2
+		rows = b"\0" * 6 + b"\xff\xff"
+		for ofs in offsets + [start]:
+			rows += b"\1" + struct.pack(">Q", ofs)[3:] + b"\0\0"
+		f.write(str(n - 1).encode() + b" 0 obj\n")
+		f.write(b"<< /Type /XRef /Size " + str(n).encode())
+		f.write(b" /W [ 1 5 2 ] /Root 1 0 R /Length " + str(len(rows)).encode() + b" >>\n")
+		f.write(b"stream\n" + rows + b"\nendstream\nendobj\n")
+	else:
+		f.write(b"xref\n0 " + str(len(offsets) + 1).encode() + b"\n")
+		f.write(b"0000000000 65535 f \n")
+		for ofs in offsets:
+			f.write(("%010d 00000 n \n" % ofs).encode())
+		f.write(b"trailer\n<< /Size " + str(len(offsets) + 1).encode() + b" /Root 1 0 R >>\n")
+	f.write(b"startxref\n" + str(start).encode() + b"\n%%EOF\n")
+	f.close()
+
+XPS_PARTS = [
+	("_rels/.rels",
+		b'<Relationships xmlns="http://schemas.openxmlformats.org/package/2006/relationships">'
+		b'<Relationship Id="R0" Type="http://schemas.microsoft.com/xps/2005/06/fixedrepresentation" Target="/FixedDocSeq.fdseq"/>'
+		b'</Relationships>'),
+	("FixedDocSeq.fdseq",
+		b'<FixedDocumentSequence xmlns="http://schemas.microsoft.com/xps/2005/06">'
+		b'<DocumentReference Source="/Documents/1/FixedDoc.fdoc"/>'
+		b'</FixedDocumentSequence>'),
+	("Documents/1/FixedDoc.fdoc",
+		b'<FixedDocument xmlns="http://schemas.microsoft.com/xps/2005/06">'
+		b'<PageContent Source="/Documents/1/Pages/1.fpage"/>'
+		b'</FixedDocument>'),
+	("Documents/1/Pages/1.fpage",
+		b'<FixedPage xmlns="http://schemas.microsoft.com/xps/2005/06" Width="100" Height="100" xml:lang="en">'
+		b'<Path Fill="#FF0000FF" Data="M 10,10 L 90,10 90,90 10,90 Z"/>'
+		b'<Path Fill="#FFFF0000" Data="M 30,30 L 70,30 70,70 30,70 Z"/>'
+		b'</FixedPage>'),
+]
+
+def write_xps(name, gap):
+	# Stored (uncompressed) entries, after a hole of gap bytes. Offsets
+	# past 4GB go in ZIP64 extra fields, and the end of central directory
+	# points to a ZIP64 one.
+	f = open(name, "wb")
+	if gap:
+		f.seek(gap)
+	central = b""
+	for part, data in XPS_PARTS:
+		crc = zlib.crc32(data) & 0xffffffff
+		ofs = f.tell()
+		f.write(struct.pack("<IHHHHHIIIHH", 0x04034b50, 45, 0, 0, 0, 0,
+			crc, len(data), len(data), len(part), 0))
+		f.write(part.encode() + data)
+		if ofs >= 0xffffffff:
+			extra = struct.pack("<HHQ", 0x0001, 8, ofs)
+			ofs = 0xffffffff
+		else:
+			extra = b""
+		central += struct.pack("<IHHHHHHIIIHHHHHII", 0x02014b50, 45, 45, 0, 0, 0, 0,
+			crc, len(data), len(data), len(part), len(extra), 0, 0, 0, 0, ofs)
+		central += part.encode() + extra
+	cdofs = f.tell()
+	f.write(central)
+	count = len(XPS_PARTS)
+	if cdofs >= 0xffffffff:
+		eocd64 = f.tell()
+		f.write(struct.pack("<IQHHIIQQQQ", 0x06064b50, 44, 45, 45, 0, 0,
+			count, count, len(central), cdofs))
+		f.write(struct.pack("<IIQI", 0x07064b50, 0, eocd64, 1))
+		f.write(struct.pack("<IHHHHIIH", 0x06054b50, 0, 0, 0xffff, 0xffff,
+			0xffffffff, 0xffffffff, 0))
+	else:
+		f.write(struct.pack("<IHHHHIIH", 0x06054b50, 0, 0, count, count,
+			len(central), cdofs, 0))
+	f.close()
+
+def run(args):
+	sys.stdout.write("$ " + " ".join(args) + "\n")
+	p = subprocess.Popen(args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+	out = p.communicate()[0].decode("latin-1")
+	sys.stdout.write(out)
+	return p.returncode, out
+
+def md5_of(bindir, name):
+	code, out = run([os.path.join(bindir, "mudraw"), "-5", name])
+	for line in out.splitlines():
+		if line.startswith("page "):
+			return line.split()[-1]
+	return None
+
+def main():
+	bindir = len(sys.argv) > 1 and sys.argv[1] or "build/debug"
+	if len(sys.argv) > 2:
+		tmpdir = sys.argv[2]
+		keep = True
+	else:
+		tmpdir = tempfile.mkdtemp()
+		keep = False
+
+	failed = 0
+	try:
+		for name, xrefstm in (("big.pdf", False), ("bigstm.pdf", True)):
+			big = os.path.join(tmpdir, name)
+			small = os.path.join(tmpdir, "small-" + name)
+			write_pdf(big, GAP, xrefstm)
+			write_pdf(small, 0, xrefstm)
+			a = md5_of(bindir, big)
+			b = md5_of(bindir, small)
+			if a is None or a != b:
+				sys.stdout.write("FAIL: %s does not draw like %s\n" % (big, small))
+				failed += 1
+			for what in ("xref", "trailer", "pagetree", "3", "4"):
+				code, out = run([os.path.join(bindir, "mutool"), "show", big, what])
+				if code != 0 or "error" in out:
+					sys.stdout.write("FAIL: mutool show %s %s\n" % (big, what))
+					failed += 1
+				if what == "xref" and ("%010d" % GAP) not in out:
+					sys.stdout.write("FAIL: xref of %s does not hold offsets past 4GB\n" % big)
+					failed += 1
+
+		big = os.path.join(tmpdir, "big.xps")
+		small = os.path.join(tmpdir, "small.xps")
+		write_xps(big, GAP)
+		write_xps(small, 0)
+		a = md5_of(bindir, big)
+		b = md5_of(bindir, small)
+		if a is None or a != b:
+			sys.stdout.write("FAIL: %s does not draw like %s\n" % (big, small))
+			failed += 1
+	finally:
+		if not keep:
+			shutil.rmtree(tmpdir)
+
+	if failed:
+		sys.stdout.write("%d failures\n" % failed)
+		sys.exit(1)
+	sys.stdout.write("all big files drawn\n")
+
+main()
@@ -174,8 +174,8 @@ typedef struct xps_entry_s xps_entry;
 struct xps_entry_s
 {
 	char *name;
-	int offset;
-	int csize;
+	fz_off_t offset;
+	int csize; /* -1 if too large to load */
 	int usize;
 };
 
@@ -59,11 +59,11 @@ xps_measure_font_glyph(xps_document *doc, fz_font *font, int gid, xps_glyph_metr
 	FT_Fixed hadv, vadv;
 	fz_context *ctx = doc->ctx;
 
-	fz_lock(ctx, FZ_LOCK_FREETYPE);
+	fz_lock_ft_face(ctx, font);
 	FT_Set_Char_Size(face, 64, 64, 72, 72);
 	FT_Get_Advance(face, gid, mask, &hadv);
 	FT_Get_Advance(face, gid, mask | FT_LOAD_VERTICAL_LAYOUT, &vadv);
-	fz_unlock(ctx, FZ_LOCK_FREETYPE);
+	fz_unlock_ft_face(ctx, font);
 
 	mtx->hadv = hadv / 65536.0f;
 	mtx->vadv = vadv / 65536.0f;
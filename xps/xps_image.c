@@ -55,7 +55,7 @@ xps_load_image(fz_context *ctx, byte *buf, int len)
 	{
 		image = fz_malloc_struct(ctx, xps_image);
 
-		FZ_INIT_STORABLE(&image->base, 1, xps_free_image);
+		FZ_INIT_STORABLE(&image->base, 1, xps_free_image, FZ_STORE_IMAGE);
 		image->base.w = pix->w;
 		image->base.h = pix->h;
 		image->base.mask = NULL;
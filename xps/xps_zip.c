@@ -42,20 +42,20 @@ static inline int getshort(fz_stream *file)
 	return a | b << 8;
 }
 
-static inline int getlong(fz_stream *file)
+static inline unsigned int getlong(fz_stream *file)
 {
-	int a = fz_read_byte(file);
-	int b = fz_read_byte(file);
-	int c = fz_read_byte(file);
-	int d = fz_read_byte(file);
+	unsigned int a = fz_read_byte(file);
+	unsigned int b = fz_read_byte(file);
+	unsigned int c = fz_read_byte(file);
+	unsigned int d = fz_read_byte(file);
 	return a | b << 8 | c << 16 | d << 24;
 }
 
-static inline int getlong64(fz_stream *file)
+static inline fz_off_t getlong64(fz_stream *file)
 {
-	int a = getlong(file);
-	int b = getlong(file);
-	return b != 0 ? -1 : a;
+	fz_off_t a = getlong(file);
+	fz_off_t b = getlong(file);
+	return a | b << 32;
 }
 
 static void *
@@ -102,12 +102,15 @@ xps_read_zip_entry(xps_document *doc, xps_entry *ent, unsigned char *outbuf)
 {
 	z_stream stream;
 	unsigned char *inbuf;
-	int sig;
+	unsigned int sig;
 	int version, general, method;
 	int namelength, extralength;
 	int code;
 	fz_context *ctx = doc->ctx;
 
+	if (ent->usize < 0)
+		fz_throw(ctx, "zip entry too large to load: %s", ent->name);
+
 	fz_seek(doc->file, ent->offset, 0);
 
 	sig = getlong(doc->file);
@@ -181,10 +184,11 @@ xps_read_zip_entry(xps_document *doc, xps_entry *ent, unsigned char *outbuf)
  */
 
 static void
-xps_read_zip_dir(xps_document *doc, int start_offset)
+xps_read_zip_dir(xps_document *doc, fz_off_t start_offset)
 {
-	int sig;
-	int offset, count;
+	unsigned int sig;
+	fz_off_t offset, count;
+	fz_off_t csize, usize;
 	int namesize, metasize, commentsize;
 	int i;
 
@@ -202,7 +206,7 @@ xps_read_zip_dir(xps_document *doc, int start_offset)
 	offset = getlong(doc->file); /* offset to central directory */
 
 	/* ZIP64 */
-	if (count == 0xFFFF)
+	if (count == 0xFFFF || offset == 0xFFFFFFFF)
 	{
 		fz_seek(doc->file, start_offset - 20, 0);
 
@@ -213,7 +217,7 @@ xps_read_zip_dir(xps_document *doc, int start_offset)
 		(void) getlong(doc->file); /* start disk */
 		offset = getlong64(doc->file); /* offset to end of central directory record */
 		if (offset < 0)
-			fz_throw(doc->ctx, "zip64 files larger than 2 GB aren't supported");
+			fz_throw(doc->ctx, "zip64 end of central directory offset out of range");
 
 		fz_seek(doc->file, offset, 0);
 
@@ -230,11 +234,11 @@ xps_read_zip_dir(xps_document *doc, int start_offset)
 		(void) getlong64(doc->file); /* entries in central directory */
 		(void) getlong64(doc->file); /* size of central directory */
 		offset = getlong64(doc->file); /* offset to central directory */
-
-		if (count < 0 || offset < 0)
-			fz_throw(doc->ctx, "zip64 files larger than 2 GB aren't supported");
 	}
 
+	if (count < 0 || count > INT_MAX / (int)sizeof(xps_entry) || offset < 0)
+		fz_throw(doc->ctx, "zip central directory out of range");
+
 	doc->zip_table = fz_malloc_array(doc->ctx, count, sizeof(xps_entry));
 	memset(doc->zip_table, 0, count * sizeof(xps_entry));
 	doc->zip_count = count;
@@ -254,15 +258,15 @@ xps_read_zip_dir(xps_document *doc, int start_offset)
 		(void) getshort(doc->file); /* last mod file time */
 		(void) getshort(doc->file); /* last mod file date */
 		(void) getlong(doc->file); /* crc-32 */
-		doc->zip_table[i].csize = getlong(doc->file);
-		doc->zip_table[i].usize = getlong(doc->file);
+		csize = getlong(doc->file);
+		usize = getlong(doc->file);
 		namesize = getshort(doc->file);
 		metasize = getshort(doc->file);
 		commentsize = getshort(doc->file);
 		(void) getshort(doc->file); /* disk number start */
 		(void) getshort(doc->file); /* int file atts */
 		(void) getlong(doc->file); /* ext file atts */
-		doc->zip_table[i].offset = getlong(doc->file);
+		offset = getlong(doc->file);
 
 		doc->zip_table[i].name = fz_malloc(doc->ctx, namesize + 1);
 		fz_read(doc->file, (unsigned char*)doc->zip_table[i].name, namesize);
@@ -274,16 +278,37 @@ xps_read_zip_dir(xps_document *doc, int start_offset)
 			int size = getshort(doc->file);
 			if (type == ZIP64_EXTRA_FIELD_SIG)
 			{
-				doc->zip_table[i].usize = getlong64(doc->file);
-				doc->zip_table[i].csize = getlong64(doc->file);
-				doc->zip_table[i].offset = getlong64(doc->file);
-				fz_seek(doc->file, -24, 1);
+				/* Only the fields that overflowed are present, in this order */
+				if (usize == 0xFFFFFFFF && size >= 8)
+				{
+					usize = getlong64(doc->file);
+					size -= 8;
+					metasize -= 8;
+				}
+				if (csize == 0xFFFFFFFF && size >= 8)
+				{
+					csize = getlong64(doc->file);
+					size -= 8;
+					metasize -= 8;
+				}
+				if (offset == 0xFFFFFFFF && size >= 8)
+				{
+					offset = getlong64(doc->file);
+					size -= 8;
+					metasize -= 8;
+				}
 			}
 			fz_seek(doc->file, size, 1);
 			metasize -= 4 + size;
 		}
-		if (doc->zip_table[i].usize < 0 || doc->zip_table[i].csize < 0 || doc->zip_table[i].offset < 0)
-			fz_throw(doc->ctx, "zip64 files larger than 2 GB aren't supported");
+		if (offset < 0)
+			fz_throw(doc->ctx, "zip entry offset out of range: %s", doc->zip_table[i].name);
+		/* Parts are loaded whole; flag the ones that cannot be */
+		if (usize < 0 || usize >= INT_MAX || csize < 0 || csize >= INT_MAX)
+			usize = csize = -1;
+		doc->zip_table[i].csize = csize;
+		doc->zip_table[i].usize = usize;
+		doc->zip_table[i].offset = offset;
 
 		fz_seek(doc->file, commentsize, 1);
 	}
@@ -295,14 +320,15 @@ static void
 xps_find_and_read_zip_dir(xps_document *doc)
 {
 	unsigned char buf[512];
-	int file_size, back, maxback;
+	fz_off_t file_size;
+	int back, maxback;
 	int i, n;
 	fz_context *ctx = doc->ctx;
 
 	fz_seek(doc->file, 0, SEEK_END);
 	file_size = fz_tell(doc->file);
 
-	maxback = fz_mini(file_size, 0xFFFF + sizeof buf);
+	maxback = file_size < 0xFFFF + (int)sizeof buf ? (int)file_size : 0xFFFF + (int)sizeof buf;
 	back = fz_mini(maxback, sizeof buf);
 
 	while (back < maxback)
@@ -345,6 +371,8 @@ xps_read_zip_part(xps_document *doc, char *partname)
 	ent = xps_find_zip_entry(doc, name);
 	if (ent)
 	{
+		if (ent->usize < 0)
+			fz_throw(doc->ctx, "zip entry too large to load: %s", ent->name);
 		part = xps_new_part(doc, partname, ent->usize);
 		fz_try(doc->ctx)
 		{
@@ -373,6 +401,8 @@ xps_read_zip_part(xps_document *doc, char *partname)
 		}
 		if (!ent)
 			break;
+		if (ent->usize < 0 || size > INT_MAX - 1 - ent->usize)
+			fz_throw(doc->ctx, "zip entry too large to load: %s", ent->name);
 		count ++;
 		size += ent->usize;
 	}